@@ -0,0 +1,177 @@
+/* =========================================================================
+ * File:        CMDBENCH.C
+ * Description: Micro benchmark for the command matching in cmdinterp().
+ *              The command is matched against the same chain of regular
+ *              expressions, in the same order, as cmdinterp() does until
+ *              one of them matches. This is run both with the cached
+ *              matchcmd() and with a copy of the old matchcmd() that
+ *              compiled the regex on every call so the two can be
+ *              compared directly.
+ *
+ *              Build with "make check" and run as
+ *              ./cmdbench [-n <iterations>] ["<command>"]
+ *              The default command is "db tail 10".
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pcre.h>
+
+#include "config.h"
+#include "utils.h"
+#include "logger.h"
+#include "g7cmd_regex.h"
+
+/**
+ * Default number of times the command is interpreted in each run
+ */
+#define CMDBENCH_ITERATIONS 20000
+
+/**
+ * The command regular expressions in the order they are tried by cmdinterp()
+ */
+static const char *cmdbench_regex[] = {
+    CMD_RE_TABLE,
+    NULL
+};
+
+/**
+ * The utility functions log through logmsg(). The benchmark only needs
+ * the errors on stderr.
+ */
+void
+logmsg(int priority, const char *msg, ...) {
+    if (priority <= LOG_ERR) {
+        va_list ap;
+        va_start(ap, msg);
+        vfprintf(stderr, msg, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+}
+
+/**
+ * The matchcmd() used before the patterns were cached. The regex is compiled
+ * and freed on every call.
+ * @param regex Regular expression to match the command
+ * @param cmd Command string to test
+ * @param field The identified fields in the command string
+ * @return -1 on failure, number of fields on success
+ */
+static int
+matchcmd_nocache(const char *regex, const char *cmd, char ***field) {
+    pcre *cregex;
+    int ovector[100];
+    const char *errptr;
+    int erroff, ret;
+
+    cregex = pcre_compile(regex, PCRE_CASELESS | PCRE_MULTILINE | PCRE_NEWLINE_CRLF | PCRE_UTF8,
+            &errptr, &erroff, NULL);
+
+    if (cregex) {
+        ret = pcre_exec(cregex, NULL, cmd, strlen(cmd), 0, 0, ovector, 90);
+        pcre_free(cregex);
+        if (ret > 0) {
+            (void) pcre_get_substring_list(cmd, ovector, ret, (const char ***) field);
+            return ret;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Interpret the command the same way as cmdinterp(), i.e. try each regex
+ * in turn until one matches
+ * @param match The match function to use
+ * @param cmd Command string
+ * @return Index of the matching regex, -1 if no regex matched
+ */
+static int
+cmdbench_interp(int (*match)(const char *, const char *, char ***), const char *cmd) {
+    char **field = NULL;
+    for (int i = 0; cmdbench_regex[i]; i++) {
+        if (0 < match(cmdbench_regex[i], cmd, &field)) {
+            matchcmd_free(&field);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Run one benchmark and print the result
+ * @param name Name of the run
+ * @param match The match function to use
+ * @param cmd Command string
+ * @param n Number of iterations
+ */
+static void
+cmdbench_run(const char *name, int (*match)(const char *, const char *, char ***), const char *cmd, const unsigned n) {
+    struct timespec t0, t1;
+    int idx = -1;
+
+    // Warm up so the cached run does not include the first compilation
+    idx = cmdbench_interp(match, cmd);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned i = 0; i < n; i++) {
+        cmdbench_interp(match, cmd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    const double s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%-10s %8u commands in %7.3f s  %10.0f commands/s  %7.2f us/command  (matched regex #%d)\n",
+            name, n, s, n / s, s * 1e6 / n, idx + 1);
+}
+
+int
+main(int argc, char **argv) {
+    unsigned n = CMDBENCH_ITERATIONS;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "n:"))) {
+        if ('n' == opt) {
+            n = (unsigned) atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n <iterations>] [\"<command>\"]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char *cmd = optind < argc ? argv[optind] : "db tail 10";
+    if (0 == n) {
+        n = CMDBENCH_ITERATIONS;
+    }
+
+    printf("Command \"%s\"\n", cmd);
+    cmdbench_run("uncached", matchcmd_nocache, cmd, n);
+    cmdbench_run("cached", matchcmd, cmd, n);
+    return EXIT_SUCCESS;
+}
+
+/* EOF */
@@ -38,6 +38,7 @@
 #include <pthread.h>
 #include <math.h>
 #include <signal.h>
+#include <stdint.h>
 
 #include "config.h"
 #include "g7config.h"
@@ -52,6 +53,9 @@
 #include "nicks.h"
 #include "export.h"
 #include "geoloc.h"
+#include "geoloc_cache.h"
+#include "geoworker.h"
+#include "dbwriter.h"
 #include "libunitbl/unicode_tbl.h"
 
 #define ERR_DB_READ_EVENT "[ERR] Can not read number of events in DB."
@@ -59,6 +63,7 @@
 #define ERR_DB_CONNECT "[ERR] Cannot connect to DB"
 #define ERR_DB_DATE "[ERR] \"From Date\" can not be larger than \"To Date\""
 #define ERR_DB_DIST_TWOPOINTS  "[ERR] Selection must have at least two points."
+#define ERR_DB_MIGRATING "[ERR] The DB is being upgraded. Old locations are not available until the upgrade is done (about %zu rows left). Please try again later."
 #define INFO_DB_DIST  "Calculating approximate distance using %zd points.\n"
 
 char *db_filename = DEFAULT_TRACKER_DB;
@@ -139,7 +144,364 @@ _chk_db_size_cb(void *numLocRows, int nColumns, char **values, char **colNames)
 #pragma GCC diagnostic pop
 
 /**
- * Check that the opened database is the current version
+ * Number of rows converted in each transaction when migrating a version 2
+ * DB. Small enough that the DB writer is only held up a short while.
+ */
+#define DB_MIGRATE_CHUNK 2000
+
+/**
+ * Pause in ms between each migrated chunk to let other connections in
+ */
+#define DB_MIGRATE_PAUSE 100
+
+/**
+ * Busy timeout in ms for the migration connection
+ */
+#define DB_MIGRATE_BUSY_TIMEOUT 10000
+
+/**
+ * Set once the background migration has been started in this process
+ */
+static _Bool db_migrate_started = FALSE;
+static pthread_mutex_t db_migrate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Set while there are rows left in the version 2 location table. Commands
+ * that read locations are refused during this time since they would only
+ * see the part of the history that has been converted so far.
+ */
+static _Bool db_migrate_pending = FALSE;
+static size_t db_migrate_left = 0;
+
+/**
+ * Check if the DB still has a version 2 location table with rows that have
+ * not yet been migrated
+ * @param sqlDB Open DB handle
+ * @return TRUE if the table exists
+ */
+static _Bool
+_db_has_v2_table(sqlite3 *sqlDB) {
+    static char *q = "SELECT count(*) FROM sqlite_master WHERE type='table' AND name='" DB_TABLE_LOC_V2 "';";
+    int exists = 0;
+    return SQLITE_OK == sqlite3_exec(sqlDB, q, _chk_db_size_cb, (void *) &exists, NULL) && exists;
+}
+
+/**
+ * Switch a version 2 DB over to the current version. The old location table
+ * is renamed and an empty table with the new schema (including the unique
+ * location index) takes its place so that new locations can be stored
+ * directly. The old rows are then moved over in the background by
+ * _db_migrate_thread() where duplicates are skipped by the unique index.
+ * The autoincrement counter is carried over so that the keys of the old
+ * rows are kept and new rows always get a higher key.
+ * @param sqlDB Open DB handle
+ * @return 0 on success, -1 on failure
+ */
+static int
+_db_migrate_v2_begin(sqlite3 *sqlDB) {
+    static char *q =
+            "BEGIN IMMEDIATE TRANSACTION;"
+            "ALTER TABLE " DB_TABLE_LOC " RENAME TO " DB_TABLE_LOC_V2 ";"
+            DB_SCHEMA_LOC
+            "INSERT INTO sqlite_sequence (name,seq) SELECT '" DB_TABLE_LOC "', IFNULL(MAX(fld_key),0) FROM " DB_TABLE_LOC_V2 ";"
+            "UPDATE " DB_TABLE_INFO " SET fld_dbversion=4;"
+            "COMMIT TRANSACTION;";
+    char *errMsg;
+
+    logmsg(LOG_NOTICE, "Upgrading DB from version 2 to version %d. Old locations will be converted in the background.", DB_VERSION);
+    sqlite3_busy_timeout(sqlDB, DB_MIGRATE_BUSY_TIMEOUT);
+    if (SQLITE_OK != sqlite3_exec(sqlDB, q, NULL, NULL, &errMsg)) {
+        logmsg(LOG_CRIT, "Cannot upgrade DB to version %d ( \"%s\" )", DB_VERSION, errMsg);
+        sqlite3_free(errMsg);
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove duplicate locations (same device and device time) with a key in
+ * [lo,hi) from a version 3 DB. The row with the lowest key is kept.
+ * @param sqlDB Open DB handle
+ * @param lo First key in the range
+ * @param hi First key after the range
+ * @return Number of removed rows, -1 on failure
+ */
+static int
+_db_upgrade_v3_dedup(sqlite3 *sqlDB, const sqlite3_int64 lo, const sqlite3_int64 hi) {
+    static char *q =
+            "DELETE FROM " DB_TABLE_LOC " WHERE fld_key >= ?1 AND fld_key < ?2 AND EXISTS "
+            "(SELECT 1 FROM " DB_TABLE_LOC " AS t WHERE t.fld_deviceid=" DB_TABLE_LOC ".fld_deviceid AND "
+            "t.fld_datetime=" DB_TABLE_LOC ".fld_datetime AND t.fld_key < " DB_TABLE_LOC ".fld_key);";
+    sqlite3_stmt *stmt;
+
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, q, -1, &stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
+        return -1;
+    }
+    sqlite3_bind_int64(stmt, 1, lo);
+    sqlite3_bind_int64(stmt, 2, hi);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (SQLITE_DONE != rc) {
+        logmsg(LOG_ERR, "Cannot remove duplicate locations : \"%s\"", sqlite3_errmsg(sqlDB));
+        return -1;
+    }
+    return sqlite3_changes(sqlDB);
+}
+
+/**
+ * Upgrade a version 3 DB to version 4. Existing duplicate locations are
+ * removed one key range at a time, each in its own short transaction, so
+ * that the DB writer can keep storing new locations. The last step removes
+ * any duplicates stored while the upgrade was running and creates the unique
+ * index in one transaction. This is run by the background migration thread
+ * once all version 2 rows have been converted. No VACUUM is done. The space
+ * freed by the removed rows is reused by new locations.
+ * @param sqlDB Open DB handle
+ * @return 0 on success, -1 on failure
+ */
+static int
+_db_upgrade_v3(sqlite3 *sqlDB) {
+    static char *q_max = "SELECT IFNULL(MAX(fld_key),0) FROM " DB_TABLE_LOC ";";
+    static char *q_index =
+            "DROP INDEX IF EXISTS idx_track_dev_datetime;"
+            DB_SCHEMA_LOC_INDEX
+            "UPDATE " DB_TABLE_INFO " SET fld_dbversion=4;"
+            "COMMIT TRANSACTION;";
+    const struct timespec pause = {0, DB_MIGRATE_PAUSE * 1000000L};
+    sqlite3_stmt *stmt;
+    char *errMsg;
+
+    logmsg(LOG_NOTICE, "Upgrading DB from version 3 to version 4 in the background.");
+
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, q_max, -1, &stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
+        return -1;
+    }
+    const sqlite3_int64 maxkey = SQLITE_ROW == sqlite3_step(stmt) ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+
+    long ndup = 0;
+    sqlite3_int64 lo = 0;
+    while (lo <= maxkey) {
+        const int n = _db_upgrade_v3_dedup(sqlDB, lo, lo + DB_MIGRATE_CHUNK);
+        if (-1 == n) {
+            return -1;
+        }
+        ndup += n;
+        lo += DB_MIGRATE_CHUNK;
+        nanosleep(&pause, NULL);
+    }
+
+    // Rows stored while we were busy are checked in the same transaction
+    // that creates the unique index so no new duplicate can slip in between
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &errMsg)) {
+        logmsg(LOG_ERR, "Cannot upgrade DB to version 4 ( \"%s\" )", errMsg);
+        sqlite3_free(errMsg);
+        return -1;
+    }
+    const int n = _db_upgrade_v3_dedup(sqlDB, maxkey + 1, INT64_MAX);
+    if (-1 == n || SQLITE_OK != sqlite3_exec(sqlDB, q_index, NULL, NULL, &errMsg)) {
+        if (-1 != n) {
+            logmsg(LOG_ERR, "Cannot upgrade DB to version 4 ( \"%s\" )", errMsg);
+            sqlite3_free(errMsg);
+        }
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+        return -1;
+    }
+    ndup += n;
+    logmsg(LOG_NOTICE, "DB upgrade to version 4 finished. Removed %ld duplicate locations", ndup);
+    return 0;
+}
+
+/**
+ * Move the newest chunk of not yet converted rows from the version 2 table
+ * to the location table. The newest rows are moved first so that recent
+ * locations are available as soon as possible.
+ * @param sqlDB Open DB handle
+ * @return 1 if there are more rows to move, 0 when finished, -1 on failure
+ */
+static int
+_db_migrate_v2_chunk(sqlite3 *sqlDB) {
+    static char *q_lo =
+            "SELECT fld_key FROM " DB_TABLE_LOC_V2 " ORDER BY fld_key DESC LIMIT 1 OFFSET ?1;";
+    char *errMsg;
+    sqlite3_stmt *stmt;
+
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, &errMsg)) {
+        logmsg(LOG_ERR, "Cannot start DB migration transaction ( \"%s\" )", errMsg);
+        sqlite3_free(errMsg);
+        return -1;
+    }
+
+    // Find the lowest key in this chunk. If there are fewer rows left than
+    // the chunk size we take all of them.
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, q_lo, -1, &stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, DB_MIGRATE_CHUNK - 1);
+    int rc = sqlite3_step(stmt);
+    const sqlite3_int64 lo = SQLITE_ROW == rc ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    if (SQLITE_ROW != rc && SQLITE_DONE != rc) {
+        logmsg(LOG_ERR, "Cannot read version 2 location table : \"%s\"", sqlite3_errmsg(sqlDB));
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    // Once the last chunk has been moved the old table is dropped in the
+    // same transaction
+    char cleanup[128];
+    if (SQLITE_ROW == rc) {
+        snprintf(cleanup, sizeof (cleanup), "DELETE FROM " DB_TABLE_LOC_V2 " WHERE fld_key >= %lld;", (long long) lo);
+    } else {
+        snprintf(cleanup, sizeof (cleanup), "DROP TABLE " DB_TABLE_LOC_V2 ";");
+    }
+    char q[1024];
+    snprintf(q, sizeof (q),
+            "INSERT OR IGNORE INTO " DB_TABLE_LOC " (fld_key,fld_timestamp,fld_deviceid,fld_datetime,fld_lat,fld_lon,"
+            "fld_approxaddr,fld_speed,fld_heading,fld_altitude,fld_satellite,fld_event,fld_voltage,fld_detachstat) "
+            "SELECT fld_key,fld_timestamp,fld_deviceid,fld_datetime,CAST(fld_lat AS REAL),CAST(fld_lon AS REAL),"
+            "fld_approxaddr,CAST(fld_speed AS INTEGER),fld_heading,fld_altitude,fld_satellite,fld_event,"
+            "CAST(fld_voltage AS REAL),fld_detachstat FROM " DB_TABLE_LOC_V2 " WHERE fld_key >= %lld;"
+            "%s"
+            "COMMIT TRANSACTION;", (long long) lo, cleanup);
+
+    if (SQLITE_OK != sqlite3_exec(sqlDB, q, NULL, NULL, &errMsg)) {
+        logmsg(LOG_ERR, "Failed to migrate chunk of locations ( \"%s\" )", errMsg);
+        sqlite3_free(errMsg);
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+        return -1;
+    }
+
+    return SQLITE_ROW == rc ? 1 : 0;
+}
+
+/**
+ * Background thread that moves all rows from the version 2 location table
+ * to the new location table one chunk at a time. Each chunk is its own
+ * transaction so storing of new locations is never blocked for more than
+ * a short while. If the daemon is stopped the migration continues where
+ * it left off at next start.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+_db_migrate_thread(void *arg) {
+    (void) arg;
+    sqlite3 *sqlDB;
+    size_t nchunks = 0;
+
+    pthread_detach(pthread_self());
+
+    if (-1 == db_setup(&sqlDB)) {
+        logmsg(LOG_ERR, "Cannot open DB for migration of old locations");
+        pthread_exit(NULL);
+        return (void *) 0;
+    }
+    sqlite3_busy_timeout(sqlDB, DB_MIGRATE_BUSY_TIMEOUT);
+
+    // The write ahead log is kept on disk so an interrupted chunk is always
+    // rolled back properly
+
+    const struct timespec pause = {0, DB_MIGRATE_PAUSE * 1000000L};
+    int rc = 0;
+    if (_db_has_v2_table(sqlDB)) {
+        int left = 0;
+        sqlite3_exec(sqlDB, "SELECT count(*) FROM " DB_TABLE_LOC_V2 ";", _chk_db_size_cb, (void *) &left, NULL);
+        pthread_mutex_lock(&db_migrate_mutex);
+        db_migrate_left = (size_t) left;
+        pthread_mutex_unlock(&db_migrate_mutex);
+
+        while (1 == (rc = _db_migrate_v2_chunk(sqlDB))) {
+            pthread_mutex_lock(&db_migrate_mutex);
+            db_migrate_left = db_migrate_left > DB_MIGRATE_CHUNK ? db_migrate_left - DB_MIGRATE_CHUNK : 0;
+            pthread_mutex_unlock(&db_migrate_mutex);
+            if (0 == ++nchunks % 100) {
+                logmsg(LOG_INFO, "DB migration: %zu rows converted so far", nchunks * DB_MIGRATE_CHUNK);
+            }
+            nanosleep(&pause, NULL);
+        }
+
+        // The old table is also gone if all locations were deleted by the
+        // user while the migration was running
+        if (0 == rc || !_db_has_v2_table(sqlDB)) {
+            rc = 0;
+            pthread_mutex_lock(&db_migrate_mutex);
+            db_migrate_pending = FALSE;
+            db_migrate_left = 0;
+            pthread_mutex_unlock(&db_migrate_mutex);
+            logmsg(LOG_NOTICE, "DB migration of version 2 locations finished");
+        }
+    }
+
+    // A version 3 DB gets its unique index once all old rows are in place
+    int version = -1;
+    if (0 == rc && SQLITE_OK == sqlite3_exec(sqlDB, _SQL_SELECT_DBVERSION, _chk_db_version_cb, (void *) &version, NULL) &&
+        3 == version) {
+        rc = _db_upgrade_v3(sqlDB);
+    }
+
+    if (rc) {
+        logmsg(LOG_ERR, "DB migration stopped. It will be resumed at next restart.");
+    }
+
+    db_close(sqlDB);
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Start the background migration if the DB still has rows in the version 2
+ * location table or if the DB is still version 3. The migration is started
+ * at most once in each process.
+ * @param sqlDB Open DB handle
+ * @param version The version of the DB
+ */
+static void
+_db_migrate_resume(sqlite3 *sqlDB, const int version) {
+    pthread_mutex_lock(&db_migrate_mutex);
+    const _Bool v2 = _db_has_v2_table(sqlDB);
+    if (!db_migrate_started && (3 == version || v2)) {
+        db_migrate_pending = v2;
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, _db_migrate_thread, NULL);
+        if (0 != ret) {
+            logmsg(LOG_ERR, "Could not create DB migration thread ( %d : %s )", ret, strerror(ret));
+        } else {
+            db_migrate_started = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&db_migrate_mutex);
+}
+
+/**
+ * Check if the location history is complete, i.e. there are no version 2
+ * rows left to migrate. If there are an error is written back to the client.
+ * @param cli_info Client context
+ * @return 0 if all locations are available, -1 if the migration is running
+ */
+int
+db_chk_migration(struct client_info *cli_info) {
+    pthread_mutex_lock(&db_migrate_mutex);
+    const _Bool pending = db_migrate_pending;
+    const size_t left = db_migrate_left;
+    pthread_mutex_unlock(&db_migrate_mutex);
+    if (pending) {
+        _writef(cli_info->cli_socket, ERR_DB_MIGRATING, left);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check that the opened database is the current version. A version 2 DB
+ * is upgraded and the conversion of its stored locations is started. A
+ * version 3 DB is used as is while it gets the unique location index in
+ * the background.
  * @param sqlDB
  * @return 0 on success, -1 on version mismatch
  */
@@ -155,7 +517,14 @@ _chk_db_version(sqlite3 *sqlDB) {
         sqlite3_close(sqlDB);
         return -1;
     } else {
-        if (currentDBVersion == DB_VERSION) {
+        if (2 == currentDBVersion) {
+            if (_db_migrate_v2_begin(sqlDB)) {
+                return -1;
+            }
+            currentDBVersion = DB_VERSION;
+        }
+        if (3 == currentDBVersion || DB_VERSION == currentDBVersion) {
+            _db_migrate_resume(sqlDB, currentDBVersion);
             return 0;
         } else {
             logmsg(LOG_ERR, "Database version mismatch. Please delete old DB");
@@ -165,24 +534,28 @@ _chk_db_version(sqlite3 *sqlDB) {
 }
 
 /**
- * Return the total number of rows in location table
+ * Return the total number of rows in location table. While a version 2 DB
+ * is being migrated the rows not yet converted are included.
  * @param[out] size Size of table
  * @return 0 on success, -1 on failure
  */
 int
 _db_get_size(int *size) {
     sqlite3 *sqlDB;
-    if (0 == db_setup(&sqlDB)) {
-        static char *q = _SQL_SELECT_COUNT;
+    if (0 == db_acquire(&sqlDB)) {
+        pthread_mutex_lock(&db_migrate_mutex);
+        const _Bool pending = db_migrate_pending;
+        pthread_mutex_unlock(&db_migrate_mutex);
+        const char *q = pending ? _SQL_SELECT_COUNT_MIGRATING : _SQL_SELECT_COUNT;
         char *errMsg;
         int rc = sqlite3_exec(sqlDB, q, _chk_db_size_cb, (void *) size, &errMsg);
         if (rc != SQLITE_OK) {
             logmsg(LOG_CRIT, "Can not read DB size ( \"%s\" )", errMsg);
             sqlite3_free(errMsg);
-            sqlite3_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }        
-        sqlite3_close(sqlDB);
+        db_release(sqlDB);
         return 0;
     } 
     return -1;
@@ -252,7 +625,7 @@ db_setup(sqlite3 **sqlDB) {
         if (newdb) {
             char *errMsg = 0;
             logmsg(LOG_DEBUG, "SCHEMA : %s %s %s", DB_SCHEMA_INFO, DB_SCHEMA_LOC, DB_SCHEMA_NICK);
-            rc = sqlite3_exec(*sqlDB, DB_SCHEMA_INFO DB_SCHEMA_LOC DB_SCHEMA_NICK, NULL, 0, &errMsg);
+            rc = sqlite3_exec(*sqlDB, _SQL_PRAGMA_AUTOVACUUM DB_SCHEMA_INFO DB_SCHEMA_LOC DB_SCHEMA_NICK, NULL, 0, &errMsg);
             if (rc != SQLITE_OK) {
                 logmsg(LOG_CRIT, "Can not create DB Schema in new DB ( \"%s\" )", errMsg);
                 sqlite3_free(errMsg);
@@ -308,6 +681,235 @@ db_close(sqlite3 *sqlDB) {
     // pthread_mutex_unlock(&db_mutex);
 }
 
+/**
+ * Maximum number of cached prepared statements per pooled connection
+ */
+#define DB_POOL_MAX_STMTS 8
+
+/**
+ * Busy timeout in ms for pooled connections when another connection holds
+ * a lock on the DB
+ */
+#define DB_POOL_BUSY_TIMEOUT 5000
+
+/**
+ * Maximum time in seconds to wait for a free connection in db_acquire().
+ * Long running exports keep their connection for the whole export so this
+ * makes sure other DB users get an error instead of being stalled forever.
+ */
+#define DB_POOL_ACQUIRE_TIMEOUT 20
+
+/**
+ * One pooled DB connection together with its cache of prepared statements.
+ * When the cache is full the least recently used statement is replaced.
+ * Statements that could not be cached are finalized when the connection
+ * is released.
+ */
+struct db_poolconn {
+    sqlite3 *db;
+    _Bool inuse;
+    pthread_t owner;
+    size_t nstmts;
+    const char *sql[DB_POOL_MAX_STMTS];
+    sqlite3_stmt *stmt[DB_POOL_MAX_STMTS];
+    unsigned long lastuse[DB_POOL_MAX_STMTS];
+    unsigned long usecnt;
+    size_t nuncached;
+    sqlite3_stmt *uncached[DB_POOL_MAX_STMTS];
+};
+
+static struct db_poolconn *db_pool = NULL;
+static size_t db_pool_len = 0;
+static pthread_mutex_t db_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_pool_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Open the pool of DB connections. All connections are opened directly so
+ * that any problem with the DB is detected at startup. Must be called after
+ * the daemon has switched to the user it will run as so that a new DB
+ * file gets the correct owner.
+ * @param size Number of connections in the pool
+ * @return 0 on success, -1 on failure
+ */
+int
+db_pool_init(const size_t size) {
+    pthread_mutex_lock(&db_pool_mutex);
+    if (db_pool) {
+        pthread_mutex_unlock(&db_pool_mutex);
+        return 0;
+    }
+    db_pool = calloc(size, sizeof (struct db_poolconn));
+    if (NULL == db_pool) {
+        pthread_mutex_unlock(&db_pool_mutex);
+        logmsg(LOG_CRIT, "Cannot allocate memory for DB connection pool");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (-1 == db_setup(&db_pool[i].db)) {
+            logmsg(LOG_CRIT, "Cannot open DB connection %zu for the DB pool", i);
+            for (size_t j = 0; j < i; j++) {
+                db_close(db_pool[j].db);
+            }
+            free(db_pool);
+            db_pool = NULL;
+            pthread_mutex_unlock(&db_pool_mutex);
+            return -1;
+        }
+        sqlite3_busy_timeout(db_pool[i].db, DB_POOL_BUSY_TIMEOUT);
+    }
+    db_pool_len = size;
+    pthread_mutex_unlock(&db_pool_mutex);
+    logmsg(LOG_DEBUG, "Opened DB pool with %zu connections", size);
+    return 0;
+}
+
+/**
+ * Check out a DB connection from the pool. If all connections are in use
+ * the call will wait until one is released but at most DB_POOL_ACQUIRE_TIMEOUT
+ * seconds. A thread that already holds a connection never waits since it
+ * could then wait for itself. Each successful call must be paired with a
+ * call to db_release()
+ * @param[out] sqlDB handle for DB
+ * @return 0 on success, -1 on failure or timeout
+ */
+int
+db_acquire(sqlite3 **sqlDB) {
+    if (NULL == db_pool && -1 == db_pool_init(DEFAULT_DB_POOL_SIZE)) {
+        return -1;
+    }
+    struct timespec abstime;
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += DB_POOL_ACQUIRE_TIMEOUT;
+
+    pthread_mutex_lock(&db_pool_mutex);
+    while (TRUE) {
+        _Bool nested = FALSE;
+        for (size_t i = 0; i < db_pool_len; i++) {
+            if (!db_pool[i].inuse) {
+                db_pool[i].inuse = TRUE;
+                db_pool[i].owner = pthread_self();
+                *sqlDB = db_pool[i].db;
+                pthread_mutex_unlock(&db_pool_mutex);
+                return 0;
+            }
+            nested |= pthread_equal(db_pool[i].owner, pthread_self());
+        }
+        if (nested) {
+            pthread_mutex_unlock(&db_pool_mutex);
+            logmsg(LOG_ERR, "All DB connections in use and the calling thread already holds one");
+            return -1;
+        }
+        if (ETIMEDOUT == pthread_cond_timedwait(&db_pool_cond, &db_pool_mutex, &abstime)) {
+            pthread_mutex_unlock(&db_pool_mutex);
+            logmsg(LOG_ERR, "Timeout after %d s waiting for a free DB connection", DB_POOL_ACQUIRE_TIMEOUT);
+            return -1;
+        }
+    }
+}
+
+/**
+ * Return a connection checked out with db_acquire() to the pool. Any
+ * transaction left open is rolled back and all cached statements are reset.
+ * @param sqlDB handle for DB
+ */
+void
+db_release(sqlite3 *sqlDB) {
+    if (!sqlite3_get_autocommit(sqlDB)) {
+        logmsg(LOG_ERR, "Released DB connection with open transaction. Rolling back.");
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+    }
+    pthread_mutex_lock(&db_pool_mutex);
+    for (size_t i = 0; i < db_pool_len; i++) {
+        if (db_pool[i].db == sqlDB) {
+            for (size_t j = 0; j < db_pool[i].nstmts; j++) {
+                sqlite3_reset(db_pool[i].stmt[j]);
+            }
+            for (size_t j = 0; j < db_pool[i].nuncached; j++) {
+                sqlite3_finalize(db_pool[i].uncached[j]);
+            }
+            db_pool[i].nuncached = 0;
+            db_pool[i].inuse = FALSE;
+            pthread_cond_signal(&db_pool_cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&db_pool_mutex);
+}
+
+/**
+ * Get a prepared statement for the given SQL on a connection checked out
+ * with db_acquire(). The statement is compiled the first time it is used on
+ * each connection and then kept for the life time of the pool or until it
+ * is replaced as the least recently used statement. The caller must not
+ * finalize the statement. It is reset when the connection is released.
+ * @param sqlDB handle for DB
+ * @param sql The SQL statement (with parameters)
+ * @param[out] stmt The prepared statement
+ * @return 0 on success, -1 on failure
+ */
+int
+db_prepare_cached(sqlite3 *sqlDB, const char *sql, sqlite3_stmt **stmt) {
+    struct db_poolconn *conn = NULL;
+
+    // The connection is checked out by the calling thread so no one else
+    // can touch its statement cache
+    for (size_t i = 0; i < db_pool_len && NULL == conn; i++) {
+        if (db_pool[i].db == sqlDB) {
+            conn = &db_pool[i];
+        }
+    }
+    if (NULL == conn) {
+        logmsg(LOG_ERR, "db_prepare_cached() called with a DB handle not from the pool");
+        return -1;
+    }
+
+    for (size_t i = 0; i < conn->nstmts; i++) {
+        if (conn->sql[i] == sql || 0 == strcmp(conn->sql[i], sql)) {
+            *stmt = conn->stmt[i];
+            conn->lastuse[i] = ++conn->usecnt;
+            sqlite3_reset(*stmt);
+            sqlite3_clear_bindings(*stmt);
+            return 0;
+        }
+    }
+
+    // Find a free slot or else the least recently used statement that the
+    // caller is not in the middle of stepping through
+    size_t slot = conn->nstmts;
+    if (slot == DB_POOL_MAX_STMTS) {
+        for (size_t i = 0; i < conn->nstmts; i++) {
+            if (!sqlite3_stmt_busy(conn->stmt[i]) &&
+                (slot == DB_POOL_MAX_STMTS || conn->lastuse[i] < conn->lastuse[slot])) {
+                slot = i;
+            }
+        }
+    }
+    if (slot == DB_POOL_MAX_STMTS && conn->nuncached == DB_POOL_MAX_STMTS) {
+        logmsg(LOG_ERR, "Too many DB statements in use at the same time on one connection");
+        return -1;
+    }
+
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, sql, -1, stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
+        return -1;
+    }
+    if (slot < DB_POOL_MAX_STMTS) {
+        if (slot < conn->nstmts) {
+            sqlite3_finalize(conn->stmt[slot]);
+        } else {
+            conn->nstmts++;
+        }
+        conn->sql[slot] = sql;
+        conn->stmt[slot] = *stmt;
+        conn->lastuse[slot] = ++conn->usecnt;
+    } else {
+        // All cached statements are in use. This one is finalized when the
+        // connection is released.
+        conn->uncached[conn->nuncached++] = *stmt;
+    }
+    return 0;
+}
+
 /**
  * Execute a SQL statement where the result of the statement will not be used.
  * @param sql SQL statment
@@ -317,18 +919,18 @@ db_close(sqlite3 *sqlDB) {
 int
 db_exec_sql(char *sql, int *changes) {
     sqlite3 *sqlDB;
-    if (0 == db_setup(&sqlDB)) {
+    if (0 == db_acquire(&sqlDB)) {
         char *errorMessage;
         logmsg(LOG_DEBUG, "Executing SQL: \"%s\"", sql);
         int rc = sqlite3_exec(sqlDB, sql, NULL, NULL, &errorMessage);
         if (rc != SQLITE_OK) {
             logmsg(LOG_ERR, "SQL Error [%s] for sql=\"%s\"", errorMessage, sql);
             sqlite3_free(errorMessage);
-            sqlite3_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
         *changes = sqlite3_changes(sqlDB);
-        sqlite3_close(sqlDB);
+        db_release(sqlDB);
     } else {
         return -1;
     }
@@ -336,248 +938,212 @@ db_exec_sql(char *sql, int *changes) {
 }
 
 /**
- * Handles storing the received location update from the device in our
- * database. The received data can be both a single update or a batch of
- * updates either from device memory or directly.
- * The callback function can be used to perform any activity needed just
- * after each row has been updated in the DB. The callback function will
- * receive all fields just stored as the first argument.
- * @param recvBuff Received data from the device. This can be one or
- *                 multiple location updates separated with "\r\n"
- * @param cb Callback function (int,struct splitfields *,void *)
- * @param cb_option The third argument to the callback
- * @return number of written positions on success (>0), -1 on failure
+ * SQL statement used to insert one location row. The parameters are bound
+ * with db_bind_locrec()
  */
-int
-db_store_locations(int sockd, unsigned num_loc, const char *recvBuff, void (*cb)(struct splitfields *, void *), void *cb_option) {
-       
-    sqlite3 *sqlDB;
-    unsigned pcnt = 0;
-    int cnt=0;
-
-    if (0 == db_setup(&sqlDB)) {
-        // Now the location update gets a bit convoluted. The string we received
-        // from the tracker is either of the form
-        // "[(loc-update-data\r\n)+]"
-        // or
-        // "(loc-update-data\r\n)+"
-        //
-        // we can receive an arbitrary number of updates in the same packet
-        //
-        // Example data received is:[3000000001,20131211002222,17.959445,59.366545,0,0,0,0,2,3.88V,0\r\n
-        //                           3000000001,20131211002422,17.959445,59.366545,0,0,0,0,2,3.88V,0]
-        //
-        char *sqlStmt =
-                "insert into tbl_track (fld_timestamp,fld_deviceid,fld_datetime,fld_lon,fld_lat,fld_approxaddr,fld_speed,"
-                "fld_heading,fld_altitude,fld_satellite,fld_event,fld_voltage,fld_detachstat) "
-                "values (?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13)";
-
-        sqlite3_stmt* stmt;
-        if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, sqlStmt, strlen(sqlStmt), &stmt, NULL)) {
-            logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
-            db_close(sqlDB);
-            return -1;
-        }
+#define _SQL_INSERT_LOC \
+        "insert or ignore into tbl_track (fld_timestamp,fld_deviceid,fld_datetime,fld_lon,fld_lat,fld_approxaddr,fld_speed," \
+        "fld_heading,fld_altitude,fld_satellite,fld_event,fld_voltage,fld_detachstat) " \
+        "values (?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11,?12,?13)"
 
-        _Bool expectBracket = FALSE;
-        const char *bptr = recvBuff;
-        if ('[' == *recvBuff) {
-            expectBracket = TRUE;
-            bptr++;
-            logmsg(LOG_INFO, "Received location update from stale positions which previously failed to be sent back");
-        }
+/**
+ * Prepare the statement used to insert location rows in the DB
+ * @param sqlDB Open DB handle
+ * @param[out] stmt The prepared statement
+ * @return 0 on success, -1 on failure
+ */
+int
+db_prepare_locinsert(sqlite3 *sqlDB, sqlite3_stmt **stmt) {
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, _SQL_INSERT_LOC, -1, stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot compile SQL : \"%s\"", sqlite3_errmsg(sqlDB));
+        return -1;
+    }
+    return 0;
+}
 
-        char locBuff[512] = {'\0'};
-        char *lptr = locBuff;
+/**
+ * Extract and validate the next location row from data received from the
+ * device. The data is either of the form
+ * "[(loc-update-data\r\n)+]"
+ * or
+ * "(loc-update-data\r\n)+"
+ *
+ * Example data received is:[3000000001,20131211002222,17.959445,59.366545,0,0,0,0,2,3.88V,0\r\n
+ *                           3000000001,20131211002422,17.959445,59.366545,0,0,0,0,2,3.88V,0]
+ *
+ * @param[in,out] bptr Running pointer in the received data. Advanced past the
+ *                extracted row
+ * @param[out] flds The fields of the extracted row. The ending 'V' in the
+ *                battery voltage is removed.
+ * @return 1 if a row was extracted, 0 if there are no more rows, -1 on
+ *         format error
+ */
+int
+db_next_location(const char **bptr, struct splitfields *flds) {
+    const char *p = *bptr;
 
-        char* errorMsg;
-        if (SQLITE_OK != sqlite3_exec(sqlDB, "BEGIN TRANSACTION", NULL, NULL, &errorMsg)) {
-            logmsg(LOG_ERR, "Cannot start DB transaction (%s)", errorMsg);
-            sqlite3_finalize(stmt);
-            sqlite3_free(errorMsg);
-            db_close(sqlDB);
-            return -1;
-        }
+    if ('[' == *p) {
+        p++;
+        logmsg(LOG_INFO, "Received location update from stale positions which previously failed to be sent back");
+    }
+    if ('\0' == *p || ']' == *p) {
+        *bptr = p;
+        return 0;
+    }
 
-        logmsg(LOG_DEBUG, "Storing location(s) in DB : db_store_locations()");
-        
-        const unsigned percent10 = num_loc/10;
-        unsigned percent_progress = 0;
-        
-        if( num_loc > 100 ) {
-            _writef(sockd,"[0%%].");
+    char locBuff[512];
+    char *lptr = locBuff;
+    size_t numFields = 1;
+    _Bool finished = 0;
+    do {
+        finished = '\0' == *p ||
+                ('\r' == *p && '\n' == *(p + 1)) ||
+                ']' == *p ||
+                lptr >= locBuff + sizeof (locBuff) - 1;
+        if (!finished) {
+            *lptr++ = *p++;
+            if (LOC_DELIM == *p) numFields++;
         }
-        
-        do {
-
-            size_t numFields = 1;
-            _Bool finished = 0;
-            do {
-                finished = '\0' == *bptr ||
-                        ('\r' == *bptr && '\n' == *(bptr + 1)) ||
-                        ']' == *bptr;
-                if (!finished) {
-                    *lptr++ = *bptr++;
-                    if (LOC_DELIM == *bptr) numFields++;
-                }
-
-            } while (!finished && numFields < 12);
-
-            *lptr = '\0';
-            lptr = locBuff; // Reset running pointer for potential next row
-            if ('\r' == *bptr && '\n' == *(bptr + 1)) {
-                bptr += 2;
-            }
 
-            if (numFields >= 12) {
-                logmsg(LOG_ERR, "Unknown format in received location update: \"%s\"", locBuff);
-                sqlite3_finalize(stmt);
-                db_close(sqlDB);
-                return -1;
-            }
-
-            size_t len = strlen(locBuff);
-            if (len < 50) {
-                logmsg(LOG_ERR, "Received %zd chars. Location data must be >= 50 chars.", len);
-                logmsg(LOG_ERR, "  \"%s\"", locBuff);
-                sqlite3_finalize(stmt);
-                db_close(sqlDB);
-                return -1;
-            }
+    } while (!finished && numFields < 12);
 
-            // Split the received data in the different fields and store in the DB
-            struct splitfields flds;
-            if (-1 == xstrsplitfields(locBuff, LOC_DELIM, &flds)) {
-                logmsg(LOG_ERR, "Error running xstrsplitfields() on \"%s\"", locBuff);
-                sqlite3_finalize(stmt);
-                db_close(sqlDB);
-                return -1;
-            }
+    *lptr = '\0';
+    if ('\r' == *p && '\n' == *(p + 1)) {
+        p += 2;
+    }
+    *bptr = p;
 
-            if (11 != flds.nf) {
-                logmsg(LOG_ERR, "Expected 11 field but found %zd in \"%s\"", flds.nf, locBuff);
-                sqlite3_finalize(stmt);
-                db_close(sqlDB);
-                return -1;
-            }
+    if (numFields >= 12) {
+        logmsg(LOG_ERR, "Unknown format in received location update: \"%s\"", locBuff);
+        return -1;
+    }
 
-            // A real GM7 location string has the device id as the first field and deviceid
-            // always start with a '3' digit in the first position. So we test for that to
-            // verify that the data is proper.
-            if (strlen(flds.fld[GM7_LOC_DEVID]) != 10 || '3' != *(flds.fld[GM7_LOC_DEVID])) {
-                logmsg(LOG_ERR, "Received data is not a valid GM7 location update");
-                sqlite3_finalize(stmt);
-                db_close(sqlDB);
-                return -1;
-            }
+    size_t len = strlen(locBuff);
+    if (len < 50) {
+        logmsg(LOG_ERR, "Received %zd chars. Location data must be >= 50 chars.", len);
+        logmsg(LOG_ERR, "  \"%s\"", locBuff);
+        return -1;
+    }
 
-            // Remove the ending 'V' in the battery voltage
-            const size_t vlen = strlen(flds.fld[GM7_LOC_VOLT]);
-            if (vlen > 0) {
-                flds.fld[GM7_LOC_VOLT][ vlen - 1 ] = '\0';
-            }
+    // Split the received data in the different fields
+    if (-1 == xstrsplitfields(locBuff, LOC_DELIM, flds)) {
+        logmsg(LOG_ERR, "Error running xstrsplitfields() on \"%s\"", locBuff);
+        return -1;
+    }
 
-            // We now have one row of location data that we can send to the
-            // the database for storage
-            // Example data: 3000000001,20131211002222,17.959445,59.366545,0,0,0,0,2,3.88V,0\r\n
-            sqlite3_bind_int64(stmt, 1, time(NULL));
-            sqlite3_bind_int64(stmt, 2, xatol(flds.fld[GM7_LOC_DEVID]));
-            sqlite3_bind_int64(stmt, 3, xatol(flds.fld[GM7_LOC_DATE]));
-            sqlite3_bind_text(stmt, 4, flds.fld[GM7_LOC_LON], -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(stmt, 5, flds.fld[GM7_LOC_LAT], -1, SQLITE_TRANSIENT);
-
-            // If user has enabled reverse address lookup we try to find the approx address and store it in DB as well
-            char address[512];
-            *address='\0';
-            
-            if (use_address_lookup) {
-                (void)get_address_from_latlon(flds.fld[GM7_LOC_LAT], flds.fld[GM7_LOC_LON], address, sizeof (address));
-            } else {
-                logmsg(LOG_DEBUG, "Geolocation lookup disabled. Setting location to \"---\"");
-                xstrlcpy(address, "---", sizeof (address));
-            }
-            
-            sqlite3_bind_text(stmt, 6, address, -1, SQLITE_TRANSIENT);
-
-            sqlite3_bind_int(stmt, 7, xatol(flds.fld[GM7_LOC_SPEED]));
-            sqlite3_bind_int(stmt, 8, xatol(flds.fld[GM7_LOC_HEADING]));
-            sqlite3_bind_int(stmt, 9, xatol(flds.fld[GM7_LOC_ALT]));
-            sqlite3_bind_int(stmt, 10, xatol(flds.fld[GM7_LOC_SAT]));
-            sqlite3_bind_int(stmt, 11, xatol(flds.fld[GM7_LOC_EVENTID]));
-            sqlite3_bind_text(stmt, 12, flds.fld[GM7_LOC_VOLT], -1, SQLITE_TRANSIENT);
-            sqlite3_bind_int(stmt, 13, xatol(flds.fld[GM7_LOC_DETACH]));
-
-            int rc = sqlite3_step(stmt);
-
-            if (rc == SQLITE_LOCKED) {
-                // If the table is locked this is due to another client just updating the table
-                // Hold back a random time (1-5s) and try up to three times before really giving up.
-
-                srand((unsigned) time(NULL));
-                size_t wait = rand() % 5 + 1;
-
-                logmsg(LOG_DEBUG, "DB is locked waiting %zu s before trying again", wait);
-                sleep(wait);
-
-                rc = sqlite3_step(stmt);
-                if (rc == SQLITE_LOCKED) {
-                    wait = rand() % 7 + 1;
-                    logmsg(LOG_DEBUG, "DB is still locked waiting %zu s before trying again", wait);
-                    sleep(wait);
-                    rc = sqlite3_step(stmt);
-                }
+    if (11 != flds->nf) {
+        logmsg(LOG_ERR, "Expected 11 field but found %zd in \"%s\"", flds->nf, locBuff);
+        return -1;
+    }
 
-                if (rc != SQLITE_DONE) {
-                    logmsg(LOG_ERR, "sqlite3_step() : Failed. \"%s\"", sqlite3_errmsg(sqlDB));
-                }
+    // A real GM7 location string has the device id as the first field and deviceid
+    // always start with a '3' digit in the first position. So we test for that to
+    // verify that the data is proper.
+    if (strlen(flds->fld[GM7_LOC_DEVID]) != 10 || '3' != *(flds->fld[GM7_LOC_DEVID])) {
+        logmsg(LOG_ERR, "Received data is not a valid GM7 location update");
+        return -1;
+    }
 
-            }
+    // Remove the ending 'V' in the battery voltage
+    const size_t vlen = strlen(flds->fld[GM7_LOC_VOLT]);
+    if (vlen > 0) {
+        flds->fld[GM7_LOC_VOLT][ vlen - 1 ] = '\0';
+    }
 
-            sqlite3_reset(stmt);
+    return 1;
+}
 
-            if (NULL != cb) {
-                cb(&flds, cb_option);
-            }
+/**
+ * Fill a location record from the fields of one received location row. If
+ * the user has enabled reverse address lookup the address is taken from
+ * the cache or else marked as pending for the backfill worker. The lookup
+ * service is never called from here.
+ * @param flds Fields as returned by db_next_location()
+ * @param[out] rec The record to fill
+ */
+void
+db_fill_locrec(struct splitfields *flds, struct db_locrec *rec) {
+    rec->ts = time(NULL);
+    rec->devid = xatol(flds->fld[GM7_LOC_DEVID]);
+    rec->datetime = xatol(flds->fld[GM7_LOC_DATE]);
+    xstrlcpy(rec->lon, flds->fld[GM7_LOC_LON], sizeof (rec->lon));
+    xstrlcpy(rec->lat, flds->fld[GM7_LOC_LAT], sizeof (rec->lat));
+
+    *rec->address = '\0';
+    if (use_address_lookup) {
+        // Unless the address is already cached the backfill worker fills it
+        // in later. If the worker is not running the rows stay pending and
+        // are handled when it is started.
+        if (!in_address_cache(flds->fld[GM7_LOC_LAT], flds->fld[GM7_LOC_LON], rec->address, sizeof (rec->address))) {
+            xstrlcpy(rec->address, DB_ADDR_PENDING, sizeof (rec->address));
+            geoworker_notify();
+        }
+    } else {
+        logmsg(LOG_DEBUG, "Geolocation lookup disabled. Setting location to \"---\"");
+        xstrlcpy(rec->address, "---", sizeof (rec->address));
+    }
 
-            pcnt++;
-            cnt++;
-            // Only send back progress if there are more than 100 locations to update
-            if(  num_loc > 100 && pcnt > percent10 ) {
-                pcnt=0;
-                percent_progress += 10;
-                _writef(sockd,"[%u%%].",percent_progress);
-            }
+    rec->speed = xatol(flds->fld[GM7_LOC_SPEED]);
+    rec->heading = xatol(flds->fld[GM7_LOC_HEADING]);
+    rec->altitude = xatol(flds->fld[GM7_LOC_ALT]);
+    rec->satellite = xatol(flds->fld[GM7_LOC_SAT]);
+    rec->eventid = xatol(flds->fld[GM7_LOC_EVENTID]);
+    xstrlcpy(rec->voltage, flds->fld[GM7_LOC_VOLT], sizeof (rec->voltage));
+    rec->detach = xatol(flds->fld[GM7_LOC_DETACH]);
+}
 
-        } while (*bptr && ']' != *bptr);
+/**
+ * Bind all values in a location record to the insert statement prepared
+ * with db_prepare_locinsert()
+ * @param stmt The prepared statement
+ * @param rec The location record
+ */
+void
+db_bind_locrec(sqlite3_stmt *stmt, const struct db_locrec *rec) {
+    sqlite3_bind_int64(stmt, 1, rec->ts);
+    sqlite3_bind_int64(stmt, 2, rec->devid);
+    sqlite3_bind_int64(stmt, 3, rec->datetime);
+    sqlite3_bind_double(stmt, 4, strtod(rec->lon, NULL));
+    sqlite3_bind_double(stmt, 5, strtod(rec->lat, NULL));
+    sqlite3_bind_text(stmt, 6, rec->address, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 7, rec->speed);
+    sqlite3_bind_int(stmt, 8, rec->heading);
+    sqlite3_bind_int(stmt, 9, rec->altitude);
+    sqlite3_bind_int(stmt, 10, rec->satellite);
+    sqlite3_bind_int(stmt, 11, rec->eventid);
+    sqlite3_bind_double(stmt, 12, strtod(rec->voltage, NULL));
+    sqlite3_bind_int(stmt, 13, rec->detach);
+}
 
-        if( num_loc > 100 ) {
-            _writef(sockd,"[100%%]\n");
-        }
-        
-        if (SQLITE_OK != sqlite3_exec(sqlDB, "COMMIT TRANSACTION", NULL, NULL, &errorMsg)) {
-            logmsg(LOG_ERR, "Cannot COMMIT TRANSACTION ( %s )", errorMsg);
-            sqlite3_free(errorMsg);
-            sqlite3_finalize(stmt);
-            db_close(sqlDB);
+/**
+ * Parse the received location update(s) from the device and hand them over
+ * to the DB writer thread which stores them in batches. The callback is
+ * called for each row as soon as it has been queued.
+ * @param recvBuff Received data from the device. This can be one or
+ *                 multiple location updates separated with "\r\n"
+ * @param cb Callback function (int,struct splitfields *,void *)
+ * @param cb_option The third argument to the callback
+ * @return number of queued positions on success, -1 on failure
+ */
+int
+db_queue_locations(const char *recvBuff, void (*cb)(struct splitfields *, void *), void *cb_option) {
+    const char *bptr = recvBuff;
+    struct splitfields flds;
+    struct db_locrec rec;
+    int cnt = 0, nrc;
+
+    while (1 == (nrc = db_next_location(&bptr, &flds))) {
+        db_fill_locrec(&flds, &rec);
+        if (-1 == dbwriter_enqueue(&rec)) {
             return -1;
-        } else {
-            sqlite3_finalize(stmt);
-            db_close(sqlDB);
-            logmsg(LOG_DEBUG, "Successfully updated DB with %03d records",cnt);
         }
-
-        if (expectBracket && ']' != *bptr) {
-            logmsg(LOG_ERR, "Was expecting ']' at end of location data from tracker");
+        if (NULL != cb) {
+            cb(&flds, cb_option);
         }
-
-    } else {
-
-        logmsg(LOG_CRIT, "Cannot open DB to write location update! ( %d : %s )", errno, strerror(errno));
-        return -1;
-
+        cnt++;
     }
 
-    return cnt;
+    return -1 == nrc ? -1 : cnt;
 }
 
 /**
@@ -590,20 +1156,28 @@ db_empty_loc(struct client_info *cli_info) {
     const int sockd = cli_info->cli_socket;
     sqlite3 *sqlDB;
     int rc = 0;
-    if (0 == db_setup(&sqlDB)) {
-        char q[512];
+    if (0 == db_acquire(&sqlDB)) {
+        char q[1024];
         char *errorMsg = NULL;
-        snprintf(q, sizeof (q), "DROP TABLE %s; VACUUM; %s", DB_TABLE_LOC, DB_SCHEMA_LOC);
+        snprintf(q, sizeof (q), "DROP TABLE %s; DROP TABLE IF EXISTS %s; %s", DB_TABLE_LOC, DB_TABLE_LOC_V2, DB_SCHEMA_LOC);
         int ret = sqlite3_exec(sqlDB, q, NULL, NULL, &errorMsg);
         if (ret != SQLITE_OK || NULL != errorMsg) {
             logmsg(LOG_ERR, "SQLITE3 error when dropping table : %s", errorMsg);
             sqlite3_free(errorMsg);
             rc = -1;
         } else {
+            // Any version 2 rows not yet migrated are gone as well
+            pthread_mutex_lock(&db_migrate_mutex);
+            db_migrate_pending = FALSE;
+            db_migrate_left = 0;
+            pthread_mutex_unlock(&db_migrate_mutex);
             _writef(sockd, "ALL stored locations deleted.");
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
+        // The freed pages are given back in the background
+        dbwriter_request_vacuum();
     } else {
+        _writef(sockd, ERR_DB_CONNECT);
         rc = -1;
     }    
     return rc;
@@ -649,7 +1223,11 @@ db_calc_distance(struct client_info *cli_info, ssize_t nf, char **fields) {
     sqlite3 *sqlDB;
     int rc = 0;
 
-    if (0 == db_setup(&sqlDB)) {
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+
+    if (0 == db_acquire(&sqlDB)) {
 
         char from[16], to[16], deviceid[16], eventid[8];
 
@@ -681,26 +1259,32 @@ db_calc_distance(struct client_info *cli_info, ssize_t nf, char **fields) {
             }
         }
 
-        // Get a memory copy of all the selected data so we can operate on it
-        rc = export_to_internal_set(sqlDB, from, to, deviceid, eventid);
-        db_close(sqlDB);
+        // Step through the selected locations and add up the distance between
+        // each consecutive pair
+        struct export_ctx ctx;
+        export_init_ctx(&ctx);
+        rc = export_to_internal_set(sqlDB, &ctx, from, to, deviceid, eventid);
 
         if (0 == rc) {
-            if (resSetLength > 1) {
-                double dist = 0.0;
-                double dist2 = 0.0;
-                _writef(sockd, INFO_DB_DIST, resSetLength);
-                struct g7loc_t *p1, *p2;
-                for (size_t i = 0; i < resSetLength - 1; ++i) {
-                    p1 = &g7loc_list[i];
-                    p2 = &g7loc_list[i + 1];
-                    const double lat1 = xatof(p1->lat);
-                    const double lon1 = xatof(p1->lon);
-                    const double lat2 = xatof(p2->lat);
-                    const double lon2 = xatof(p2->lon);
+            double dist = 0.0;
+            double dist2 = 0.0;
+            double lat1 = 0.0, lon1 = 0.0;
+            int nrc;
+            while ((nrc = export_next_loc(&ctx)) > 0) {
+                const double lat2 = xatof(ctx.loc.lat);
+                const double lon2 = xatof(ctx.loc.lon);
+                if (ctx.nrows > 1) {
                     dist += gpsdist_km(lat1, lon1, lat2, lon2);
                     dist2 += gpsdist_m(lat1, lon1, lat2, lon2);
                 }
+                lat1 = lat2;
+                lon1 = lon2;
+            }
+            if (nrc < 0) {
+                _writef(sockd, ERR_DB_READING);
+                rc = -1;
+            } else if (ctx.nrows > 1) {
+                _writef(sockd, INFO_DB_DIST, ctx.nrows);
                 if (dist > 1) {
                     _writef(sockd, "%.1f km (alt. %.1f m)", round(dist * 10) / 10.0, round(dist2 * 10) / 10.0);
                 } else {
@@ -718,7 +1302,8 @@ db_calc_distance(struct client_info *cli_info, ssize_t nf, char **fields) {
                 logmsg(LOG_ERR, "Export to internal set failed. Cannot calculate distance.");
             }
         }
-        free_internal_set();
+        free_internal_set(&ctx);
+        db_release(sqlDB);
     } else {
         logmsg(LOG_ERR, "Cannot connect to DB");
         _writef(sockd, ERR_DB_CONNECT);
@@ -766,7 +1351,7 @@ db_get_sortorder_string(void) {
 int
 _db_getloclist(char *buff[],unsigned maxrows,_Bool head) {
     sqlite3 *sqlDB;
-    if (0 == db_setup(&sqlDB)) {
+    if (0 == db_acquire(&sqlDB)) {
         char *errMsg;
 
         char q[256];
@@ -779,7 +1364,7 @@ _db_getloclist(char *buff[],unsigned maxrows,_Bool head) {
         int rc = sqlite3_exec(sqlDB, q, sql_reslist_callback, buff, &errMsg);
         if (rc) {
             logmsg(LOG_DEBUG, "Can execute SQL [\"%s\"]", errMsg);
-            db_close(sqlDB);
+            db_release(sqlDB);
             sqlite3_free(errMsg);
             return -1;
         }
@@ -789,7 +1374,7 @@ _db_getloclist(char *buff[],unsigned maxrows,_Bool head) {
             // No callbacks so DB must be empty
             rc = -2;
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
         return rc;
     } else {
         return -1;
@@ -822,6 +1407,10 @@ db_loclist(struct client_info *cli_info, _Bool head, size_t numrows) {
     const int sockd = cli_info->cli_socket;
     const size_t cols = _DB_GETLOCLIST_COLS;
 
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+
     if (numrows > 1000) {
         logmsg(LOG_ERR, "Too many rows in db_loclist()");
         _writef(sockd, "[ERR] Too many rows specified.\n");
@@ -949,6 +1538,10 @@ mail_lastloc(struct client_info *cli_info) {
 
     const int sockd = cli_info->cli_socket;
 
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+
     // Setup key replacements
     dict_t rkeys = new_dict();
     char valBuff[256];
@@ -1033,7 +1626,7 @@ mail_lastloc(struct client_info *cli_info) {
             snprintf(kval,sizeof(kval),"%d",minimap_detailed_zoom);
             add_dict(rkeys, "ZOOM_DETAILED", kval);
 
-            char *overview_imgdata, *detailed_imgdata;
+            char *overview_imgdata = NULL, *detailed_imgdata = NULL;
             const char *lat = res[2];
             const char *lon = res[3];
             const unsigned short overview_zoom = minimap_overview_zoom;
@@ -1048,7 +1641,7 @@ mail_lastloc(struct client_info *cli_info) {
             if( 0 == rc1 )
                 rc1 = get_minimap_from_latlon(lat, lon, detailed_zoom, minimap_width, minimap_height, &detailed_imgdata, &detailed_datasize);
 
-            if (-1 == rc1 ) {
+            if (0 != rc1 ) {
                 logmsg(LOG_ERR, "Failed to get static map from Google. Are you using a correct API key?");
                 logmsg(LOG_ERR, "Sending mail without the static maps.");
                 rc = send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,
@@ -1067,6 +1660,9 @@ mail_lastloc(struct client_info *cli_info) {
                 free(inlineimg_arr);
 
             }
+            // The images are our own copies from the minimap cache
+            free(overview_imgdata);
+            free(detailed_imgdata);
 
         } else {
         
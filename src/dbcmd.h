@@ -30,30 +30,54 @@ extern "C" {
 #endif
 
 /* What version of DB schema is this */
-#define DB_VERSION 2
+#define DB_VERSION 4
 
 /**
  * DB schema. If no database is found it will be initialized with this
- * SQL statement
+ * SQL statement. From version 3 the coordinates, speed and voltage are
+ * stored as numbers and the table is indexed on the columns used for
+ * sorting and selection. From version 4 the index on device and device
+ * time is unique so that the same location is never stored twice.
  */
-#define DB_SCHEMA_LOC "CREATE TABLE tbl_track  "\
+#define DB_SCHEMA_LOC_TABLE "CREATE TABLE tbl_track  "\
   "('fld_key' INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "\
   "'fld_timestamp' INTEGER NOT NULL, "\
   "'fld_deviceid' INTEGER NOT NULL, "\
   "'fld_datetime' INTEGER NOT NULL, "\
-  "'fld_lat' TEXT NOT NULL, "\
-  "'fld_lon' TEXT NOT NULL, "\
+  "'fld_lat' REAL NOT NULL, "\
+  "'fld_lon' REAL NOT NULL, "\
   "'fld_approxaddr' TEXT NOT NULL, "\
-  "'fld_speed' TEXT NOT NULL, "\
+  "'fld_speed' INTEGER NOT NULL, "\
   "'fld_heading' INTEGER NOT NULL, "\
   "'fld_altitude' INTEGER NOT NULL, "\
   "'fld_satellite' INTEGER NOT NULL, "\
   "'fld_event' INTEGER NOT NULL, "\
-  "'fld_voltage' TEXT NOT NULL, "\
+  "'fld_voltage' REAL NOT NULL, "\
   "'fld_detachstat' INTEGER NOT NULL);"
 
+#define DB_SCHEMA_LOC_INDEX \
+  "CREATE UNIQUE INDEX IF NOT EXISTS idx_track_dev_datetime_u ON tbl_track (fld_deviceid, fld_datetime);"\
+  "CREATE INDEX IF NOT EXISTS idx_track_datetime ON tbl_track (fld_datetime);"\
+  "CREATE INDEX IF NOT EXISTS idx_track_timestamp ON tbl_track (fld_timestamp);"\
+  "CREATE INDEX IF NOT EXISTS idx_track_addr_pending ON tbl_track (fld_lat, fld_lon) WHERE fld_approxaddr='(pending)';"
+
+#define DB_SCHEMA_LOC DB_SCHEMA_LOC_TABLE DB_SCHEMA_LOC_INDEX
+
+/**
+ * Address stored for new locations until the address backfill worker has
+ * looked up the real address. Must match the partial index above.
+ */
+#define DB_ADDR_PENDING "(pending)"
+
+/**
+ * While a version 2 DB is being migrated the not yet converted rows are
+ * kept in this table
+ */
+#define DB_TABLE_LOC_V2 "tbl_track_v2"
+
 #define DB_TABLE_LOC "tbl_track"
 #define _SQL_SELECT_COUNT "SELECT count(*) FROM tbl_track;"
+#define _SQL_SELECT_COUNT_MIGRATING "SELECT (SELECT count(*) FROM tbl_track)+(SELECT count(*) FROM tbl_track_v2);"
 
 #define DB_SCHEMA_INFO "CREATE TABLE tbl_info "\
   "('fld_key' INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL, "\
@@ -64,7 +88,39 @@ extern "C" {
 #define _SQL_INFO_INSERT "INSERT INTO %s (fld_created,fld_dbversion) VALUES ('%s',%d);"
 #define _SQL_SELECT_DBVERSION "SELECT fld_dbversion FROM tbl_info;"
 
-#define _SQL_PRAGMA "PRAGMA synchronous=OFF;PRAGMA journal_mode=MEMORY;PRAGMA temp_store=MEMORY;"
+/**
+ * The DB uses a write ahead log so that long running reads (for example a
+ * streaming export) never block the DB writer from committing new locations
+ * and the writer never blocks the readers. The journal mode is stored in the
+ * DB file so it only has to be switched once.
+ */
+#define _SQL_PRAGMA "PRAGMA journal_mode=WAL;PRAGMA synchronous=NORMAL;PRAGMA temp_store=MEMORY;"
+
+/**
+ * Free pages are given back to the file system a few at a time by the DB
+ * writer thread instead of running a full VACUUM. Must be set before any
+ * table is created.
+ */
+#define _SQL_PRAGMA_AUTOVACUUM "PRAGMA auto_vacuum=INCREMENTAL;"
+
+/**
+ * One location row ready to be inserted in the DB
+ */
+struct db_locrec {
+    time_t ts;              // Arrival time
+    long devid;             // Device ID
+    long datetime;          // Device timestamp as YYYYMMDDhhmmss
+    char lon[16];
+    char lat[16];
+    char address[512];      // Approximate address (or "---" if lookup is disabled)
+    int speed;
+    int heading;
+    int altitude;
+    int satellite;
+    int eventid;
+    char voltage[8];        // Battery voltage without the ending 'V'
+    int detach;
+};
 
 enum sort_order_t {
     SORT_DEVICETIME=0, SORT_ARRIVALTIME=1
@@ -83,6 +139,18 @@ db_setup(sqlite3 **sqlDB);
 void
 db_close(sqlite3 *sqlDB);
 
+int
+db_pool_init(const size_t size);
+
+int
+db_acquire(sqlite3 **sqlDB);
+
+void
+db_release(sqlite3 *sqlDB);
+
+int
+db_prepare_cached(sqlite3 *sqlDB, const char *sql, sqlite3_stmt **stmt);
+
 int
 db_exec_sql(char *sql,int *changes);
 
@@ -92,7 +160,19 @@ db_store_loc(sqlite3 *sqlDB,
 	     char *heading,char *alt,char *sat,char *eventid,char *volt,char *detach);
 
 int
-db_store_locations(int sockd, unsigned num_loc, const char *recvBuff, void (*cb)(struct splitfields *,void *), void *cb_option);
+db_prepare_locinsert(sqlite3 *sqlDB, sqlite3_stmt **stmt);
+
+int
+db_next_location(const char **bptr, struct splitfields *flds);
+
+void
+db_fill_locrec(struct splitfields *flds, struct db_locrec *rec);
+
+void
+db_bind_locrec(sqlite3_stmt *stmt, const struct db_locrec *rec);
+
+int
+db_queue_locations(const char *recvBuff, void (*cb)(struct splitfields *,void *), void *cb_option);
 
 void
 db_add_wcond(char *w, size_t maxlen, char *col, char *op, char *val);
@@ -115,6 +195,9 @@ db_tail(struct client_info *cli_info, unsigned size);
 int
 db_get_numevents(struct client_info *cli_info);
 
+int
+db_chk_migration(struct client_info *cli_info);
+
 double
 deg2rad(double d) __attribute__ ((pure));
 
@@ -0,0 +1,636 @@
+/* =========================================================================
+ * File:        DBWRITER.C
+ * Description: Dedicated DB writer thread that stores received locations
+ *              in batches. The tracker threads (and event loops) put the
+ *              parsed locations in a bounded queue and the writer thread
+ *              owns one long lived DB connection and commits the queued
+ *              rows in one transaction either when a full batch is
+ *              available or when the commit interval has passed since the
+ *              first row in the batch was queued (group commit).
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "utils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "dbcmd.h"
+#include "dbwriter.h"
+
+/**
+ * How long (in seconds) to wait before trying to open the DB again after
+ * a failure
+ */
+#define DBWRITER_RETRY_DELAY 2
+
+/**
+ * Busy timeout in ms for the writer connection when another connection
+ * holds a lock on the DB
+ */
+#define DBWRITER_BUSY_TIMEOUT 5000
+
+/**
+ * How many times a batch is tried again when the DB is still locked by
+ * another connection after the busy timeout and the delay in ms before the
+ * first retry. The delay is doubled for each retry.
+ */
+#define DBWRITER_MAX_RETRIES 5
+#define DBWRITER_RETRY_BACKOFF 250
+
+/**
+ * Number of free pages released in each incremental vacuum step. Small enough
+ * that queued rows never have to wait long for the writer.
+ */
+#define DBWRITER_VACUUM_PAGES 64
+
+/**
+ * How often (in seconds) an idle writer checks if the DB has free pages that
+ * should be given back to the file system
+ */
+#define DBWRITER_VACUUM_INTERVAL 600
+
+/**
+ * Outcome for each row in a written batch
+ */
+enum dbw_row_result {
+    DBW_ROW_STORED = 0,
+    DBW_ROW_DUPLICATE,
+    DBW_ROW_ERROR
+};
+
+/**
+ * The queue. A circular buffer of location records. Only the writer thread
+ * removes records from the head and it does so without holding the mutex
+ * while the rows are written to the DB since the producers only ever write
+ * to slots outside [head, head+count)
+ */
+static struct db_locrec *dbw_queue = NULL;
+static double *dbw_queued_ms = NULL;
+static struct dbwriter_token **dbw_token = NULL;
+static unsigned char *dbw_result = NULL;
+static size_t dbw_size = 0;
+static size_t dbw_head = 0;
+static size_t dbw_count = 0;
+
+/**
+ * Total number of rows ever queued, the number of rows the writer is done
+ * with (stored, skipped or failed) and the number of threads waiting in
+ * dbwriter_sync(). Protected by dbw_mutex
+ */
+static unsigned long dbw_enqueued = 0;
+static unsigned long dbw_processed = 0;
+static unsigned dbw_sync_waiters = 0;
+
+static unsigned dbw_batch_size = 0;
+static unsigned dbw_commit_interval = 0;
+static _Bool dbw_running = FALSE;
+static _Bool dbw_stopping = FALSE;
+static _Bool dbw_exited = FALSE;
+
+/**
+ * Set when the DB should be (incrementally) vacuumed the next time the
+ * writer is idle. Protected by dbw_mutex
+ */
+static _Bool dbw_vacuum = FALSE;
+
+static pthread_t dbw_thread;
+static pthread_mutex_t dbw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dbw_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dbw_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dbw_synced = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Statistics. Protected by dbw_mutex
+ */
+static struct dbwriter_stat dbw_stat;
+
+/**
+ * Monotonic time in ms used to measure latencies
+ * @return Current time in ms
+ */
+static double
+_dbw_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Open the DB and prepare the insert statement used by the writer
+ * @param[out] sqlDB DB handle
+ * @param[out] stmt Prepared insert statement
+ * @return 0 on success, -1 on failure
+ */
+static int
+_dbw_open(sqlite3 **sqlDB, sqlite3_stmt **stmt) {
+    if (-1 == db_setup(sqlDB)) {
+        *sqlDB = NULL;
+        return -1;
+    }
+    sqlite3_busy_timeout(*sqlDB, DBWRITER_BUSY_TIMEOUT);
+    if (-1 == db_prepare_locinsert(*sqlDB, stmt)) {
+        db_close(*sqlDB);
+        *sqlDB = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check if the last DB call failed since another connection held a lock
+ * @param sqlDB DB handle
+ * @return TRUE if the call can be tried again later
+ */
+static _Bool
+_dbw_is_busy(sqlite3 *sqlDB) {
+    const int rc = sqlite3_errcode(sqlDB) & 0xff;
+    return SQLITE_BUSY == rc || SQLITE_LOCKED == rc;
+}
+
+/**
+ * Make one attempt to write a batch of queued rows in one transaction. If
+ * the attempt fails the transaction is rolled back so that nothing from the
+ * batch is stored.
+ * @param sqlDB DB handle
+ * @param stmt Prepared insert statement
+ * @param first Index in queue of the first row
+ * @param n Number of rows
+ * @param[out] errors Number of rows that could not be stored
+ * @param[out] duplicates Number of rows ignored since they were already stored
+ * @return 0 on success, 1 if the DB was locked and the batch should be
+ * tried again, -1 if the batch could not be stored
+ */
+static int
+_dbw_try_batch(sqlite3 *sqlDB, sqlite3_stmt *stmt, const size_t first, const size_t n,
+               unsigned long *errors, unsigned long *duplicates) {
+    char *errorMsg;
+
+    *errors = 0;
+    *duplicates = 0;
+
+    // Take the write lock at once so a locked DB is found before any row is written
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, &errorMsg)) {
+        const _Bool busy = _dbw_is_busy(sqlDB);
+        logmsg(busy ? LOG_NOTICE : LOG_ERR, "Cannot start DB transaction ( %s )", errorMsg);
+        sqlite3_free(errorMsg);
+        return busy ? 1 : -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        db_bind_locrec(stmt, &dbw_queue[(first + i) % dbw_size]);
+        const size_t idx = (first + i) % dbw_size;
+        dbw_result[idx] = DBW_ROW_STORED;
+        if (SQLITE_DONE == sqlite3_step(stmt)) {
+            if (0 == sqlite3_changes(sqlDB)) {
+                dbw_result[idx] = DBW_ROW_DUPLICATE;
+                (*duplicates)++;
+            }
+        } else if (_dbw_is_busy(sqlDB)) {
+            logmsg(LOG_NOTICE, "DB locked while storing rows ( %s )", sqlite3_errmsg(sqlDB));
+            sqlite3_reset(stmt);
+            sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+            return 1;
+        } else {
+            logmsg(LOG_ERR, "sqlite3_step() : Failed. \"%s\"", sqlite3_errmsg(sqlDB));
+            dbw_result[idx] = DBW_ROW_ERROR;
+            (*errors)++;
+        }
+        sqlite3_reset(stmt);
+    }
+
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "COMMIT TRANSACTION", NULL, NULL, &errorMsg)) {
+        const _Bool busy = _dbw_is_busy(sqlDB);
+        logmsg(busy ? LOG_NOTICE : LOG_ERR, "Cannot COMMIT TRANSACTION ( %s )", errorMsg);
+        sqlite3_free(errorMsg);
+        sqlite3_exec(sqlDB, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+        return busy ? 1 : -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write a batch of queued rows in one transaction. If the DB is locked by
+ * another connection the whole batch is tried again after an increasing
+ * delay. Rows are only reported as stored once the batch has been committed.
+ * @param sqlDB DB handle
+ * @param stmt Prepared insert statement
+ * @param first Index in queue of the first row
+ * @param n Number of rows
+ * @param[out] errors Number of rows that could not be stored
+ * @param[out] duplicates Number of rows ignored since they were already stored
+ * @param[out] retries Number of times the batch was tried again
+ */
+static void
+_dbw_write_batch(sqlite3 *sqlDB, sqlite3_stmt *stmt, const size_t first, const size_t n,
+                 unsigned long *errors, unsigned long *duplicates, unsigned long *retries) {
+    unsigned delay = DBWRITER_RETRY_BACKOFF;
+    *retries = 0;
+    while (TRUE) {
+        const int rc = _dbw_try_batch(sqlDB, stmt, first, n, errors, duplicates);
+        if (0 == rc) {
+            return;
+        }
+        if (-1 == rc || *retries >= DBWRITER_MAX_RETRIES) {
+            break;
+        }
+        (*retries)++;
+        usleep(delay * 1000);
+        delay *= 2;
+    }
+    logmsg(LOG_ERR, "DB writer could not store a batch of %zu rows after %lu retries", n, *retries);
+    *errors = n;
+    *duplicates = 0;
+    for (size_t i = 0; i < n; i++) {
+        dbw_result[(first + i) % dbw_size] = DBW_ROW_ERROR;
+    }
+}
+
+/**
+ * Get the number of unused pages in the DB file
+ * @param sqlDB DB handle
+ * @return Number of free pages, -1 on failure
+ */
+static int
+_dbw_freelist_count(sqlite3 *sqlDB) {
+    sqlite3_stmt *stmt;
+    int cnt = -1;
+    if (SQLITE_OK == sqlite3_prepare_v2(sqlDB, "PRAGMA freelist_count;", -1, &stmt, NULL)) {
+        if (SQLITE_ROW == sqlite3_step(stmt)) {
+            cnt = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return cnt;
+}
+
+/**
+ * Release a limited number of free pages back to the file system. Only has
+ * an effect on DBs created with incremental auto vacuum.
+ * @param sqlDB DB handle
+ * @return TRUE if there are more pages that can be released
+ */
+static _Bool
+_dbw_vacuum_step(sqlite3 *sqlDB) {
+    const int before = _dbw_freelist_count(sqlDB);
+    if (before <= 0) {
+        return FALSE;
+    }
+
+    char q[64];
+    char *errorMsg;
+    snprintf(q, sizeof (q), "PRAGMA incremental_vacuum(%d);", DBWRITER_VACUUM_PAGES);
+    if (SQLITE_OK != sqlite3_exec(sqlDB, q, NULL, NULL, &errorMsg)) {
+        logmsg(LOG_ERR, "Incremental vacuum failed ( %s )", errorMsg);
+        sqlite3_free(errorMsg);
+        return FALSE;
+    }
+
+    // If no pages were released the DB is not using incremental auto vacuum
+    const int after = _dbw_freelist_count(sqlDB);
+    logmsg(LOG_DEBUG, "DB writer released %d free pages (%d left)", before - after, after);
+    return after > 0 && after < before;
+}
+
+/**
+ * The writer thread. Waits for queued rows and stores them in batches.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+dbwriter_thread(void *arg) {
+    (void) arg;
+    sqlite3 *sqlDB = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    pthread_mutex_lock(&dbw_mutex);
+    while (TRUE) {
+
+        while (0 == dbw_count && !dbw_stopping) {
+            // Use idle time to give free pages back a few at a time so that
+            // newly queued rows are picked up between the steps
+            if (dbw_vacuum) {
+                dbw_vacuum = FALSE;
+                pthread_mutex_unlock(&dbw_mutex);
+                _Bool more = FALSE;
+                if (NULL != sqlDB || 0 == _dbw_open(&sqlDB, &stmt)) {
+                    more = _dbw_vacuum_step(sqlDB);
+                }
+                pthread_mutex_lock(&dbw_mutex);
+                if (more) {
+                    dbw_vacuum = TRUE;
+                }
+                continue;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += DBWRITER_VACUUM_INTERVAL;
+            if (ETIMEDOUT == pthread_cond_timedwait(&dbw_not_empty, &dbw_mutex, &deadline)) {
+                dbw_vacuum = TRUE;
+            }
+        }
+        if (0 == dbw_count && dbw_stopping) {
+            break;
+        }
+
+        // Group commit. Give the producers up to commit_interval ms to fill
+        // up a complete batch before we write unless someone is waiting for
+        // the queue to be written.
+        if (dbw_count < dbw_batch_size && !dbw_stopping && 0 == dbw_sync_waiters) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += dbw_commit_interval / 1000;
+            deadline.tv_nsec += (long) (dbw_commit_interval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (dbw_count < dbw_batch_size && !dbw_stopping && 0 == dbw_sync_waiters) {
+                if (ETIMEDOUT == pthread_cond_timedwait(&dbw_not_empty, &dbw_mutex, &deadline)) {
+                    break;
+                }
+            }
+        }
+
+        const size_t first = dbw_head;
+        const size_t n = dbw_count < dbw_batch_size ? dbw_count : dbw_batch_size;
+        pthread_mutex_unlock(&dbw_mutex);
+
+        if (NULL == sqlDB && -1 == _dbw_open(&sqlDB, &stmt)) {
+            pthread_mutex_lock(&dbw_mutex);
+            if (dbw_stopping) {
+                logmsg(LOG_CRIT, "DB writer cannot open DB. Discarding %zu queued rows", dbw_count);
+                dbw_stat.errors += dbw_count;
+                break;
+            }
+            pthread_mutex_unlock(&dbw_mutex);
+            logmsg(LOG_CRIT, "DB writer cannot open DB. Retrying in %d s", DBWRITER_RETRY_DELAY);
+            sleep(DBWRITER_RETRY_DELAY);
+            pthread_mutex_lock(&dbw_mutex);
+            continue;
+        }
+
+        const double t0 = _dbw_now_ms();
+        unsigned long errors, duplicates, retries;
+        _dbw_write_batch(sqlDB, stmt, first, n, &errors, &duplicates, &retries);
+        const double t1 = _dbw_now_ms();
+
+        pthread_mutex_lock(&dbw_mutex);
+        for (size_t i = 0; i < n; i++) {
+            const size_t idx = (first + i) % dbw_size;
+            struct dbwriter_token *token = dbw_token[idx];
+            if (token) {
+                if (DBW_ROW_STORED == dbw_result[idx]) {
+                    token->stored++;
+                } else if (DBW_ROW_DUPLICATE == dbw_result[idx]) {
+                    token->duplicates++;
+                } else {
+                    token->errors++;
+                }
+            }
+            const double latency = t1 - dbw_queued_ms[idx];
+            dbw_stat.latency_avg_ms += (latency - dbw_stat.latency_avg_ms) / (double) (dbw_processed + i + 1);
+            if (latency > dbw_stat.latency_max_ms) {
+                dbw_stat.latency_max_ms = latency;
+            }
+        }
+        dbw_processed += n;
+        dbw_stat.rows += n - errors - duplicates;
+        dbw_stat.errors += errors;
+        dbw_stat.duplicates += duplicates;
+        dbw_stat.retries += retries;
+        dbw_stat.batches++;
+        dbw_stat.commit_avg_ms += (t1 - t0 - dbw_stat.commit_avg_ms) / (double) dbw_stat.batches;
+        if (t1 - t0 > dbw_stat.commit_max_ms) {
+            dbw_stat.commit_max_ms = t1 - t0;
+        }
+
+        dbw_head = (dbw_head + n) % dbw_size;
+        dbw_count -= n;
+        pthread_cond_broadcast(&dbw_not_full);
+        if (dbw_sync_waiters) {
+            pthread_cond_broadcast(&dbw_synced);
+        }
+
+        logmsg(LOG_DEBUG, "DB writer stored %zu rows in %.1f ms (%zu still queued)", n, t1 - t0, dbw_count);
+    }
+    dbw_exited = TRUE;
+    pthread_cond_broadcast(&dbw_synced);
+    pthread_mutex_unlock(&dbw_mutex);
+
+    if (sqlDB) {
+        sqlite3_finalize(stmt);
+        db_close(sqlDB);
+    }
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Setup the queue and start the DB writer thread
+ * @param queue_size Maximum number of queued rows
+ * @param batch_size Maximum number of rows written in one transaction
+ * @param commit_interval Maximum time in ms to wait for a full batch
+ * @return 0 on success, -1 on failure
+ */
+int
+dbwriter_init(const unsigned queue_size, const unsigned batch_size, const unsigned commit_interval) {
+    dbw_size = queue_size;
+    dbw_batch_size = batch_size < queue_size ? batch_size : queue_size;
+    dbw_commit_interval = commit_interval;
+    dbw_queue = calloc(dbw_size, sizeof (struct db_locrec));
+    dbw_queued_ms = calloc(dbw_size, sizeof (double));
+    dbw_token = calloc(dbw_size, sizeof (struct dbwriter_token *));
+    dbw_result = calloc(dbw_size, sizeof (unsigned char));
+    if (NULL == dbw_queue || NULL == dbw_queued_ms || NULL == dbw_token || NULL == dbw_result) {
+        logmsg(LOG_CRIT, "Cannot allocate memory for DB writer queue");
+        return -1;
+    }
+    memset(&dbw_stat, 0, sizeof (dbw_stat));
+
+    int ret = pthread_create(&dbw_thread, NULL, dbwriter_thread, NULL);
+    if (0 != ret) {
+        logmsg(LOG_CRIT, "Could not create DB writer thread ( %d : %s )", ret, strerror(ret));
+        return -1;
+    }
+    dbw_running = TRUE;
+    logmsg(LOG_DEBUG, "Started DB writer (queue=%u, batch=%u, interval=%u ms)", queue_size, dbw_batch_size, commit_interval);
+    return 0;
+}
+
+/**
+ * Stop the DB writer thread after all queued rows have been written
+ */
+void
+dbwriter_shutdown(void) {
+    if (!dbw_running) {
+        return;
+    }
+    pthread_mutex_lock(&dbw_mutex);
+    dbw_stopping = TRUE;
+    pthread_cond_signal(&dbw_not_empty);
+    pthread_cond_broadcast(&dbw_not_full);
+    pthread_mutex_unlock(&dbw_mutex);
+    pthread_join(dbw_thread, NULL);
+    dbw_running = FALSE;
+    logmsg(LOG_DEBUG, "DB writer stopped after storing %lu rows", dbw_stat.rows);
+}
+
+/**
+ * Queue a location row for storage in the DB. If the queue is full the caller
+ * will wait until the writer has made room.
+ * @param rec The location record to store
+ * @return 0 on success, -1 on failure
+ */
+int
+dbwriter_enqueue(const struct db_locrec *rec) {
+    return dbwriter_enqueue_tagged(rec, NULL);
+}
+
+/**
+ * Queue a location row for storage in the DB and have the outcome for the
+ * row added to the token once the row has been written. Rows are refused as
+ * soon as dbwriter_shutdown() has been called.
+ * @param rec The location record to store
+ * @param token Token that collects the result for the row (may be NULL)
+ * @return 0 on success, -1 on failure
+ */
+int
+dbwriter_enqueue_tagged(const struct db_locrec *rec, struct dbwriter_token *token) {
+    if (!dbw_running) {
+        logmsg(LOG_ERR, "DB writer is not running. Location for device %ld dropped.", rec->devid);
+        return -1;
+    }
+
+    pthread_mutex_lock(&dbw_mutex);
+    // Once the writer has been asked to stop it will not look at the queue
+    // again after it has been emptied, so a row queued now would be lost
+    if (dbw_stopping) {
+        pthread_mutex_unlock(&dbw_mutex);
+        logmsg(LOG_ERR, "DB writer is stopping. Location for device %ld dropped.", rec->devid);
+        return -1;
+    }
+    if (dbw_count == dbw_size) {
+        dbw_stat.full_waits++;
+        logmsg(LOG_NOTICE, "DB writer queue is full (%zu rows). Waiting.", dbw_size);
+        while (dbw_count == dbw_size && !dbw_stopping) {
+            pthread_cond_wait(&dbw_not_full, &dbw_mutex);
+        }
+        if (dbw_stopping) {
+            pthread_mutex_unlock(&dbw_mutex);
+            return -1;
+        }
+    }
+
+    const size_t tail = (dbw_head + dbw_count) % dbw_size;
+    dbw_queue[tail] = *rec;
+    dbw_queued_ms[tail] = _dbw_now_ms();
+    dbw_token[tail] = token;
+    dbw_count++;
+    dbw_enqueued++;
+    if (dbw_count > dbw_stat.queue_peak) {
+        dbw_stat.queue_peak = dbw_count;
+    }
+
+    // Only wake the writer when it has something new to act on, i.e. the first
+    // row that starts the commit interval or when a full batch is available
+    if (1 == dbw_count || dbw_count >= dbw_batch_size) {
+        pthread_cond_signal(&dbw_not_empty);
+    }
+    pthread_mutex_unlock(&dbw_mutex);
+    return 0;
+}
+
+/**
+ * Wait until the writer is done with all rows queued so far. Rows that could
+ * not be stored are counted in the errors statistics and in the token they
+ * were queued with. Rows queued by other threads while waiting are not
+ * waited for.
+ * @return 0 when all rows have been handled, -1 if the writer stopped
+ * before that
+ */
+int
+dbwriter_sync(void) {
+    if (!dbw_running) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dbw_mutex);
+    // Rows are written in order so our rows have been handled when the number
+    // of handled rows has reached the number of queued rows right now
+    const unsigned long target = dbw_enqueued;
+    dbw_sync_waiters++;
+    pthread_cond_signal(&dbw_not_empty);
+    // Wait for the writer to exit if it is stopping so that it is never
+    // updating a token after we have returned
+    while (dbw_processed < target && !dbw_exited) {
+        pthread_cond_wait(&dbw_synced, &dbw_mutex);
+    }
+    dbw_sync_waiters--;
+    const int rc = dbw_processed >= target ? 0 : -1;
+    pthread_mutex_unlock(&dbw_mutex);
+    return rc;
+}
+
+/**
+ * Ask the writer to give unused pages in the DB back to the file system.
+ * This is done in small steps when the writer is otherwise idle so that
+ * it does not block new locations the way a full VACUUM would.
+ */
+void
+dbwriter_request_vacuum(void) {
+    if (!dbw_running) {
+        return;
+    }
+    pthread_mutex_lock(&dbw_mutex);
+    dbw_vacuum = TRUE;
+    pthread_cond_signal(&dbw_not_empty);
+    pthread_mutex_unlock(&dbw_mutex);
+}
+
+/**
+ * Get a snapshot of the DB writer statistics
+ * @param[out] stat Statistics
+ */
+void
+dbwriter_get_stat(struct dbwriter_stat *stat) {
+    pthread_mutex_lock(&dbw_mutex);
+    *stat = dbw_stat;
+    stat->queue_len = dbw_count;
+    stat->queue_size = dbw_size;
+    pthread_mutex_unlock(&dbw_mutex);
+}
+
+/* EOF */
@@ -0,0 +1,89 @@
+/* =========================================================================
+ * File:        DBWRITER.H
+ * Description: Dedicated DB writer thread that stores received locations
+ *              in batches.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef DBWRITER_H
+#define	DBWRITER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct db_locrec;
+
+/**
+ * Statistics for the DB writer
+ */
+struct dbwriter_stat {
+    size_t queue_len;           // Current number of queued rows
+    size_t queue_size;          // Maximum number of rows in the queue
+    size_t queue_peak;          // Largest number of queued rows seen
+    unsigned long full_waits;   // Number of times a producer had to wait for a full queue
+    unsigned long rows;         // Total number of stored rows
+    unsigned long batches;      // Total number of committed batches
+    unsigned long errors;       // Number of rows that failed to be stored
+    unsigned long duplicates;   // Number of rows ignored since already stored
+    unsigned long retries;      // Number of batches tried again since the DB was locked
+    double commit_avg_ms;       // Average time to write and commit one batch
+    double commit_max_ms;       // Longest time to write and commit one batch
+    double latency_avg_ms;      // Average time from queued to committed for a row
+    double latency_max_ms;      // Longest time from queued to committed for a row
+};
+
+/**
+ * Result for the rows queued by one producer with dbwriter_enqueue_tagged().
+ * The writer thread adds the outcome of each tagged row to the token so the
+ * counts are not mixed up with rows queued by other threads. The token must
+ * stay valid until dbwriter_sync() has returned.
+ */
+struct dbwriter_token {
+    unsigned long stored;       // Number of stored rows
+    unsigned long duplicates;   // Number of rows ignored since already stored
+    unsigned long errors;       // Number of rows that failed to be stored
+};
+
+int
+dbwriter_init(const unsigned queue_size, const unsigned batch_size, const unsigned commit_interval);
+
+void
+dbwriter_shutdown(void);
+
+int
+dbwriter_enqueue(const struct db_locrec *rec);
+
+int
+dbwriter_enqueue_tagged(const struct db_locrec *rec, struct dbwriter_token *token);
+
+int
+dbwriter_sync(void);
+
+void
+dbwriter_request_vacuum(void);
+
+void
+dbwriter_get_stat(struct dbwriter_stat *stat);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* DBWRITER_H */
@@ -1,6 +1,7 @@
 /* =========================================================================
  * File:        DICT.C
- * Description: Functions to do dictionary substitution in buffers and files
+ * Description: Functions to do dictionary substitution in buffers and files.
+ *              Templates are compiled once and cached until they change.
  * Author:      Johan Persson (johan162@gmail.com)
  *
  * Copyright (C) 2013-2015  Johan Persson
@@ -26,7 +27,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "dict.h"
 #include "libxstr/xstr.h"
@@ -37,6 +42,324 @@
 // buffer when doing replacement. By default set to 1MB
 #define _MAX_REPLACE_BUFFER_SIZE 1024*1024
 
+// Maximum length of a keyword between the "[]"
+#define _MAX_KEYWORD_LEN 255
+
+/**
+ * One segment in a compiled template. Either a literal text or a keyword slot
+ * that is replaced with the value from the dictionary when the template is
+ * rendered. For a keyword slot str/len covers the whole "[KEY]" which is used
+ * as is when the key is not in the dictionary.
+ */
+struct dict_segment {
+    const char *str;
+    size_t len;
+    char *key;      // NULL for a literal segment
+};
+
+/**
+ * A template compiled into a list of segments
+ */
+struct dict_template {
+    char *text;
+    size_t nseg;
+    struct dict_segment *seg;
+};
+
+/**
+ * Cached compiled template for a file together with the file status it was
+ * compiled from so that we know when it has to be reloaded
+ */
+struct dict_template_entry {
+    char *filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+    struct dict_template *tmpl;
+    struct dict_template_entry *next;
+};
+
+static struct dict_template_entry *template_cache = NULL;
+static pthread_mutex_t template_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Case insensitive FNV-1a hash of the key. Keywords in templates are matched
+ * without regard to case so the hash must be the same for all case variants.
+ * @param key Key to hash
+ * @return Hash value
+ */
+static size_t
+_dict_hash(const char *key) {
+    size_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char) tolower((unsigned char) *key++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Find the tuple for the key
+ * @param dict Dictionary
+ * @param key Key to search for
+ * @param nocase TRUE to ignore the case when comparing keys
+ * @return Index of the tuple, -1 if the key doesn't exist
+ */
+static ssize_t
+_dict_find(dict_t dict, const char *key, int nocase) {
+    const size_t mask = dict->nbuckets - 1;
+    for (size_t b = _dict_hash(key) & mask; dict->bucket[b]; b = (b + 1) & mask) {
+        const size_t i = dict->bucket[b] - 1;
+        if (0 == (nocase ? strcasecmp(key, dict->tuple[i].key) : strcmp(key, dict->tuple[i].key))) {
+            return (ssize_t) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Rebuild the hash index so that it has room for maxsize tuples with a load
+ * factor of at most 0.5
+ * @param dict Dictionary
+ * @return 0 on success, -1 on failure
+ */
+static int
+_dict_rehash(dict_t dict) {
+    size_t nbuckets = 16;
+    while (nbuckets < 2 * dict->maxsize) {
+        nbuckets *= 2;
+    }
+    size_t *bucket = calloc(nbuckets, sizeof (size_t));
+    if (NULL == bucket) {
+        return -1;
+    }
+    free(dict->bucket);
+    dict->bucket = bucket;
+    dict->nbuckets = nbuckets;
+    for (size_t i = 0; i < dict->idx; i++) {
+        size_t b = _dict_hash(dict->tuple[i].key) & (nbuckets - 1);
+        while (bucket[b]) {
+            b = (b + 1) & (nbuckets - 1);
+        }
+        bucket[b] = i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Free a compiled template
+ * @param tmpl Template to free
+ */
+static void
+_dict_template_free(struct dict_template *tmpl) {
+    if (NULL == tmpl)
+        return;
+    for (size_t i = 0; i < tmpl->nseg; i++) {
+        free(tmpl->seg[i].key);
+    }
+    free(tmpl->seg);
+    free(tmpl->text);
+    free(tmpl);
+}
+
+/**
+ * Compile a template text into a list of literal segments and keyword slots.
+ * A keyword slot is a key of at most _MAX_KEYWORD_LEN characters surrounded
+ * by "[]".
+ * @param text Template text. The template takes ownership of the text.
+ * @return The compiled template, NULL on failure
+ */
+static struct dict_template *
+_dict_template_compile(char *text) {
+    struct dict_template *tmpl = calloc(1, sizeof (struct dict_template));
+    if (NULL == tmpl) {
+        free(text);
+        return NULL;
+    }
+    tmpl->text = text;
+
+    // Each '[' can at most split a literal and add one keyword slot
+    size_t maxseg = 1;
+    for (const char *p = text; *p; p++) {
+        if ('[' == *p) {
+            maxseg += 2;
+        }
+    }
+    tmpl->seg = calloc(maxseg, sizeof (struct dict_segment));
+    if (NULL == tmpl->seg) {
+        _dict_template_free(tmpl);
+        return NULL;
+    }
+
+    const char *lit = text;
+    const char *p = text;
+    while (*p) {
+        if ('[' == *p) {
+            const size_t n = strcspn(p + 1, "[]");
+            if (n <= _MAX_KEYWORD_LEN && ']' == p[n + 1]) {
+                if (p > lit) {
+                    tmpl->seg[tmpl->nseg].str = lit;
+                    tmpl->seg[tmpl->nseg++].len = p - lit;
+                }
+                tmpl->seg[tmpl->nseg].str = p;
+                tmpl->seg[tmpl->nseg].len = n + 2;
+                tmpl->seg[tmpl->nseg++].key = strndup(p + 1, n);
+                p += n + 2;
+                lit = p;
+                continue;
+            }
+        }
+        p++;
+    }
+    if (p > lit) {
+        tmpl->seg[tmpl->nseg].str = lit;
+        tmpl->seg[tmpl->nseg++].len = p - lit;
+    }
+    return tmpl;
+}
+
+/**
+ * Render a compiled template with the values from the dictionary. The size
+ * of the result is calculated first so the result is written in one go to a
+ * buffer of exactly the right size.
+ * @param dict Dictionary to use
+ * @param tmpl Compiled template
+ * @param[out] buffer The rendered text. It is the calling functions responsibility
+ * to free the buffer after usage.
+ * @return 0 on success, -1 on failure
+ */
+static int
+_dict_template_render(dict_t dict, const struct dict_template *tmpl, char **buffer) {
+    struct dict_segment *out = calloc(tmpl->nseg + 1, sizeof (struct dict_segment));
+    if (NULL == out) {
+        return -1;
+    }
+
+    size_t N = 0;
+    for (size_t i = 0; i < tmpl->nseg; i++) {
+        out[i].str = tmpl->seg[i].str;
+        out[i].len = tmpl->seg[i].len;
+        if (tmpl->seg[i].key) {
+            ssize_t t = _dict_find(dict, tmpl->seg[i].key, 1);
+            if (t >= 0) {
+                out[i].str = dict->tuple[t].val;
+                out[i].len = strlen(dict->tuple[t].val);
+            }
+        }
+        N += out[i].len;
+    }
+
+    *buffer = malloc(N + 1);
+    if (NULL == *buffer) {
+        free(out);
+        return -1;
+    }
+    char *pbuff = *buffer;
+    for (size_t i = 0; i < tmpl->nseg; i++) {
+        memcpy(pbuff, out[i].str, out[i].len);
+        pbuff += out[i].len;
+    }
+    *pbuff = '\0';
+    free(out);
+    return 0;
+}
+
+/**
+ * Get the compiled template for a file. The template is read and compiled
+ * the first time and then again only when the file has changed. Must be
+ * called with the template mutex held.
+ * @param filename Template file
+ * @return The compiled template, NULL on failure
+ */
+static struct dict_template *
+_dict_template_get(char *filename) {
+    struct stat buf;
+    if (-1 == stat(filename, &buf)) {
+        return NULL;
+    }
+
+    struct dict_template_entry *entry = template_cache;
+    while (entry && strcmp(entry->filename, filename)) {
+        entry = entry->next;
+    }
+    if (entry && entry->dev == buf.st_dev && entry->ino == buf.st_ino && entry->size == buf.st_size &&
+        entry->mtim.tv_sec == buf.st_mtim.tv_sec && entry->mtim.tv_nsec == buf.st_mtim.tv_nsec) {
+        return entry->tmpl;
+    }
+
+    FILE *fp;
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        return NULL;
+    }
+    // By allocating with calloc() we ensure 0 terminated string from the call to fread()
+    char *text = calloc(buf.st_size + 1, sizeof (char));
+    if (NULL == text) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t readsize = fread(text, sizeof (char), buf.st_size, fp);
+    fclose(fp);
+    if (readsize != (size_t) buf.st_size) {
+        free(text);
+        return NULL;
+    }
+
+    struct dict_template *tmpl = _dict_template_compile(text);
+    if (NULL == tmpl) {
+        return NULL;
+    }
+
+    if (NULL == entry) {
+        entry = calloc(1, sizeof (struct dict_template_entry));
+        if (NULL == entry) {
+            _dict_template_free(tmpl);
+            return NULL;
+        }
+        entry->filename = strdup(filename);
+        entry->next = template_cache;
+        template_cache = entry;
+    }
+    _dict_template_free(entry->tmpl);
+    entry->tmpl = tmpl;
+    entry->dev = buf.st_dev;
+    entry->ino = buf.st_ino;
+    entry->size = buf.st_size;
+    entry->mtim = buf.st_mtim;
+    return tmpl;
+}
+
+/**
+ * Read and compile a template file so that it is ready to use. This is
+ * normally done at startup for all templates. If the file is later changed
+ * it is compiled again the next time it is used.
+ * @param filename Template file
+ * @return 0 on success, -1 on failure
+ */
+int
+dict_load_template(char *filename) {
+    pthread_mutex_lock(&template_mutex);
+    int rc = _dict_template_get(filename) ? 0 : -1;
+    pthread_mutex_unlock(&template_mutex);
+    return rc;
+}
+
+/**
+ * Free all compiled templates
+ */
+void
+dict_free_templates(void) {
+    pthread_mutex_lock(&template_mutex);
+    while (template_cache) {
+        struct dict_template_entry *next = template_cache->next;
+        _dict_template_free(template_cache->tmpl);
+        free(template_cache->filename);
+        free(template_cache);
+        template_cache = next;
+    }
+    pthread_mutex_unlock(&template_mutex);
+}
+
 /**
  * Replace all occurrences of each key surrounded by "[]" with its value in
  * the buffer pointed to by buffer. Note. The maximum allowed size of the
@@ -49,57 +372,19 @@
 int
 replace_dict_in_buf(dict_t dict, char *buffer, size_t maxlen) {
 
-    // The worst possible size needed
-    size_t const N = strnlen(buffer,_MAX_REPLACE_BUFFER_SIZE) + MAX_DICTIONARY_VAL_SIZE * dict->idx;
-    if( _MAX_REPLACE_BUFFER_SIZE <= N ) {
+    if( _MAX_REPLACE_BUFFER_SIZE <= strnlen(buffer,_MAX_REPLACE_BUFFER_SIZE) ) {
         return -1;
     }
-        
-    
-    char match[256];
-    char *wbuff = calloc(N, sizeof (char));
-    char *pwbuff = wbuff;
-    char *pbuff = buffer;
-    size_t n = 0;
-
-    while (n < N && *pbuff) {
-        if (*pbuff == '[') {
-            char *ppbuff = pbuff;
-            size_t nn = 0;
-            ++ppbuff;
-            while (nn < sizeof (match) - 1 && *ppbuff && *ppbuff != ']') {
-                match[nn++] = *ppbuff++;
-            }
-            match[nn] = '\0';
-            if (*ppbuff == ']') {
 
-                size_t i = 0;
-                while (i < dict->idx && strcasecmp(match, dict->tuple[i].key)) {
-                    i++;
-                }
-                if (i < dict->idx) {
-                    // We got a match
-                    nn = MIN(MAX_DICTIONARY_VAL_SIZE, strlen(dict->tuple[i].val));
-                    size_t j = 0;
-                    while (nn > 0) {
-                        *pwbuff++ = dict->tuple[i].val[j++];
-                        nn--;
-                    }
-                    pbuff = ++ppbuff;
-                } else {
-                    // No match
-                    *pwbuff++ = *pbuff++;
-                    n++;
-                }
-
-            } else {
-                *pwbuff++ = *pbuff++;
-                n++;
-            }
-        } else {
-            *pwbuff++ = *pbuff++;
-            n++;
-        }
+    struct dict_template *tmpl = _dict_template_compile(strdup(buffer));
+    if (NULL == tmpl) {
+        return -1;
+    }
+    char *wbuff;
+    int rc = _dict_template_render(dict, tmpl, &wbuff);
+    _dict_template_free(tmpl);
+    if (-1 == rc) {
+        return -1;
     }
 
     if (maxlen > strlen(wbuff)) {
@@ -113,9 +398,10 @@ replace_dict_in_buf(dict_t dict, char *buffer, size_t maxlen) {
 }
 
 /**
- * Read a template from a file and replace all keywords with the key values and store
+ * Replace all keywords in a template file with the key values and store
  * the result in the buffer pointed to by buffer. It is the calling functions responsibility
- * to free the buffer after usage.
+ * to free the buffer after usage. The template is only read from disk the
+ * first time it is used and when it has changed.
  * @param dict Dictionary to use
  * @param filename Template file to read
  * @param[out] buffer The resulting replaced text
@@ -123,34 +409,12 @@ replace_dict_in_buf(dict_t dict, char *buffer, size_t maxlen) {
  */
 int
 replace_dict_in_file(dict_t dict, char *filename, char **buffer) {
-
-    FILE *fp;
     *buffer = NULL;
-    if ((fp = fopen(filename, "rb")) == NULL) {
-        return -1;
-    }
-    int fd = fileno(fp);
-    struct stat buf;
-    if( -1 == fstat(fd, &buf) ) {
-        fclose(fp);
-        return -1;
-    }
-    size_t const N = buf.st_size + MAX_DICTIONARY_VAL_SIZE * dict->idx + 1;
-    
-    // By allocating with calloc() we ensure 0 terminated string from the call to fread()
-    *buffer = calloc(N, sizeof (char));    
-    size_t readsize = fread(*buffer, sizeof (char), buf.st_size, fp);
-    
-    if (readsize != (size_t) buf.st_size) {
-        fclose(fp);
-        free(*buffer);
-        *buffer = NULL;
-        return -1;
-    }
-    
-    fclose(fp);
-    
-    return replace_dict_in_buf(dict, *buffer, N);
+    pthread_mutex_lock(&template_mutex);
+    struct dict_template *tmpl = _dict_template_get(filename);
+    int rc = tmpl ? _dict_template_render(dict, tmpl, buffer) : -1;
+    pthread_mutex_unlock(&template_mutex);
+    return rc;
 }
 
 /**
@@ -162,6 +426,11 @@ new_dict(void) {
     dict_t ptr = calloc(1, sizeof (struct dict));
     ptr->tuple = calloc(DICTIONARY_INIITIAL_SIZE, sizeof (struct dict_tuple));
     ptr->maxsize = DICTIONARY_INIITIAL_SIZE;
+    if (-1 == _dict_rehash(ptr)) {
+        free(ptr->tuple);
+        free(ptr);
+        return NULL;
+    }
     return ptr;
 }
 
@@ -197,11 +466,20 @@ add_dict(dict_t dict, char *key, char *val) {
         free(dict->tuple);
         dict->tuple = newptr;
         dict->maxsize = newsize;
+        if (-1 == _dict_rehash(dict)) {
+            return -1;
+        }
     }
 
     dict->tuple[dict->idx].key = strdup(key);
     dict->tuple[dict->idx].val = strdup(val);
-    dict->idx++;
+
+    const size_t mask = dict->nbuckets - 1;
+    size_t b = _dict_hash(key) & mask;
+    while (dict->bucket[b]) {
+        b = (b + 1) & mask;
+    }
+    dict->bucket[b] = ++dict->idx;
     return 0;
 
 }
@@ -226,6 +504,7 @@ free_dict(dict_t dict) {
         }
         free(dict->tuple);
     }
+    free(dict->bucket);
     free(dict);
     return 0;
 }
@@ -257,12 +536,8 @@ map_dict(dict_t dict, dict_map_t f) {
  */
 char *
 getval_dict(dict_t dict, char *key) {
-    for (size_t i = 0; i < dict->idx; i++) {
-        if (0 == strcmp(key, dict->tuple[i].key)) {
-            return dict->tuple[i].val;
-        }
-    }
-    return NULL;
+    ssize_t i = _dict_find(dict, key, 0);
+    return i >= 0 ? dict->tuple[i].val : NULL;
 }
 
 
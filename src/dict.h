@@ -28,11 +28,6 @@
 extern "C" {
 #endif
 
-/* Maximum size for values. We need this to be able to estimate the maximum buffer size 
- * needed when doing replacements in a buffer.
- */
-#define MAX_DICTIONARY_VAL_SIZE 1024
-    
 /* The dictionary will grow dynamically as needed but this is the initial size
  */
 #define DICTIONARY_INIITIAL_SIZE 100
@@ -52,6 +47,9 @@ typedef struct dict {
     size_t idx;
     size_t maxsize;
     struct dict_tuple *tuple;
+    /** Hash index into tuple (index + 1, 0 is an empty bucket) */
+    size_t nbuckets;
+    size_t *bucket;
 } *dict_t;
 
 
@@ -83,6 +81,12 @@ map_dict(dict_t dict, dict_map_t f);
 char *
 getval_dict(dict_t d, char *key);
 
+int
+dict_load_template(char *filename);
+
+void
+dict_free_templates(void);
+
 
 #ifdef	__cplusplus
 }
@@ -48,6 +48,7 @@
 #include "dbcmd.h"
 #include "mailutil.h"
 #include "export.h"
+#include "outbuf.h"
 
 
 
@@ -74,142 +75,24 @@ xsi:schemaLocation=\"http://www.topografix.com/GPX/1/0 http://www.topografix.com
 
 #define EXPORTDB_BASE_NAME "g7db_export"
 
-// Initial size of internal memory list for export. We also use this
-// as the chink size when the list needs to grow
-#define INTERNAL_LIST_CHUNKSIZE 50000
-
-/** Determine lat/long bounding box */
-char minlat[32], maxlat[32],
-minlon[32], maxlon[32];
-
-/** Length of the current result set read from the DB. Needs to
- * be global since it is used by a callback routine
- */
-size_t resSetLength = 0;
-
-/** The current maximum allocated size for th internal memory list which
- is created when prepare for the db export
- */
-size_t g7locListSize = 0;
-
-/**
- * Internal list to hold the exported DB in memory as an
- * intermediate step before writing the exported file in the
- * chosen format. Maximum size is 500,000 location points
- */
-struct g7loc_t *g7loc_list = NULL;
-
-// Silent gcc about unused "arg"in the callbacks
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-
-/**
- * Result callback from sqlite3_exec(). This callback is called for each row
- * in the result set. This is called when we do the SQL for an export
- *
- * @param NotUsed   Required argument for callback but not used
- * @param nColumns  Number of columns in row
- * @param azSolVals    Column values
- * @param azColName  Name of each column
- * @return 0 to continue to the next row, -1 to abort
- */
-static int
-sqres_export_callback(void *NotUsed, int nColumns, char **azSolVals, char **azColName) {
-
-    if (nColumns != 11) {
-        logmsg(LOG_ERR, "SELECT statement returned wrong number of columns!");
-        return 1; // Abort
-    }
-
-    if (resSetLength >= g7locListSize) {
-        logmsg(LOG_DEBUG, "Increasing internal memory buffer with %d bytes", INTERNAL_LIST_CHUNKSIZE);
-        // We need to expand the internal dataset to make room for the entire database
-        g7loc_list = (struct g7loc_t *) realloc(g7loc_list, g7locListSize + INTERNAL_LIST_CHUNKSIZE);
-        if (NULL == g7loc_list) {
-            logmsg(LOG_CRIT, "Out of memory when exporting DB");
-            return 1;
-        }
-        g7locListSize += INTERNAL_LIST_CHUNKSIZE;
-    }
-
-    for (int i = 0; i < nColumns; ++i) {
-
-        if (NULL == azSolVals[i]) {
-            logmsg(LOG_CRIT, "SQL SELECT returned a NULL valued column (index=%d).", i);
-            return 1;
-        }
-
-    }
-    struct g7loc_t *p = &g7loc_list[resSetLength];
-    strncpy(p->lat, azSolVals[0], 15);
-    strncpy(p->lon, azSolVals[1], 15);
-    strncpy(p->approxaddr, azSolVals[2], 127);
-    strncpy(p->date, convert_to_utc(azSolVals[3]), 31);
-
-    // Convert the datetime to a timestamp t be able to compare locations
-    // easier during export
-    struct tm tm;
-    CLEAR(tm); // strptime() is dangerous since it will not initialize tm
-    strptime(azSolVals[2], "%Y%m%d%H%M%S", &tm);
-    p->date_timestamp = mktime(&tm);
-
-    strncpy(p->altitude, azSolVals[4], 7);
-    strncpy(p->speed, azSolVals[5], 7);
-    strncpy(p->voltage, azSolVals[6], 7);
-    strncpy(p->event, azSolVals[7], 7);
-    strncpy(p->heading, azSolVals[8], 7);
-    strncpy(p->deviceid, azSolVals[9], 15);
-    strncpy(p->satellite, azSolVals[10], 7);
-
-    // Keep track of boundary lat/long values in set since this is needed
-    // in the GPX format
-    if (0 == resSetLength) {
-        xstrlcpy(minlat, p->lat, sizeof(minlat));
-        xstrlcpy(maxlat, p->lat, sizeof(maxlat));
-        xstrlcpy(minlon, p->lon, sizeof(minlon));
-        xstrlcpy(maxlon, p->lon, sizeof(maxlon));
-    } else {
-        if (strcmp(p->lat, minlat) < 0)
-            xstrlcpy(minlat, p->lat, sizeof(minlat));
-        if (strcmp(p->lon, minlon) < 0)
-            xstrlcpy(minlon, p->lon, sizeof(minlon));
-
-        if (strcmp(p->lat, maxlat) > 0)
-            xstrlcpy(maxlat, p->lat, sizeof(maxlat));
-        if (strcmp(p->lon, maxlon) > 0)
-            xstrlcpy(maxlon, p->lon, sizeof(maxlon));
-    }
-    resSetLength++;
-    return 0;
-}
-
-#pragma GCC diagnostic pop
-
-/**
- * Free the internal export structure used to read the DB to memory
- */
-void
-free_internal_set(void) {
-    if (g7loc_list) {
-        free(g7loc_list);
-        g7loc_list = NULL;
-    }
-}
-
 /**
  * Interpret given datetime string as UTZ time. It is used to convert
  * a string from (for example) "20131201093042" to "2013-12-01T09:30:42Z"
  * Note that this does not do any timezone calculation but only a syntactic
  * change of the string.
  * @param datetime
- * @return A pointer to a static buffer that holds the formatted
- * time. NOT thread safe due to the static buffer.
+ * @param[out] buff Buffer for the formatted time
+ * @param maxlen Size of buffer (at least 21 characters)
+ * @return A pointer to buff
  *
  * FIXME: Add real time conversion not just dummy placeholder!!
  */
 char *
-convert_to_utc(const char *datetime) {
-    static char buff[32];
+convert_to_utc(const char *datetime, char *buff, size_t maxlen) {
+    if (maxlen < 21 || strlen(datetime) < 14) {
+        *buff = '\0';
+        return buff;
+    }
     const char *p = datetime;
     strncpy(buff, p, 4);
     p += 4;
@@ -234,66 +117,166 @@ convert_to_utc(const char *datetime) {
 }
 
 /**
- * Export the DB to intermediary in-memory structure.
- * The export is filtered according to the arguments given.
+ * Select the locations to export. The rows are not read into memory, instead
+ * the caller steps through them one at a time with export_next_loc() so that
+ * exports use the same amount of memory regardless of the size of the DB.
  * Note: It is the calling routines responsibility to call free_internal_set()
- * after the internal memory structure is no longer needed.
+ * when the context is no longer needed and to keep the DB connection until then.
+ * All state for the export is kept in the context so several exports may run
+ * at the same time.
  * @param sqlDB     DB Handle
+ * @param[in,out] ctx Export context for this request
  * @param fromDate  From date and time
  * @param toDate    To date and time
  * @param deviceId  Device id
  * @param eventId   Event id
- * @return 0 on success, -2 if fromDate > toDate, -1 on other failure (most likely OOM)
+ * @return 0 on success, -2 if fromDate > toDate, -1 on other failure
  */
 int
-export_to_internal_set(sqlite3 *sqlDB, char *fromDate, char *toDate, char *deviceId, char *eventId) {
+export_to_internal_set(sqlite3 *sqlDB, struct export_ctx *ctx, char *fromDate, char *toDate, char *deviceId, char *eventId) {
+
+    free_internal_set(ctx);
+    ctx->sqlDB = sqlDB;
+    ctx->nrows = 0;
+    *ctx->where = '\0';
+
+    if (strcmp(fromDate, toDate) > 0) {
+        logmsg(LOG_ERR, "export_to_internal_set() : fromDate > toDate");
+        return -2;
+    }
+
+    db_add_wcond(ctx->where, sizeof(ctx->where), "fld_datetime", ">=", fromDate);
+    db_add_wcond(ctx->where, sizeof(ctx->where),"fld_datetime", "<=", toDate);
+    db_add_wcond(ctx->where, sizeof(ctx->where),"fld_deviceid", "=", deviceId);
+    db_add_wcond(ctx->where, sizeof(ctx->where),"fld_event", "=", eventId);
 
     char q[1024];
     snprintf(q, sizeof (q),
             "select fld_lat, fld_lon, fld_approxaddr, fld_datetime, fld_altitude, fld_speed,"
             "fld_voltage, fld_event, fld_heading, fld_deviceid, fld_satellite "
-            "from %s ", DB_TABLE_LOC);
+            "from %s %s;", DB_TABLE_LOC, ctx->where);
+    logmsg(LOG_DEBUG, "SQL: \"%s\"", q);
 
+    if (SQLITE_OK != sqlite3_prepare_v2(sqlDB, q, -1, &ctx->stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot prepare export statement ( %s )", sqlite3_errmsg(sqlDB));
+        ctx->stmt = NULL;
+        return -1;
+    }
+    return 0;
+}
 
-    char w[512];
-    if (strcmp(fromDate, toDate) > 0) {
-        logmsg(LOG_ERR, "export_to_internal_set() : fromDate > toDate");
-        return -2;
+/**
+ * Read the next location from an export cursor
+ * @param ctx Export context set up with export_to_internal_set()
+ * @return 1 if a new location was read into ctx->loc, 0 when there are no
+ * more locations, -1 on failure
+ */
+int
+export_next_loc(struct export_ctx *ctx) {
+    int rc = sqlite3_step(ctx->stmt);
+    if (SQLITE_DONE == rc) {
+        return 0;
+    }
+    if (SQLITE_ROW != rc) {
+        logmsg(LOG_ERR, "Cannot read location to export ( %s )", sqlite3_errmsg(ctx->sqlDB));
+        return -1;
     }
 
-    *w = '\0';
-    db_add_wcond(w, sizeof(w), "fld_datetime", ">=", fromDate);
-    db_add_wcond(w, sizeof(w),"fld_datetime", "<=", toDate);
-    db_add_wcond(w, sizeof(w),"fld_deviceid", "=", deviceId);
-    db_add_wcond(w, sizeof(w),"fld_event", "=", eventId);
-    xstrlcat(q, w, sizeof(q));
-    xstrlcat(q, ";", sizeof(q));
-    logmsg(LOG_DEBUG, "SQL: \"%s\"", q);
-    // Pre-allocate space for result set
-    // Assume result set < MAX_ENTRYLIST entries
-    g7loc_list = _chk_calloc_exit(INTERNAL_LIST_CHUNKSIZE * sizeof (struct g7loc_t));
-    g7locListSize = INTERNAL_LIST_CHUNKSIZE;
-
-    resSetLength = 0;
-    *minlat = '\0';
-    *maxlat = '\0';
-    *minlon = '\0';
-    *maxlon = '\0';
-    char *errMsg;
-
-    int rc = sqlite3_exec(sqlDB, q, sqres_export_callback, (void *) 0, &errMsg);
-
-    if (rc) {
-        if (SQLITE_ABORT == rc) {
-            logmsg(LOG_ERR, "Result set is too large to hold in memory");
-            return -1;
-        } else {
-            logmsg(LOG_DEBUG, "Can execute SQL [\"%s\"]", errMsg);
-            sqlite3_free(errMsg);
+    const char *col[11];
+    for (int i = 0; i < 11; ++i) {
+        col[i] = (const char *) sqlite3_column_text(ctx->stmt, i);
+        if (NULL == col[i]) {
+            logmsg(LOG_CRIT, "SQL SELECT returned a NULL valued column (index=%d).", i);
             return -1;
         }
     }
-    return 0;
+
+    struct g7loc_t *p = &ctx->loc;
+    xstrlcpy(p->lat, col[0], sizeof(p->lat));
+    xstrlcpy(p->lon, col[1], sizeof(p->lon));
+    xstrlcpy(p->approxaddr, col[2], sizeof(p->approxaddr));
+    convert_to_utc(col[3], p->date, sizeof(p->date));
+
+    // Convert the datetime to a timestamp t be able to compare locations
+    // easier during export
+    struct tm tm;
+    CLEAR(tm); // strptime() is dangerous since it will not initialize tm
+    strptime(col[3], "%Y%m%d%H%M%S", &tm);
+    p->date_timestamp = mktime(&tm);
+
+    xstrlcpy(p->altitude, col[4], sizeof(p->altitude));
+    xstrlcpy(p->speed, col[5], sizeof(p->speed));
+    xstrlcpy(p->voltage, col[6], sizeof(p->voltage));
+    xstrlcpy(p->event, col[7], sizeof(p->event));
+    xstrlcpy(p->heading, col[8], sizeof(p->heading));
+    xstrlcpy(p->deviceid, col[9], sizeof(p->deviceid));
+    xstrlcpy(p->satellite, col[10], sizeof(p->satellite));
+
+    ctx->nrows++;
+    return 1;
+}
+
+/**
+ * Determine the lat/long bounding box of the selected locations. This is
+ * needed in the header of some formats before the locations are written so
+ * it is done with a separate aggregate query instead of an extra pass.
+ * @param ctx Export context set up with export_to_internal_set()
+ * @return 0 on success, -1 on failure
+ */
+int
+export_get_bounds(struct export_ctx *ctx) {
+    char q[1024];
+    snprintf(q, sizeof (q),
+            "select min(fld_lat), max(fld_lat), min(fld_lon), max(fld_lon) from %s %s;",
+            DB_TABLE_LOC, ctx->where);
+
+    *ctx->minlat = '\0';
+    *ctx->maxlat = '\0';
+    *ctx->minlon = '\0';
+    *ctx->maxlon = '\0';
+
+    sqlite3_stmt *stmt;
+    if (SQLITE_OK != sqlite3_prepare_v2(ctx->sqlDB, q, -1, &stmt, NULL)) {
+        logmsg(LOG_ERR, "Cannot prepare export bounds statement ( %s )", sqlite3_errmsg(ctx->sqlDB));
+        return -1;
+    }
+    int rc = -1;
+    if (SQLITE_ROW == sqlite3_step(stmt)) {
+        // All columns are NULL for an empty selection
+        if (SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+            xstrlcpy(ctx->minlat, (const char *) sqlite3_column_text(stmt, 0), sizeof(ctx->minlat));
+            xstrlcpy(ctx->maxlat, (const char *) sqlite3_column_text(stmt, 1), sizeof(ctx->maxlat));
+            xstrlcpy(ctx->minlon, (const char *) sqlite3_column_text(stmt, 2), sizeof(ctx->minlon));
+            xstrlcpy(ctx->maxlon, (const char *) sqlite3_column_text(stmt, 3), sizeof(ctx->maxlon));
+        }
+        rc = 0;
+    } else {
+        logmsg(LOG_ERR, "Cannot read export bounds ( %s )", sqlite3_errmsg(ctx->sqlDB));
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/**
+ * Initialize an empty export context. Must be called before the context is
+ * used the first time.
+ * @param[out] ctx Export context
+ */
+void
+export_init_ctx(struct export_ctx *ctx) {
+    CLEAR(*ctx);
+}
+
+/**
+ * Release the DB resources held by an export context
+ * @param ctx Export context
+ */
+void
+free_internal_set(struct export_ctx *ctx) {
+    if (ctx->stmt) {
+        sqlite3_finalize(ctx->stmt);
+        ctx->stmt = NULL;
+    }
 }
 
 /**
@@ -354,174 +337,200 @@ open_export_file(const char *fileName, char *newFileName, size_t maxlen) {
 
 /**
  * Export to the proprietary XML format to include all columns in the DB
- * @param fileName
+ * @param fileName File to export to
+ * @param ctx Export context with the locations to export
  * @return  0 on success, -1 on failure
  */
 int
-export_to_prop_xml(const char *fileName) {
+export_to_prop_xml(const char *fileName, struct export_ctx *ctx) {
     int fd = open_export_file(fileName, NULL, 0);
     if (fd < 0) {
         return -1;
     }
+    struct outbuf ob;
+    outbuf_init(&ob, fd, FALSE);
     int y, m, d, h, mi, s;
     fromtimestamp(time(NULL), &y, &m, &d, &h, &mi, &s);
-    _writef(fd, PROP_XML_HEADER, y, m, d, h, mi, s);
-    _writef(fd, "<bounds minlat=\"%s\" minlon=\"%s\" maxlat=\"%s\" maxlon=\"%s\" />\n",
-            minlat, minlon, maxlat, maxlon);
-    for (size_t i = 0; i < resSetLength; i++) {
-        _writef(fd, "  <event eventid=\"%s\" devid=\"%s\" lat=\"%s\" lon=\"%s\" alt=\"%s\">\n",
-                g7loc_list[i].event, g7loc_list[i].deviceid, g7loc_list[i].lat, g7loc_list[i].lon, g7loc_list[i].altitude);
-        _writef(fd, "    <address>%s</address>\n", g7loc_list[i].approxaddr);
-        _writef(fd, "    <datetime>%s</datetime>\n", g7loc_list[i].date);
-        _writef(fd, "    <speed>%s</speed>\n", g7loc_list[i].speed);
-        _writef(fd, "    <voltage>%s</voltage>\n", g7loc_list[i].voltage);
-        _writef(fd, "    <heading>%s</heading>\n", g7loc_list[i].heading);
-        _writef(fd, "    <sat>%s</sat>\n", g7loc_list[i].satellite);
-        _writef(fd, "  </event>\n");
-    }
-    _writef(fd, "</g7ctrl>\n");
-    return 0;
+    outbuf_printf(&ob, PROP_XML_HEADER, y, m, d, h, mi, s);
+    outbuf_printf(&ob, "<bounds minlat=\"%s\" minlon=\"%s\" maxlat=\"%s\" maxlon=\"%s\" />\n",
+            ctx->minlat, ctx->minlon, ctx->maxlat, ctx->maxlon);
+    const struct g7loc_t *p = &ctx->loc;
+    int rc;
+    while ((rc = export_next_loc(ctx)) > 0) {
+        outbuf_printf(&ob, "  <event eventid=\"%s\" devid=\"%s\" lat=\"%s\" lon=\"%s\" alt=\"%s\">\n",
+                p->event, p->deviceid, p->lat, p->lon, p->altitude);
+        outbuf_printf(&ob, "    <address>%s</address>\n", p->approxaddr);
+        outbuf_printf(&ob, "    <datetime>%s</datetime>\n", p->date);
+        outbuf_printf(&ob, "    <speed>%s</speed>\n", p->speed);
+        outbuf_printf(&ob, "    <voltage>%s</voltage>\n", p->voltage);
+        outbuf_printf(&ob, "    <heading>%s</heading>\n", p->heading);
+        outbuf_printf(&ob, "    <sat>%s</sat>\n", p->satellite);
+        outbuf_printf(&ob, "  </event>\n");
+    }
+    outbuf_printf(&ob, "</g7ctrl>\n");
+    int ret = outbuf_close(&ob);
+    close(fd);
+    return rc < 0 ? -1 : ret;
 }
 
 /**
  * Dump internal set into GPX format
  * @param fileName File to export to
+ * @param ctx Export context with the locations to export
  * @return  0 on success, -1 on failure
  */
 int
-export_to_gpx(const char *fileName) {
+export_to_gpx(const char *fileName, struct export_ctx *ctx) {
 
     int fd = open_export_file(fileName, NULL, 0);
     if (fd < 0) {
         logmsg(LOG_ERR, "Cannot open export file! ( %d : %s)", errno, strerror(errno));
         return -1;
     }
+    struct outbuf ob;
+    outbuf_init(&ob, fd, FALSE);
 
+    const struct g7loc_t *p = &ctx->loc;
     unsigned long prevDateTime = 0;
     size_t numTrack = 1;
-    if (resSetLength > 0) {
-        prevDateTime = g7loc_list[0].date_timestamp;
-    }
+    int rc;
     int y, m, d, h, mi, s;
     fromtimestamp(time(NULL), &y, &m, &d, &h, &mi, &s);
-    _writef(fd, GPX_XML_HEADER);
-    _writef(fd, "<metadata>\n");
-    _writef(fd, "  <time>%d-%02d-%02dT%02d:%02d:%02dZ</time>\n", y, m, d, h, mi, s);
-    _writef(fd, "</metadata>\n");
-    _writef(fd, "<bounds minlat=\"%s\" minlon=\"%s\" maxlat=\"%s\" maxlon=\"%s\" />\n",
-            minlat, minlon, maxlat, maxlon);
-    _writef(fd, "<trk>\n");
-    _writef(fd, "  <name>Track %02zd: GM7 Xtreme GPS tracker</name>\n", numTrack++);
-    _writef(fd, "  <trkseg>\n");
-    for (size_t i = 0; i < resSetLength; i++) {
-        if (track_split_time > 0 && g7loc_list[i].date_timestamp - prevDateTime > (unsigned long) track_split_time * 60) {
-            _writef(fd, "  </trkseg>\n");
-            _writef(fd, "</trk>\n");
-            _writef(fd, "<trk>\n");
-            _writef(fd, "  <name>Track %02zd: GM7 Xtreme GPS tracker</name>\n", numTrack++);
-            _writef(fd, "  <trkseg>\n");
+    outbuf_printf(&ob, GPX_XML_HEADER);
+    outbuf_printf(&ob, "<metadata>\n");
+    outbuf_printf(&ob, "  <time>%d-%02d-%02dT%02d:%02d:%02dZ</time>\n", y, m, d, h, mi, s);
+    outbuf_printf(&ob, "</metadata>\n");
+    outbuf_printf(&ob, "<bounds minlat=\"%s\" minlon=\"%s\" maxlat=\"%s\" maxlon=\"%s\" />\n",
+            ctx->minlat, ctx->minlon, ctx->maxlat, ctx->maxlon);
+    outbuf_printf(&ob, "<trk>\n");
+    outbuf_printf(&ob, "  <name>Track %02zd: GM7 Xtreme GPS tracker</name>\n", numTrack++);
+    outbuf_printf(&ob, "  <trkseg>\n");
+    while ((rc = export_next_loc(ctx)) > 0) {
+        const size_t i = ctx->nrows - 1;
+        if (0 == i) {
+            prevDateTime = p->date_timestamp;
+        }
+        if (track_split_time > 0 && p->date_timestamp - prevDateTime > (unsigned long) track_split_time * 60) {
+            outbuf_printf(&ob, "  </trkseg>\n");
+            outbuf_printf(&ob, "</trk>\n");
+            outbuf_printf(&ob, "<trk>\n");
+            outbuf_printf(&ob, "  <name>Track %02zd: GM7 Xtreme GPS tracker</name>\n", numTrack++);
+            outbuf_printf(&ob, "  <trkseg>\n");
             logmsg(LOG_DEBUG, "Splitting GPX TRACK at location %05zd (diff=%lu, prev=%lu, curr=%lu)", i,
-                    g7loc_list[i].date_timestamp - prevDateTime,
+                    p->date_timestamp - prevDateTime,
                     prevDateTime,
-                    g7loc_list[i].date_timestamp
+                    p->date_timestamp
                     );
-        } else if (trackseg_split_time > 0 && g7loc_list[i].date_timestamp - prevDateTime > (unsigned long) trackseg_split_time * 60) {
-            _writef(fd, "  </trkseg>\n");
-            _writef(fd, "  <trkseg>\n");
+        } else if (trackseg_split_time > 0 && p->date_timestamp - prevDateTime > (unsigned long) trackseg_split_time * 60) {
+            outbuf_printf(&ob, "  </trkseg>\n");
+            outbuf_printf(&ob, "  <trkseg>\n");
             logmsg(LOG_DEBUG, "Splitting GPX TRACKSEG at location %05zd (diff=%lu, prev=%lu, curr=%lu)", i,
-                    g7loc_list[i].date_timestamp - prevDateTime,
+                    p->date_timestamp - prevDateTime,
                     prevDateTime,
-                    g7loc_list[i].date_timestamp
+                    p->date_timestamp
                     );
         }
-        prevDateTime = g7loc_list[i].date_timestamp;
+        prevDateTime = p->date_timestamp;
 
-        _writef(fd, "    <trkpt lat=\"%s\" lon=\"%s\">\n"
+        outbuf_printf(&ob, "    <trkpt lat=\"%s\" lon=\"%s\">\n"
                 "      <ele>%s</ele>\n"
                 "      <time>%s</time> <timestamp>%lu</timestamp>\n"
                 "      <course>%s</course>\n"
                 "      <speed>%s</speed>\n"
                 "      <sat>%s</sat>\n"
                 "    </trkpt>\n",
-                g7loc_list[i].lat, g7loc_list[i].lon,
-                g7loc_list[i].altitude,
-                g7loc_list[i].date, g7loc_list[i].date_timestamp,
-                g7loc_list[i].heading,
-                g7loc_list[i].speed,
-                g7loc_list[i].satellite);
-    }
-    _writef(fd, "  </trkseg>\n");
-    _writef(fd, "</trk>\n");
-    _writef(fd, "</gpx>\n");
+                p->lat, p->lon,
+                p->altitude,
+                p->date, p->date_timestamp,
+                p->heading,
+                p->speed,
+                p->satellite);
+    }
+    outbuf_printf(&ob, "  </trkseg>\n");
+    outbuf_printf(&ob, "</trk>\n");
+    outbuf_printf(&ob, "</gpx>\n");
+    int ret = outbuf_close(&ob);
     close(fd);
-    return 0;
+    return rc < 0 ? -1 : ret;
 }
 
 /**
  * Export DB using KML format
  * @param fileName File to export to
+ * @param ctx Export context with the locations to export
  * @return  0 on success, -1 on failure
  */
 int
-export_to_kml(const char *fileName) {
+export_to_kml(const char *fileName, struct export_ctx *ctx) {
 
     int fd = open_export_file(fileName, NULL, 0);
     if (fd < 0) {
         logmsg(LOG_ERR, "Cannot open export file! ( %d : %s)", errno, strerror(errno));
         return -1;
     }
+    struct outbuf ob;
+    outbuf_init(&ob, fd, FALSE);
 
     int y, m, d, h, mi, s;
     fromtimestamp(time(NULL), &y, &m, &d, &h, &mi, &s);
-    _writef(fd, KML_XML_HEADER);
-    for (size_t i = 0; i < resSetLength; i++) {
-        _writef(fd, "<placemark>\n");
-        _writef(fd, "  <name>#%d</name>\n", (int) i);
-        _writef(fd, "  <description>%s</description>\n", g7loc_list[i].date);
-        _writef(fd, "  <point>\n");
-        _writef(fd, "    <coordinates>%s,%s</coordinates>\n", g7loc_list[i].lat, g7loc_list[i].lon);
-        _writef(fd, "  </point>\n");
-        _writef(fd, "</placemark>\n");
-    }
-    _writef(fd, "</kml>\n");
+    outbuf_printf(&ob, KML_XML_HEADER);
+    const struct g7loc_t *p = &ctx->loc;
+    int rc;
+    while ((rc = export_next_loc(ctx)) > 0) {
+        outbuf_printf(&ob, "<placemark>\n");
+        outbuf_printf(&ob, "  <name>#%d</name>\n", (int) ctx->nrows - 1);
+        outbuf_printf(&ob, "  <description>%s</description>\n", p->date);
+        outbuf_printf(&ob, "  <point>\n");
+        outbuf_printf(&ob, "    <coordinates>%s,%s</coordinates>\n", p->lat, p->lon);
+        outbuf_printf(&ob, "  </point>\n");
+        outbuf_printf(&ob, "</placemark>\n");
+    }
+    outbuf_printf(&ob, "</kml>\n");
+    int ret = outbuf_close(&ob);
     close(fd);
-    return 0;
+    return rc < 0 ? -1 : ret;
 }
 
 /**
  * Export DB using Comma Separated file (CSV). All fields are exported and the
  * first row has all the column names
  * @param fileName File to export to
+ * @param ctx Export context with the locations to export
  * @return  0 on success, -1 on failure
  */
 int
-export_to_csv(const char *fileName) {
+export_to_csv(const char *fileName, struct export_ctx *ctx) {
     int fd = open_export_file(fileName, NULL, 0);
     if (fd < 0) {
         logmsg(LOG_ERR, "Cannot open export file! ( %d : %s)", errno, strerror(errno));
         return -1;
     }
+    struct outbuf ob;
+    outbuf_init(&ob, fd, FALSE);
 
     // First write out the name of the columns
-    _writef(fd, "date,device,latitude,longitude,address,elevation,speed,heading,satellite,event,voltage\n");
+    outbuf_printf(&ob, "date,device,latitude,longitude,address,elevation,speed,heading,satellite,event,voltage\n");
 
     // The export all the data in the result set
-    for (size_t i = 0; i < resSetLength; i++) {
-        _writef(fd, "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",%s,%s,%s,%s,%s,\"%s\"\n",
-                g7loc_list[i].date,
-                g7loc_list[i].deviceid,
-                g7loc_list[i].lat, g7loc_list[i].lon,
-                g7loc_list[i].approxaddr,
-                g7loc_list[i].altitude,
-                g7loc_list[i].speed,
-                g7loc_list[i].heading,
-                g7loc_list[i].satellite,
-                g7loc_list[i].event,
-                g7loc_list[i].voltage);
-    }
-    _writef(fd, "\n");
+    const struct g7loc_t *p = &ctx->loc;
+    int rc;
+    while ((rc = export_next_loc(ctx)) > 0) {
+        outbuf_printf(&ob, "\"%s\",\"%s\",\"%s\",\"%s\",\"%s\",%s,%s,%s,%s,%s,\"%s\"\n",
+                p->date,
+                p->deviceid,
+                p->lat, p->lon,
+                p->approxaddr,
+                p->altitude,
+                p->speed,
+                p->heading,
+                p->satellite,
+                p->event,
+                p->voltage);
+    }
+    outbuf_printf(&ob, "\n");
+    int ret = outbuf_close(&ob);
     close(fd);
-    return 0;
+    return rc < 0 ? -1 : ret;
 }
 
 /**
@@ -545,26 +554,33 @@ export_to_csv(const char *fileName) {
  * }
  *
  * @param fileName File to export to
+ * @param ctx Export context with the locations to export
  * @return  0 on success, -1 on failure
  */
 int
-export_to_json(const char *fileName) {
+export_to_json(const char *fileName, struct export_ctx *ctx) {
     int fd = open_export_file(fileName, NULL, 0);
     if (fd < 0) {
         logmsg(LOG_ERR, "Cannot open export file! ( %d : %s)", errno, strerror(errno));
         return -1;
     }
+    struct outbuf ob;
+    outbuf_init(&ob, fd, FALSE);
     int y, m, d, h, mi, s;
     fromtimestamp(time(NULL), &y, &m, &d, &h, &mi, &s);
-    _writef(fd, "{");
-    _writef(fd, "\"ver\":\"1.0\",\n");
-    _writef(fd, "\"exportdate\":\"%d-%02d-%02dT%02d:%02d:%02dZ\",\n", y, m, d, h, mi, s);
-    _writef(fd, "\"creator\":\"g7ctrl http://www.sourceforge.com/p/g7ctrl\",\n");
-    _writef(fd, "\"bbox\": { \"minlat\" : %s, \"minlon\" : %s, \"maxlat\" : %s, \"maxlon\" : %s },\n", minlat, minlon, maxlat, maxlon);
-    _writef(fd, "\"positions\" : [");
-
-    for (size_t i = 0; i < resSetLength; i++) {
-        _writef(fd, "["
+    outbuf_printf(&ob, "{");
+    outbuf_printf(&ob, "\"ver\":\"1.0\",\n");
+    outbuf_printf(&ob, "\"exportdate\":\"%d-%02d-%02dT%02d:%02d:%02dZ\",\n", y, m, d, h, mi, s);
+    outbuf_printf(&ob, "\"creator\":\"g7ctrl http://www.sourceforge.com/p/g7ctrl\",\n");
+    outbuf_printf(&ob, "\"bbox\": { \"minlat\" : %s, \"minlon\" : %s, \"maxlat\" : %s, \"maxlon\" : %s },\n", ctx->minlat, ctx->minlon, ctx->maxlat, ctx->maxlon);
+    outbuf_printf(&ob, "\"positions\" : [");
+
+    const struct g7loc_t *p = &ctx->loc;
+    int rc;
+    while ((rc = export_next_loc(ctx)) > 0) {
+        if (ctx->nrows > 1)
+            outbuf_printf(&ob, ",\n");
+        outbuf_printf(&ob, "["
                 "\"%s\","
                 "%s,"
                 "%s,"
@@ -576,38 +592,47 @@ export_to_json(const char *fileName) {
                 "%s,"
                 "%s,"
                 "%s]",
-                g7loc_list[i].date,
-                g7loc_list[i].deviceid,
-                g7loc_list[i].lat,
-                g7loc_list[i].lon,
-                g7loc_list[i].approxaddr,
-                g7loc_list[i].altitude,
-                g7loc_list[i].speed,
-                g7loc_list[i].heading,
-                g7loc_list[i].satellite,
-                g7loc_list[i].event,
-                g7loc_list[i].voltage);
-        if (i < resSetLength - 1)
-            _writef(fd, ",\n");
-    }
-    _writef(fd, "]}\n");
+                p->date,
+                p->deviceid,
+                p->lat,
+                p->lon,
+                p->approxaddr,
+                p->altitude,
+                p->speed,
+                p->heading,
+                p->satellite,
+                p->event,
+                p->voltage);
+    }
+    outbuf_printf(&ob, "]}\n");
+    int ret = outbuf_close(&ob);
     close(fd);
-    return 0;
+    return rc < 0 ? -1 : ret;
 }
 
 /**
  * Mail exported and compressed DB in the specified format
- * @param sockd
+ * @param cli_info Client context
+ * @param ctx Export context for this request
  * @param exportFormat
  * @return  0 on success, -1 on failure
  */
 int
-mail_as_attachment(struct client_info *cli_info, char *exportFormat) {
+mail_as_attachment(struct client_info *cli_info, struct export_ctx *ctx, char *exportFormat) {
     
     const int sockd = cli_info->cli_socket;
+
+    // Use a unique temporary file so that several clients can mail exports
+    // at the same time
     char tmpExportFile[256];
-    snprintf(tmpExportFile, sizeof (tmpExportFile), "/tmp/%s.", EXPORTDB_BASE_NAME);
+    snprintf(tmpExportFile, sizeof (tmpExportFile), "/tmp/%s_XXXXXX.", EXPORTDB_BASE_NAME);
     strncat(tmpExportFile, exportFormat, sizeof(tmpExportFile)-1-strlen(tmpExportFile));
+    int tmpfd = mkstemps(tmpExportFile, strlen(exportFormat) + 1);
+    if (-1 == tmpfd) {
+        logmsg(LOG_ERR, "Cannot create temporary export file \"%s\" ( %d : %s )", tmpExportFile, errno, strerror(errno));
+        return -1;
+    }
+    close(tmpfd);
 
     char format[6];
     strncpy(format, exportFormat, 5);
@@ -629,7 +654,10 @@ mail_as_attachment(struct client_info *cli_info, char *exportFormat) {
         tmpExportFile /* filename */
     };
 
-    exportdb_to_external_format(cli_info, 21, fldVal);
+    if (-1 == exportdb_to_external_format(cli_info, ctx, 21, fldVal)) {
+        unlink(tmpExportFile);
+        return -1;
+    }
 
     // Double check that the file has been exported
     if (-1 == access(tmpExportFile, R_OK)) {
@@ -751,7 +779,12 @@ mail_as_attachment(struct client_info *cli_info, char *exportFormat) {
 int
 mail_gpx_attachment(struct client_info *cli_info) {
     const int sockd = cli_info->cli_socket;
-    int rc = mail_as_attachment(cli_info, "gpx");
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+    struct export_ctx ctx;
+    export_init_ctx(&ctx);
+    int rc = mail_as_attachment(cli_info, &ctx, "gpx");
     if( rc ) {
         _writef(sockd, "[ERR] Failed to send compressed DB export.");
     }
@@ -770,7 +803,12 @@ mail_gpx_attachment(struct client_info *cli_info) {
 int
 mail_csv_attachment(struct client_info *cli_info) {
     const int sockd = cli_info->cli_socket;
-    int rc = mail_as_attachment(cli_info, "csv");
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+    struct export_ctx ctx;
+    export_init_ctx(&ctx);
+    int rc = mail_as_attachment(cli_info, &ctx, "csv");
     if( rc ) {
         _writef(sockd, "[ERR] Failed to send compressed DB export.");
     }    
@@ -781,17 +819,21 @@ mail_csv_attachment(struct client_info *cli_info) {
  * Internal dispatcher function that is initially called for all exports.
  * Depending on the actual format requested it will then call the
  * appropriate format exporter function.
- * @param sockd Client socket to communicate on
+ * @param cli_info Client context
+ * @param ctx Export context for this request
  * @param nf Number of fields in the command
  * @param fields Each argument in the user given command
  * @return 0 on success, -1 on failure
  */
 int
-exportdb_to_external_format(struct client_info *cli_info, ssize_t nf, char **fields) {
+exportdb_to_external_format(struct client_info *cli_info, struct export_ctx *ctx, ssize_t nf, char **fields) {
 
     const int sockd = cli_info->cli_socket;
     sqlite3 *sqlDB;
-    if (0 == db_setup(&sqlDB)) {
+    if (db_chk_migration(cli_info)) {
+        return -1;
+    }
+    if (0 == db_acquire(&sqlDB)) {
 
         char filename[256], from[16], to[16], format[8];
         char deviceid[16], eventid[8];
@@ -832,8 +874,10 @@ exportdb_to_external_format(struct client_info *cli_info, ssize_t nf, char **fie
         }
 
         logmsg(LOG_DEBUG, "Exporting DB to \"%s\" (using %s schema)", filename, format);
-        int rc = export_to_internal_set(sqlDB, from, to, deviceid, eventid);
-        db_close(sqlDB);
+
+        // The locations are read from the DB while the file is written so the
+        // connection is kept until the export is done
+        int rc = export_to_internal_set(sqlDB, ctx, from, to, deviceid, eventid);
         if (rc < 0) {
             switch (rc) {
                 case -2:
@@ -844,7 +888,8 @@ exportdb_to_external_format(struct client_info *cli_info, ssize_t nf, char **fie
                     logmsg(LOG_ERR, "Export to internal set failed. Cannot ecport dataset.");
                     break;
             }
-            free_internal_set();
+            free_internal_set(ctx);
+            db_release(sqlDB);
             return -1;
         }
 
@@ -854,39 +899,47 @@ exportdb_to_external_format(struct client_info *cli_info, ssize_t nf, char **fie
         if (0 == strcmp(format, "gpx")) {
             if (!hasExt)
                 xstrlcat(filename, ".gpx",sizeof(filename));
-            rc = export_to_gpx(filename);
+            rc = export_get_bounds(ctx);
+            if (0 == rc)
+                rc = export_to_gpx(filename, ctx);
         } else if (0 == xstricmp(format, "csv")) {
             if (!hasExt)
                 xstrlcat(filename, ".csv",sizeof(filename));
-            rc = export_to_csv(filename);
+            rc = export_to_csv(filename, ctx);
         } else if (0 == xstricmp(format, "kml")) {
             if (!hasExt)
                 xstrlcat(filename, ".kml",sizeof(filename));
-            rc = export_to_kml(filename);
+            rc = export_to_kml(filename, ctx);
         } else if (0 == xstricmp(format, "xml")) {
             if (!hasExt)
                 xstrlcat(filename, ".xml",sizeof(filename));
-            rc = export_to_prop_xml(filename);
+            rc = export_get_bounds(ctx);
+            if (0 == rc)
+                rc = export_to_prop_xml(filename, ctx);
         } else if (0 == xstricmp(format, "json")) {
             if (!hasExt)
                 xstrlcat(filename, ".json",sizeof(filename));
-            rc = export_to_json(filename);
+            rc = export_get_bounds(ctx);
+            if (0 == rc)
+                rc = export_to_json(filename, ctx);
         } else {
             _writef(sockd, "Unknown export format. Must be one of (GPX/KML/XML/CSV/JSON)\n\n");
-            free_internal_set();
+            free_internal_set(ctx);
+            db_release(sqlDB);
             return -1;
         }
+        free_internal_set(ctx);
+        db_release(sqlDB);
 
         if (rc < 0) {
             _writef(sockd, "Failed to export in %s format to \"%s\"\n", format, filename);
             logmsg(LOG_ERR, "Cannot export to %s format: \"%s\" ( %d : %s )", format, filename, errno, strerror(errno));
             rc = -1;
         } else {
-            _writef(sockd, "Exported %zd records in %s format to \"%s\"\n", resSetLength, format, filename);
-            logmsg(LOG_INFO, "Exported %zd records in %s format to \"%s\"", resSetLength, format, filename);
+            _writef(sockd, "Exported %zd records in %s format to \"%s\"\n", ctx->nrows, format, filename);
+            logmsg(LOG_INFO, "Exported %zd records in %s format to \"%s\"", ctx->nrows, format, filename);
             rc = 0;
         }
-        free_internal_set();
         return rc;
     } else {
         logmsg(LOG_ERR, "Cannot connect to DB");
@@ -49,19 +49,41 @@ struct g7loc_t {
     char heading[8];
 };
 
-
-extern size_t resSetLength;
-extern struct g7loc_t *g7loc_list;
+/**
+ * All state for one export request. The selected locations are streamed from
+ * the DB one at a time and the current location is kept in "loc". Each client
+ * uses its own context so that exports can run concurrently.
+ */
+struct export_ctx {
+    sqlite3 *sqlDB;         // DB connection the statement belongs to
+    sqlite3_stmt *stmt;     // The stepped select statement
+    char where[512];        // Where clause for the selection
+    struct g7loc_t loc;     // The last read location
+    size_t nrows;           // Number of locations read so far
+    char minlat[32];        // Bounding box of the selection (only set
+    char maxlat[32];        // after export_get_bounds() has been called)
+    char minlon[32];
+    char maxlon[32];
+};
 
 // Forward declarations
 char *
-convert_to_utc(const char *datetime);
+convert_to_utc(const char *datetime, char *buff, size_t maxlen);
+
+void
+export_init_ctx(struct export_ctx *ctx);
+
+int
+exportdb_to_external_format(struct client_info *cli_info, struct export_ctx *ctx, ssize_t nf, char **fields);
+
+int
+export_to_internal_set(sqlite3 *sqlDB, struct export_ctx *ctx, char *fromDate, char *toDate, char *deviceId, char *eventId);
 
 int
-exportdb_to_external_format(struct client_info *cli_info, ssize_t nf, char **fields);
+export_next_loc(struct export_ctx *ctx);
 
 int
-export_to_internal_set(sqlite3 *sqlDB,char *fromDate, char *toDate, char *deviceId, char *eventId);
+export_get_bounds(struct export_ctx *ctx);
 
 int
 mail_gpx_attachment(struct client_info *cli_info);
@@ -70,7 +92,7 @@ int
 mail_csv_attachment(struct client_info *cli_info);
 
 void
-free_internal_set(void);
+free_internal_set(struct export_ctx *ctx);
 
 #ifdef	__cplusplus
 }
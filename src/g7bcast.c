@@ -0,0 +1,575 @@
+/* =========================================================================
+ * File:        G7BCAST.C
+ * Description: Send the same device command to many GPRS connected
+ *              trackers at once and collect the replies. The commands are
+ *              sent concurrently through the command queue and the result
+ *              for each device is written back to the user as soon as it
+ *              arrives followed by a summary table.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "g7config.h"
+#include "utils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "g7sendcmd.h"
+#include "presets.h"
+#include "nicks.h"
+#include "libunitbl/unicode_tbl.h"
+#include "g7bcast.h"
+
+/**
+ * Result of the command for one device in a broadcast
+ */
+enum bcast_status {
+    BCAST_PENDING = 0,
+    BCAST_OK,
+    BCAST_DEVERR,
+    BCAST_TIMEOUT,
+    BCAST_FAILED,
+    BCAST_NOTCONN
+};
+
+/** Printable names for the broadcast status */
+static const char *bcast_status_str[] = {
+    "PENDING", "OK", "ERR", "TIMEOUT", "FAILED", "NOTCONN"
+};
+
+/**
+ * One target device in a broadcast
+ */
+struct bcast_dev {
+    unsigned devid;             // Device id
+    char nick[16];              // Nick name (if one is defined)
+    enum bcast_status status;   // Result of the command
+    unsigned long t_sent;       // Time (ms) when the command was sent
+    unsigned long ms;           // Round trip time in ms
+    char result[256];           // Reply fields or error message
+};
+
+/**
+ * Check if the string only consists of digits
+ * @param str String to check
+ * @return TRUE if str is a non empty string of digits
+ */
+static _Bool
+_bcast_isnum(const char *str) {
+    if (!*str) {
+        return FALSE;
+    }
+    while (*str) {
+        if (!isdigit((unsigned char) *str++)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Add a device to the list of targets unless it is already in the list
+ * @param devs Target list
+ * @param ndevs Number of targets in the list
+ * @param maxdevs Size of the target list
+ * @param devid Device id
+ * @param connected TRUE if the device is connected right now
+ */
+static void
+_bcast_add(struct bcast_dev *devs, size_t *ndevs, const size_t maxdevs, const unsigned devid, const _Bool connected) {
+    for (size_t i = 0; i < *ndevs; i++) {
+        if (devs[i].devid == devid) {
+            return;
+        }
+    }
+    if (*ndevs < maxdevs) {
+        devs[*ndevs].devid = devid;
+        devs[*ndevs].status = connected ? BCAST_PENDING : BCAST_NOTCONN;
+        if (!connected) {
+            xstrlcpy(devs[*ndevs].result, "Device is not connected", sizeof (devs[*ndevs].result));
+        }
+        (*ndevs)++;
+    }
+}
+
+/**
+ * Find the socket for a connected tracker. The caller must hold the
+ * socks_mutex since the socket can be closed and its number reused by
+ * another tracker as soon as the mutex is released.
+ * @param devid Device id
+ * @return The socket the device is connected on, -1 if not connected
+ */
+static int
+_bcast_dev_sockd(const unsigned devid) {
+    for (size_t i = 0; i < max_clients; i++) {
+        if (client_info_list[i].cli_thread && !client_info_list[i].cli_is_cmdconn &&
+            client_info_list[i].cli_devid == devid) {
+            return client_info_list[i].cli_socket;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check if a tracker is connected right now
+ * @param devid Device id
+ * @return TRUE if the device is connected
+ */
+static _Bool
+_bcast_is_connected(const unsigned devid) {
+    pthread_mutex_lock(&socks_mutex);
+    const int sockd = _bcast_dev_sockd(devid);
+    pthread_mutex_unlock(&socks_mutex);
+    return sockd >= 0;
+}
+
+/**
+ * Write a command to a tracker. The socket is looked up by device id and
+ * written while holding the socks_mutex so that the command can never end
+ * up on a socket that has been reused by another tracker after the target
+ * disconnected.
+ * @param devid Device id
+ * @param cmd Command to write
+ * @param cmdlen Length of the command
+ * @return 0 on success, -1 on write error, -2 if the device is not connected
+ */
+static int
+_bcast_write_dev(const unsigned devid, const char *cmd, const size_t cmdlen) {
+    int ret = 0;
+    pthread_mutex_lock(&socks_mutex);
+    const int dev_sockd = _bcast_dev_sockd(devid);
+    if (dev_sockd < 0) {
+        ret = -2;
+    } else if ((ssize_t) cmdlen != write(dev_sockd, cmd, cmdlen)) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&socks_mutex);
+    return ret;
+}
+
+/**
+ * Translate the target specification to a list of devices. The target is
+ * specified as either "all" (all connected trackers), a device id range
+ * "<id1>-<id2>" (all connected trackers in the range) or a comma separated
+ * list of nick names and device ids.
+ * @param sockd User socket for error messages
+ * @param targets Target specification
+ * @param[out] devs Allocated target list. The caller must free this.
+ * @param[out] ndevs Number of targets
+ * @return 0 on success, -1 on failure
+ */
+static int
+_bcast_resolve_targets(const int sockd, const char *targets, struct bcast_dev **devs, size_t *ndevs) {
+    char buff[1024];
+    xstrlcpy(buff, targets, sizeof (buff));
+
+    // A list can never have more entries than there are characters
+    const size_t maxdevs = max_clients + strlen(buff) + 1;
+    *ndevs = 0;
+    *devs = calloc(maxdevs, sizeof (struct bcast_dev));
+    if (NULL == *devs) {
+        logmsg(LOG_ERR, "Out of memory in _bcast_resolve_targets()");
+        return -1;
+    }
+
+    char *dash = strchr(buff, '-');
+    if (0 == strcmp("all", buff) || (dash && (*dash = '\0', _bcast_isnum(buff) && _bcast_isnum(dash + 1)))) {
+        unsigned low = 0, high = ~0U;
+        if (dash) {
+            low = (unsigned) xatol(buff);
+            high = (unsigned) xatol(dash + 1);
+        }
+        pthread_mutex_lock(&socks_mutex);
+        for (size_t i = 0; i < max_clients; i++) {
+            if (client_info_list[i].cli_thread && !client_info_list[i].cli_is_cmdconn &&
+                client_info_list[i].cli_devid >= low && client_info_list[i].cli_devid <= high &&
+                client_info_list[i].cli_devid > 0) {
+                _bcast_add(*devs, ndevs, maxdevs, client_info_list[i].cli_devid, TRUE);
+            }
+        }
+        pthread_mutex_unlock(&socks_mutex);
+    } else {
+        if (dash) {
+            *dash = '-';
+        }
+        char *saveptr = NULL;
+        for (char *t = strtok_r(buff, ",", &saveptr); t; t = strtok_r(NULL, ",", &saveptr)) {
+            unsigned devid;
+            if (_bcast_isnum(t)) {
+                devid = (unsigned) xatol(t);
+            } else {
+                char devidbuff[16];
+                if (db_get_devid_from_nick(t, devidbuff)) {
+                    _writef(sockd, "[ERR] Nick name \"%s\" does not exist", t);
+                    free(*devs);
+                    *devs = NULL;
+                    return -1;
+                }
+                devid = (unsigned) xatol(devidbuff);
+            }
+            _bcast_add(*devs, ndevs, maxdevs, devid, _bcast_is_connected(devid));
+        }
+    }
+
+    // Look up the nick names to make the output easier to read
+    char devidbuff[16];
+    for (size_t i = 0; i < *ndevs; i++) {
+        snprintf(devidbuff, sizeof (devidbuff), "%u", (*devs)[i].devid);
+        db_get_nick_from_devid(devidbuff, (*devs)[i].nick);
+    }
+
+    return 0;
+}
+
+/**
+ * Store the result from the reply from a device in the target
+ * @param dev Target device
+ * @param reply The raw reply from the device
+ */
+static void
+_bcast_set_reply(struct bcast_dev *dev, char *reply) {
+    size_t len = strlen(reply);
+    while (len > 0 && ('\r' == reply[len - 1] || '\n' == reply[len - 1])) {
+        reply[--len] = '\0';
+    }
+
+    _Bool isok;
+    char cmdname[16], tag[16];
+    struct splitfields flds;
+    if (extract_devcmd_reply(reply, &isok, cmdname, tag, &flds)) {
+        dev->status = BCAST_FAILED;
+        snprintf(dev->result, sizeof (dev->result), "Unknown reply \"%s\"", reply);
+    } else if (!isok) {
+        char *errstr;
+        device_strerr(flds.nf > 0 ? xatoi(flds.fld[0]) : 0, &errstr);
+        dev->status = BCAST_DEVERR;
+        xstrlcpy(dev->result, errstr, sizeof (dev->result));
+    } else {
+        dev->status = BCAST_OK;
+        *dev->result = '\0';
+        for (size_t i = 0; i < flds.nf; i++) {
+            if (i > 0) {
+                xstrlcat(dev->result, ",", sizeof (dev->result));
+            }
+            xstrlcat(dev->result, flds.fld[i], sizeof (dev->result));
+        }
+    }
+}
+
+/**
+ * Write the result for one device back to the user
+ * @param sockd User socket
+ * @param dev Target device
+ */
+static void
+_bcast_write_result(const int sockd, const struct bcast_dev *dev) {
+    _writef(sockd, "%010u %-12s %-7s %6lu ms  %s\n", dev->devid, dev->nick,
+            bcast_status_str[dev->status], dev->ms, dev->result);
+}
+
+/**
+ * Write the summary table for the broadcast back to the user
+ * @param cli_info Client context
+ * @param devs Target list
+ * @param ndevs Number of targets
+ * @param elapsed Total time for the broadcast in ms
+ */
+static void
+_bcast_summary(struct client_info *cli_info, const struct bcast_dev *devs, const size_t ndevs, const unsigned long elapsed) {
+    const int sockd = cli_info->cli_socket;
+    size_t cnt[BCAST_NOTCONN + 1];
+    memset(cnt, 0, sizeof (cnt));
+    for (size_t i = 0; i < ndevs; i++) {
+        cnt[devs[i].status]++;
+    }
+
+    const size_t nCols = 5;
+    const size_t nRows = ndevs + 1;
+    char **tdata = calloc(nRows * nCols, sizeof (char *));
+    if (NULL == tdata) {
+        logmsg(LOG_ERR, "Out of memory in _bcast_summary()");
+        return;
+    }
+    tdata[0] = strdup("  Dev ID  ");
+    tdata[1] = strdup("  Nick  ");
+    tdata[2] = strdup("  Status  ");
+    tdata[3] = strdup("  Time (ms)  ");
+    tdata[4] = strdup("  Reply  ");
+
+    char buff[64];
+    for (size_t i = 0; i < ndevs; i++) {
+        const size_t r = (i + 1) * nCols;
+        snprintf(buff, sizeof (buff), " %010u ", devs[i].devid);
+        tdata[r + 0] = strdup(buff);
+        snprintf(buff, sizeof (buff), " %s ", devs[i].nick);
+        tdata[r + 1] = strdup(buff);
+        snprintf(buff, sizeof (buff), " %s ", bcast_status_str[devs[i].status]);
+        tdata[r + 2] = strdup(buff);
+        snprintf(buff, sizeof (buff), " %lu ", devs[i].ms);
+        tdata[r + 3] = strdup(buff);
+        char rbuff[sizeof (devs[i].result) + 2];
+        snprintf(rbuff, sizeof (rbuff), " %s ", devs[i].result);
+        tdata[r + 4] = strdup(rbuff);
+    }
+
+    table_t *t = utable_create_set(nRows, nCols, tdata);
+    utable_set_row_halign(t, 0, CENTERALIGN);
+    if (cli_info->use_unicode_table) {
+        utable_stroke(t, sockd, TSTYLE_DOUBLE_V2);
+    } else {
+        utable_stroke(t, sockd, TSTYLE_ASCII_V3);
+    }
+    utable_free(t);
+    for (size_t i = 0; i < nRows * nCols; i++) {
+        free(tdata[i]);
+    }
+    free(tdata);
+
+    _writef(sockd, "%zu devices in %lu ms: %zu OK, %zu ERR, %zu TIMEOUT, %zu FAILED, %zu NOTCONN",
+            ndevs, elapsed, cnt[BCAST_OK], cnt[BCAST_DEVERR], cnt[BCAST_TIMEOUT],
+            cnt[BCAST_FAILED], cnt[BCAST_NOTCONN]);
+}
+
+/**
+ * Send the raw command to all targets. At most BCAST_MAX_INFLIGHT commands
+ * are outstanding at the same time. The result for each device is written
+ * back to the user as soon as it is known.
+ * @param cli_info Client context
+ * @param devs Target list
+ * @param ndevs Number of targets
+ * @param rawcmd Raw device command (without "\r\n")
+ * @param tag Tag used in the raw command
+ */
+static void
+_bcast_run(struct client_info *cli_info, struct bcast_dev *devs, const size_t ndevs, const char *rawcmd, const char *tag) {
+    const int sockd = cli_info->cli_socket;
+    const unsigned long timeout = BCAST_REPLY_TIMEOUT * 1000UL;
+
+    // Command queue index and target index for each slot in the window
+    int qidx[BCAST_MAX_INFLIGHT];
+    size_t didx[BCAST_MAX_INFLIGHT];
+    size_t ninflight = 0;
+    size_t next = 0;
+
+    pthread_cond_t notify;
+    cmdqueue_notify_init(&notify);
+
+    char cmdbuff[256];
+    snprintf(cmdbuff, sizeof (cmdbuff), "%s\r\n", rawcmd);
+    const size_t cmdlen = strlen(cmdbuff);
+
+    for (size_t i = 0; i < BCAST_MAX_INFLIGHT; i++) {
+        qidx[i] = -1;
+    }
+
+    unsigned long now;
+    while (next < ndevs || ninflight > 0) {
+
+        // Fill up the window
+        for (size_t w = 0; w < BCAST_MAX_INFLIGHT && next < ndevs; w++) {
+            if (qidx[w] >= 0) {
+                continue;
+            }
+            while (next < ndevs && BCAST_PENDING != devs[next].status) {
+                next++;
+            }
+            if (next >= ndevs) {
+                break;
+            }
+            struct bcast_dev *dev = &devs[next];
+            mtime(&dev->t_sent);
+            int idx = cmdqueue_insert_notify(sockd, dev->devid, tag, rawcmd, &notify);
+            if (idx < 0) {
+                // The queue is full. Try again when some of our own commands have finished
+                if (0 == ninflight) {
+                    dev->status = BCAST_FAILED;
+                    xstrlcpy(dev->result, "Command queue is full", sizeof (dev->result));
+                    _bcast_write_result(sockd, dev);
+                    next++;
+                    continue;
+                }
+                break;
+            }
+            // The device may have disconnected since the targets were resolved
+            const int wret = _bcast_write_dev(dev->devid, cmdbuff, cmdlen);
+            if (wret) {
+                cmdqueue_clridx(idx);
+                if (-2 == wret) {
+                    dev->status = BCAST_NOTCONN;
+                    xstrlcpy(dev->result, "Device is not connected", sizeof (dev->result));
+                } else {
+                    dev->status = BCAST_FAILED;
+                    snprintf(dev->result, sizeof (dev->result), "Could not write to device (%d : %s)", errno, strerror(errno));
+                }
+                _bcast_write_result(sockd, dev);
+                next++;
+                continue;
+            }
+            qidx[w] = idx;
+            didx[w] = next++;
+            ninflight++;
+        }
+
+        if (0 == ninflight) {
+            continue;
+        }
+
+        // Wait until the next reply arrives or until the oldest command times out
+        mtime(&now);
+        unsigned long wait_ms = timeout;
+        for (size_t w = 0; w < BCAST_MAX_INFLIGHT; w++) {
+            if (qidx[w] >= 0) {
+                const unsigned long age = now - devs[didx[w]].t_sent;
+                wait_ms = age >= timeout ? 0 : MIN(wait_ms, timeout - age);
+            }
+        }
+        int w = wait_ms > 0 ? cmdqueue_wait_any(qidx, BCAST_MAX_INFLIGHT, &notify, (unsigned) wait_ms) : -1;
+
+        mtime(&now);
+        if (w >= 0) {
+            struct bcast_dev *dev = &devs[didx[w]];
+            char reply[1024];
+            dev->ms = now - dev->t_sent;
+            if (0 == cmdqueue_check_reply(qidx[w], reply, sizeof (reply))) {
+                _bcast_set_reply(dev, reply);
+            } else {
+                dev->status = BCAST_FAILED;
+                xstrlcpy(dev->result, "Lost reply", sizeof (dev->result));
+            }
+            _bcast_write_result(sockd, dev);
+            qidx[w] = -1;
+            ninflight--;
+        }
+
+        // Expire all commands that have waited too long
+        for (size_t i = 0; i < BCAST_MAX_INFLIGHT; i++) {
+            if (qidx[i] >= 0 && now - devs[didx[i]].t_sent >= timeout) {
+                struct bcast_dev *dev = &devs[didx[i]];
+                cmdqueue_clridx(qidx[i]);
+                dev->ms = now - dev->t_sent;
+                dev->status = BCAST_TIMEOUT;
+                xstrlcpy(dev->result, "No reply from device", sizeof (dev->result));
+                _bcast_write_result(sockd, dev);
+                qidx[i] = -1;
+                ninflight--;
+            }
+        }
+    }
+
+    pthread_cond_destroy(&notify);
+}
+
+/**
+ * Broadcast a prepared raw command to the specified targets
+ * @param cli_info Client context
+ * @param targets Target specification
+ * @param rawcmd Raw device command
+ * @param tag Tag used in the raw command
+ * @return 0 if the command succeeded on all targets, -1 otherwise
+ */
+static int
+_bcast_rawcmd(struct client_info *cli_info, const char *targets, const char *rawcmd, const char *tag) {
+    const int sockd = cli_info->cli_socket;
+    struct bcast_dev *devs;
+    size_t ndevs;
+
+    if (-1 == _bcast_resolve_targets(sockd, targets, &devs, &ndevs)) {
+        return -1;
+    }
+    if (0 == ndevs) {
+        _writef(sockd, "[ERR] No connected devices matches \"%s\"", targets);
+        free(devs);
+        return -1;
+    }
+
+    logmsg(LOG_INFO, "Broadcasting \"%s\" to %zu devices", rawcmd, ndevs);
+    _writef(sockd, "Sending \"%s\" to %zu devices ...\n", rawcmd, ndevs);
+
+    unsigned long start, stop;
+    mtime(&start);
+    _bcast_run(cli_info, devs, ndevs, rawcmd, tag);
+    mtime(&stop);
+
+    _bcast_summary(cli_info, devs, ndevs, stop - start);
+
+    int rc = 0;
+    for (size_t i = 0; i < ndevs && 0 == rc; i++) {
+        rc = BCAST_OK == devs[i].status ? 0 : -1;
+    }
+    free(devs);
+    return rc;
+}
+
+/**
+ * Broadcast a query ("get") command to many devices
+ * @param cli_info Client context
+ * @param targets Target specification, "all", "<id1>-<id2>" or a comma
+ * separated list of nick names and device ids
+ * @param cmd The server command to query, e.g. "ver"
+ * @return 0 if the command succeeded on all targets, -1 otherwise
+ */
+int
+bcast_query(struct client_info *cli_info, const char *targets, const char *cmd) {
+    struct devcmd_batch q;
+    if (-1 == prepare_cmdquery(cmd, NULL, &q)) {
+        _writef(cli_info->cli_socket, "[ERR] Command \"%s\" does not exist.", cmd);
+        return -1;
+    }
+    return _bcast_rawcmd(cli_info, targets, q.cmd, q.tag);
+}
+
+/**
+ * Broadcast a set command given in the same function form as used in the
+ * presets, e.g. "roam(1)", to many devices
+ * @param cli_info Client context
+ * @param targets Target specification, "all", "<id1>-<id2>" or a comma
+ * separated list of nick names and device ids
+ * @param func The command in function form
+ * @return 0 if the command succeeded on all targets, -1 otherwise
+ */
+int
+bcast_func(struct client_info *cli_info, const char *targets, const char *func) {
+    char pinbuff[16], tagbuff[16], rawcmd[128];
+    if (-1 == get_device_pin(pinbuff, sizeof (pinbuff)) ||
+        -1 == get_device_tag(tagbuff, sizeof (tagbuff))) {
+        return -1;
+    }
+    if (-1 == buildPresetFunc(func, tagbuff, pinbuff, rawcmd, sizeof (rawcmd))) {
+        _writef(cli_info->cli_socket, "[ERR] Incorrect function \"%s\"", func);
+        return -1;
+    }
+    return _bcast_rawcmd(cli_info, targets, rawcmd, tagbuff);
+}
+
+/* EOF */
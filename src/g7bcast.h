@@ -0,0 +1,55 @@
+/* =========================================================================
+ * File:        G7BCAST.H
+ * Description: Send the same device command to many GPRS connected
+ *              trackers at once and collect the replies.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef G7BCAST_H
+#define	G7BCAST_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of commands in flight at the same time in a broadcast.
+ * Must be less than the size of the command queue so that a broadcast
+ * never starves the ordinary commands.
+ */
+#define BCAST_MAX_INFLIGHT 64
+
+/**
+ * Timeout in seconds for a reply from a single device in a broadcast
+ */
+#define BCAST_REPLY_TIMEOUT 30
+
+struct client_info;
+
+int
+bcast_query(struct client_info *cli_info, const char *targets, const char *cmd);
+
+int
+bcast_func(struct client_info *cli_info, const char *targets, const char *func);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* G7BCAST_H */
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <sys/param.h>
 #include <sqlite3.h>
 #include <fcntl.h>
@@ -52,6 +53,7 @@
 #include "presets.h"
 #include "g7sendcmd.h"
 #include "g7cmd.h"
+#include "g7cmd_regex.h"
 #include "g7srvcmd.h"
 #include "export.h"
 #include "geoloc.h"
@@ -1239,20 +1241,16 @@ prepare_cmd_to_device(struct client_info *cli_info, const int cmdidx, const int
 int
 get_arg(const int sockd, char *label, size_t maxb, char *arg) {
     // Give user a prompt and read argument.
-    fd_set read_fdset;
-    struct timeval timeout;
+    struct pollfd pfd;
     int ret;
 
     *arg = '\0';
     if (*label)
         _writef(sockd, "%s", label);
 
-    FD_ZERO(&read_fdset);
-    FD_SET(sockd, &read_fdset);
-
-    timerclear(&timeout);
-    timeout.tv_sec = 300; // 5 min timeout to enter value
-    ret = select(sockd + 1, &read_fdset, NULL, NULL, &timeout);
+    pfd.fd = sockd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, 300 * 1000); // 5 min timeout to enter value
     if (0 == ret) {
         // Timeout
         logmsg(LOG_INFO, "Timeout for command argument \"%s\"", label);
@@ -1749,15 +1747,20 @@ exec_help_commandlist(struct client_info *cli_info) {
     _writef(sockd, "Server Command list:\n--------------------\n");
     _writef(sockd, "help                   - Print help for all commands\n");
     _writef(sockd, ".address               - Toggle address lookup when storing locations\n");
+    _writef(sockd, ".bcast                 - Send a command to many connected devices\n");
     _writef(sockd, ".cachestat             - Display statistics for the Geolocation cache\n");
-    _writef(sockd, ".date                  - Display server date and time\n");    
+    _writef(sockd, ".date                  - Display server date and time\n");
+    _writef(sockd, ".dbstat                - Display statistics for the DB writer\n");    
     _writef(sockd, ".dn                    - Delete specified nick\n");    
     _writef(sockd, ".lc                    - List command connections\n");
     _writef(sockd, ".ld                    - List all devices connections (on USB and GPRS)\n");
     _writef(sockd, ".ln                    - List all registered nicks\n");
+    _writef(sockd, ".mailstat              - Display statistics for the mail queue\n");
     _writef(sockd, ".nick                  - Register a nick-name for connected device\n");    
+    _writef(sockd, ".pluginstat            - Display statistics for the event handler plugins\n");
     _writef(sockd, ".ratereset             - Reset Geolocation lookup rate suspension\n");
     _writef(sockd, ".report                - Generate a PDF report of connected device to specified file\n");
+    _writef(sockd, ".scriptstat            - Display statistics for the event scripts\n");
     _writef(sockd, ".table                 - Switch between ASCII and Unicode box drawing characters for output tables\n");
     _writef(sockd, ".target                - List devices connected over GPRS or set active GPRS connection\n");    
     _writef(sockd, ".usb                   - List devices on USB or set active USB connection\n");
@@ -2010,8 +2013,7 @@ int
 check_password(int sockd) {
     static const char *AUTH_FAIL_MSG = INVALID_AUTHENTICATION;
     static const char *PWD_LBL_MSG = "Password: ";
-    fd_set read_fdset;
-    struct timeval timeout;
+    struct pollfd pfd;
     int authenticated = 0, ret;
 
     if (require_client_pwd) {
@@ -2020,13 +2022,9 @@ check_password(int sockd) {
         while (tries > 0 && !authenticated) {
             _writef(sockd, "%s\r\n", PWD_LBL_MSG);
 
-            FD_ZERO(&read_fdset);
-            FD_SET(sockd, &read_fdset);
-
-            timerclear(&timeout);
-            timeout.tv_sec = 120; // 2 min timeout to give a password
-
-            ret = select(sockd + 1, &read_fdset, NULL, NULL, &timeout);
+            pfd.fd = sockd;
+            pfd.events = POLLIN;
+            ret = poll(&pfd, 1, 120 * 1000); // 2 min timeout to give a password
             if (0 == ret) {
                 // Timeout
                 logmsg(LOG_DEBUG, "Timeout for password query on socket %d", sockd);
@@ -2089,69 +2087,71 @@ cmdinterp(char *cmdstr, struct client_info *cli_info) {
     char **field = (void *) NULL;
     int rc = 0, nf = 0;
 
-    if (0 < matchcmd("^set" _PR_S _PR_AN _PR_S _PR_ONOFF _PR_E, cmdstr, &field)) {
+    if (0 < matchcmd(CMD_RE_SET_ONOFF, cmdstr, &field)) {
         rc = exec_binary_command(cli_info, field);
-    } else if (0 < matchcmd("^get locg" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_GET_LOCG, cmdstr, &field)) {
         rc = exec_get_locg(cli_info);
 //    } else if (0 < matchcmd("^get address" _PR_E, cmdstr, &field)) {
 //        rc = exec_get_address(cli_info);        
-    } else if (0 < matchcmd("^get gfevt" _PR_S _PR_N _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_GET_GFEVT, cmdstr, &field)) {
         rc = exec_get_gfevt(cli_info, field);
-    } else if (0 < matchcmd("^get" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_GET, cmdstr, &field)) {
         rc = exec_get_command(cli_info, field); // Parameter getting
-    } else if (0 < matchcmd("^set" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_SET, cmdstr, &field)) {
         rc = exec_set_command(cli_info, field); // Parameter setting
-    } else if (0 < matchcmd("^do" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DO, cmdstr, &field)) {
         rc = exec_do_command(cli_info, field); // System command/ Command without arguments
-    } else if (0 < matchcmd("^help \\." _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_HELP_SRV, cmdstr, &field)) {
         srvcmd_help(cli_info, field);
-    } else if (0 < matchcmd("^help db" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_HELP_DB, cmdstr, &field)) {
         db_help(cli_info, field);
-    } else if (0 < matchcmd("^help" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_HELP, cmdstr, &field)) {
         exec_help_commandlist(cli_info);
-    } else if (0 < matchcmd("^help" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_HELP_CMD, cmdstr, &field)) {
         exec_help_for_command(cli_info, field[1]);
-    } else if (0 < (nf = matchcmd("^\\." _PR_ANPSO _PR_E, cmdstr, &field))) {
+    } else if (0 < (nf = matchcmd(CMD_RE_SRV, cmdstr, &field))) {
         exec_srv_command(cli_info, cmdstr);
-    } else if (0 < matchcmd("^\\$WP\\+" _PR_ANP _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_NATIVE, cmdstr, &field)) {
         exec_native_command(cli_info, cmdstr);
-    } else if (0 < (nf = matchcmd("^db" _PR_S "export" _PR_SO _PR_OPDEVID _PR_OPEVENTID _PR_OPTOFROMDATE _PR_SO "(kml|gpx|xml|csv|json)" "(" _PR_SO _PR_FNAMEOEXT ")?" _PR_E, cmdstr, &field))) {
-        rc = exportdb_to_external_format(cli_info, nf, field);
-    } else if (0 < (nf = matchcmd("^db" _PR_S "dist" _PR_SO _PR_OPDEVID _PR_OPEVENTID _PR_OPTOFROMDATE _PR_E, cmdstr, &field))) {
+    } else if (0 < (nf = matchcmd(CMD_RE_DB_EXPORT, cmdstr, &field))) {
+        struct export_ctx ctx;
+        export_init_ctx(&ctx);
+        rc = exportdb_to_external_format(cli_info, &ctx, nf, field);
+    } else if (0 < (nf = matchcmd(CMD_RE_DB_DIST, cmdstr, &field))) {
         rc = db_calc_distance(cli_info, nf, field);
-    } else if (0 < matchcmd("^db mailgpx" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_MAILGPX, cmdstr, &field)) {
         rc = mail_gpx_attachment(cli_info);
-    } else if (0 < matchcmd("^db mailcsv" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_MAILCSV, cmdstr, &field)) {
         rc = mail_csv_attachment(cli_info);
-    } else if (0 < matchcmd("^db mailpos" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_MAILPOS, cmdstr, &field)) {
         rc = mail_lastloc(cli_info);
-    } else if (0 < matchcmd("^db size" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_SIZE, cmdstr, &field)) {
         rc = db_get_numevents(cli_info);
-    } else if (0 < matchcmd("^db lastloc" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_LASTLOC, cmdstr, &field)) {
         rc = db_lastloc(cli_info);
-    } else if (0 < matchcmd("^db head" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_HEAD, cmdstr, &field)) {
         rc = db_head(cli_info,10);       
-    } else if (0 < matchcmd("^db head" _PR_S _PR_N _PR_E, cmdstr, &field)) {        
+    } else if (0 < matchcmd(CMD_RE_DB_HEAD_N, cmdstr, &field)) {        
         rc = db_head(cli_info,xatoi(field[1]));               
-    } else if (0 < matchcmd("^db tail" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_TAIL, cmdstr, &field)) {
         rc = db_tail(cli_info,10);                
-    } else if (0 < matchcmd("^db tail" _PR_S _PR_N _PR_E, cmdstr, &field)) {        
+    } else if (0 < matchcmd(CMD_RE_DB_TAIL_N, cmdstr, &field)) {        
         rc = db_tail(cli_info,xatoi(field[1]));                       
-    } else if (0 < matchcmd("^db sort device" _PR_E, cmdstr, &field)) {        
+    } else if (0 < matchcmd(CMD_RE_DB_SORT_DEVICE, cmdstr, &field)) {        
         db_set_sortorder(SORT_DEVICETIME);
         _writef(cli_info->cli_socket, "Table sort order: device");
-    } else if (0 < matchcmd("^db sort arrival" _PR_E, cmdstr, &field)) {        
+    } else if (0 < matchcmd(CMD_RE_DB_SORT_ARRIVAL, cmdstr, &field)) {        
         db_set_sortorder(SORT_ARRIVALTIME);        
         _writef(cli_info->cli_socket, "Table sort order: arrival");
-    } else if(0 < matchcmd("^db sort" _PR_E, cmdstr, &field)) {
+    } else if(0 < matchcmd(CMD_RE_DB_SORT, cmdstr, &field)) {
         _writef(cli_info->cli_socket, "Sort order: %s",db_get_sortorder_string());
-    } else if (0 < matchcmd("^db deletelocations" _PR_E, cmdstr, &field)) {
+    } else if (0 < matchcmd(CMD_RE_DB_DELETELOC, cmdstr, &field)) {
         rc = db_empty_loc(cli_info);
-    } else if (0 < (nf = matchcmd("^preset" _PR_S "(list|refresh)" _PR_E, cmdstr, &field))) {
+    } else if (0 < (nf = matchcmd(CMD_RE_PRESET_LIST, cmdstr, &field))) {
         rc = commandPreset(cli_info, cmdstr, nf, field);
-    } else if (0 < (nf = matchcmd("^preset" _PR_S "(use|help)" _PR_S _PR_AN _PR_E, cmdstr, &field))) {
+    } else if (0 < (nf = matchcmd(CMD_RE_PRESET_USE, cmdstr, &field))) {
         rc = commandPreset(cli_info, cmdstr, nf, field);
-    } else if (0 < (nf = matchcmd("^@@" _PR_ANF _PR_E, cmdstr, &field))) {        
+    } else if (0 < (nf = matchcmd(CMD_RE_PRESET_FUNC, cmdstr, &field))) {        
         // Execute a function directly with the same syntax as presets read from file
         // but here they are read directly from the commands
         _DBG_REGFLD(nf,field); 
@@ -2165,7 +2165,7 @@ cmdinterp(char *cmdstr, struct client_info *cli_info) {
             _writef(cli_info->cli_socket, "OK.");
         else
             _writef(cli_info->cli_socket, "FAILED function \"%s\"",field[1]);
-    } else if (0 < (nf = matchcmd("^@" _PR_AN _PR_E, cmdstr, &field))) {
+    } else if (0 < (nf = matchcmd(CMD_RE_PRESET_SHORT, cmdstr, &field))) {
         // Short form for "preset use dummy == @dummy
         char *tmpField[3];
         tmpField[0] = (char *) calloc(32, sizeof(char));
@@ -2200,8 +2200,7 @@ cmd_clientsrv(void *arg) {
     int rc;
     ssize_t numCharsFromClient;
     struct client_info *cli_info = (struct client_info *) arg;
-    fd_set read_fdset;
-    struct timeval timeout;
+    struct pollfd pfd;
     char *readClientBuffer = _chk_calloc_exit(BUFFER_10K + 1);
 
     // To avoid reserving ~8MB after the thread terminates we
@@ -2249,15 +2248,15 @@ cmd_clientsrv(void *arg) {
 
     do {
 
-        FD_ZERO(&read_fdset);
-        FD_SET((unsigned) cli_info->cli_socket, &read_fdset);
-
-        timerclear(&timeout);
-        timeout.tv_sec = 1;
+        // We use poll() rather than select() since with many connected trackers
+        // the socket descriptor can be larger than FD_SETSIZE
+        pfd.fd = cli_info->cli_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
         // Wait for user to give command
         errno = 0;
-        rc = select(cli_info->cli_socket + 1, &read_fdset, NULL, NULL, &timeout);
+        rc = poll(&pfd, 1, 1000);
         if (rc == 0) {
             // Use the timeout as opportunity to give information about changed state of any
             // device connected over USB.
@@ -2275,7 +2274,7 @@ cmd_clientsrv(void *arg) {
                 numCharsFromClient = 1; // To keep the loop going
             }
 
-        } else if (FD_ISSET(cli_info->cli_socket, &read_fdset)) {
+        } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
 
             // User has typed a command. Read it and do processing.
             idle_time = 0;
@@ -2307,7 +2306,7 @@ cmd_clientsrv(void *arg) {
                 }
             }
         } else {
-            logmsg(LOG_CRIT, "KERNEL error. select() claims file ready when it is not!");
+            logmsg(LOG_CRIT, "KERNEL error. poll() claims file ready when it is not!");
             abort();
         }
     } while (numCharsFromClient > 0);
@@ -0,0 +1,110 @@
+/* =========================================================================
+ * File:        G7CMD_REGEX.H
+ * Description: The regular expressions that define the command grammar
+ *              understood by cmdinterp(). They are kept here so that the
+ *              command benchmark matches exactly the same patterns.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef G7CMD_REGEX_H
+#define	G7CMD_REGEX_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "utils.h"
+
+/*
+ * One pattern per command. The _PR_* building blocks are defined in utils.h
+ */
+#define CMD_RE_SET_ONOFF       "^set" _PR_S _PR_AN _PR_S _PR_ONOFF _PR_E
+#define CMD_RE_GET_LOCG        "^get locg" _PR_E
+#define CMD_RE_GET_GFEVT       "^get gfevt" _PR_S _PR_N _PR_E
+#define CMD_RE_GET             "^get" _PR_S _PR_AN _PR_E
+#define CMD_RE_SET             "^set" _PR_S _PR_AN _PR_E
+#define CMD_RE_DO              "^do" _PR_S _PR_AN _PR_E
+#define CMD_RE_HELP_SRV        "^help \\." _PR_AN _PR_E
+#define CMD_RE_HELP_DB         "^help db" _PR_S _PR_AN _PR_E
+#define CMD_RE_HELP            "^help" _PR_E
+#define CMD_RE_HELP_CMD        "^help" _PR_S _PR_AN _PR_E
+#define CMD_RE_SRV             "^\\." _PR_ANPSO _PR_E
+#define CMD_RE_NATIVE          "^\\$WP\\+" _PR_ANP _PR_E
+#define CMD_RE_DB_EXPORT       "^db" _PR_S "export" _PR_SO _PR_OPDEVID _PR_OPEVENTID _PR_OPTOFROMDATE _PR_SO "(kml|gpx|xml|csv|json)" "(" _PR_SO _PR_FNAMEOEXT ")?" _PR_E
+#define CMD_RE_DB_DIST         "^db" _PR_S "dist" _PR_SO _PR_OPDEVID _PR_OPEVENTID _PR_OPTOFROMDATE _PR_E
+#define CMD_RE_DB_MAILGPX      "^db mailgpx" _PR_E
+#define CMD_RE_DB_MAILCSV      "^db mailcsv" _PR_E
+#define CMD_RE_DB_MAILPOS      "^db mailpos" _PR_E
+#define CMD_RE_DB_SIZE         "^db size" _PR_E
+#define CMD_RE_DB_LASTLOC      "^db lastloc" _PR_E
+#define CMD_RE_DB_HEAD         "^db head" _PR_E
+#define CMD_RE_DB_HEAD_N       "^db head" _PR_S _PR_N _PR_E
+#define CMD_RE_DB_TAIL         "^db tail" _PR_E
+#define CMD_RE_DB_TAIL_N       "^db tail" _PR_S _PR_N _PR_E
+#define CMD_RE_DB_SORT_DEVICE  "^db sort device" _PR_E
+#define CMD_RE_DB_SORT_ARRIVAL "^db sort arrival" _PR_E
+#define CMD_RE_DB_SORT         "^db sort" _PR_E
+#define CMD_RE_DB_DELETELOC    "^db deletelocations" _PR_E
+#define CMD_RE_PRESET_LIST     "^preset" _PR_S "(list|refresh)" _PR_E
+#define CMD_RE_PRESET_USE      "^preset" _PR_S "(use|help)" _PR_S _PR_AN _PR_E
+#define CMD_RE_PRESET_FUNC     "^@@" _PR_ANF _PR_E
+#define CMD_RE_PRESET_SHORT    "^@" _PR_AN _PR_E
+
+/**
+ * All command patterns in the order they are tried by cmdinterp(). When a
+ * command is added to cmdinterp() it must be added here at the same place.
+ */
+#define CMD_RE_TABLE \
+    CMD_RE_SET_ONOFF, \
+    CMD_RE_GET_LOCG, \
+    CMD_RE_GET_GFEVT, \
+    CMD_RE_GET, \
+    CMD_RE_SET, \
+    CMD_RE_DO, \
+    CMD_RE_HELP_SRV, \
+    CMD_RE_HELP_DB, \
+    CMD_RE_HELP, \
+    CMD_RE_HELP_CMD, \
+    CMD_RE_SRV, \
+    CMD_RE_NATIVE, \
+    CMD_RE_DB_EXPORT, \
+    CMD_RE_DB_DIST, \
+    CMD_RE_DB_MAILGPX, \
+    CMD_RE_DB_MAILCSV, \
+    CMD_RE_DB_MAILPOS, \
+    CMD_RE_DB_SIZE, \
+    CMD_RE_DB_LASTLOC, \
+    CMD_RE_DB_HEAD, \
+    CMD_RE_DB_HEAD_N, \
+    CMD_RE_DB_TAIL, \
+    CMD_RE_DB_TAIL_N, \
+    CMD_RE_DB_SORT_DEVICE, \
+    CMD_RE_DB_SORT_ARRIVAL, \
+    CMD_RE_DB_SORT, \
+    CMD_RE_DB_DELETELOC, \
+    CMD_RE_PRESET_LIST, \
+    CMD_RE_PRESET_USE, \
+    CMD_RE_PRESET_FUNC, \
+    CMD_RE_PRESET_SHORT
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* G7CMD_REGEX_H */
@@ -42,6 +42,7 @@
 #include "logger.h"
 #include "libxstr/xstr.h"
 #include "build.h"
+#include "trkloop.h"
 
 /* The iniparser library used is dependent on the configuration. It can either be the
  * system wide existing library or the daemon can use an internal version. Hence we need
@@ -97,10 +98,16 @@ char client_pwd[MAX_PASSWORD_LEN];
 // Maximum number of clients allowed to connect to us
 size_t max_clients = 10;
 
+// Number of event loop threads serving tracker connections. 0 = one thread per tracker
+unsigned tracker_event_loops = DEFAULT_TRACKER_EVENT_LOOPS;
+
 // Maximum idel time we allow after a device has connected but haven't sent
 // any data. Specified in seconds.
 unsigned max_device_idle_time = DEFAULT_DEVICE_IDLE_TIME;
 
+// Maximum number of commands in flight to one device over GPRS
+unsigned gprs_cmd_window = DEFAULT_GPRS_CMD_WINDOW;
+
 // Max idle time in seconds before automatic logout for command (Default 30min))
 unsigned max_idle_time = DEFAULT_CLIENT_IDLE_TIME;
 
@@ -189,6 +196,17 @@ _Bool mail_on_tracker_conn;
 // Script on new tracker connection
 _Bool script_on_tracker_conn;
 
+// Number of concurrent event scripts and the length of the script queue
+unsigned script_workers;
+unsigned script_queue_size;
+
+// Maximum run time in seconds for an event script
+unsigned script_timeout;
+
+// Directory with event handler plugins and the length of the plugin event queue
+char plugin_dir[256];
+unsigned plugin_queue_size;
+
 _Bool include_minimap ;
 
 unsigned minimap_overview_zoom;
@@ -199,6 +217,22 @@ unsigned minimap_height;
 unsigned geocache_address_size;
 unsigned geocache_minimap_size;
 
+// DB writer queue and batch settings
+unsigned db_queue_size;
+unsigned db_batch_size;
+unsigned db_commit_interval;
+
+// Number of connections in the DB connection pool
+unsigned db_pool_size;
+
+// Mail queue workers and retries
+unsigned mail_workers;
+unsigned mail_max_retries;
+
+// Event mail digest window and the events that bypass the digest
+unsigned mail_digest_window;
+char mail_digest_priority_events[128];
+
 _Bool use_short_devid ;
 
 _Bool pdfreport_geoevent_newpage ;
@@ -265,6 +299,15 @@ read_inisettings_startup(void) {
     INIT_INIINT("startup:cmd_port", tcpip_cmd_port, DEFAULT_CMD_PORT, 1025, 60000);
     INIT_INIINT("startup:geocache_address_size", geocache_address_size, DEFAULT_GEOCACHE_ADDRESS_SIZE, 100, 100000);
     INIT_INIINT("startup:geocache_minimap_size", geocache_minimap_size, DEFAULT_GEOCACHE_MINIMAP_SIZE, 200, 200000);
+    INIT_INIINT("startup:db_queue_size", db_queue_size, DEFAULT_DB_QUEUE_SIZE, 16, 100000);
+    INIT_INIINT("startup:db_batch_size", db_batch_size, DEFAULT_DB_BATCH_SIZE, 1, 10000);
+    INIT_INIINT("startup:db_commit_interval", db_commit_interval, DEFAULT_DB_COMMIT_INTERVAL, 1, 10000);
+    INIT_INIINT("startup:db_pool_size", db_pool_size, DEFAULT_DB_POOL_SIZE, 1, 64);
+    INIT_INIINT("startup:tracker_event_loops", tracker_event_loops, DEFAULT_TRACKER_EVENT_LOOPS, 0, MAX_TRACKER_EVENT_LOOPS);
+
+    // The client list is allocated once at startup so the size cannot be changed
+    // when the config is re-read
+    INIT_INIINT("config:max_clients", max_clients, DEFAULT_MAXCLIENTS, 2, 5000);
     
     
     /*---------------------------------------------------------------------------
@@ -294,7 +337,6 @@ read_inisettings(void) {
      *--------------------------------------------------------------------------
      */
 
-    INIT_INIINT("config:max_clients", max_clients, DEFAULT_MAXCLIENTS, 2, 100);
 #ifdef __APPLE__
     char tmpBuff[128];
     struct splitfields sfields;
@@ -324,6 +366,7 @@ read_inisettings(void) {
 #endif
     INIT_INIINT("config:client_idle_time", max_idle_time, DEFAULT_CLIENT_IDLE_TIME, 60, 12*3600);
     INIT_INIINT("config:device_idle_time", max_device_idle_time, DEFAULT_DEVICE_IDLE_TIME, 60, 600);
+    INIT_INIINT("config:gprs_cmd_window", gprs_cmd_window, DEFAULT_GPRS_CMD_WINDOW, 1, 32);
 
     INIT_INIINT("config:trackseg_split_time", trackseg_split_time, DEFAULT_TRACKSEG_SPLIT_TIME,-1,99999);
     INIT_INIINT("config:track_split_time", track_split_time, DEFAULT_TRACK_SPLIT_TIME,-1,99999);
@@ -353,6 +396,11 @@ read_inisettings(void) {
 
     INIT_INIBOOL("config:mail_on_tracker_conn", mail_on_tracker_conn, DEFAULT_MAIL_ON_TRACKER_CONN);
     INIT_INIBOOL("config:script_on_tracker_conn", script_on_tracker_conn, DEFAULT_SCRIPT_ON_TRACKER_CONN);
+    INIT_INIINT("config:script_workers", script_workers, DEFAULT_SCRIPT_WORKERS, 1, 16);
+    INIT_INIINT("config:script_queue_size", script_queue_size, DEFAULT_SCRIPT_QUEUE_SIZE, 10, 10000);
+    INIT_INIINT("config:script_timeout", script_timeout, DEFAULT_SCRIPT_TIMEOUT, 0, 3600);
+    INIT_INISTR("config:plugin_dir", plugin_dir, DEFAULT_PLUGIN_DIR);
+    INIT_INIINT("config:plugin_queue_size", plugin_queue_size, DEFAULT_PLUGIN_QUEUE_SIZE, 100, 1000000);
 
     INIT_INIINT("config:address_lookup_proximity",address_lookup_proximity,DEFAULT_ADDRESS_LOOKUP_PROXIMITY,0,200);
     
@@ -389,6 +437,10 @@ read_inisettings(void) {
     INIT_INIINT("mail:minimap_detailed_zoom", minimap_detailed_zoom, DEFAULT_MINIMAP_DETAILED_ZOOM, 1, 25);
     INIT_INIINT("mail:minimap_width", minimap_width, DEFAULT_MINIMAP_WIDTH, 50, 500);
     INIT_INIINT("mail:minimap_height", minimap_height, DEFAULT_MINIMAP_HEIGHT, 50, 500);
+    INIT_INIINT("mail:mail_workers", mail_workers, DEFAULT_MAIL_WORKERS, 1, 8);
+    INIT_INIINT("mail:mail_max_retries", mail_max_retries, DEFAULT_MAIL_MAX_RETRIES, 0, 20);
+    INIT_INIINT("mail:mail_digest_window", mail_digest_window, DEFAULT_MAIL_DIGEST_WINDOW, 0, 86400);
+    INIT_INISTR("mail:mail_digest_priority_events", mail_digest_priority_events, DEFAULT_MAIL_DIGEST_PRIORITY_EVENTS);
     
 
 }
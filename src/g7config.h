@@ -80,6 +80,13 @@ extern "C" {
  */
 #define DEFAULT_MAXCLIENTS 5
 
+/**
+ * DEFAULT_TRACKER_EVENT_LOOPS int
+ * Number of event loop threads used to serve tracker connections. 0 means
+ * that each tracker gets its own thread.
+ */
+#define DEFAULT_TRACKER_EVENT_LOOPS 0
+
 /**
  * DEFAULT_CLIENT_IDLE_TIME int
  * Default time for client command connection timeout (20 min)
@@ -94,6 +101,13 @@ extern "C" {
  */
 #define DEFAULT_DEVICE_IDLE_TIME 180
 
+/**
+ * DEFAULT_GPRS_CMD_WINDOW int
+ * Maximum number of commands sent to a tracker over GPRS without waiting
+ * for the replies when a sequence of commands is executed (presets, reports)
+ */
+#define DEFAULT_GPRS_CMD_WINDOW 4
+
 /**
  * DEFAULT_STTY string
  * Deafult index for USB ttyACM<n> device
@@ -199,6 +213,35 @@ extern "C" {
  */
 #define DEFAULT_GEOCACHE_ADDRESS_SIZE 10000
 #define DEFAULT_GEOCACHE_MINIMAP_SIZE 20000
+
+/**
+ * Default settings for the DB writer thread. Maximum number of queued
+ * locations, maximum number of locations in one transaction and the
+ * maximum time (in ms) to wait for a full batch before committing.
+ */
+#define DEFAULT_DB_QUEUE_SIZE 2048
+#define DEFAULT_DB_BATCH_SIZE 500
+#define DEFAULT_DB_COMMIT_INTERVAL 50
+
+/**
+ * Default number of connections in the DB connection pool
+ */
+#define DEFAULT_DB_POOL_SIZE 4
+
+/**
+ * Default number of threads sending queued event mails and the number of
+ * times a failed mail is retried before it is given up
+ */
+#define DEFAULT_MAIL_WORKERS 2
+#define DEFAULT_MAIL_MAX_RETRIES 5
+
+/**
+ * Default length (in seconds) of the event mail digest window. 0 disables
+ * the digest so that one mail is sent per event. The priority events are
+ * always mailed right away (48=GFEN, 100=SETRA).
+ */
+#define DEFAULT_MAIL_DIGEST_WINDOW 0
+#define DEFAULT_MAIL_DIGEST_PRIORITY_EVENTS "48,100"
         
 /**
  * Default file name for storing the geocache
@@ -220,6 +263,28 @@ extern "C" {
  */
 #define DEFAULT_MINIMAP_GEOCACHE_BACKUPFILE "geoloc_minimapcache_backup.txt"
 
+/**
+ * Default file name for the binary (memory mapped) address geocache. The
+ * text format file above is only read if this file does not exist.
+ */
+#define DEFAULT_ADDRESS_GEOCACHE_BINFILE "geoloc_addrcache.bin"
+
+/**
+ * Default file name for backup of the binary address geocache
+ */
+#define DEFAULT_ADDRESS_GEOCACHE_BINBACKUPFILE "geoloc_addrcache_backup.bin"
+
+/**
+ * Default file name for the binary (memory mapped) minimap geocache which
+ * also holds all the images
+ */
+#define DEFAULT_MINIMAP_GEOCACHE_BINFILE "geoloc_minimapcache.bin"
+
+/**
+ * Default file name for backup of the binary minimap geocache
+ */
+#define DEFAULT_MINIMAP_GEOCACHE_BINBACKUPFILE "geoloc_minimapcache_backup.bin"
+
 /**
  * Default file name for stored hit/miss statistics between invocations of daemon
  */    
@@ -283,6 +348,25 @@ extern "C" {
  */
 #define DEFAULT_SCRIPT_ON_TRACKER_CONN 0
 
+/**
+ * Default number of event scripts that may run at the same time and the
+ * maximum number of scripts waiting to run
+ */
+#define DEFAULT_SCRIPT_WORKERS 2
+#define DEFAULT_SCRIPT_QUEUE_SIZE 200
+
+/**
+ * Default maximum run time in seconds for an event script (0 = no limit)
+ */
+#define DEFAULT_SCRIPT_TIMEOUT 60
+
+/**
+ * Default directory for event handler plugins (empty = no plugins) and the
+ * maximum number of events waiting for the plugins
+ */
+#define DEFAULT_PLUGIN_DIR ""
+#define DEFAULT_PLUGIN_QUEUE_SIZE 8192
+
 /**
  * USE_ADDRESS_LOOKUP_IN_MAIL bool
  * Use Google service reverse lookup to translate coordinates to an
@@ -350,9 +434,15 @@ extern unsigned max_idle_time ;
 /// Maximum number of clients allowed to connect to us
 extern size_t max_clients;
 
+/// Number of event loops serving tracker connections (0 = thread per tracker)
+extern unsigned tracker_event_loops;
+
 /// Maximum idle time after a device have connected to us
 extern unsigned max_device_idle_time;
 
+/// Maximum number of outstanding commands to one device over GPRS
+extern unsigned gprs_cmd_window;
+
 /// Should we run as a daemon or not
 extern int daemonize;
 
@@ -446,8 +536,41 @@ extern unsigned minimap_height;
 extern unsigned geocache_address_size;
 extern unsigned geocache_minimap_size;
 
+/**
+ * DB writer settings
+ */
+extern unsigned db_queue_size;
+extern unsigned db_batch_size;
+extern unsigned db_commit_interval;
+extern unsigned db_pool_size;
+
+/**
+ * Mail queue settings
+ */
+extern unsigned mail_workers;
+extern unsigned mail_max_retries;
+
+/**
+ * Event mail digest settings
+ */
+extern unsigned mail_digest_window;
+extern char mail_digest_priority_events[128];
+
 
 extern _Bool script_on_tracker_conn ;
+
+/**
+ * Event script execution settings
+ */
+extern unsigned script_workers;
+extern unsigned script_queue_size;
+extern unsigned script_timeout;
+
+/**
+ * Event handler plugin settings
+ */
+extern char plugin_dir[256];
+extern unsigned plugin_queue_size;
 extern _Bool mail_on_tracker_conn ;
 
 extern _Bool use_short_devid ;
@@ -544,6 +667,10 @@ read_inisettings_startup(void);
 // The parameters are: mail_subject_prefix, Device ID and Event description
 #define SUBJECT_EVENTMAIL  "%s[ID:%s] Event: \"%s\""
 
+// Subject in digest mails with several events
+// The parameters are: mail_subject_prefix, Device ID and number of events
+#define SUBJECT_DIGESTMAIL  "%s[ID:%s] Event digest: %zu events"
+
 
 // Name for the events. The names are used in the mails sent when an event is received
 #define EVENTDESC_EVENT_GETLOC "Position data"
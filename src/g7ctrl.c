@@ -41,6 +41,7 @@
 #include <pthread.h>
 #include <grp.h>
 #include <time.h>
+#include <sqlite3.h>
 #include <libgen.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,6 +67,17 @@
 #include "g7config.h"
 #include "geoloc_cache.h"
 #include "geoloc.h"
+#include "trkloop.h"
+#include "dbcmd.h"
+#include "nicks.h"
+#include "dbwriter.h"
+#include "geoworker.h"
+#include "mailqueue.h"
+#include "maildigest.h"
+#include "scriptpool.h"
+#include "plugins.h"
+#include "mailutil.h"
+#include "libsmtpmail/mailclientlib.h"
 
 
 // Since these defines are supposed to be defined directly in the linker using
@@ -705,6 +717,10 @@ main(int argc, char *argv[]) {
     // thread to avoid possible deadlocks. It also creates a handle
     // for serious errors like SIGSEGV
     setup_sighandling();
+
+    // From now on log messages are written by a background thread. This must
+    // be done after the signals have been blocked.
+    (void)logger_start();
     
     // Setup geo-location cache structures
     init_geoloc_cache();
@@ -743,6 +759,59 @@ main(int argc, char *argv[]) {
     // Initialize the command queue we use for GPRS command
     cmdqueue_init();
 
+    // Open the pool of DB connections used for all queries
+    if (-1 == db_pool_init(db_pool_size)) {
+        logmsg(LOG_ERR, "Unable to open DB.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Nick names are needed for every event so keep them in memory
+    if (-1 == nick_cache_load()) {
+        logmsg(LOG_ERR, "Unable to read nick names from DB.");
+    }
+
+    // Start the thread that stores received locations in the DB
+    if (-1 == dbwriter_init(db_queue_size, db_batch_size, db_commit_interval)) {
+        logmsg(LOG_ERR, "Unable to start DB writer.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the worker that fills in the address of stored locations
+    if (use_address_lookup && -1 == geoworker_init()) {
+        logmsg(LOG_ERR, "Unable to start address backfill worker. Addresses will be filled in at next start.");
+    }
+
+    // Compile the mail templates once. They are recompiled when changed.
+    if (-1 == load_mail_templates()) {
+        logmsg(LOG_ERR, "Unable to load mail templates.");
+    }
+
+    // Start the workers that send the event mails
+    if (-1 == mailqueue_init(mail_workers, mail_max_retries)) {
+        logmsg(LOG_ERR, "Unable to start mail workers. Mails will be sent directly.");
+    }
+
+    // Start the workers that run the event scripts
+    if (-1 == scriptpool_init(script_workers, script_queue_size, script_timeout)) {
+        logmsg(LOG_ERR, "Unable to start script workers. Scripts will be run directly.");
+    }
+
+    // Load the event handler plugins (if any)
+    if (-1 == plugins_init(plugin_dir, plugin_queue_size)) {
+        logmsg(LOG_ERR, "Unable to start plugin dispatcher. Plugins will not be called.");
+    }
+
+    // Start collecting event mails into digests (if enabled)
+    if (-1 == maildigest_init(mail_digest_window, mail_digest_priority_events)) {
+        logmsg(LOG_ERR, "Unable to start mail digest. One mail will be sent per event.");
+    }
+
+    // Start the event loops that serves the tracker connections (if enabled)
+    if (-1 == trkloop_init(tracker_event_loops)) {
+        logmsg(LOG_ERR, "Unable to start tracker event loops.");
+        exit(EXIT_FAILURE);
+    }
+
     // *********************************************************************************
     // *********************************************************************************
     // **     This is the real main starting point of the program                     **
@@ -763,6 +832,16 @@ main(int argc, char *argv[]) {
     // *********************************************************************************
 
     logmsg(LOG_INFO, "Received signal %d. Shutting down daemon", received_signal);
+
+    // Make sure all queued locations are stored before we exit
+    dbwriter_shutdown();
+    geoworker_shutdown();
+    maildigest_shutdown();
+    mailqueue_shutdown();
+    scriptpool_shutdown();
+    plugins_shutdown();
+    smtp_session_pool_close();
+    dict_free_templates();
     
     logmsg(LOG_DEBUG, "Trying to save geocache statistics and cache vectors" );
 
@@ -792,6 +871,9 @@ main(int argc, char *argv[]) {
         logmsg(LOG_INFO, "Trying to clean up lockfil and exit");
         delete_lockfile();
     }
+
+    // Make sure all queued log messages are written
+    logger_shutdown();
     _exit(EXIT_SUCCESS);
 
 }
@@ -61,6 +61,9 @@ struct client_info {
     * Fields only used for device connections
     */
    unsigned  cli_devid;         // Tracker device ID as integer. Always have 10 digits
+   _Bool     cli_evloop;        // TRUE if the tracker socket is served by one of the
+                                // shared tracker event loops instead of a dedicated
+                                // thread. In that case cli_thread is the loop thread
 };
 
 /**
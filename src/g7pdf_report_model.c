@@ -199,25 +199,14 @@ char report_header_title[128] = {0};
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
 /**
- * Send the specified command to the device and get the replies. The reply is splitted in the
- * different fields in the reply.
- * @param cli_info Client context
- * @param dev_srvcmd The command to send to the device
+ * Split the reply from a device query in the different fields in the reply.
+ * @param dev_srvcmd The command that was sent to the device
+ * @param reply The raw reply from the device
  * @param flds The returned reply splitted in the different fields
- * @param event_id Only used when the command is GFEVT and in that case hold the event id
  * @return 0 on success, -1 on faiure
  */
-int
-send_command_get_replies(struct client_info *cli_info, char *dev_srvcmd, struct splitfields *flds, size_t event_id) {
-    logmsg(LOG_DEBUG,"Running send_command_get_replies(%s) for PDF report",dev_srvcmd);
-    char reply[1024];
-    if( event_id ) {
-        snprintf(reply,sizeof(reply),"%zu",event_id);
-    }
-    if( -1 == send_cmdquery_reply(cli_info, dev_srvcmd, reply, sizeof(reply)) ) {
-        logmsg(LOG_DEBUG,"Failed send_cmdquery_reply()");
-        return -1;
-    }
+static int
+parse_command_reply(const char *dev_srvcmd, const char *reply, struct splitfields *flds) {
     _Bool isok;
     char cmdname[16];
     char devtag[16];
@@ -243,6 +232,163 @@ send_command_get_replies(struct client_info *cli_info, char *dev_srvcmd, struct
     return rc;
 }
 
+/**
+ * Send the specified command to the device and get the replies. The reply is splitted in the
+ * different fields in the reply.
+ * @param cli_info Client context
+ * @param dev_srvcmd The command to send to the device
+ * @param flds The returned reply splitted in the different fields
+ * @param event_id Only used when the command is GFEVT and in that case hold the event id
+ * @return 0 on success, -1 on faiure
+ */
+int
+send_command_get_replies(struct client_info *cli_info, char *dev_srvcmd, struct splitfields *flds, size_t event_id) {
+    logmsg(LOG_DEBUG,"Running send_command_get_replies(%s) for PDF report",dev_srvcmd);
+    char reply[1024];
+    if( event_id ) {
+        snprintf(reply,sizeof(reply),"%zu",event_id);
+    }
+    if( -1 == send_cmdquery_reply(cli_info, dev_srvcmd, reply, sizeof(reply)) ) {
+        logmsg(LOG_DEBUG,"Failed send_cmdquery_reply()");
+        return -1;
+    }
+    return parse_command_reply(dev_srvcmd, reply, flds);
+}
+
+/**
+ * Progress of the device queries for the report. A mark is written to the
+ * user for each 10% of the queries that have completed.
+ */
+struct report_progress {
+    int sockd;          // User socket
+    size_t total;       // Total number of queries
+    size_t done;        // Number of completed queries
+    size_t percent;     // Last written mark
+};
+
+/**
+ * Add completed queries to the progress and write any new progress marks
+ * @param p Progress
+ * @param n Number of queries that have just completed
+ */
+static void
+report_progress_add(struct report_progress *p, const size_t n) {
+    p->done += n;
+    while (p->percent < 90 && (p->percent + 10) * p->total <= p->done * 100) {
+        p->percent += 10;
+        _writef(p->sockd, "[%zu%%].", p->percent);
+    }
+}
+
+/**
+ * Number of times a failed report query is sent again
+ */
+#define REPORT_QUERY_RETRIES 1
+
+/**
+ * State passed to report_query_done() while the report queries are sent
+ */
+struct report_query_ctx {
+    struct report_progress *progress;
+    _Bool over_gprs;    // Queries are pipelined over GPRS
+    _Bool last_try;     // No more retries after this round
+};
+
+/**
+ * Called as each report query completes. Updates the progress and waits
+ * before the next query where the device needs some time. A command marked
+ * as barrier is followed by a two second pause to let the device finish
+ * (used for the "test" command). Over USB there is a short pause between
+ * all queries.
+ * @param q The completed query
+ * @param arg The report_query_ctx
+ */
+static void
+report_query_done(struct devcmd_batch *q, void *arg) {
+    struct report_query_ctx *ctx = (struct report_query_ctx *) arg;
+
+    // A failed query is counted when it is not retried any more
+    if (0 == q->rc || '\0' == *q->cmd || ctx->last_try) {
+        report_progress_add(ctx->progress, 1);
+    }
+    if ('\0' == *q->cmd) {
+        return;
+    }
+    if (q->barrier) {
+        usleep(2000000); // Sleep two seconds to wait for result from test
+    } else if (!ctx->over_gprs) {
+        usleep(500000); // Sleep 0.5 seconds between two commands
+    }
+}
+
+/**
+ * Send all report queries to the device. Over GPRS up to gprs_cmd_window
+ * queries are in flight and a new query is sent as soon as a reply arrives
+ * so the device is kept busy for the whole report. Progress is shown as the
+ * replies arrive. Queries that fail (or are never sent since an earlier query
+ * failed) are sent again up to REPORT_QUERY_RETRIES times. Queries that have
+ * succeeded are never sent again. Queries with an empty command string are
+ * skipped.
+ * @param cli_info Client context
+ * @param batch The prepared queries
+ * @param n Number of queries
+ * @param stop_on_error TRUE to stop at the first failed query, FALSE to
+ * continue with the queries after a failed query
+ * @param progress Progress that is updated as the queries complete
+ * @return 0 if all queries succeeded, -1 otherwise
+ */
+static int
+send_report_queries(struct client_info *cli_info, struct devcmd_batch *batch, const size_t n, const _Bool stop_on_error,
+                    struct report_progress *progress) {
+    struct report_query_ctx ctx = {progress, cli_info->target_socket > 0 && cli_info->target_cli_idx >= 0, FALSE};
+
+    // We don't want any output to the user at this level so set sockd to -1 temporarily
+    const int old_sockd = cli_info->cli_socket;
+    cli_info->cli_socket = -1;
+
+    ctx.last_try = 0 == REPORT_QUERY_RETRIES;
+    int ret = send_rawcmd_batch(cli_info, batch, n, stop_on_error, report_query_done, &ctx);
+
+    for (unsigned retry = 0; -1 == ret && retry < REPORT_QUERY_RETRIES; retry++) {
+        size_t *idx = calloc(n, sizeof (size_t));
+        struct devcmd_batch *again = calloc(n, sizeof (struct devcmd_batch));
+        if (NULL == idx || NULL == again) {
+            free(idx);
+            free(again);
+            break;
+        }
+        size_t nfail = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (*batch[i].cmd && batch[i].rc) {
+                idx[nfail] = i;
+                again[nfail++] = batch[i];
+            }
+        }
+        if (nfail > 0) {
+            logmsg(LOG_DEBUG, "Retrying %zu failed report queries", nfail);
+            ctx.last_try = retry + 1 == REPORT_QUERY_RETRIES;
+            (void) send_rawcmd_batch(cli_info, again, nfail, stop_on_error, report_query_done, &ctx);
+            for (size_t i = 0; i < nfail; i++) {
+                batch[idx[i]] = again[i];
+            }
+        }
+        free(idx);
+        free(again);
+        if (0 == nfail) {
+            break;
+        }
+        ret = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i].rc) {
+                ret = -1;
+            }
+        }
+    }
+
+    cli_info->cli_socket = old_sockd;
+    return ret;
+}
+
 /**
  * Make the returned dates and number of location logged on the device  more
  * human friendly to read
@@ -333,14 +479,47 @@ init_model_from_device(void *tag, _Bool read_from_file, _Bool include_geofevt) {
     
     size_t i=0;
     struct splitfields flds;
-    size_t percent=0; // Percent finished
-    _writef(cli_info->cli_socket,"[%zu%%].",percent);
-    
+
+    // Prepare all queries up front so that they can be pipelined to the device
+    size_t ncmds=0;
+    while( dev_report_cmd_list[ncmds].cmd_name ) {
+        ncmds++;
+    }
+    const size_t ngfevt = include_geofevt ? 50 : 0;
+
+    // Progress is shown as the device replies arrive
+    struct report_progress progress = {cli_info->cli_socket, ncmds + ngfevt, 0, 0};
+    _writef(cli_info->cli_socket,"[%zu%%].",progress.percent);
+    struct devcmd_batch *batch = calloc(ncmds + ngfevt, sizeof(struct devcmd_batch));
+    if( NULL == batch ) {
+        logmsg(LOG_ERR,"Out of memory in init_model_from_device()");
+        _writef(cli_info->cli_socket,"\n");
+        assoc_destroy(device_info);
+        return -1;
+    }
+    for( i=0; i < ncmds; i++ ) {
+        if( -1 == prepare_cmdquery(dev_report_cmd_list[i].cmd_name, NULL, &batch[i]) ) {
+            logmsg(LOG_ERR,"Failed command %s in report generation",dev_report_cmd_list[i].cmd_name);
+            _writef(cli_info->cli_socket,"\n");
+            free(batch);
+            assoc_destroy(device_info);
+            return -1;
+        }
+        batch[i].barrier = 0==strcmp("test",dev_report_cmd_list[i].cmd_name);
+    }
+
+    logmsg(LOG_DEBUG,"Running %zu report commands", ncmds);
+    (void)send_report_queries(cli_info, batch, ncmds, TRUE, &progress);
+
+    i=0;
     while( dev_report_cmd_list[i].cmd_name ) {
         
         logmsg(LOG_DEBUG,"Running \"%s\"", dev_report_cmd_list[i].cmd_name);
 
-        int rc = send_command_get_replies(cli_info, dev_report_cmd_list[i].cmd_name, &flds,0);
+        int rc = batch[i].rc;
+        if( 0 == rc ) {
+            rc = parse_command_reply(dev_report_cmd_list[i].cmd_name, batch[i].reply, &flds);
+        }
 
         if( 0 == rc ) {
             // Device normal response            
@@ -367,32 +546,12 @@ init_model_from_device(void *tag, _Bool read_from_file, _Bool include_geofevt) {
         } else {
             logmsg(LOG_ERR,"Failed command %s in report generation",dev_report_cmd_list[i].cmd_name);
             _writef(cli_info->cli_socket,"\n");
+            free(batch);
             assoc_destroy(device_info);
             return -1;
         }
-                
-        if( 0==strcmp("test",dev_report_cmd_list[i].cmd_name) ) {
-            usleep(2000000); // Sleep two seconds to wait for result from test
-        } else {
-            usleep(500000); // Sleep 0.5 seconds between two commands
-        }
         
         i++;
-        if (include_geofevt ) {
-            
-            if( 0 == i%7  && percent < 90 ) {
-                percent += 10;
-                _writef(cli_info->cli_socket,"[%zu%%].",percent);
-            }
-            
-        } else {
-            
-            if( 0 == i%2  && percent < 90 ) {
-                percent += 10;
-                _writef(cli_info->cli_socket,"[%zu%%].",percent);
-            }
-            
-        }
 
     }
     
@@ -403,10 +562,25 @@ init_model_from_device(void *tag, _Bool read_from_file, _Bool include_geofevt) {
         
         char cmdbuf[32];
         char namebuf[64];
+        char evtbuf[8];
+        snprintf(cmdbuf, sizeof (cmdbuf), "gfevt");
+
         // The events are between 50 to 99 and we have to check each one
+        struct devcmd_batch *evtbatch = &batch[ncmds];
+        for (size_t event_id = 50; event_id < 100; event_id++) {
+            snprintf(evtbuf, sizeof (evtbuf), "%zu", event_id);
+            if (-1 == prepare_cmdquery(cmdbuf, evtbuf, &evtbatch[event_id - 50])) {
+                *evtbatch[event_id - 50].cmd = '\0';
+            }
+        }
+
+        (void)send_report_queries(cli_info, evtbatch, ngfevt, FALSE, &progress);
+
         for (size_t event_id = 50; event_id < 100; event_id++) {
-            snprintf(cmdbuf, sizeof (cmdbuf), "gfevt");
-            int rc = send_command_get_replies(cli_info, cmdbuf, &flds, event_id);
+            int rc = evtbatch[event_id - 50].rc;
+            if (0 == rc) {
+                rc = parse_command_reply(cmdbuf, evtbatch[event_id - 50].reply, &flds);
+            }
 
             if (0 == rc) {
 
@@ -448,14 +622,11 @@ init_model_from_device(void *tag, _Bool read_from_file, _Bool include_geofevt) {
 
             }
 
-            if (0 == (event_id - 49) % 7 && percent < 90) {
-                percent += 10;
-                _writef(cli_info->cli_socket, "[%zu%%].", percent);
-            }
-
         }
     }
     
+    free(batch);
+
     static char date_buf[64];
     time_t t = time(NULL);
     ctime_r(&t,date_buf);
@@ -0,0 +1,132 @@
+/* =========================================================================
+ * File:        G7PLUGIN.H
+ * Description: Public interface for in-process event handler plugins.
+ *              A plugin is a shared object placed in the plugin directory
+ *              (config:plugin_dir). It must export the function
+ *
+ *                  int g7plugin_init(struct g7plugin *plugin);
+ *
+ *              which is called once when the daemon starts. The function
+ *              should check api_version, fill in the name and the
+ *              callbacks it wants and return 0. Any other return value
+ *              makes the daemon unload the plugin.
+ *
+ *              All callbacks are called from one dispatcher thread in the
+ *              order the events arrived. The records passed to the
+ *              callbacks are only valid during the call. A callback should
+ *              return quickly. If the callbacks cannot keep up, the oldest
+ *              events are kept and new events are dropped.
+ *
+ *              Build a plugin with for example
+ *              gcc -shared -fPIC -o myplugin.so myplugin.c
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef G7PLUGIN_H
+#define	G7PLUGIN_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <time.h>
+
+/**
+ * Version of the plugin interface. Increased whenever a record or the
+ * plugin structure changes in an incompatible way.
+ */
+#define G7PLUGIN_API_VERSION 1
+
+/**
+ * Name of the function a plugin must export
+ */
+#define G7PLUGIN_INIT_SYMBOL "g7plugin_init"
+
+/**
+ * A location update received from a tracker
+ */
+struct g7plugin_location {
+    time_t ts;                  // Arrival time
+    unsigned devid;             // Device ID
+    long datetime;              // Device timestamp as YYYYMMDDhhmmss
+    double lat;
+    double lon;
+    int speed;                  // km/h
+    int heading;                // Degrees
+    int altitude;               // Meters
+    int satellite;              // Number of satellites
+    int eventid;                // Event id (see the device manual)
+    double voltage;             // Battery voltage
+    int detach;                 // Detach sensor
+};
+
+/**
+ * Connection events
+ */
+#define G7PLUGIN_CONNECT 1
+#define G7PLUGIN_DISCONNECT 2
+
+/**
+ * A tracker that connects to or disconnects from the server
+ */
+struct g7plugin_connection {
+    time_t ts;                  // Time of the event
+    unsigned devid;             // Device ID
+    int event;                  // G7PLUGIN_CONNECT or G7PLUGIN_DISCONNECT
+    char ipadr[16];             // IP address of the tracker
+};
+
+/**
+ * A reply from a tracker to a command
+ */
+struct g7plugin_cmdreply {
+    time_t ts;                  // Arrival time
+    unsigned devid;             // Device ID
+    int isok;                   // 1 if the device reported success
+    char tag[8];                // Command tag (empty for a location reply)
+    char cmd[16];               // Command name (empty for a location reply)
+    const char *reply;          // The full reply from the device
+};
+
+/**
+ * The plugin. api_version and filename are set by the daemon, everything
+ * else is filled in by g7plugin_init(). Callbacks that are not needed are
+ * left as NULL.
+ */
+struct g7plugin {
+    unsigned api_version;
+    const char *filename;
+    const char *name;
+    void *user;                 // Passed unchanged to all callbacks
+    void (*on_location)(const struct g7plugin_location *loc, void *user);
+    void (*on_connection)(const struct g7plugin_connection *conn, void *user);
+    void (*on_cmdreply)(const struct g7plugin_cmdreply *reply, void *user);
+    void (*on_exit)(void *user);
+};
+
+/**
+ * Prototype for the init function
+ */
+typedef int (*g7plugin_init_func)(struct g7plugin *plugin);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* G7PLUGIN_H */
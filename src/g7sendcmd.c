@@ -43,6 +43,7 @@
 #include "g7cmd.h"
 #include "libxstr/xstr.h"
 #include "dbcmd.h"
+#include "dbwriter.h"
 #include "logger.h"
 #include "utils.h"
 #include "g7sendcmd.h"
@@ -75,15 +76,43 @@ const size_t g7error_list_num = sizeof (g7error_list) / sizeof (struct g7error);
 /** Max number of outstanding command (over GPRS) to device */
 #define MAX_CMDQUEUE_LEN 128
 
+/** Number of buckets in the hash index for the command queue. Must be a power of 2 */
+#define CMDQUEUE_HASH_SIZE 256
+
 /** Queue of commands sent to the device */
 struct cmdqueue_t *cmdq;
 
 /** Current number of active commands int the command queue */
 size_t cmdq_len = 0;
 
+/**
+ * Hash index on (devid,tag) for the command queue. Each bucket holds the
+ * index + 1 of the first entry in the bucket (0 = empty) and the entries
+ * are chained through the "next" field.
+ */
+static size_t cmdq_hash[CMDQUEUE_HASH_SIZE];
+
+/** First free entry (index + 1) in the command queue, 0 if the queue is full */
+static size_t cmdq_free = 0;
+
 /** Timeout for waiting on a reply from a device over GPRS (30 sec) */
 #define CMDQUEUE_TIMEOUT 30U
 
+/**
+ * Compute the hash bucket for a command
+ * @param devid Device id
+ * @param tag Command tag
+ * @return Bucket index
+ */
+static size_t
+_cmdqueue_bucket(const unsigned devid, const char *tag) {
+    size_t h = 2166136261u ^ devid;
+    while (*tag) {
+        h = (h ^ (unsigned char) *tag++) * 16777619u;
+    }
+    return h & (CMDQUEUE_HASH_SIZE - 1);
+}
+
 /**
  * Initialize command queue
  */
@@ -91,6 +120,38 @@ void
 cmdqueue_init(void) {
     cmdq = _chk_calloc_exit(MAX_CMDQUEUE_LEN * sizeof (struct cmdqueue_t));
     cmdq_len = 0;
+    memset(cmdq_hash, 0, sizeof (cmdq_hash));
+
+    // The wait for a reply is measured with the monotonic clock so that it
+    // is not affected if the system time is adjusted
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    for (size_t i = 0; i < MAX_CMDQUEUE_LEN; ++i) {
+        pthread_cond_init(&cmdq[i].cond, &attr);
+        cmdq[i].next = i + 2 <= MAX_CMDQUEUE_LEN ? i + 2 : 0;
+    }
+    pthread_condattr_destroy(&attr);
+    cmdq_free = 1;
+}
+
+/**
+ * Initialize a condition to be used as the extra notification for commands
+ * inserted with cmdqueue_insert_notify(). The condition uses the same clock
+ * as the wait for replies in the queue.
+ * @param notify Condition to initialize
+ */
+void
+cmdqueue_notify_init(pthread_cond_t *notify) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(notify, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
 /**
@@ -105,29 +166,53 @@ cmdqueue_init(void) {
  */
 int
 cmdqueue_insert(const int user_sockd, const unsigned devid, const char *tag, const char *cmdstr) {
-    if (cmdq_len >= MAX_CMDQUEUE_LEN) {
-        logmsg(LOG_ERR, "Command queue is full");
-        return -1;
-    }
+    return cmdqueue_insert_notify(user_sockd, devid, tag, cmdstr, NULL);
+}
+
+/**
+ * Insert a command in the command queue with an extra condition that is
+ * signalled when the reply arrives. This makes it possible for one thread
+ * to wait for replies on many outstanding commands at once.
+ * @param user_sockd User socket to write command reply to
+ * @param devid Device id
+ * @param tag Command tag
+ * @param cmdstr The full command string
+ * @param notify Extra condition to signal (may be NULL)
+ * @return -1 on failure, >= 0 The command index where the command
+ * was inserted
+ * @see cmdqueue_wait_any()
+ */
+int
+cmdqueue_insert_notify(const int user_sockd, const unsigned devid, const char *tag, const char *cmdstr, pthread_cond_t *notify) {
     if (strlen(tag) > 5 || strlen(cmdstr) > 255) {
         return -1;
     }
-    // Find the first empty place
     pthread_mutex_lock(&cmdqueue_mutex);
-    for (size_t i = 0; i < MAX_CMDQUEUE_LEN; ++i) {
-        if (0 == cmdq[i].devid && 0 == cmdq[i].ts) {
-            cmdq[i].ts = time(NULL);
-            cmdq[i].devid = devid;
-            cmdq[i].user_sockd = user_sockd;
-            xstrlcpy(cmdq[i].tag, tag, sizeof (cmdq[i].tag));
-            xstrlcpy(cmdq[i].cmd, cmdstr, sizeof (cmdq[i].cmd));
-            logmsg(LOG_DEBUG, "QUEUE: Inserted [%u:%s] cmd %s", devid, tag, cmdstr);
-            pthread_mutex_unlock(&cmdqueue_mutex);
-            return i;
-        }
+    if (0 == cmdq_free) {
+        pthread_mutex_unlock(&cmdqueue_mutex);
+        logmsg(LOG_ERR, "Command queue is full");
+        return -1;
     }
+    const size_t i = cmdq_free - 1;
+    cmdq_free = cmdq[i].next;
+
+    cmdq[i].ts = time(NULL);
+    cmdq[i].devid = devid;
+    cmdq[i].user_sockd = user_sockd;
+    cmdq[i].validreply = FALSE;
+    cmdq[i].notify = notify;
+    *cmdq[i].reply = '\0';
+    xstrlcpy(cmdq[i].tag, tag, sizeof (cmdq[i].tag));
+    xstrlcpy(cmdq[i].cmd, cmdstr, sizeof (cmdq[i].cmd));
+
+    const size_t b = _cmdqueue_bucket(devid, cmdq[i].tag);
+    cmdq[i].next = cmdq_hash[b];
+    cmdq_hash[b] = i + 1;
+    cmdq_len++;
     pthread_mutex_unlock(&cmdqueue_mutex);
-    return -1;
+
+    logmsg(LOG_DEBUG, "QUEUE: Inserted [%u:%s] cmd %s", devid, tag, cmdstr);
+    return i;
 }
 
 /**
@@ -145,74 +230,124 @@ cmdqueue_insert(const int user_sockd, const unsigned devid, const char *tag, con
  */
 int
 cmdqueue_check_reply(const size_t idx, char *replybuff, const size_t maxreply) {
-    _Bool timeout = FALSE;
     if (idx >= MAX_CMDQUEUE_LEN) {
         logmsg(LOG_ERR, "Internal error. Illegal index in cmdqueue_check_reply()");
         return -1;
     }
-    const unsigned ts = cmdq[idx].ts;
-    while (!timeout) {
-        if (cmdq[idx].validreply) {
-            xmb_strncpy(replybuff, cmdq[idx].reply, maxreply);
-            cmdqueue_clridx(idx);
-            return 0;
-        }
-        timeout = (time(NULL) - ts) > CMDQUEUE_TIMEOUT;
-        usleep(100000);
+
+    struct timespec deadline;
+#ifndef __APPLE__
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+    deadline.tv_sec += CMDQUEUE_TIMEOUT;
+
+    int ret = 0;
+    pthread_mutex_lock(&cmdqueue_mutex);
+    while (!cmdq[idx].validreply && ETIMEDOUT != ret) {
+        ret = pthread_cond_timedwait(&cmdq[idx].cond, &cmdqueue_mutex, &deadline);
+    }
+    const _Bool gotreply = cmdq[idx].validreply;
+    if (gotreply) {
+        xmb_strncpy(replybuff, cmdq[idx].reply, maxreply);
     }
+    pthread_mutex_unlock(&cmdqueue_mutex);
+
     cmdqueue_clridx(idx);
-    return -1;
+    return gotreply ? 0 : -1;
 }
 
-/*
- * Return a pointer to the specified command queue
- * @param idx Index in queue
- * @param[out] entry A pointer to a command queue entry
- * @return 0 on success, -1 if index does not exist
+/**
+ * Wait until any of the specified commands has received a reply. The commands
+ * must have been inserted with cmdqueue_insert_notify() using the same
+ * notify condition. The reply itself is then read with cmdqueue_check_reply()
+ * which returns immediately.
+ * @param idx Command queue indexes to wait for. Negative indexes are ignored.
+ * @param n Number of indexes
+ * @param notify The condition given when the commands were inserted
+ * @param timeout_ms Maximum time to wait
+ * @return The position in idx of a command with a reply, -1 on timeout
  */
-/*
 int
-cmdqueue_get(size_t idx,struct cmdqueue_t **entry) {
-    if( cmdq_len >= MAX_CMDQUEUE_LEN ) {
-        logmsg(LOG_ERR,"Trying to read past command queue end");
-        return -1;
+cmdqueue_wait_any(const int *idx, const size_t n, pthread_cond_t *notify, const unsigned timeout_ms) {
+    struct timespec deadline;
+#ifndef __APPLE__
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+#else
+    clock_gettime(CLOCK_REALTIME, &deadline);
+#endif
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
-    // Sanity check
-    if( 0 == cmdq[idx].devid || 0 == cmdq[idx].user_sockd) {
-        logmsg(LOG_ERR,"Command queue entry seems to be empty");
-        return -1;
+
+    int found = -1;
+    int ret = 0;
+    pthread_mutex_lock(&cmdqueue_mutex);
+    while (-1 == found) {
+        for (size_t i = 0; i < n && -1 == found; i++) {
+            if (idx[i] >= 0 && idx[i] < MAX_CMDQUEUE_LEN && cmdq[idx[i]].validreply) {
+                found = (int) i;
+            }
+        }
+        if (-1 == found) {
+            if (ETIMEDOUT == ret) {
+                break;
+            }
+            ret = pthread_cond_timedwait(notify, &cmdqueue_mutex, &deadline);
+        }
     }
- *entry = &cmdq[idx];
-    return 0;
+    pthread_mutex_unlock(&cmdqueue_mutex);
+    return found;
 }
- */
 
 /**
- * Search the command queue for a matching command for the given device id
+ * Store the reply from a device in the matching command in the queue and
+ * wake up the thread waiting for the reply.
+ * If the reply has no tag the oldest outstanding command to the device without
+ * a tag is used and if there is no such command any outstanding command to
+ * the device.
  * @param devid Device id of device we were sending this command to
  * @param tag Optional tag in command
- * @param[out] entry This is set to the found entry in queue
+ * @param reply The reply from the device
  * @return 0 if found, -1 if not found
  */
 int
-cmdqueue_match(const unsigned devid, const char *tag, struct cmdqueue_t **entry) {
-    logmsg(LOG_DEBUG, "QUEUE: Searching for match: [%u:\"%s\"]", devid, tag);
-    _Bool found = FALSE;
-    for (size_t i = 0; !found && i < MAX_CMDQUEUE_LEN; i++) {
-        logmsg(LOG_DEBUG, "QUEUE: Comparing to [%u:\"%s\"]", cmdq[i].devid, cmdq[i].tag);
-        if (cmdq[i].devid && cmdq[i].devid == devid) {
-            if (*tag) {
-                if (0 == strcmp(tag, cmdq[i].tag)) {
-                    found = TRUE;
-                    *entry = &cmdq[i];
-                }
-            } else {
-                found = TRUE;
-                *entry = &cmdq[i];
+cmdqueue_set_reply(const unsigned devid, const char *tag, const char *reply) {
+    size_t found = 0;
+
+    pthread_mutex_lock(&cmdqueue_mutex);
+    // The bucket is searched to the end since the oldest matching command
+    // is last in the chain
+    for (size_t i = cmdq_hash[_cmdqueue_bucket(devid, tag)]; i; i = cmdq[i - 1].next) {
+        if (cmdq[i - 1].devid == devid && !cmdq[i - 1].validreply && 0 == strcmp(tag, cmdq[i - 1].tag)) {
+            found = i;
+        }
+    }
+    if (0 == found && '\0' == *tag) {
+        for (size_t i = 0; 0 == found && i < MAX_CMDQUEUE_LEN; i++) {
+            if (cmdq[i].devid == devid && cmdq[i].ts && !cmdq[i].validreply) {
+                found = i + 1;
             }
         }
     }
-    logmsg(LOG_DEBUG, "QUEUE Match result: %d", (int) found);
+    if (found) {
+        struct cmdqueue_t *entry = &cmdq[found - 1];
+        xmb_strncpy(entry->reply, reply, sizeof (entry->reply) - 1);
+        entry->validreply = TRUE;
+        pthread_cond_signal(&entry->cond);
+        if (entry->notify) {
+            pthread_cond_broadcast(entry->notify);
+        }
+        logmsg(LOG_DEBUG, "Matching cmd: [%u:%s] \"%s\" ts=%lu, sock=%d",
+                entry->devid, entry->tag, entry->cmd, entry->ts, entry->user_sockd);
+    }
+    pthread_mutex_unlock(&cmdqueue_mutex);
+
+    logmsg(LOG_DEBUG, "QUEUE Match result for [%u:\"%s\"]: %d", devid, tag, found ? 1 : 0);
     return found ? 0 : -1;
 }
 
@@ -223,14 +358,35 @@ cmdqueue_match(const unsigned devid, const char *tag, struct cmdqueue_t **entry)
  */
 int
 cmdqueue_clridx(const size_t idx) {
-    if (idx < MAX_CMDQUEUE_LEN) {
-        pthread_mutex_lock(&cmdqueue_mutex);
-        memset(cmdq + idx, 0, sizeof (struct cmdqueue_t));
+    if (idx >= MAX_CMDQUEUE_LEN) {
+        return -1;
+    }
+    pthread_mutex_lock(&cmdqueue_mutex);
+    if (0 == cmdq[idx].ts) {
+        // Already cleared
         pthread_mutex_unlock(&cmdqueue_mutex);
-        return 0;
-    } else {
         return -1;
     }
+
+    // Unlink from the hash chain and put the entry on the free list
+    size_t *link = &cmdq_hash[_cmdqueue_bucket(cmdq[idx].devid, cmdq[idx].tag)];
+    while (*link && *link != idx + 1) {
+        link = &cmdq[*link - 1].next;
+    }
+    if (*link) {
+        *link = cmdq[idx].next;
+    }
+    cmdq[idx].devid = 0;
+    cmdq[idx].ts = 0;
+    cmdq[idx].user_sockd = 0;
+    cmdq[idx].validreply = FALSE;
+    cmdq[idx].notify = NULL;
+    *cmdq[idx].tag = '\0';
+    cmdq[idx].next = cmdq_free;
+    cmdq_free = idx + 1;
+    cmdq_len--;
+    pthread_mutex_unlock(&cmdqueue_mutex);
+    return 0;
 }
 
 /**
@@ -617,33 +773,13 @@ set_gprs_device_target_by_nickname(struct client_info *cli_info, const char *nic
 }
 
 /**
- * Sends the specified command to the device over GPRS
- * The device is connected on the specified socket which we use to
- * send the command over. Since the reply also comes over a socket at
- * a later time we insert the ID of this command in the cmd queue
- * which is used in the tracker thread to match a reply from the tracker
- * with this command once it comes back.
- * @param[in] cli_info Client info structure that holds information about the current
- *                 command client that is connecting to us in this thread. Among
- *                 other things this structure stores the socket used to communicate bac
- *                 to the client as well as information about which device the client
- *                 has set as target device.
- * @param[in] cmd Command string to send to the device (including "\r\n")
- * @param[in] tagbuff The tag-id used in the command
- * @param[out] replybuff Reply from device, If replybuff is NULL then ignore
- * the reply read back from the device and just return
- * @param[in] maxreply Maximum size of replybuff
- * @return -1 on failure, 0 on success
+ * Check that the device the client has as GPRS target is still connected.
+ * If not the target is reset to USB.
+ * @param cli_info Client context
+ * @return 0 if connected, -1 otherwise
  */
-int
-send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const char *tagbuff, char *replybuff, size_t maxreply) {
-
-    const int sockd = cli_info->cli_socket;
-
-    char cmdbuff[1024];
-    snprintf(cmdbuff, sizeof (cmdbuff), "%s\r\n", cmd);
-
-    // First check if this client is still connected
+static int
+_gprs_target_connected(struct client_info *cli_info) {
     _Bool found = FALSE;
     for (size_t i = 0; i < max_clients && !found; i++) {
         found = (client_info_list[i].cli_devid == cli_info->target_deviceid &&
@@ -652,10 +788,27 @@ send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const
 
     if (!found) {
         logmsg(LOG_ERR, "Device is no longer connected (%u). Resetting target device to USB", cli_info->target_deviceid);
-        _writef(sockd, "[ERR] Device is no longer connected.");
+        _writef(cli_info->cli_socket, "[ERR] Device is no longer connected.");
         set_gprs_device_target_by_index(cli_info, -1);
         return -1;
     }
+    return 0;
+}
+
+/**
+ * Put a command in the command queue and send it to the device over GPRS
+ * without waiting for the reply
+ * @param cli_info Client context
+ * @param cmd Command string to send to the device (without "\r\n")
+ * @param tagbuff The tag-id used in the command
+ * @return The command queue index to wait on, -1 on failure
+ */
+static int
+_gprs_send_cmd(struct client_info *cli_info, const char *cmd, const char *tagbuff) {
+    const int sockd = cli_info->cli_socket;
+
+    char cmdbuff[1024];
+    snprintf(cmdbuff, sizeof (cmdbuff), "%s\r\n", cmd);
 
     // Insert this command in the device queue so that the tracker
     // thread can match this command when the reply comes back
@@ -669,8 +822,25 @@ send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const
     if (rc != (int) strlen(cmdbuff)) {
         logmsg(LOG_ERR, "Failed to send command to device");
         _writef(sockd, "[ERR] Could not write to device.");
+        cmdqueue_clridx(cmdqueue_idx);
         return -1;
     }
+    return cmdqueue_idx;
+}
+
+/**
+ * Wait for the reply to a command sent with _gprs_send_cmd() and handle it
+ * @param cli_info Client context
+ * @param cmdqueue_idx Command queue index returned by _gprs_send_cmd()
+ * @param tagbuff The tag-id used in the command
+ * @param[out] replybuff Reply from device, If replybuff is NULL then ignore
+ * the reply read back from the device and just return
+ * @param[in] maxreply Maximum size of replybuff
+ * @return -1 on failure, 0 on success
+ */
+static int
+_gprs_wait_reply(struct client_info *cli_info, const int cmdqueue_idx, const char *tagbuff, char *replybuff, size_t maxreply) {
+    const int sockd = cli_info->cli_socket;
 
     // Now wait until we get a reply in the tracker thread or until
     // we get a timeout
@@ -686,7 +856,7 @@ send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const
 
     // Drop ending "\r\n"
     size_t _len = strlen(reply);
-    if (reply[_len - 2] != '\r' || reply[_len - 1] != '\n') {
+    if (_len < 2 || reply[_len - 2] != '\r' || reply[_len - 1] != '\n') {
         logmsg(LOG_DEBUG, "Was expecting device reply to end with \"\\r\\n\"");
         _writef(sockd, "[ERR] Unknown device reply.");
         return -1;
@@ -694,7 +864,7 @@ send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const
     reply[_len - 2] = '\0';
 
 
-    rc = handle_device_reply(sockd, reply, tagbuff);
+    int rc = handle_device_reply(sockd, reply, tagbuff);
     if (0 == rc) {
         if (replybuff != NULL && maxreply > 0) {
             snprintf(replybuff, maxreply, "%s", reply);
@@ -704,6 +874,40 @@ send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const
     return rc;
 }
 
+/**
+ * Sends the specified command to the device over GPRS
+ * The device is connected on the specified socket which we use to
+ * send the command over. Since the reply also comes over a socket at
+ * a later time we insert the ID of this command in the cmd queue
+ * which is used in the tracker thread to match a reply from the tracker
+ * with this command once it comes back.
+ * @param[in] cli_info Client info structure that holds information about the current
+ *                 command client that is connecting to us in this thread. Among
+ *                 other things this structure stores the socket used to communicate bac
+ *                 to the client as well as information about which device the client
+ *                 has set as target device.
+ * @param[in] cmd Command string to send to the device (including "\r\n")
+ * @param[in] tagbuff The tag-id used in the command
+ * @param[out] replybuff Reply from device, If replybuff is NULL then ignore
+ * the reply read back from the device and just return
+ * @param[in] maxreply Maximum size of replybuff
+ * @return -1 on failure, 0 on success
+ */
+int
+send_rawcmd_reply_over_gprs(struct client_info *cli_info, const char *cmd, const char *tagbuff, char *replybuff, size_t maxreply) {
+
+    if (-1 == _gprs_target_connected(cli_info)) {
+        return -1;
+    }
+
+    int cmdqueue_idx = _gprs_send_cmd(cli_info, cmd, tagbuff);
+    if (cmdqueue_idx < 0) {
+        return -1;
+    }
+
+    return _gprs_wait_reply(cli_info, cmdqueue_idx, tagbuff, replybuff, maxreply);
+}
+
 /**
  * Sends the specified command to the device over the virtual serial port and wait for
  * reply.
@@ -849,6 +1053,149 @@ send_rawcmd(struct client_info *cli_info, const char *cmd, const char *tagbuff)
     return send_rawcmd_reply(cli_info, cmd, tagbuff, NULL, 0);
 }
 
+/**
+ * Check if a command in a batch must be sent on its own, i.e. not while any
+ * other command is waiting for a reply. Commands without a tag cannot be
+ * told apart when the reply comes back. An empty command is never sent.
+ * @param cmd Command
+ * @return TRUE if the command must be sent on its own
+ */
+static inline _Bool
+_batch_cmd_alone(const struct devcmd_batch *cmd) {
+    return *cmd->cmd && (cmd->barrier || '\0' == *cmd->tag);
+}
+
+/**
+ * Send a sequence of commands to the device. Over GPRS up to gprs_cmd_window
+ * commands are kept in flight and a new command is sent as soon as the reply
+ * to the oldest command has arrived. The replies are matched back to the
+ * commands by their tag. Over USB the commands are sent one at a time.
+ * The commands are always completed in order. The result for each command is
+ * stored in the rc field of the command and the reply in the reply field.
+ * Commands with an empty command string are not sent and fail.
+ * @param cli_info Client context
+ * @param cmds The commands to send
+ * @param ncmds Number of commands
+ * @param stop_on_error TRUE to send no more commands after the first failed
+ * command, FALSE to send all commands
+ * @param cb Optional callback that is called as each command completes
+ * @param cb_arg Argument passed on to the callback
+ * @return 0 if all commands succeeded, -1 otherwise
+ */
+int
+send_rawcmd_batch(struct client_info *cli_info, struct devcmd_batch *cmds, const size_t ncmds, const _Bool stop_on_error,
+                  void (*cb)(struct devcmd_batch *, void *), void *cb_arg) {
+    _Bool failed = FALSE;
+    for (size_t i = 0; i < ncmds; i++) {
+        cmds[i].rc = -1;
+        *cmds[i].reply = '\0';
+    }
+
+    if (cli_info->target_socket <= 0 || cli_info->target_cli_idx < 0) {
+        for (size_t i = 0; i < ncmds; i++) {
+            if (*cmds[i].cmd) {
+                cmds[i].rc = send_rawcmd_reply(cli_info, cmds[i].cmd, cmds[i].tag, cmds[i].reply, sizeof (cmds[i].reply));
+            }
+            if (cb) {
+                cb(&cmds[i], cb_arg);
+            }
+            if (cmds[i].rc) {
+                failed = TRUE;
+                if (stop_on_error) {
+                    break;
+                }
+            }
+        }
+        return failed ? -1 : 0;
+    }
+
+    if (-1 == _gprs_target_connected(cli_info)) {
+        return -1;
+    }
+
+    // Queue index for the commands in flight (indexed by command number modulo the window)
+    int qidx[MAX_GPRS_CMD_WINDOW];
+    size_t window = gprs_cmd_window;
+    if (window < 1) {
+        window = 1;
+    } else if (window > MAX_GPRS_CMD_WINDOW) {
+        window = MAX_GPRS_CMD_WINDOW;
+    }
+    size_t next = 0, done = 0;
+    _Bool stop = FALSE;
+
+    while (done < ncmds) {
+        // Fill up the window
+        while (!stop && next < ncmds && next - done < window &&
+               (next == done || (!_batch_cmd_alone(&cmds[next]) && !_batch_cmd_alone(&cmds[next - 1])))) {
+            int *q = &qidx[next % MAX_GPRS_CMD_WINDOW];
+            *q = -1;
+            if (*cmds[next].cmd) {
+                *q = _gprs_send_cmd(cli_info, cmds[next].cmd, cmds[next].tag);
+                if (*q < 0) {
+                    // The connection is most likely gone so don't try the rest
+                    stop = TRUE;
+                }
+            }
+            next++;
+        }
+        if (done == next) {
+            break;
+        }
+
+        // Wait for the oldest command in flight
+        if (qidx[done % MAX_GPRS_CMD_WINDOW] >= 0) {
+            cmds[done].rc = _gprs_wait_reply(cli_info, qidx[done % MAX_GPRS_CMD_WINDOW], cmds[done].tag,
+                    cmds[done].reply, sizeof (cmds[done].reply));
+        }
+        if (cb) {
+            cb(&cmds[done], cb_arg);
+        }
+        if (cmds[done].rc) {
+            failed = TRUE;
+            stop = stop || stop_on_error;
+        }
+        done++;
+    }
+
+    logmsg(LOG_DEBUG, "Sent %zu of %zu commands to device %u (window=%zu)", next, ncmds, cli_info->target_deviceid, window);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Prepare a raw device query command (e.g. "$WP+VER+0001=0000,?") for the
+ * given server command with a new tag so that it can be sent on its own or
+ * as part of a batch of commands.
+ * @param cmd User command
+ * @param evtarg Event id used for the SETEVT command (may be NULL for all
+ * other commands)
+ * @param[out] q The prepared command
+ * @return 0 on success, -1 on failure
+ */
+int
+prepare_cmdquery(const char *cmd, const char *evtarg, struct devcmd_batch *q) {
+    char pinbuff[16];
+
+    memset(q, 0, sizeof (*q));
+    if (-1 == get_device_pin(pinbuff, sizeof (pinbuff)) ||
+            -1 == get_device_tag(q->tag, sizeof (q->tag))) {
+        return -1;
+    }
+    char rawcmd[16];
+    if (-1 == get_devcmd_from_srvcmd(cmd, sizeof (rawcmd), rawcmd)) {
+        logmsg(LOG_ERR, "_dev_cmd_help(): Cannot find user command %s", cmd);
+        return -1;
+    }
+
+    if (0 == strcmp("SETEVT", rawcmd)) {
+        snprintf(q->cmd, sizeof (q->cmd), "$WP+%s+%s=%s,%s,?", rawcmd, q->tag, pinbuff, evtarg ? evtarg : "");
+        logmsg(LOG_DEBUG, "Handle GFEVT in send_cmdquery_reply() %s", q->cmd);
+    } else {
+        snprintf(q->cmd, sizeof (q->cmd), "$WP+%s+%s=%s,?", rawcmd, q->tag, pinbuff);
+    }
+    return 0;
+}
+
 /**
  * Helper function to send a user device command to the actual device.
  * The function translates the user command to the raw command, sends it
@@ -865,35 +1212,20 @@ send_rawcmd(struct client_info *cli_info, const char *cmd, const char *tagbuff)
  */
 int
 send_cmdquery_reply(struct client_info *cli_info, const char *cmd, char *reply, const size_t maxreply) {
-    char pinbuff[16];
-    char tagbuff[16];
-
-    if (-1 == get_device_pin(pinbuff, sizeof (pinbuff)) ||
-            -1 == get_device_tag(tagbuff, sizeof (tagbuff))) {
-        return -1;
-    }
-    char rawcmd[16];
-    if (-1 == get_devcmd_from_srvcmd(cmd, sizeof (rawcmd), rawcmd)) {
-        logmsg(LOG_ERR, "_dev_cmd_help(): Cannot find user command %s", cmd);
-        return -1;
-    }
-    char devcmd[128];
+    struct devcmd_batch q;
 
     // For the special case of the SETEVT command we also need to specify a event id in the GET command
     // so we use the "reply" argument as input in this special case. This is kludge!!
-    if (0 == strcmp("SETEVT", rawcmd)) {
-        snprintf(devcmd, sizeof (devcmd), "$WP+%s+%s=%s,%s,?", rawcmd, tagbuff, pinbuff, reply);
-        logmsg(LOG_DEBUG, "Handle GFEVT in send_cmdquery_reply() %s", devcmd);
-    } else {
-        snprintf(devcmd, sizeof (devcmd), "$WP+%s+%s=%s,?", rawcmd, tagbuff, pinbuff);
+    if (-1 == prepare_cmdquery(cmd, reply, &q)) {
+        return -1;
     }
 
     // We don't want any output to the user at this level so set sockd to -1 temporarily
     const int old_sockd = cli_info->cli_socket;
     cli_info->cli_socket = -1;
-    logmsg(LOG_DEBUG, "Prepared raw command \"%s\" for USB idx=%zd", devcmd, cli_info->target_usb_idx);
+    logmsg(LOG_DEBUG, "Prepared raw command \"%s\" for USB idx=%zd", q.cmd, cli_info->target_usb_idx);
     *reply = '\0';
-    int rc = send_rawcmd_reply(cli_info, devcmd, tagbuff, reply, maxreply);
+    int rc = send_rawcmd_reply(cli_info, q.cmd, q.tag, reply, maxreply);
     cli_info->cli_socket = old_sockd;
 
     if (-1 == rc) {
@@ -949,10 +1281,85 @@ get_numrec(struct client_info *cli_info, int *numrec) {
     return 0;
 }
 
+/** Size of the buffer used to read the recorded locations from the device */
+#define DLREC_READ_BUFFER 8192
+
+/**
+ * State while streaming the recorded locations from the device to the DB
+ */
+struct dlrec_state {
+    int sockd;              // User socket for progress information
+    FILE *copy;             // Copy of all read data (may be NULL)
+    _Bool got_ok;           // TRUE when the initial "$OK:DLREC" line has been read
+    _Bool finished;         // TRUE when the "Download Completed" line has been read
+    int num_loc;            // Number of locations in device memory
+    int num_queued;         // Number of locations handed over to the DB writer
+    int num_bad;            // Number of malformed lines
+    int progress_mark;      // Number of locations between progress marks
+    int progress_cnt;       // Current progress in percent
+    int progress_next;      // Number of locations when next mark is printed
+    struct dbwriter_token dbres; // Result from the DB writer for our locations
+};
+
+/**
+ * Handle one complete line read from the device during DLREC. The location
+ * is parsed and handed over to the DB writer thread so that the DB is updated
+ * at the same time as we read more data from the device.
+ * @param st Download state
+ * @param line The line without the ending "\r\n"
+ * @return 0 on success, -1 on failure
+ */
+static int
+_dlrec_line(struct dlrec_state *st, const char *line) {
+    if (!st->got_ok) {
+        // Check that the first line is $OK:DLREC+<TAG>=0,0
+        if (line[0] != '$' || line[1] != 'O' || line[2] != 'K') {
+            logmsg(LOG_ERR, "DLREC : Unexpected reply from device \"%s\"", line);
+            return -1;
+        }
+        st->got_ok = TRUE;
+        return 0;
+    }
+    if (0 == xstricmp(line, "$MSG:Download Completed")) {
+        logmsg(LOG_DEBUG, "Got \"Download Completed\" message from device");
+        st->finished = TRUE;
+        return 0;
+    }
+    if ('\0' == *line) {
+        return 0;
+    }
+
+    if (st->copy) {
+        fprintf(st->copy, "%s\r\n", line);
+    }
+
+    struct splitfields flds;
+    struct db_locrec rec;
+    const char *bptr = line;
+    if (1 != db_next_location(&bptr, &flds)) {
+        st->num_bad++;
+        return 0;
+    }
+    db_fill_locrec(&flds, &rec);
+    if (-1 == dbwriter_enqueue_tagged(&rec, &st->dbres)) {
+        return -1;
+    }
+    st->num_queued++;
+
+    if (st->num_queued >= st->progress_next && st->progress_cnt < 100) {
+        _writef(st->sockd, "[%d%%].", st->progress_cnt);
+        logmsg(LOG_DEBUG, "Downloaded ~%d%%", st->progress_cnt);
+        st->progress_cnt += 10;
+        st->progress_next += st->progress_mark;
+    }
+    return 0;
+}
+
 /**
  * Read all internally recorded locations stored in the device internal
- * memory and store them in the database. After a successful read the
- * device internal memory is cleared.
+ * memory and store them in the database. The locations are parsed line by
+ * line as they are read from the device and handed over to the DB writer
+ * thread so the DB is updated while the download is still in progress.
  * @param sockd Socket used for user communication
  * @return 0 on success, -1 on failure
  */
@@ -975,28 +1382,9 @@ get_dlrec_to_db(struct client_info *cli_info) {
     }
     logmsg(LOG_DEBUG, "Number of locations in device memory: %d", num_loc);
 
-    // Get a buffer big enough to hold all locations
-    size_t max_read = 1024 + num_loc * 70;
-    _Bool finished = FALSE;
-
-    char *rbuff = _chk_calloc_exit(max_read);
-    char *bptr = rbuff;
-    size_t cnt = 0;
-    _writef(sockd, "Reading %d locations from device, please wait ...\n", num_loc);
-
-    // We want a mark at each 10:th (i.e. 10%) of the total number of locations
-    // we download. In case there are fewer than 10 locations in total we put a
-    // mark at every locations.
-    int progress_mark = num_loc > 10 ? num_loc / 10 : 1;
-    // Setup for the progress marks.
-    int progress_nread = progress_mark * 66; // To print a progress mark at first read
-    int progress_cnt = 0;
-    int nread;
-
     // Verify that the device is really connected
     if (!is_usb_connected(cli_info->target_usb_idx)) {
         _writef(sockd, "[ERR] Command not possible. Device not connected.");
-        free(rbuff);
         return -1;
     }
 
@@ -1005,19 +1393,19 @@ get_dlrec_to_db(struct client_info *cli_info) {
         logmsg(LOG_ERR, "Cannot get USB device name for index=%zd", cli_info->target_usb_idx);
         return -1;
     }
-    int sfd = serial_open(device, DEVICE_BAUD_RATE);
-    if (sfd < 0) {
-        free(rbuff);
-        return -1;
-    }
 
     char pinbuff[16];
     char tagbuff[16];
     if (-1 == get_device_pin(pinbuff, sizeof (pinbuff)) ||
             -1 == get_device_tag(tagbuff, sizeof (tagbuff))) {
-        free(rbuff);
         return -1;
     }
+
+    int sfd = serial_open(device, DEVICE_BAUD_RATE);
+    if (sfd < 0) {
+        return -1;
+    }
+
     char cmdbuff[64];
     snprintf(cmdbuff, sizeof (cmdbuff), "$WP+DLREC+%s=%s,0,0\r\n", tagbuff, pinbuff);
     int rc = serial_write(sfd, cmdbuff, strlen(cmdbuff));
@@ -1026,140 +1414,142 @@ get_dlrec_to_db(struct client_info *cli_info) {
         _writef(sockd, "[ERR] Cannot write command to device.");
         logmsg(LOG_ERR, "Cannot write command to device");
         serial_close(sfd);
-        free(rbuff);
         return -1;
     }
 
-    do {
+    struct dlrec_state st;
+    memset(&st, 0, sizeof (st));
+    st.sockd = sockd;
+    st.num_loc = num_loc;
+    // We want a mark at each 10:th (i.e. 10%) of the total number of locations
+    // we download. In case there are fewer than 10 locations in total we put a
+    // mark at every locations.
+    st.progress_mark = num_loc > 10 ? num_loc / 10 : 1;
+    st.progress_next = 0; // To print a progress mark at first location
 
-        nread = serial_read_timeout(sfd, max_read, bptr, 5000); // 5s timeout
+    _writef(sockd, "Storing a copy of read locations in \"%s\" ...\n", LAST_DLREC_FILE);
+    st.copy = fopen(LAST_DLREC_FILE, "w");
+    if (NULL == st.copy) {
+        logmsg(LOG_ERR, "Cannot open \"%s\" ( %d : %s )", LAST_DLREC_FILE, errno, strerror(errno));
+    }
 
+    _writef(sockd, "Reading %d locations from device, please wait ...\n", num_loc);
+    if (use_address_lookup) {
+        _writef(sockd, "Updating DB while reading. Address lookup used  ...\n");
+    }
+
+    // Only a partial line is ever kept between two reads so the buffer never
+    // has to be larger than the longest line plus one read
+    char rbuff[DLREC_READ_BUFFER + 1];
+    size_t rlen = 0;
+    rc = 0;
+    while (0 == rc && !st.finished) {
+
+        if (rlen >= DLREC_READ_BUFFER) {
+            logmsg(LOG_ERR, "DLREC : Line too long in data from device");
+            _writef(sockd, "\n[ERR] Corrupt data read from device.");
+            rc = -1;
+            break;
+        }
+
+        int nread = serial_read_timeout(sfd, DLREC_READ_BUFFER - rlen, rbuff + rlen, 5000); // 5s timeout
         if (nread < 0) {
             logmsg(LOG_ERR, "Error while reading recorded positions");
             _writef(sockd, "\n[ERR] Error while reading from device.");
-            serial_close(sfd);
-            free(rbuff);
-            return -1;
-        }
-        *(bptr + nread) = '\0';
-
-        const size_t len = strlen(bptr);
-        static const char *END_STR = "$MSG:Download Completed\r\n";
-        const size_t elen = strlen(END_STR);
-        // Check for end indicated by "$Download Completed" string as the
-        if (len >= elen && 0 == xstricmp(bptr + len - elen, END_STR)) {
-            logmsg(LOG_DEBUG, "Got \"Download Completed\" message from device");
-            finished = TRUE;
-            nread -= elen; // We don't want the end mark to be included
+            rc = -1;
+            break;
         }
-        bptr += nread;
-        max_read -= nread;
-        progress_nread += nread;
-
-        // Each location string is approx 66 chars long so if we want a mark
-        // for every 1000 locations then we need to count up to 660000
-        if (progress_nread > progress_mark * 66) {
-            _writef(sockd, "[%d%%].", progress_cnt);
-            logmsg(LOG_DEBUG, "Downloaded ~%d%%", progress_cnt);
-            progress_cnt += 10;
-            progress_nread = 0;
+        rlen += nread;
+        rbuff[rlen] = '\0';
+
+        // Handle all complete lines and keep any partial line for the next read
+        char *line = rbuff;
+        char *eol;
+        while (0 == rc && !st.finished && NULL != (eol = strstr(line, "\r\n"))) {
+            *eol = '\0';
+            rc = _dlrec_line(&st, line);
+            line = eol + 2;
         }
-        cnt++;
+        rlen -= line - rbuff;
+        memmove(rbuff, line, rlen);
+    }
 
-    } while (!finished && max_read > 0);
+    if (st.copy) {
+        fclose(st.copy);
+    }
 
-    _writef(sockd, "[100%%]\n");
+    if (0 == rc) {
+        _writef(sockd, "[100%%]\n");
+    }
 
     snprintf(cmdbuff, sizeof (cmdbuff), "$WP+SPDLREC+%s=%s\r\n", tagbuff, pinbuff);
-    rc = serial_write(sfd, cmdbuff, strlen(cmdbuff));
-
-    serial_close(sfd);
-
-    if (-1 == rc) {
+    if (-1 == serial_write(sfd, cmdbuff, strlen(cmdbuff))) {
         logmsg(LOG_ERR, "Failed to write stop download command to device");
     }
+    serial_close(sfd);
 
-    if (max_read <= 0) {
-        _writef(sockd, "[ERR] Internal error. Buffer to read data from device too small");
-        logmsg(LOG_ERR, "DLREC : Buffer to read data from device too small!");
-        free(rbuff);
-        return -1;
-    }
-
-    *bptr = '\0';
-    _writef(sockd, "Storing a copy of read locations in \"%s\" ...\n", LAST_DLREC_FILE);
+    const time_t t2 = time(NULL);
 
-    (void) _wbuff2file(LAST_DLREC_FILE, rbuff, strlen(rbuff));
+    // Wait for the DB writer to store the remaining locations. This is done even
+    // if the download failed so the locations read so far are kept.
+    // The result is collected in our own token so rows stored at the same
+    // time by other connections are not counted
+    if (st.num_queued > 0) {
+        _writef(sockd, "Updating DB ...\n");
+    }
+    int src = dbwriter_sync();
 
-    // Check that the first line is $OK:DLREC+<TAG>=0,0
-    bptr = rbuff;
-    if (*bptr != '$' || *(bptr + 1) != 'O' || *(bptr + 2) != 'K') {
-        free(rbuff);
+    if (rc) {
+        if (!st.got_ok) {
+            _writef(sockd, "[ERR] Corrupt data read from device.");
+        }
         return -1;
     }
-    while (*bptr != '\r')
-        bptr++;
-    bptr += 2;
-    // Verify that this points to the first character of the first device id
-    if (*bptr != '3' && *bptr != '[') {
-        free(rbuff);
-        _writef(sockd, "[ERR] Corrupt data read from device.");
+
+    if (-1 == src) {
+        _writef(sockd, "[ERR] Error storing location update in DB\n");
         return -1;
     }
 
-    const time_t t2 = time(NULL);
+    if (st.num_bad > 0) {
+        logmsg(LOG_ERR, "DLREC : Skipped %d malformed locations from device", st.num_bad);
+        _writef(sockd, "Skipped %d malformed locations.\n", st.num_bad);
+    }
+    if (st.dbres.errors > 0) {
+        _writef(sockd, "[ERR] %lu locations could not be stored. See log for more information.\n",
+                st.dbres.errors);
+    }
 
-    if (0 == strlen(bptr)) {
+    if (0 == st.num_queued) {
         _writef(sockd, "[ERR] No locations in memory.\n");
     } else {
-        if (use_address_lookup)
-            _writef(sockd, "Updating DB. Address lookup used  ...\n");
-        else
-            _writef(sockd, "Updating DB ...\n");
-        int num = db_store_locations(sockd, num_loc, bptr, NULL, NULL);
-        if (num > 0) {
-            _writef(sockd, "Checking for duplicates ...\n");
-            // Now remove any duplicates
-            char *sql_dedup = "DELETE FROM tbl_track "
-                    "WHERE fld_key NOT IN "
-                    "("
-                    "SELECT MIN(fld_key) "
-                    "FROM tbl_track "
-                    "GROUP BY fld_deviceid,fld_datetime "
-                    ");VACUUM;";
-            int changes;
-            rc = db_exec_sql(sql_dedup, &changes);
-            if (0 == rc) {
-                if (changes > 0) {
-                    _writef(sockd, "%d locations imported, %d duplicates removed (already imported).\n", num, changes);
-                } else {
-                    _writef(sockd, "%d locations imported.\n", num);
-                }
-                const time_t t3 = time(NULL);
-                unsigned t_tot = t3 - t1;
-                unsigned t_dev = t2 - t1;
-                unsigned t_db = t3 - t2;
-
-                if (t_tot > 120) {
-                    unsigned t_tot_min = t_tot / 60;
-                    unsigned t_tot_s = t_tot % 60;
-                    unsigned t_dev_min = t_dev / 60;
-                    unsigned t_dev_s = t_dev % 60;
-                    unsigned t_db_min = t_db / 60;
-                    unsigned t_db_s = t_db % 60;
-                    _writef(sockd, "Total time: %u:%02u min (Device read: %u:%02u min, DB Update: %u:%02u min)\n", t_tot_min, t_tot_s, t_dev_min, t_dev_s, t_db_min, t_db_s);
-                } else {
-                    _writef(sockd, "Total time: %us (Device read: %us, DB Update: %us)\n", t_tot, t_dev, t_db);
-                }
-
-            } else {
-                _writef(sockd, "[ERR] Failed to update DB. See log form more information.");
-            }
+        // Rows already in the DB are ignored by the writer (unique index on
+        // device and timestamp) so there is no need for a separate dedup pass
+        const unsigned long ndup = st.dbres.duplicates;
+        const int num = (int) st.dbres.stored;
+        if (ndup > 0) {
+            _writef(sockd, "%d locations read, %d new locations imported, %lu duplicates skipped (already imported).\n",
+                    st.num_queued, num, ndup);
         } else {
-            _writef(sockd, "[ERR] Error storing location update in DB\n");
+            _writef(sockd, "%d locations imported.\n", num);
+        }
+        const time_t t3 = time(NULL);
+        unsigned t_tot = t3 - t1;
+        unsigned t_dev = t2 - t1;
+        unsigned t_db = t3 - t2;
+
+        if (t_tot > 120) {
+            unsigned t_tot_min = t_tot / 60;
+            unsigned t_tot_s = t_tot % 60;
+            unsigned t_dev_min = t_dev / 60;
+            unsigned t_dev_s = t_dev % 60;
+            unsigned t_db_min = t_db / 60;
+            unsigned t_db_s = t_db % 60;
+            _writef(sockd, "Total time: %u:%02u min (Device read: %u:%02u min, DB Update after read: %u:%02u min)\n", t_tot_min, t_tot_s, t_dev_min, t_dev_s, t_db_min, t_db_s);
+        } else {
+            _writef(sockd, "Total time: %us (Device read: %us, DB Update after read: %us)\n", t_tot, t_dev, t_db);
         }
     }
-    free(rbuff);
     return 0;
 }
 
@@ -45,7 +45,30 @@ struct cmdqueue_t {
     /** Reply from device */
     char reply[1024];
     /** Indicate that we have a valid reply */
-    volatile _Bool validreply;
+    _Bool validreply;
+    /** Signalled when the reply has been received */
+    pthread_cond_t cond;
+    /** Next entry (index + 1) in the same hash bucket or in the free list */
+    size_t next;
+    /** Optional extra condition signalled when the reply has been received */
+    pthread_cond_t *notify;
+};
+
+/** Upper limit for the number of commands in flight to one GPRS device */
+#define MAX_GPRS_CMD_WINDOW 32
+
+/** A command that is sent to a device as part of a batch of commands */
+struct devcmd_batch {
+    /** Raw command string (without "\r\n") */
+    char cmd[128];
+    /** Tag used in the command (empty if the command is untagged) */
+    char tag[16];
+    /** Do not send this command while other commands are in flight */
+    _Bool barrier;
+    /** Result of the command, 0 on success and -1 on failure */
+    int rc;
+    /** Reply from device */
+    char reply[1024];
 };
 
 void
@@ -54,11 +77,20 @@ cmdqueue_init(void);
 int
 cmdqueue_insert(const int user_sockd, const unsigned devid, const char *tag, const char *cmdstr);
 
-//int
-//cmdqueue_get(size_t idx,struct cmdqueue_t **entry);
+int
+cmdqueue_insert_notify(const int user_sockd, const unsigned devid, const char *tag, const char *cmdstr, pthread_cond_t *notify);
+
+void
+cmdqueue_notify_init(pthread_cond_t *notify);
 
 int
-cmdqueue_match(const unsigned devid, const char *tag, struct cmdqueue_t **entry);
+cmdqueue_wait_any(const int *idx, const size_t n, pthread_cond_t *notify, const unsigned timeout_ms);
+
+int
+cmdqueue_check_reply(const size_t idx, char *replybuff, const size_t maxreply);
+
+int
+cmdqueue_set_reply(const unsigned devid, const char *tag, const char *reply);
 
 int
 cmdqueue_clridx(const size_t idx);
@@ -81,6 +113,13 @@ send_rawcmd_reply(struct client_info *cli_info, const char *cmd, const char *tag
 int
 send_rawcmd(struct client_info *cli_info, const char *cmd, const char *tagbuff);
 
+int
+send_rawcmd_batch(struct client_info *cli_info, struct devcmd_batch *cmds, const size_t ncmds, const _Bool stop_on_error,
+                  void (*cb)(struct devcmd_batch *, void *), void *cb_arg);
+
+int
+prepare_cmdquery(const char *cmd, const char *evtarg, struct devcmd_batch *q);
+
 int
 send_cmdquery_reply(struct client_info *cli_info, const char *cmd,char *reply, const size_t maxreply);
 
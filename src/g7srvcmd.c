@@ -52,8 +52,15 @@
 #include "libunitbl/unicode_tbl.h"
 #include "geoloc.h"
 #include "geoloc_cache.h"
+#include "dbwriter.h"
+#include "mailqueue.h"
+#include "maildigest.h"
+#include "scriptpool.h"
+#include "plugins.h"
 #include "mailutil.h"
 #include "g7pdf_report_view.h"
+#include "g7bcast.h"
+#include "geoworker.h"
 
 
 /**
@@ -95,6 +102,44 @@ struct srvcmd_help srvcmd_help_list [] = {
        "",
        ""
     },    
+    {"dbstat",
+       "Print information about the DB writer queue and commit times",
+       "",
+       "",
+       ""
+    },
+    {"mailstat",
+       "Print information about the mail queue and mail delivery times",
+       "",
+       "",
+       ""
+    },
+    {"scriptstat",
+       "Print information about the event script queue and script run times",
+       "",
+       "",
+       ""
+    },
+    {"pluginstat",
+       "Print information about the loaded event handler plugins, the plugin\n"
+       "event queue and the time spent in each plugin",
+       "",
+       "",
+       ""
+    },
+    {"bcast",
+       "Send the same command to many GPRS connected devices at once.\n"
+       "The result from each device is printed as soon as it arrives and the\n"
+       "command finishes with a summary table for all devices.",
+       "targets (get cmd|@@func(arg1,arg2,...))",
+       "targets     - \"all\" for all connected devices, a device id range \"id1-id2\"\n"
+       "              or a comma separated list of nick names and device ids\n"
+       "get cmd     - Query the command \"cmd\" (same as the \"get\" command)\n"
+       "@@func(...) - Set command in function form (same as in presets)",
+       "\".bcast all get ver\"            - Get firmware version from all connected devices\n"
+       "\".bcast mycar,mybike get loc\"   - Get location from two devices\n"
+       "\".bcast 3000000001-3000000099 @@roam(1)\" - Enable roaming on a range of devices"
+    },
     {"target",
         "Specify which target device to use to send commands to.\n"
         "The target is specified as either the client number (as listed by \".lc\" command)\n"
@@ -588,6 +633,321 @@ _srv_cache_stat(struct client_info *cli_info) {
 }
 #pragma clang diagnostic pop
 #pragma GCC diagnostic pop
+
+/**
+ * Display the DB writer queue and commit statistics to the user
+ * @param cli_info Client context
+ */
+#define DBSTAT_ROWS 11
+void
+_srv_db_stat(struct client_info *cli_info) {
+
+    const int sockd = cli_info->cli_socket;
+    struct dbwriter_stat stat;
+    dbwriter_get_stat(&stat);
+
+    char *tdata[(DBSTAT_ROWS + 1) * 2];
+    char valbuff[VALBUFF_LEN];
+    size_t row = 0;
+
+    tdata[row * 2 + 0] = strdup("  Writer ");
+    tdata[row * 2 + 1] = strdup("  Value ");
+    row++;
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_len);
+    tdata[row * 2 + 0] = strdup(" Queued rows ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_size);
+    tdata[row * 2 + 0] = strdup(" Queue size ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_peak);
+    tdata[row * 2 + 0] = strdup(" Queue peak ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.full_waits);
+    tdata[row * 2 + 0] = strdup(" Waits on full queue ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.rows);
+    tdata[row * 2 + 0] = strdup(" Stored rows ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.errors);
+    tdata[row * 2 + 0] = strdup(" Failed rows ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.duplicates);
+    tdata[row * 2 + 0] = strdup(" Duplicates skipped ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.batches);
+    tdata[row * 2 + 0] = strdup(" Batches ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.retries);
+    tdata[row * 2 + 0] = strdup(" Retries on locked DB ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%.1f / %.1f ", stat.commit_avg_ms, stat.commit_max_ms);
+    tdata[row * 2 + 0] = strdup(" Commit avg/max (ms) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%.1f / %.1f ", stat.latency_avg_ms, stat.latency_max_ms);
+    tdata[row * 2 + 0] = strdup(" Latency avg/max (ms) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    table_t *t = utable_create_set(row, 2, tdata);
+    utable_set_table_halign(t, RIGHTALIGN);
+    utable_set_row_halign(t, 0, CENTERALIGN);
+    utable_set_col_halign(t, 0, LEFTALIGN);
+    utable_set_interior(t, TRUE, FALSE);
+    if (cli_info->use_unicode_table) {
+        utable_stroke(t, sockd, TSTYLE_DOUBLE_V4);
+    } else {
+        utable_stroke(t, sockd, TSTYLE_ASCII_V2);
+    }
+    utable_free(t);
+    for (size_t i = 0; i < row * 2; i++) {
+        free(tdata[i]);
+    }
+}
+/**
+ * Display the mail queue statistics to the user
+ * @param cli_info Client context
+ */
+#define MAILSTAT_ROWS 11
+void
+_srv_mail_stat(struct client_info *cli_info) {
+
+    const int sockd = cli_info->cli_socket;
+    struct mailqueue_stat stat;
+    mailqueue_get_stat(&stat);
+    struct maildigest_stat dstat;
+    maildigest_get_stat(&dstat);
+
+    char *tdata[(MAILSTAT_ROWS + 1) * 2];
+    char valbuff[VALBUFF_LEN];
+    size_t row = 0;
+
+    tdata[row * 2 + 0] = strdup("  Mail queue ");
+    tdata[row * 2 + 1] = strdup("  Value ");
+    row++;
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_len);
+    tdata[row * 2 + 0] = strdup(" Queued mails ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_peak);
+    tdata[row * 2 + 0] = strdup(" Queue peak ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%u / %u ", stat.inflight, stat.workers);
+    tdata[row * 2 + 0] = strdup(" Sending / workers ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.sent);
+    tdata[row * 2 + 0] = strdup(" Sent mails ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.retries);
+    tdata[row * 2 + 0] = strdup(" Retried attempts ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.failed);
+    tdata[row * 2 + 0] = strdup(" Failed mails ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.dropped);
+    tdata[row * 2 + 0] = strdup(" Dropped (queue full) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%.0f / %.0f ", stat.latency_avg_ms, stat.latency_max_ms);
+    tdata[row * 2 + 0] = strdup(" Latency avg/max (ms) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    if (dstat.window) {
+        snprintf(valbuff, sizeof (valbuff), "%u s ", dstat.window);
+    } else {
+        snprintf(valbuff, sizeof (valbuff), "off ");
+    }
+    tdata[row * 2 + 0] = strdup(" Digest window ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu / %zu ", dstat.pending_events, dstat.pending_digests);
+    tdata[row * 2 + 0] = strdup(" Digest events / devices waiting ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu / %lu / %lu ", dstat.digests, dstat.events, dstat.priority);
+    tdata[row * 2 + 0] = strdup(" Digests / events / priority ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    table_t *t = utable_create_set(row, 2, tdata);
+    utable_set_table_halign(t, RIGHTALIGN);
+    utable_set_row_halign(t, 0, CENTERALIGN);
+    utable_set_col_halign(t, 0, LEFTALIGN);
+    utable_set_interior(t, TRUE, FALSE);
+    if (cli_info->use_unicode_table) {
+        utable_stroke(t, sockd, TSTYLE_DOUBLE_V4);
+    } else {
+        utable_stroke(t, sockd, TSTYLE_ASCII_V2);
+    }
+    utable_free(t);
+    for (size_t i = 0; i < row * 2; i++) {
+        free(tdata[i]);
+    }
+}
+
+/**
+ * Display the event script statistics to the user
+ * @param cli_info Client context
+ */
+#define SCRIPTSTAT_ROWS 11
+void
+_srv_script_stat(struct client_info *cli_info) {
+
+    const int sockd = cli_info->cli_socket;
+    struct scriptpool_stat stat;
+    scriptpool_get_stat(&stat);
+
+    char *tdata[(SCRIPTSTAT_ROWS + 1) * 2];
+    char valbuff[VALBUFF_LEN];
+    size_t row = 0;
+
+    tdata[row * 2 + 0] = strdup("  Event scripts ");
+    tdata[row * 2 + 1] = strdup("  Value ");
+    row++;
+
+    snprintf(valbuff, sizeof (valbuff), "%zu / %zu ", stat.queue_len, stat.queue_size);
+    tdata[row * 2 + 0] = strdup(" Queued / max ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_peak);
+    tdata[row * 2 + 0] = strdup(" Queue peak ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%u / %u ", stat.running, stat.workers);
+    tdata[row * 2 + 0] = strdup(" Running / workers ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.runs);
+    tdata[row * 2 + 0] = strdup(" Finished scripts ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.failed);
+    tdata[row * 2 + 0] = strdup(" Failed scripts ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.timeouts);
+    tdata[row * 2 + 0] = strdup(" Stopped (timeout) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.coalesced);
+    tdata[row * 2 + 0] = strdup(" Replaced by newer event ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.dropped);
+    tdata[row * 2 + 0] = strdup(" Dropped (queue full) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%.0f / %.0f ", stat.wait_avg_ms, stat.wait_max_ms);
+    tdata[row * 2 + 0] = strdup(" Wait avg/max (ms) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%.0f / %.0f ", stat.run_avg_ms, stat.run_max_ms);
+    tdata[row * 2 + 0] = strdup(" Run time avg/max (ms) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%s ", stat.watching ? "inotify" : "check each event");
+    tdata[row * 2 + 0] = strdup(" Script lookup ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    table_t *t = utable_create_set(row, 2, tdata);
+    utable_set_table_halign(t, RIGHTALIGN);
+    utable_set_row_halign(t, 0, CENTERALIGN);
+    utable_set_col_halign(t, 0, LEFTALIGN);
+    utable_set_interior(t, TRUE, FALSE);
+    if (cli_info->use_unicode_table) {
+        utable_stroke(t, sockd, TSTYLE_DOUBLE_V4);
+    } else {
+        utable_stroke(t, sockd, TSTYLE_ASCII_V2);
+    }
+    utable_free(t);
+    for (size_t i = 0; i < row * 2; i++) {
+        free(tdata[i]);
+    }
+}
+
+/**
+ * Display the plugin statistics to the user
+ * @param cli_info Client context
+ */
+#define PLUGINSTAT_ROWS (4 + PLUGINS_MAX)
+void
+_srv_plugin_stat(struct client_info *cli_info) {
+
+    const int sockd = cli_info->cli_socket;
+    struct plugins_stat stat;
+    struct plugins_info info[PLUGINS_MAX];
+    const size_t ninfo = plugins_get_stat(&stat, info, PLUGINS_MAX);
+
+    if (0 == stat.nplugins) {
+        _writef(sockd, "No plugins loaded.\n");
+        return;
+    }
+
+    char *tdata[(PLUGINSTAT_ROWS + 1) * 2];
+    char valbuff[VALBUFF_LEN];
+    size_t row = 0;
+
+    tdata[row * 2 + 0] = strdup("  Plugins ");
+    tdata[row * 2 + 1] = strdup("  Value ");
+    row++;
+
+    snprintf(valbuff, sizeof (valbuff), "%zu / %zu ", stat.queue_len, stat.queue_size);
+    tdata[row * 2 + 0] = strdup(" Queued events / max ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%zu ", stat.queue_peak);
+    tdata[row * 2 + 0] = strdup(" Queue peak ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.delivered);
+    tdata[row * 2 + 0] = strdup(" Dispatched events ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    snprintf(valbuff, sizeof (valbuff), "%lu ", stat.dropped);
+    tdata[row * 2 + 0] = strdup(" Dropped (queue full) ");
+    tdata[row++ * 2 + 1] = strdup(valbuff);
+
+    // One row per plugin with the number of calls and the average and
+    // longest time in the plugin
+    char namebuff[sizeof (info[0].name) + sizeof (" calls/avg/max (us) ")];
+    for (size_t i = 0; i < ninfo; i++) {
+        snprintf(namebuff, sizeof (namebuff), " %.*s calls/avg/max (us) ",
+                (int) sizeof (info[i].name) - 1, info[i].name);
+        snprintf(valbuff, sizeof (valbuff), "%lu / %.0f / %.0f ", info[i].calls, info[i].avg_us, info[i].max_us);
+        tdata[row * 2 + 0] = strdup(namebuff);
+        tdata[row++ * 2 + 1] = strdup(valbuff);
+    }
+
+    table_t *t = utable_create_set(row, 2, tdata);
+    utable_set_table_halign(t, RIGHTALIGN);
+    utable_set_row_halign(t, 0, CENTERALIGN);
+    utable_set_col_halign(t, 0, LEFTALIGN);
+    utable_set_interior(t, TRUE, FALSE);
+    if (cli_info->use_unicode_table) {
+        utable_stroke(t, sockd, TSTYLE_DOUBLE_V4);
+    } else {
+        utable_stroke(t, sockd, TSTYLE_ASCII_V2);
+    }
+    utable_free(t);
+    for (size_t i = 0; i < row * 2; i++) {
+        free(tdata[i]);
+    }
+}
+
 /**
  * Internal sever command
  * @param cli_info Client info structure that holds information about the current
@@ -614,6 +974,20 @@ exec_srv_command(struct client_info *cli_info, char *rcmdstr) {
         _srv_date(cli_info->cli_socket);
     } else if (0 < matchcmd("^cachestat" _PR_E, cmdstr, &field)) {
         _srv_cache_stat(cli_info);                
+    } else if (0 < matchcmd("^dbstat" _PR_E, cmdstr, &field)) {
+        _srv_db_stat(cli_info);
+    } else if (0 < matchcmd("^mailstat" _PR_E, cmdstr, &field)) {
+        _srv_mail_stat(cli_info);
+    } else if (0 < matchcmd("^scriptstat" _PR_E, cmdstr, &field)) {
+        _srv_script_stat(cli_info);
+    } else if (0 < matchcmd("^pluginstat" _PR_E, cmdstr, &field)) {
+        _srv_plugin_stat(cli_info);
+    } else if (0 < matchcmd("^bcast" _PR_S _PR_ANL _PR_S "get" _PR_S _PR_AN _PR_E, cmdstr, &field)) {
+        bcast_query(cli_info, field[1], field[2]);
+    } else if (0 < matchcmd("^bcast" _PR_S _PR_ANL _PR_S "@@" _PR_ANF _PR_E, cmdstr, &field)) {
+        char funcbuff[128];
+        snprintf(funcbuff, sizeof (funcbuff), "%s(%s)", field[2], field[3]);
+        bcast_func(cli_info, field[1], funcbuff);
     } else if (0 < matchcmd("^report" _PR_S _PR_FILEPATH _PR_E, cmdstr, &field)) {
         _srv_device_report(cli_info,field[1],NULL, FALSE, TRUE);        
     } else if (0 < matchcmd("^report" _PR_S _PR_FILEPATH _PR_S _PR_ANPS _PR_E, cmdstr, &field)) {
@@ -658,6 +1032,9 @@ exec_srv_command(struct client_info *cli_info, char *rcmdstr) {
         
     } else if (0 < (nf = matchcmd("^lookup" _PR_E, cmdstr, &field))) {
         use_address_lookup = !use_address_lookup;
+        if (use_address_lookup && -1 == geoworker_init()) {
+            logmsg(LOG_ERR, "Unable to start address backfill worker");
+        }
         _writef(sockd,"Address lookup : %s",use_address_lookup ? "on" : "off");
     } else if (0 < (nf = matchcmd("^ld" _PR_E, cmdstr, &field))) {
         _srv_cmd_lc(cli_info, FILTER_DEV_CONNECTIONS);
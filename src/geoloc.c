@@ -352,6 +352,7 @@ parse_result_node(xmlNodePtr node, char *address, size_t maxlen) {
  * @param maxlen
  * @return 0 on success, -1 on general failure, 
  *     0    xml_OK,
+ *   -12    also when the reply has no street address
  *   -11    xml_OverQueryLimit,
  *   -12    xml_ZeroResults,
  *   -13    xml_InvalidRequest,
@@ -443,7 +444,8 @@ parse_reply(char *reply, char *address, size_t maxlen) {
         logmsg(LOG_DEBUG, "Wrote failed geo reply to \"/tmp/failed_georeply.txt\" (Address=%s)", address);
     }
 
-    return -1;
+    // A valid reply without any street address is the same as no result
+    return GOOGLE_STATUS_ZERO;
 }
 
 /**
@@ -631,9 +633,6 @@ _get_minimap_from_latlon(const char *lat, const char *lon, unsigned short zoom,
         free(chunk.memory);
         rc = -1;
     } else {
-        *imagedata = chunk.memory;
-        *datasize = chunk.size;
-
         // Check for a correct PNG header. All valid PNG files has the magic sequence
         // 89 50 4e 47 0d 0a 1a 0a as the first 8 bytes
         static unsigned char png_header[8] = {
@@ -647,6 +646,8 @@ _get_minimap_from_latlon(const char *lat, const char *lon, unsigned short zoom,
         }
 
         if (check_cnt == check_len && chunk.size > 700) {
+            *imagedata = chunk.memory;
+            *datasize = chunk.size;
             update_minimap_cache(lat, lon, zoom, width, height, chunk.size, chunk.memory);
         } else {
             // The reply is not valid PNG image
@@ -34,6 +34,11 @@
 #include <time.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "logger.h"
@@ -59,6 +64,119 @@ static size_t minimap_cache_num=0; // Current number of entries in the cache
 // Prevents wrong usage of cache module if it hasn't been properly initialized at first
 static _Bool isInit = FALSE;
 
+/*
+ * Locking. Each cache has a read/write lock so that any number of lookups can
+ * run in parallel while updates (and evictions) of the cache are serialized.
+ * The statistics are updated on every lookup so they have their own mutex
+ * which is only held for a few instructions. The locks are always taken in
+ * the order cache lock -> stat mutex.
+ */
+static pthread_rwlock_t address_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t minimap_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t cache_stat_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Spatial index for the address cache. The positions are placed in a uniform
+ * grid where the cell size (in degrees latitude) is at least the lookup
+ * proximity. This means that a position within the proximity distance must be
+ * in the same or a neighbouring cell so a lookup only needs to check the few
+ * entries in those cells instead of all entries in the cache. The cells are
+ * stored in a hash table with chaining through the entry index.
+ */
+
+/**
+ * Marks the end of a chain in the grid index
+ */
+#define ADDR_GRID_NONE ((size_t)-1)
+
+/**
+ * Minimum number of meters per degree latitude. Using the minimum makes sure
+ * a cell is never smaller than the proximity distance.
+ */
+#define ADDR_GRID_M_PER_DEG 110000.0
+
+/**
+ * Cell size in degrees used when an exact match is required
+ */
+#define ADDR_GRID_EXACT_CELL 1.0e-5
+
+/**
+ * Grid cell and chain link for each entry in the address cache
+ */
+struct addr_grid_node {
+    long clat;
+    long clon;
+    size_t next;
+};
+
+static size_t *addr_grid_bucket = NULL; // First entry in each bucket
+static size_t addr_grid_nbuckets = 0; // Always a power of 2
+static struct addr_grid_node *addr_grid_node = NULL; // One node per cache entry
+static double addr_grid_cell = ADDR_GRID_EXACT_CELL; // Cell size in degrees
+static int addr_grid_prox = -1; // The proximity the grid was built for
+
+/**
+ * Hash bucket for a grid cell
+ * @param clat Cell row
+ * @param clon Cell column
+ * @return Bucket index
+ */
+static inline size_t
+_addr_grid_hash(const long clat, const long clon) {
+    const unsigned long h = ((unsigned long) clat * 73856093UL) ^ ((unsigned long) clon * 19349663UL);
+    return (size_t) (h & (addr_grid_nbuckets - 1));
+}
+
+/**
+ * Add an address cache entry to the grid index
+ * @param idx Index of entry in address_cache[]
+ */
+static void
+_addr_grid_insert(const size_t idx) {
+    struct addr_grid_node *node = &addr_grid_node[idx];
+    node->clat = (long) floor(address_cache[idx].dLat / addr_grid_cell);
+    node->clon = (long) floor(address_cache[idx].dLon / addr_grid_cell);
+    const size_t b = _addr_grid_hash(node->clat, node->clon);
+    node->next = addr_grid_bucket[b];
+    addr_grid_bucket[b] = idx;
+}
+
+/**
+ * Remove an address cache entry from the grid index. Must be called before
+ * an entry is overwritten.
+ * @param idx Index of entry in address_cache[]
+ */
+static void
+_addr_grid_remove(const size_t idx) {
+    const struct addr_grid_node *node = &addr_grid_node[idx];
+    size_t *link = &addr_grid_bucket[_addr_grid_hash(node->clat, node->clon)];
+    while (ADDR_GRID_NONE != *link) {
+        if (*link == idx) {
+            *link = node->next;
+            return;
+        }
+        link = &addr_grid_node[*link].next;
+    }
+}
+
+/**
+ * Rebuild the grid index from scratch. Needed after the cache has been read
+ * from file and if the lookup proximity has been changed in the config.
+ */
+static void
+_addr_grid_rebuild(void) {
+    addr_grid_prox = address_lookup_proximity;
+    addr_grid_cell = addr_grid_prox > 0 ? addr_grid_prox / ADDR_GRID_M_PER_DEG : ADDR_GRID_EXACT_CELL;
+    for (size_t b = 0; b < addr_grid_nbuckets; b++) {
+        addr_grid_bucket[b] = ADDR_GRID_NONE;
+    }
+    for (size_t i = 0; i < geocache_address_size; i++) {
+        if (address_cache[i].lat) {
+            _addr_grid_insert(i);
+        }
+    }
+}
+
 /**
  * Initialize memory structures for the geolocation cache. The maximum size of the two cache
  * structures are given in the configuration file.
@@ -68,7 +186,16 @@ init_geoloc_cache(void) {
     address_cache = (struct address_cache_t *) _chk_calloc_exit(geocache_address_size * sizeof *address_cache); //calloc(GEOCACHE_ADDRESS_SIZE, sizeof *address_cache );
     minimap_cache = (struct minimap_cache_t *) _chk_calloc_exit(geocache_minimap_size * sizeof *minimap_cache); //calloc(GEOCACHE_MINIMAP_SIZE, sizeof *minimap_cache );
 
+    // Use at least twice as many buckets as entries to keep the chains short
+    addr_grid_nbuckets = 1;
+    while (addr_grid_nbuckets < 2 * (size_t) geocache_address_size) {
+        addr_grid_nbuckets <<= 1;
+    }
+    addr_grid_bucket = (size_t *) _chk_calloc_exit(addr_grid_nbuckets * sizeof *addr_grid_bucket);
+    addr_grid_node = (struct addr_grid_node *) _chk_calloc_exit(geocache_address_size * sizeof *addr_grid_node);
+
     isInit = TRUE;
+    _addr_grid_rebuild();
 }
 
 /**
@@ -80,16 +207,21 @@ init_geoloc_cache(void) {
 static void
 update_cache_stat(enum geo_cache_t geo_cache, _Bool hit, size_t idx) {
     assert(isInit);
+    pthread_mutex_lock(&cache_stat_mutex);
     cache_stats[geo_cache].cache_tot_calls++;
     
     if (idx > cache_stats[geo_cache].cache_max_idx)
         cache_stats[geo_cache].cache_max_idx = idx;
     if (hit)
         cache_stats[geo_cache].cache_hits++;
+
+    const unsigned tot_calls = cache_stats[geo_cache].cache_tot_calls;
+    const unsigned hits = cache_stats[geo_cache].cache_hits;
+    pthread_mutex_unlock(&cache_stat_mutex);
     
     logmsg(LOG_DEBUG,"Updating %s Cache Stats [lookups=%u, hits=%d, idx=%zu]",
             geo_cache==GEOCACHE_ADDR?"Address":"Minimap",
-            cache_stats[geo_cache].cache_tot_calls, cache_stats[geo_cache].cache_hits, idx);    
+            tot_calls, hits, idx);    
 }
 
 /**
@@ -104,7 +236,8 @@ get_cache_entry(enum geo_cache_t geo_cache) {
 }
 
 /**
- * Calculate memory usage (in bytes) for address cache
+ * Calculate memory usage (in bytes) for address cache. The caller must hold
+ * the address cache lock.
  * @return The cache size in bytes
  */
 size_t
@@ -127,7 +260,8 @@ get_addrcache_memusage(void) {
 }
 
 /**
- * Calculate memory usage (in bytes) for minimap cache
+ * Calculate memory usage (in bytes) for minimap cache. The caller must hold
+ * the minimap cache lock.
  * @return The cache size in bytes
  */
 size_t
@@ -161,26 +295,36 @@ get_minimapcache_memusage(void) {
  */
 int
 get_cache_stat(enum geo_cache_t geo_cache, unsigned *tot_call, double *hitrate, double *cache_fill, size_t *musage) {
-    *tot_call = cache_stats[geo_cache].cache_tot_calls;
+    if (geo_cache != GEOCACHE_ADDR && geo_cache != GEOCACHE_MINIMAP) {
+        return -1;
+    }
+
+    pthread_rwlock_t *lock = geo_cache == GEOCACHE_ADDR ? &address_cache_lock : &minimap_cache_lock;
+    pthread_rwlock_rdlock(lock);
+    *musage = geo_cache == GEOCACHE_ADDR ? get_addrcache_memusage() : get_minimapcache_memusage();
+    const size_t cur_idx = geo_cache == GEOCACHE_ADDR ? address_cache_idx : minimap_cache_idx;
+    pthread_rwlock_unlock(lock);
+
+    pthread_mutex_lock(&cache_stat_mutex);
+    const struct geo_cache_stat_t stat = cache_stats[geo_cache];
+    pthread_mutex_unlock(&cache_stat_mutex);
+
+    *tot_call = stat.cache_tot_calls;
      if (*tot_call > 0) {
-         *hitrate = (double) cache_stats[geo_cache].cache_hits / *tot_call;
+         *hitrate = (double) stat.cache_hits / *tot_call;
      } else {
          *hitrate = 0;
      }
     if (geo_cache == GEOCACHE_ADDR) {
-        *cache_fill = (double) cache_stats[geo_cache].cache_max_idx / geocache_address_size;
-        *musage = get_addrcache_memusage();
+        *cache_fill = (double) stat.cache_max_idx / geocache_address_size;
         logmsg(LOG_DEBUG, "GEO ADDRESS: lookups=%u, address_idx=%zu, cache_max_idx=%u", 
-                cache_stats[geo_cache].cache_tot_calls, address_cache_idx, cache_stats[geo_cache].cache_max_idx);
-        return 0;
-    } else if (geo_cache == GEOCACHE_MINIMAP) {     
-        *cache_fill = (double) cache_stats[geo_cache].cache_max_idx / geocache_minimap_size;
-        *musage = get_minimapcache_memusage();
+                stat.cache_tot_calls, cur_idx, stat.cache_max_idx);
+    } else {
+        *cache_fill = (double) stat.cache_max_idx / geocache_minimap_size;
         logmsg(LOG_DEBUG, "GEO MINIMAP: lookups=%u, minimap_idx=%zu, cache_max_idx=%u", 
-                cache_stats[geo_cache].cache_tot_calls, minimap_cache_idx, cache_stats[geo_cache].cache_max_idx);
-        return 0;
+                stat.cache_tot_calls, cur_idx, stat.cache_max_idx);
     }
-    return -1;
+    return 0;
 }
 
 /**
@@ -190,10 +334,14 @@ get_cache_stat(enum geo_cache_t geo_cache, unsigned *tot_call, double *hitrate,
 int 
 get_cache_num(enum geo_cache_t geo_cache, size_t *num, size_t *max_num) {
   if( geo_cache == GEOCACHE_ADDR ) {
+    pthread_rwlock_rdlock(&address_cache_lock);
     *num = address_cache_num;
+    pthread_rwlock_unlock(&address_cache_lock);
     *max_num = geocache_address_size;
   } else if ( geo_cache == GEOCACHE_MINIMAP ) {
+    pthread_rwlock_rdlock(&minimap_cache_lock);
     *num = minimap_cache_num;
+    pthread_rwlock_unlock(&minimap_cache_lock);
     *max_num = geocache_minimap_size;
   } else {
     return -1;
@@ -217,8 +365,11 @@ write_geocache_stat(void) {
         logmsg(LOG_ERR, "Cannot create address geocache saved stat file \"%s\"  ( %d : %s )", fullPath, errno, strerror(errno));
         return -1;
     }
-    fprintf(fp, "%u;%u\n", cache_stats[GEOCACHE_ADDR].cache_tot_calls, cache_stats[GEOCACHE_ADDR].cache_hits);
-    fprintf(fp, "%u;%u\n", cache_stats[GEOCACHE_MINIMAP].cache_tot_calls, cache_stats[GEOCACHE_MINIMAP].cache_hits);
+    pthread_mutex_lock(&cache_stat_mutex);
+    struct geo_cache_stat_t stat[2] = {cache_stats[GEOCACHE_ADDR], cache_stats[GEOCACHE_MINIMAP]};
+    pthread_mutex_unlock(&cache_stat_mutex);
+    fprintf(fp, "%u;%u\n", stat[GEOCACHE_ADDR].cache_tot_calls, stat[GEOCACHE_ADDR].cache_hits);
+    fprintf(fp, "%u;%u\n", stat[GEOCACHE_MINIMAP].cache_tot_calls, stat[GEOCACHE_MINIMAP].cache_hits);
     fclose(fp);
     logmsg(LOG_INFO, "Saved geocache stat to \"%s\"", fullPath);
     return 0;
@@ -259,8 +410,10 @@ read_geocache_stat(void) {
                 tot_calls = xatoi(fields.fld[0]);
                 hits = xatoi(fields.fld[1]);
                 size_t cache = i == 0 ? GEOCACHE_ADDR : GEOCACHE_MINIMAP;
+                pthread_mutex_lock(&cache_stat_mutex);
                 cache_stats[cache].cache_tot_calls = tot_calls;
                 cache_stats[cache].cache_hits = hits;
+                pthread_mutex_unlock(&cache_stat_mutex);
             } else {
                 logmsg(LOG_INFO, "Corrupt file for saved geo cache stat on line %zu", i);
                 fclose(fp);
@@ -272,143 +425,496 @@ read_geocache_stat(void) {
     return 0;
 }
 
+/*
+ * Binary cache file format. The file is mmap'ed at startup and the cache
+ * entries point directly into the mapping so no parsing or copying is needed
+ * and pages (most importantly the minimap images) are only read from disk
+ * when they are first used. The layout is
+ *
+ *   header | record[0] ... record[n-1] | blob
+ *
+ * where the blob holds all strings (NUL terminated) and image data that the
+ * records refer to by their offset from the start of the file. The file
+ * always ends with a NUL byte so that a string at any valid offset is
+ * terminated inside the mapping.
+ */
+
 /**
- * Internal helper function to create a backup file of the index files for the cache
- * @param geo_cache The type of cache we want to backup
- * @return 0 on success, -1 on failure
+ * Version of the binary cache file format. Increase when the layout changes.
+ */
+#define GEOCACHE_BIN_VERSION 1
+#define GEOCACHE_BIN_ADDR_MAGIC "G7ADDRC"
+#define GEOCACHE_BIN_MINIMAP_MAGIC "G7MMAPC"
+
+struct geocache_bin_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t recsize;
+    uint32_t reserved;
+    uint64_t filesize;
+};
+
+struct geocache_bin_addr_rec {
+    int64_t ts;
+    double dLat;
+    double dLon;
+    uint64_t lat_off;
+    uint64_t lon_off;
+    uint64_t addr_off;
+};
+
+struct geocache_bin_minimap_rec {
+    int64_t ts;
+    double dLat;
+    double dLon;
+    uint32_t zoom;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t lat_off;
+    uint64_t lon_off;
+    uint64_t filename_off;
+    uint64_t img_off;
+    uint64_t img_size;
+};
+
+/**
+ * Map a binary cache file read only into memory and verify its header. The
+ * file is mapped once when the cache is read at startup and is never remapped
+ * or unmapped, since cache entries that have not been replaced still point
+ * into it. A new cache file is written under another name and renamed in
+ * place so the existing mapping stays valid.
+ * @param path Full path to the file
+ * @param magic Expected magic string
+ * @param recsize Expected size of each record
+ * @param[out] map Start of mapping
+ * @param[out] mapsize Size of mapping
+ * @param[out] nentries Number of records in the file
+ * @return 0 on success, 1 if the file does not exist, -1 if the file is invalid
  */
 static int
-_create_cache_backup(enum geo_cache_t geo_cache) {
-    
-    char *file, *backupFile;
-    if( geo_cache == GEOCACHE_ADDR ) {
-        file = DEFAULT_ADDRESS_GEOCACHE_FILE;
-        backupFile = DEFAULT_ADDRESS_GEOCACHE_BACKUPFILE;
-    } else {
-        file = DEFAULT_MINIMAP_GEOCACHE_FILE;
-        backupFile = DEFAULT_MINIMAP_GEOCACHE_BACKUPFILE;        
+_map_cache_file(const char *path, const char *magic, const size_t recsize, void **map, size_t *mapsize, size_t *nentries) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (ENOENT == errno) {
+            return 1;
+        }
+        logmsg(LOG_ERR, "Cannot open geo cache file \"%s\" ( %d : %s )", path, errno, strerror(errno));
+        return -1;
     }
-    
+
+    struct stat st;
+    if (-1 == fstat(fd, &st) || (size_t) st.st_size < sizeof (struct geocache_bin_hdr) + 1) {
+        logmsg(LOG_ERR, "Geo cache file \"%s\" is truncated", path);
+        close(fd);
+        return -1;
+    }
+
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == m) {
+        logmsg(LOG_ERR, "Cannot map geo cache file \"%s\" ( %d : %s )", path, errno, strerror(errno));
+        return -1;
+    }
+
+    const struct geocache_bin_hdr *hdr = m;
+    const size_t size = st.st_size;
+    if (memcmp(hdr->magic, magic, sizeof (hdr->magic)) || GEOCACHE_BIN_VERSION != hdr->version ||
+        recsize != hdr->recsize || size != hdr->filesize ||
+        (size - sizeof (*hdr)) / recsize < hdr->nentries || '\0' != ((const char *) m)[size - 1]) {
+        logmsg(LOG_ERR, "Geo cache file \"%s\" has wrong version or is corrupt", path);
+        munmap(m, size);
+        return -1;
+    }
+
+    *map = m;
+    *mapsize = size;
+    *nentries = hdr->nentries;
+    return 0;
+}
+
+/**
+ * Check that a string or data offset read from a cache file is inside the
+ * blob area of the mapping
+ * @param off Offset
+ * @param len Length of data at offset (1 for strings)
+ * @param blob Offset of the blob
+ * @param mapsize Size of mapping
+ * @return TRUE if valid
+ */
+static inline _Bool
+_valid_offset(const uint64_t off, const uint64_t len, const size_t blob, const size_t mapsize) {
+    return off >= blob && off <= mapsize && len <= mapsize - off;
+}
+
+/**
+ * Move a newly written cache file in place. The previous file is kept as a
+ * backup. Since the new file is written under a temporary name and then
+ * renamed a crash never leaves a half written cache file and the mapping of
+ * the previous file stays valid.
+ * @param tmpPath The newly written file
+ * @param file Name of cache file
+ * @param backupFile Name of backup file
+ * @return 0 on success, -1 on failure
+ */
+static int
+_install_cache_file(const char *tmpPath, const char *file, const char *backupFile) {
     // The cache will always be written to the defined data directory
     // Which is available as the defined DEFAULT_DB_DIR
     char fullPath[256];
     char fullBackupPath[256];
     snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, file);
-    snprintf(fullBackupPath, sizeof (fullBackupPath), "%s/%s", db_dir, backupFile);    
-    
-    // Always create a backup file first. This might look strange
-    // but this achieves what we want. It takes a possible previous backup file
-    // and renames it so we can write the latest backup to the non-indexed 
-    // backup file in the next step.
-    (void)mv_and_rename(fullBackupPath, fullBackupPath, NULL, 0);
-
+    snprintf(fullBackupPath, sizeof (fullBackupPath), "%s/%s", db_dir, backupFile);
 
-    logmsg(LOG_DEBUG, "Trying to backup existing cache index [%s] ...",geo_cache==GEOCACHE_ADDR?"ADDRESS":"MINIMAP");
-    if( -1 == mv_and_rename(fullPath, fullBackupPath, NULL, 0) ) {
-      logmsg(LOG_ERR, "Couldn't save backup of cache index [%s]",geo_cache==GEOCACHE_ADDR?"ADDRESS":"MINIMAP");
-      return -1;
+    if (-1 == rename(fullPath, fullBackupPath) && ENOENT != errno) {
+        logmsg(LOG_ERR, "Couldn't save backup of cache file \"%s\" ( %d : %s )", fullPath, errno, strerror(errno));
+    }
+    if (-1 == rename(tmpPath, fullPath)) {
+        logmsg(LOG_ERR, "Cannot rename \"%s\" to \"%s\" ( %d : %s )", tmpPath, fullPath, errno, strerror(errno));
+        unlink(tmpPath);
+        return -1;
     }
-
-    logmsg(LOG_DEBUG, "Successfully created backup for cache index.");
-   
     return 0;
 }
 
+/**
+ * Write a string to the blob and update the running offset
+ * @param fp File
+ * @param str String to write
+ * @param[in,out] off Running offset
+ * @return The offset where the string was written
+ */
+static uint64_t
+_write_blob_str(FILE *fp, const char *str, uint64_t *off) {
+    const uint64_t start = *off;
+    const size_t len = strlen(str) + 1;
+    fwrite(str, 1, len, fp);
+    *off += len;
+    return start;
+}
 
 /**
- * Write address geo cache to file
+ * Write address geo cache to file in the binary format
  * @return 0 on success, -1 on failure
  */
 int
 write_address_geocache(void) {
 
-    _create_cache_backup(GEOCACHE_ADDR);
-    
-    char fullPath[256];
-    snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_ADDRESS_GEOCACHE_FILE);
-    
-    FILE *fp = fopen(fullPath, "w");
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof (tmpPath), "%s/%s.tmp", db_dir, DEFAULT_ADDRESS_GEOCACHE_BINFILE);
+
+    FILE *fp = fopen(tmpPath, "w");
     if (NULL == fp) {
-        logmsg(LOG_ERR, "Cannot create address geocache file \"%s\"  ( %d : %s )", fullPath, errno, strerror(errno));
+        logmsg(LOG_ERR, "Cannot create address geocache file \"%s\"  ( %d : %s )", tmpPath, errno, strerror(errno));
         return -1;
     }
-    for (size_t i = 0; i <= cache_stats[GEOCACHE_ADDR].cache_max_idx && address_cache[i].addr ; ++i) {
-        //xstrtrim_crnl(_cache[i].addr);
-        fprintf(fp, "%ld;%s;%s;%s\n", address_cache[i].ts, address_cache[i].lat, address_cache[i].lon, address_cache[i].addr);
+
+    // Lookups can continue while we hold the read lock. Only updates have to
+    // wait for the file to be written.
+    pthread_rwlock_rdlock(&address_cache_lock);
+    size_t num = 0;
+    uint64_t blobsize = 0;
+    while (num < geocache_address_size && address_cache[num].addr) {
+        blobsize += strlen(address_cache[num].lat) + strlen(address_cache[num].lon) + strlen(address_cache[num].addr) + 3;
+        num++;
     }
-    (void) fclose(fp);
-    logmsg(LOG_INFO, "Wrote %zu entries to saved address geocache file \"%s\"", address_cache_idx, fullPath);
+
+    struct geocache_bin_hdr hdr;
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, GEOCACHE_BIN_ADDR_MAGIC, sizeof (hdr.magic));
+    hdr.version = GEOCACHE_BIN_VERSION;
+    hdr.nentries = num;
+    hdr.recsize = sizeof (struct geocache_bin_addr_rec);
+    hdr.filesize = sizeof (hdr) + num * sizeof (struct geocache_bin_addr_rec) + blobsize + 1;
+    fwrite(&hdr, sizeof (hdr), 1, fp);
+
+    // Records first with the offsets the strings will get in the blob
+    uint64_t off = sizeof (hdr) + num * sizeof (struct geocache_bin_addr_rec);
+    for (size_t i = 0; i < num; i++) {
+        struct geocache_bin_addr_rec rec;
+        memset(&rec, 0, sizeof (rec));
+        rec.ts = address_cache[i].ts;
+        rec.dLat = address_cache[i].dLat;
+        rec.dLon = address_cache[i].dLon;
+        rec.lat_off = off;
+        off += strlen(address_cache[i].lat) + 1;
+        rec.lon_off = off;
+        off += strlen(address_cache[i].lon) + 1;
+        rec.addr_off = off;
+        off += strlen(address_cache[i].addr) + 1;
+        fwrite(&rec, sizeof (rec), 1, fp);
+    }
+
+    off = sizeof (hdr) + num * sizeof (struct geocache_bin_addr_rec);
+    for (size_t i = 0; i < num; i++) {
+        _write_blob_str(fp, address_cache[i].lat, &off);
+        _write_blob_str(fp, address_cache[i].lon, &off);
+        _write_blob_str(fp, address_cache[i].addr, &off);
+    }
+    pthread_rwlock_unlock(&address_cache_lock);
+    fputc('\0', fp);
+
+    if (ferror(fp) | fclose(fp)) {
+        logmsg(LOG_ERR, "Failed to write address geocache file \"%s\" ( %d : %s )", tmpPath, errno, strerror(errno));
+        unlink(tmpPath);
+        return -1;
+    }
+
+    if (-1 == _install_cache_file(tmpPath, DEFAULT_ADDRESS_GEOCACHE_BINFILE, DEFAULT_ADDRESS_GEOCACHE_BINBACKUPFILE)) {
+        return -1;
+    }
+    logmsg(LOG_INFO, "Wrote %zu entries to saved address geocache file \"%s/%s\"", num, db_dir, DEFAULT_ADDRESS_GEOCACHE_BINFILE);
     return 0;
 }
 
 /**
- * Write minimap geo cache to file
+ * Take a private copy of all entries in the minimap cache so that the
+ * (slow) writing of the cache file can be done without holding the cache
+ * lock.
+ * @param[out] n Number of entries in the copy
+ * @return The copy which must be freed with _free_minimap_snapshot(), NULL
+ * on failure
+ */
+static struct minimap_cache_t *
+_get_minimap_snapshot(size_t *n) {
+    pthread_rwlock_rdlock(&minimap_cache_lock);
+    size_t num = 0;
+    while (num < geocache_minimap_size && minimap_cache[num].lat) {
+        num++;
+    }
+    struct minimap_cache_t *snap = calloc(num + 1, sizeof *snap);
+    for (size_t i = 0; snap && i < num; i++) {
+        snap[i] = minimap_cache[i];
+        snap[i].lat = strdup(minimap_cache[i].lat);
+        snap[i].lon = strdup(minimap_cache[i].lon);
+        snap[i].filename = strdup(minimap_cache[i].filename ? minimap_cache[i].filename : "");
+        snap[i].imgdata = malloc(minimap_cache[i].imgdatasize);
+        if (snap[i].imgdata) {
+            memcpy(snap[i].imgdata, minimap_cache[i].imgdata, minimap_cache[i].imgdatasize);
+        } else {
+            snap[i].imgdatasize = 0;
+        }
+    }
+    pthread_rwlock_unlock(&minimap_cache_lock);
+    *n = num;
+    return snap;
+}
+
+/**
+ * Free a copy of the minimap cache
+ * @param snap The copy returned by _get_minimap_snapshot()
+ * @param n Number of entries
+ */
+static void
+_free_minimap_snapshot(struct minimap_cache_t *snap, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(snap[i].lat);
+        free(snap[i].lon);
+        free(snap[i].filename);
+        free(snap[i].imgdata);
+    }
+    free(snap);
+}
+
+/**
+ * Write minimap geo cache, including all images, to file in the binary
+ * format. The file is written from a copy of the cache so lookups and
+ * updates are never blocked by the disk.
  * @return 0 on success, -1 on failure
  */
 int
 write_minimap_geocache(void) {
-  
-    _create_cache_backup(GEOCACHE_MINIMAP);
-    
-    // The cache will always be written to the defined data directory
-    // Which is available as the defined DEFAULT_DB_DIR    
-    char fullPath[256];
-    snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_MINIMAP_GEOCACHE_FILE);
 
-    FILE *fp = fopen(fullPath, "w");
+    size_t num;
+    struct minimap_cache_t *snap = _get_minimap_snapshot(&num);
+    if (NULL == snap) {
+        logmsg(LOG_ERR, "Out of memory when saving minimap geocache");
+        return -1;
+    }
+
+    char tmpPath[256];
+    snprintf(tmpPath, sizeof (tmpPath), "%s/%s.tmp", db_dir, DEFAULT_MINIMAP_GEOCACHE_BINFILE);
+
+    FILE *fp = fopen(tmpPath, "w");
     if (NULL == fp) {
-        logmsg(LOG_ERR, "Cannot create minimap geocache file \"%s\"  ( %d : %s )", fullPath, errno, strerror(errno));
+        logmsg(LOG_ERR, "Cannot create minimap geocache file \"%s\"  ( %d : %s )", tmpPath, errno, strerror(errno));
+        _free_minimap_snapshot(snap, num);
         return -1;
     } 
 
-    logmsg(LOG_INFO, "Trying to save %zu entries to saved minimap geocache file \"%s\"", minimap_cache_idx, fullPath);
-    
-    char mapfilename[255];
-    for (size_t i = 0; i <= cache_stats[GEOCACHE_MINIMAP].cache_max_idx && minimap_cache[i].lat ; ++i) {
-        if( minimap_cache[i].filename && strnlen(minimap_cache[i].filename, sizeof mapfilename ) > (sizeof mapfilename)/3 ) {
-            logmsg(LOG_ERR,"Cache filename invalid (%s)", minimap_cache[i].filename );
-            logmsg(LOG_ERR,"Aborting saving minimap cache to file");            
-            fclose(fp);
-            return -1;                     
-        } else {  
-            fprintf(fp, "%ld;%s;%s;%d;%d;%d;%s\n", minimap_cache[i].ts,
-                    minimap_cache[i].lat, minimap_cache[i].lon,
-                    minimap_cache[i].zoom,                     
-                    minimap_cache[i].width, minimap_cache[i].height,
-                    minimap_cache[i].filename);
-
-            snprintf(mapfilename, sizeof (mapfilename), "%s/%s/%s", db_dir, DEFAULT_MINIMAP_GEOCACHE_DIR, minimap_cache[i].filename);
-
-            mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
-            int fd = open(mapfilename, O_CREAT | O_RDWR, mode);
-            if (fd < 0) {
-                logmsg(LOG_ERR, "Failed to open minimap for writing. Aborting writing cache file \"%s\" ( %d : %s)",
-                        mapfilename, errno, strerror(errno));
-                fclose(fp);
-                return -1;
-            }
-            int rc = write(fd, minimap_cache[i].imgdata, minimap_cache[i].imgdatasize);
-            close(fd);
-            if (-1 == rc) {
-                logmsg(LOG_ERR, "Failed to write minimap image. ( %d : %s )", errno, strerror(errno));
-                fclose(fp);
-                return -1;
-            }
+    logmsg(LOG_INFO, "Trying to save %zu entries to saved minimap geocache file \"%s\"", num, tmpPath);
+
+    uint64_t blobsize = 0;
+    for (size_t i = 0; i < num; i++) {
+        blobsize += strlen(snap[i].lat) + strlen(snap[i].lon) + strlen(snap[i].filename) + 3 + snap[i].imgdatasize;
+    }
+
+    struct geocache_bin_hdr hdr;
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, GEOCACHE_BIN_MINIMAP_MAGIC, sizeof (hdr.magic));
+    hdr.version = GEOCACHE_BIN_VERSION;
+    hdr.nentries = num;
+    hdr.recsize = sizeof (struct geocache_bin_minimap_rec);
+    hdr.filesize = sizeof (hdr) + num * sizeof (struct geocache_bin_minimap_rec) + blobsize + 1;
+    fwrite(&hdr, sizeof (hdr), 1, fp);
+
+    uint64_t off = sizeof (hdr) + num * sizeof (struct geocache_bin_minimap_rec);
+    for (size_t i = 0; i < num; i++) {
+        struct geocache_bin_minimap_rec rec;
+        memset(&rec, 0, sizeof (rec));
+        rec.ts = snap[i].ts;
+        rec.dLat = snap[i].dLat;
+        rec.dLon = snap[i].dLon;
+        rec.zoom = snap[i].zoom;
+        rec.width = snap[i].width;
+        rec.height = snap[i].height;
+        rec.lat_off = off;
+        off += strlen(snap[i].lat) + 1;
+        rec.lon_off = off;
+        off += strlen(snap[i].lon) + 1;
+        rec.filename_off = off;
+        off += strlen(snap[i].filename) + 1;
+        rec.img_off = off;
+        rec.img_size = snap[i].imgdatasize;
+        off += snap[i].imgdatasize;
+        fwrite(&rec, sizeof (rec), 1, fp);
+    }
+
+    off = sizeof (hdr) + num * sizeof (struct geocache_bin_minimap_rec);
+    for (size_t i = 0; i < num; i++) {
+        _write_blob_str(fp, snap[i].lat, &off);
+        _write_blob_str(fp, snap[i].lon, &off);
+        _write_blob_str(fp, snap[i].filename, &off);
+        fwrite(snap[i].imgdata, 1, snap[i].imgdatasize, fp);
+        off += snap[i].imgdatasize;
+    }
+    fputc('\0', fp);
+    _free_minimap_snapshot(snap, num);
+
+    if (ferror(fp) | fclose(fp)) {
+        logmsg(LOG_ERR, "Failed to write minimap geocache file \"%s\" ( %d : %s )", tmpPath, errno, strerror(errno));
+        unlink(tmpPath);
+        return -1;
+    }
+
+    return _install_cache_file(tmpPath, DEFAULT_MINIMAP_GEOCACHE_BINFILE, DEFAULT_MINIMAP_GEOCACHE_BINBACKUPFILE);
+}
+
+/**
+ * Read the address geo cache from the binary cache file. The entries point
+ * directly into the mapped file.
+ * @return 0 on success, 1 if there is no binary cache file, -1 on failure
+ */
+static int
+_read_address_geocache_bin(void) {
+    char fullPath[256];
+    snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_ADDRESS_GEOCACHE_BINFILE);
+
+    void *map;
+    size_t mapsize, num;
+    int rc = _map_cache_file(fullPath, GEOCACHE_BIN_ADDR_MAGIC, sizeof (struct geocache_bin_addr_rec), &map, &mapsize, &num);
+    if (rc) {
+        return rc;
+    }
+
+    const struct geocache_bin_addr_rec *rec = (const struct geocache_bin_addr_rec *) ((char *) map + sizeof (struct geocache_bin_hdr));
+    const size_t blob = sizeof (struct geocache_bin_hdr) + num * sizeof (*rec);
+    if (num > geocache_address_size - 1) {
+        num = geocache_address_size - 1;
+    }
+
+    pthread_rwlock_wrlock(&address_cache_lock);
+    size_t n = 0;
+    for (size_t i = 0; i < num; i++) {
+        if (!_valid_offset(rec[i].lat_off, 1, blob, mapsize) || !_valid_offset(rec[i].lon_off, 1, blob, mapsize) ||
+            !_valid_offset(rec[i].addr_off, 1, blob, mapsize)) {
+            logmsg(LOG_ERR, "Invalid entry %zu in address geocache file. Ignoring rest of file.", i);
+            break;
         }
+        address_cache[n].ts = rec[i].ts;
+        address_cache[n].dLat = rec[i].dLat;
+        address_cache[n].dLon = rec[i].dLon;
+        address_cache[n].lat = (char *) map + rec[i].lat_off;
+        address_cache[n].lon = (char *) map + rec[i].lon_off;
+        address_cache[n].addr = (char *) map + rec[i].addr_off;
+        address_cache[n].mapped = TRUE;
+        n++;
     }
+    address_cache_idx = n;
+    address_cache_num = n;
+    _addr_grid_rebuild();
+    pthread_rwlock_unlock(&address_cache_lock);
 
-    (void) fclose(fp);
+    pthread_mutex_lock(&cache_stat_mutex);
+    cache_stats[GEOCACHE_ADDR].cache_max_idx = n;
+    pthread_mutex_unlock(&cache_stat_mutex);
 
+    logmsg(LOG_INFO, "Mapped %zu entries from geo cache file \"%s\"", n, fullPath);
     return 0;
 }
 
 /**
- * Read saved address geo cache from file
- * @return 0 on success, -1 on failure
+ * Read the minimap geo cache from the binary cache file. The entries point
+ * directly into the mapped file so an image is only read from disk the first
+ * time it is used.
+ * @return 0 on success, 1 if there is no binary cache file, -1 on failure
  */
-int
-read_address_geocache(void) {
-    assert(isInit);
+static int
+_read_minimap_geocache_bin(void) {
+    char fullPath[256];
+    snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_MINIMAP_GEOCACHE_BINFILE);
+
+    void *map;
+    size_t mapsize, num;
+    int rc = _map_cache_file(fullPath, GEOCACHE_BIN_MINIMAP_MAGIC, sizeof (struct geocache_bin_minimap_rec), &map, &mapsize, &num);
+    if (rc) {
+        return rc;
+    }
+
+    const struct geocache_bin_minimap_rec *rec = (const struct geocache_bin_minimap_rec *) ((char *) map + sizeof (struct geocache_bin_hdr));
+    const size_t blob = sizeof (struct geocache_bin_hdr) + num * sizeof (*rec);
+    if (num > geocache_minimap_size - 1) {
+        num = geocache_minimap_size - 1;
+    }
+
+    pthread_rwlock_wrlock(&minimap_cache_lock);
+    size_t n = 0;
+    for (size_t i = 0; i < num; i++) {
+        if (!_valid_offset(rec[i].lat_off, 1, blob, mapsize) || !_valid_offset(rec[i].lon_off, 1, blob, mapsize) ||
+            !_valid_offset(rec[i].filename_off, 1, blob, mapsize) ||
+            !_valid_offset(rec[i].img_off, rec[i].img_size, blob, mapsize)) {
+            logmsg(LOG_ERR, "Invalid entry %zu in minimap geocache file. Ignoring rest of file.", i);
+            break;
+        }
+        minimap_cache[n].ts = rec[i].ts;
+        minimap_cache[n].dLat = rec[i].dLat;
+        minimap_cache[n].dLon = rec[i].dLon;
+        minimap_cache[n].zoom = rec[i].zoom;
+        minimap_cache[n].width = rec[i].width;
+        minimap_cache[n].height = rec[i].height;
+        minimap_cache[n].lat = (char *) map + rec[i].lat_off;
+        minimap_cache[n].lon = (char *) map + rec[i].lon_off;
+        minimap_cache[n].filename = (char *) map + rec[i].filename_off;
+        minimap_cache[n].imgdata = (char *) map + rec[i].img_off;
+        minimap_cache[n].imgdatasize = rec[i].img_size;
+        minimap_cache[n].mapped = TRUE;
+        n++;
+    }
+    minimap_cache_idx = n;
+    minimap_cache_num = n;
+    pthread_rwlock_unlock(&minimap_cache_lock);
+
+    pthread_mutex_lock(&cache_stat_mutex);
+    cache_stats[GEOCACHE_MINIMAP].cache_max_idx = n;
+    pthread_mutex_unlock(&cache_stat_mutex);
+
+    logmsg(LOG_INFO, "Mapped %zu entries from minimap geo cache file \"%s\"", n, fullPath);
+    return 0;
+}
+
+static int
+_import_address_geocache_text(void) {
 
     char fullPath[256];
     snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_ADDRESS_GEOCACHE_FILE);
@@ -426,6 +932,7 @@ read_address_geocache(void) {
         // Read file line by line
         char lbuff[256];
         struct splitfields fields;
+        pthread_rwlock_wrlock(&address_cache_lock);
         address_cache_idx = 0;
         double lat, lon;
         while (address_cache_idx < geocache_address_size - 1 && fgets(lbuff, sizeof (lbuff) - 1, fp)) {
@@ -440,6 +947,8 @@ read_address_geocache(void) {
                 if (fabs(lat) < 1.0 || fabs(lat) > 89.0 || fabs(lon) < 1.0 || fabs(lon) > 89.0 || strnlen(fields.fld[3], 255) < 5) {
                     logmsg(LOG_ERR, "Address geocache file invalid. Reading aborted");
                     address_cache_idx = 0;
+                    _addr_grid_rebuild();
+                    pthread_rwlock_unlock(&address_cache_lock);
                     fclose(fp);
                     return -1;
                 } else {
@@ -456,21 +965,25 @@ read_address_geocache(void) {
             address_cache_idx++;
         }
         logmsg(LOG_INFO, "Read %zu entries from geo cache file \"%s\"", address_cache_idx, fullPath);
-        cache_stats[GEOCACHE_ADDR].cache_max_idx = address_cache_idx;
+        _addr_grid_rebuild();
 	address_cache_num = address_cache_idx;
+        pthread_rwlock_unlock(&address_cache_lock);
+        pthread_mutex_lock(&cache_stat_mutex);
+        cache_stats[GEOCACHE_ADDR].cache_max_idx = address_cache_num;
+        pthread_mutex_unlock(&cache_stat_mutex);
         fclose(fp);
         return 0;
     }
 }
 
+
 /**
- * Read saved address geo cache from file
+ * Import the minimap geo cache from the old text format file. All images are
+ * read from the cache directory.
  * @return 0 on success, -1 on failure
  */
-int
-read_minimap_geocache(void) {
-
-    assert(isInit);
+static int
+_import_minimap_geocache_text(void) {
 
     char fullPath[256];
     snprintf(fullPath, sizeof (fullPath), "%s/%s", db_dir, DEFAULT_MINIMAP_GEOCACHE_FILE);
@@ -488,6 +1001,7 @@ read_minimap_geocache(void) {
         // Read file line by line
         char lbuff[256];
         struct splitfields fields;
+        pthread_rwlock_wrlock(&minimap_cache_lock);
         minimap_cache_idx = 0;
         double lat, lon;
         while (minimap_cache_idx < geocache_minimap_size - 1 && fgets(lbuff, sizeof (lbuff) - 1, fp)) {
@@ -502,6 +1016,7 @@ read_minimap_geocache(void) {
                 if (fabs(lat) < 1.0 || fabs(lat) > 89.0 || fabs(lon) < 1.0 || fabs(lon) > 89.0) {
                     logmsg(LOG_ERR, "Minimap geocache file invalid. Reading aborted");
                     minimap_cache_idx = 0;
+                    pthread_rwlock_unlock(&minimap_cache_lock);
                     fclose(fp);
                     return -1;
                 } else {
@@ -538,13 +1053,51 @@ read_minimap_geocache(void) {
 
         }
         logmsg(LOG_INFO, "Read %zu entries from geo cache file \"%s\"", minimap_cache_idx, fullPath);
-        cache_stats[GEOCACHE_MINIMAP].cache_max_idx = minimap_cache_idx;
 	minimap_cache_num = minimap_cache_idx;
+        pthread_rwlock_unlock(&minimap_cache_lock);
+        pthread_mutex_lock(&cache_stat_mutex);
+        cache_stats[GEOCACHE_MINIMAP].cache_max_idx = minimap_cache_num;
+        pthread_mutex_unlock(&cache_stat_mutex);
         fclose(fp);
         return 0;
     }
 }
 
+
+/**
+ * Read saved address geo cache from file. The binary cache file is used if it
+ * exists otherwise the cache is imported from a text format file written by
+ * previous versions.
+ * @return 0 on success, -1 on failure
+ */
+int
+read_address_geocache(void) {
+    assert(isInit);
+
+    int rc = _read_address_geocache_bin();
+    if (0 == rc) {
+        return 0;
+    }
+    return _import_address_geocache_text();
+}
+
+/**
+ * Read saved minimap geo cache from file. The binary cache file is used if it
+ * exists otherwise the cache is imported from a text format file and the
+ * image files written by previous versions.
+ * @return 0 on success, -1 on failure
+ */
+int
+read_minimap_geocache(void) {
+    assert(isInit);
+
+    int rc = _read_minimap_geocache_bin();
+    if (0 == rc) {
+        return 0;
+    }
+    return _import_minimap_geocache_text();
+}
+
 /**
  * Check if position is in the cache. In that case return <> 0 and store
  * address in the location pointed to by addr with maximum size maxlen
@@ -558,35 +1111,74 @@ int
 in_address_cache(char *lat, char *lon, char *addr, size_t maxlen) {
     assert(isInit);
 
-    // Search for match of lon & lat
-    size_t idx = 0;
+    pthread_rwlock_rdlock(&address_cache_lock);
+    if (addr_grid_prox != address_lookup_proximity) {
+        // The proximity has been changed in the config since the grid was built
+        pthread_rwlock_unlock(&address_cache_lock);
+        pthread_rwlock_wrlock(&address_cache_lock);
+        if (addr_grid_prox != address_lookup_proximity) {
+            _addr_grid_rebuild();
+        }
+        pthread_rwlock_unlock(&address_cache_lock);
+        pthread_rwlock_rdlock(&address_cache_lock);
+    }
 
     const double dLat = atof(lat);
     const double dLon = atof(lon);
-    while (idx < geocache_address_size && address_cache[idx].lat) {
-        if (address_lookup_proximity > 0) {
-            const double dist = gpsdist_m(dLat, dLon, address_cache[idx].dLat, address_cache[idx].dLon);
-            if (dist <= (double) address_lookup_proximity) {
-                xmb_strncpy(addr, address_cache[idx].addr, maxlen);
-                logmsg(LOG_INFO, "Geocache address approx HIT for (%s,%s) -> \"%s\" distance=%.0f from (%.6f,%.6f)",
-                        lat, lon, addr, dist,
-                        address_cache[idx].dLat,
-                        address_cache[idx].dLon);
-                update_cache_stat(GEOCACHE_ADDR, TRUE, idx);
-                return TRUE;
+    const long clat = (long) floor(dLat / addr_grid_cell);
+    const long clon = (long) floor(dLon / addr_grid_cell);
+
+    // A degree longitude gets shorter closer to the poles so we might have
+    // to look more than one cell away east and west
+    long nlon = 0;
+    if (address_lookup_proximity > 0) {
+        nlon = (long) ceil(1.0 / cos(dLat * M_PI / 180.0));
+    }
+    const long nlat = address_lookup_proximity > 0 ? 1 : 0;
+
+    // Among the candidates in the neighbouring cells pick the closest
+    size_t best = ADDR_GRID_NONE;
+    double best_dist = 0;
+    for (long r = clat - nlat; r <= clat + nlat; r++) {
+        for (long c = clon - nlon; c <= clon + nlon; c++) {
+            size_t idx = addr_grid_bucket[_addr_grid_hash(r, c)];
+            for (; ADDR_GRID_NONE != idx; idx = addr_grid_node[idx].next) {
+                if (addr_grid_node[idx].clat != r || addr_grid_node[idx].clon != c) {
+                    continue;
+                }
+                if (address_lookup_proximity > 0) {
+                    const double dist = gpsdist_m(dLat, dLon, address_cache[idx].dLat, address_cache[idx].dLon);
+                    if (dist <= (double) address_lookup_proximity && (ADDR_GRID_NONE == best || dist < best_dist)) {
+                        best = idx;
+                        best_dist = dist;
+                    }
+                } else if (0 == strcmp(lat, address_cache[idx].lat) && 0 == strcmp(lon, address_cache[idx].lon)) {
+                    // Use strcmp() to avoid conversion floating point problems
+                    best = idx;
+                }
             }
+        }
+    }
+
+    if (ADDR_GRID_NONE != best) {
+        xmb_strncpy(addr, address_cache[best].addr, maxlen);
+        const double best_lat = address_cache[best].dLat;
+        const double best_lon = address_cache[best].dLon;
+        pthread_rwlock_unlock(&address_cache_lock);
+        if (address_lookup_proximity > 0) {
+            logmsg(LOG_INFO, "Geocache address approx HIT for (%s,%s) -> \"%s\" distance=%.0f from (%.6f,%.6f)",
+                    lat, lon, addr, best_dist,
+                    best_lat,
+                    best_lon);
         } else {
-            // Use strcmp() to avoid conversion floating point problems 
-            if (0 == strcmp(lat, address_cache[idx].lat) && 0 == strcmp(lon, address_cache[idx].lon)) {
-                xmb_strncpy(addr, address_cache[idx].addr, maxlen);
-                logmsg(LOG_INFO, "Geocache address HIT (%s,%s) -> \"%s\"", lat, lon, addr);
-                update_cache_stat(GEOCACHE_ADDR, TRUE, idx);
-                return TRUE;
-            }
+            logmsg(LOG_INFO, "Geocache address HIT (%s,%s) -> \"%s\"", lat, lon, addr);
         }
-        idx++;
+        update_cache_stat(GEOCACHE_ADDR, TRUE, best);
+        return TRUE;
     }
 
+    pthread_rwlock_unlock(&address_cache_lock);
+
     // The index is irrelevant here since it is always 1+ over the size
     update_cache_stat(GEOCACHE_ADDR, FALSE, 0);
     return FALSE;
@@ -602,8 +1194,8 @@ in_address_cache(char *lat, char *lon, char *addr, size_t maxlen) {
  * @param zoom Zoom factor
  * @param width width of image
  * @param height height of image
- * @param[out] imgdata An allocated memory areas where the imagedata is stored. It is
- * the calling routines responsibility to free the memory
+ * @param[out] imgdata An allocated memory areas where a copy of the imagedata is stored.
+ * It is the calling routines responsibility to free the memory
  * @param[out] imgsize The size of the image data
  * @return 1 if the image was found, 0 otherwise 
  */
@@ -630,6 +1222,7 @@ in_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned width
     const int proximity_dist = zoom == minimap_overview_zoom ? address_lookup_proximity * proximity_dist_factor : address_lookup_proximity;
     logmsg(LOG_DEBUG, "Using proximity distance (%d m)", proximity_dist);
 
+    pthread_rwlock_rdlock(&minimap_cache_lock);
     while (idx < geocache_minimap_size && minimap_cache[idx].lat) {
 
         if (zoom != minimap_cache[idx].zoom || minimap_cache[idx].width != width || minimap_cache[idx].height != height) {
@@ -657,8 +1250,17 @@ in_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned width
         }
 
         if (found) {
-            *imgdata = minimap_cache[idx].imgdata;
+            // The entry can be evicted as soon as we release the lock so the
+            // caller gets its own copy of the image
+            *imgdata = malloc(minimap_cache[idx].imgdatasize);
+            if (NULL == *imgdata) {
+                pthread_rwlock_unlock(&minimap_cache_lock);
+                logmsg(LOG_ERR, "Out of memory when copying minimap from cache");
+                return FALSE;
+            }
+            memcpy(*imgdata, minimap_cache[idx].imgdata, minimap_cache[idx].imgdatasize);
             *imgsize = minimap_cache[idx].imgdatasize;
+            pthread_rwlock_unlock(&minimap_cache_lock);
             update_cache_stat(GEOCACHE_MINIMAP, TRUE, idx);
             return TRUE;
         }
@@ -666,6 +1268,8 @@ in_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned width
         idx++;
     }
 
+    pthread_rwlock_unlock(&minimap_cache_lock);
+
     // The index is irrelevant here. We just want to mark this as a miss
     update_cache_stat(GEOCACHE_MINIMAP, FALSE, 0);
     return FALSE;
@@ -725,7 +1329,8 @@ get_minimap_cache_filename(char *cfname, size_t maxlen, const char *lat, const c
 }
 
 /**
- * Updated the in-memory minimap cache for the given position
+ * Updated the in-memory minimap cache for the given position. The cache
+ * keeps its own copy of the image data.
  * @param lat Latitude for minimap
  * @param lon Longitude for minimap
  * @param zoom Zoom factor
@@ -739,7 +1344,7 @@ int
 update_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned width, unsigned height, size_t imgdatasize, char *imgdata) {
     assert(isInit);
 
-    logmsg(LOG_DEBUG, "Updating minimap geo-cache [idx=%zu] (%s,%s) [%d,%dx%d]", minimap_cache_idx, lat, lon, zoom, width, height);
+    logmsg(LOG_DEBUG, "Updating minimap geo-cache (%s,%s) [%d,%dx%d]", lat, lon, zoom, width, height);
 
     if( lat==NULL || strlen(lat) < 6 || lon==NULL || strlen(lon) < 6 ) {
         logmsg(LOG_ERR,"Invalid arguments to update_minimap_cache() lat or lon has two few digits");
@@ -774,25 +1379,36 @@ update_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned w
         return -1;
     }
 
-    if (minimap_cache[minimap_cache_idx].lat) {
+    char *imgcopy = malloc(imgdatasize);
+    if (NULL == imgcopy) {
+        logmsg(LOG_ERR, "Out of memory when updating minimap cache");
+        return -1;
+    }
+    memcpy(imgcopy, imgdata, imgdatasize);
+
+    pthread_rwlock_wrlock(&minimap_cache_lock);
+    if (minimap_cache[minimap_cache_idx].lat && !minimap_cache[minimap_cache_idx].mapped) {
 
         // We are reusing an older cache entry
         minimap_cache[minimap_cache_idx].lat = realloc(minimap_cache[minimap_cache_idx].lat, strlen(lat) + 1);
         minimap_cache[minimap_cache_idx].lon = realloc(minimap_cache[minimap_cache_idx].lon, strlen(lon) + 1);
-        xstrlcpy(minimap_cache[minimap_cache_idx].lat, lat, strlen(lat));
-        xstrlcpy(minimap_cache[minimap_cache_idx].lon, lon, strlen(lon));
+        xstrlcpy(minimap_cache[minimap_cache_idx].lat, lat, strlen(lat) + 1);
+        xstrlcpy(minimap_cache[minimap_cache_idx].lon, lon, strlen(lon) + 1);
 
         free(minimap_cache[minimap_cache_idx].filename);
         free(minimap_cache[minimap_cache_idx].imgdata);
 
     } else {
 
+        // Either an empty slot or an entry read from the mapped cache file
+        // in which case the old data is simply left in the mapping
         minimap_cache[minimap_cache_idx].lat = strdup(lat);
         minimap_cache[minimap_cache_idx].lon = strdup(lon);
+        minimap_cache[minimap_cache_idx].mapped = FALSE;
 
     }
 
-    minimap_cache[minimap_cache_idx].imgdata = imgdata;
+    minimap_cache[minimap_cache_idx].imgdata = imgcopy;
     minimap_cache[minimap_cache_idx].imgdatasize = imgdatasize;
     minimap_cache[minimap_cache_idx].dLat = dLat;
     minimap_cache[minimap_cache_idx].dLon = dLon;
@@ -811,6 +1427,7 @@ update_minimap_cache(const char *lat, const char *lon, unsigned zoom, unsigned w
         if( minimap_cache_num < geocache_minimap_size )
             minimap_cache_num++; 
     }
+    pthread_rwlock_unlock(&minimap_cache_lock);
     return 0;
 }
 
@@ -826,7 +1443,7 @@ update_address_cache(char *lat, char *lon, char *addr) {
 
     assert(isInit);
 
-    logmsg(LOG_DEBUG, "Updating address geo-cache [idx=%zu] (%s,%s) -> \"%s\"", address_cache_idx, lat, lon, addr);
+    logmsg(LOG_DEBUG, "Updating address geo-cache (%s,%s) -> \"%s\"", lat, lon, addr);
     const double dLat = atof(lat);
     const double dLon = atof(lon);
 
@@ -835,23 +1452,31 @@ update_address_cache(char *lat, char *lon, char *addr) {
         return -1;
     }
 
+    pthread_rwlock_wrlock(&address_cache_lock);
     if (address_cache[address_cache_idx].lat) {
+        // The old entry in this slot is overwritten so it must leave the index
+        _addr_grid_remove(address_cache_idx);
+    }
+    if (address_cache[address_cache_idx].lat && !address_cache[address_cache_idx].mapped) {
         address_cache[address_cache_idx].lat = realloc(address_cache[address_cache_idx].lat, strlen(lat) + 1);
         address_cache[address_cache_idx].lon = realloc(address_cache[address_cache_idx].lon, strlen(lon) + 1);
         address_cache[address_cache_idx].addr = realloc(address_cache[address_cache_idx].addr, strlen(addr) + 1);
-        xstrlcpy(address_cache[address_cache_idx].addr, addr, strlen(addr));
-        xstrlcpy(address_cache[address_cache_idx].lat, lat, strlen(lat));
-        xstrlcpy(address_cache[address_cache_idx].lon, lon, strlen(lon));
+        xstrlcpy(address_cache[address_cache_idx].addr, addr, strlen(addr) + 1);
+        xstrlcpy(address_cache[address_cache_idx].lat, lat, strlen(lat) + 1);
+        xstrlcpy(address_cache[address_cache_idx].lon, lon, strlen(lon) + 1);
         address_cache[address_cache_idx].dLat = dLat;
         address_cache[address_cache_idx].dLon = dLon;
     } else {
+        // Either an empty slot or an entry read from the mapped cache file
         address_cache[address_cache_idx].lat = strdup(lat);
         address_cache[address_cache_idx].lon = strdup(lon);
         address_cache[address_cache_idx].addr = strdup(addr);
+        address_cache[address_cache_idx].mapped = FALSE;
         address_cache[address_cache_idx].dLat = dLat;
         address_cache[address_cache_idx].dLon = dLon;
     }
     address_cache[address_cache_idx].ts = time(NULL);
+    _addr_grid_insert(address_cache_idx);
     address_cache_idx++;
 
     if (address_cache_idx >= geocache_address_size) {
@@ -861,6 +1486,7 @@ update_address_cache(char *lat, char *lon, char *addr) {
         if( address_cache_num < geocache_address_size )
             address_cache_num++;
     }
+    pthread_rwlock_unlock(&address_cache_lock);
     return 0;
 }
 
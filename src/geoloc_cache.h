@@ -38,6 +38,7 @@ struct address_cache_t {
     double dLon;
     char *addr;
     time_t ts;
+    _Bool mapped; // Strings point into the mapped cache file and must not be freed
 };
 
 /**
@@ -55,6 +56,7 @@ struct minimap_cache_t {
     size_t imgdatasize;
     char *imgdata;
     time_t ts;
+    _Bool mapped; // Strings and image point into the mapped cache file and must not be freed
 };
 
 /**
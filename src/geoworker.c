@@ -0,0 +1,392 @@
+/* =========================================================================
+ * File:        GEOWORKER.C
+ * Description: Background worker that fills in the approximate address
+ *              for stored locations. New locations are stored with a
+ *              pending address marker so that storing is never held up by
+ *              the (rate limited) reverse geocoding service. The worker
+ *              picks up the distinct coordinates of pending rows in batches,
+ *              looks them up and updates all rows with the same coordinates
+ *              in one transaction. Since the pending rows are found in the
+ *              DB the work continues after a restart of the daemon.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "utils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "dbcmd.h"
+#include "geoloc.h"
+#include "geoworker.h"
+
+/**
+ * Maximum number of distinct coordinates looked up in one batch
+ */
+#define GEOWORKER_BATCH 50
+
+/**
+ * How often (in seconds) we look for pending rows even if we have not been
+ * notified. This catches rows left from a failed batch.
+ */
+#define GEOWORKER_POLL_INTERVAL 60
+
+/**
+ * How long (in seconds) to wait before trying again when the lookup service
+ * reports that the query limit has been exceeded
+ */
+#define GEOWORKER_QUOTA_WAIT 600
+
+/**
+ * First wait (in seconds) after a batch where no lookup succeeded, for
+ * example since the network is down. The wait is doubled for each such
+ * batch up to GEOWORKER_QUOTA_WAIT.
+ */
+#define GEOWORKER_RETRY_WAIT 30
+
+/**
+ * Number of failed lookups in a row after which the rest of the batch is
+ * left for later
+ */
+#define GEOWORKER_MAX_FAILS 3
+
+#define _SQL_SELECT_PENDING_ADDR \
+        "SELECT DISTINCT fld_lat, fld_lon FROM " DB_TABLE_LOC \
+        " WHERE fld_approxaddr='" DB_ADDR_PENDING "' LIMIT ?1;"
+
+#define _SQL_UPDATE_PENDING_ADDR \
+        "UPDATE " DB_TABLE_LOC " SET fld_approxaddr=?1" \
+        " WHERE fld_approxaddr='" DB_ADDR_PENDING "' AND fld_lat=?2 AND fld_lon=?3;"
+
+/**
+ * One coordinate to look up and the found address
+ */
+struct geoworker_item {
+    double lat;
+    double lon;
+    _Bool resolved;
+    char address[512];
+};
+
+/**
+ * Only the worker thread touches the batch so it does not need to live on
+ * the stack
+ */
+static struct geoworker_item gw_batch[GEOWORKER_BATCH];
+
+static _Bool gw_running = FALSE;
+static _Bool gw_stopping = FALSE;
+static _Bool gw_pending = TRUE;
+static time_t gw_not_before = 0;
+static time_t gw_notify_at = 0;
+static unsigned gw_retry_wait = 0;
+
+static pthread_t gw_thread;
+static pthread_mutex_t gw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gw_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Read the next batch of distinct coordinates with a pending address
+ * @param[out] n Number of coordinates read
+ * @return 0 on success, -1 on failure
+ */
+static int
+_gw_read_batch(size_t *n) {
+    sqlite3 *sqlDB;
+    sqlite3_stmt *stmt;
+    int rc;
+
+    *n = 0;
+    if (-1 == db_acquire(&sqlDB)) {
+        return -1;
+    }
+    if (-1 == db_prepare_cached(sqlDB, _SQL_SELECT_PENDING_ADDR, &stmt)) {
+        db_release(sqlDB);
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, GEOWORKER_BATCH);
+    while (*n < GEOWORKER_BATCH && SQLITE_ROW == (rc = sqlite3_step(stmt))) {
+        gw_batch[*n].lat = sqlite3_column_double(stmt, 0);
+        gw_batch[*n].lon = sqlite3_column_double(stmt, 1);
+        gw_batch[*n].resolved = FALSE;
+        (*n)++;
+    }
+    if (SQLITE_ROW != rc && SQLITE_DONE != rc) {
+        logmsg(LOG_ERR, "Cannot read locations with pending address : \"%s\"", sqlite3_errmsg(sqlDB));
+        *n = 0;
+        db_release(sqlDB);
+        return -1;
+    }
+    db_release(sqlDB);
+    return 0;
+}
+
+/**
+ * Store the found addresses for all rows with the given coordinates that
+ * are still pending. Coordinates where the lookup failed are left pending.
+ * @param n Number of coordinates in the batch
+ * @return 0 on success, -1 on failure
+ */
+static int
+_gw_store_batch(const size_t n) {
+    sqlite3 *sqlDB;
+    sqlite3_stmt *stmt;
+    char *errMsg;
+    unsigned long nrows = 0;
+
+    if (-1 == db_acquire(&sqlDB)) {
+        return -1;
+    }
+    if (-1 == db_prepare_cached(sqlDB, _SQL_UPDATE_PENDING_ADDR, &stmt)) {
+        db_release(sqlDB);
+        return -1;
+    }
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "BEGIN TRANSACTION", NULL, NULL, &errMsg)) {
+        logmsg(LOG_ERR, "Cannot start DB transaction (%s)", errMsg);
+        sqlite3_free(errMsg);
+        db_release(sqlDB);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!gw_batch[i].resolved) {
+            continue;
+        }
+        sqlite3_bind_text(stmt, 1, gw_batch[i].address, -1, SQLITE_STATIC);
+        sqlite3_bind_double(stmt, 2, gw_batch[i].lat);
+        sqlite3_bind_double(stmt, 3, gw_batch[i].lon);
+        if (SQLITE_DONE != sqlite3_step(stmt)) {
+            logmsg(LOG_ERR, "Cannot update address : \"%s\"", sqlite3_errmsg(sqlDB));
+        } else {
+            nrows += sqlite3_changes(sqlDB);
+        }
+        sqlite3_reset(stmt);
+    }
+    if (SQLITE_OK != sqlite3_exec(sqlDB, "COMMIT TRANSACTION", NULL, NULL, &errMsg)) {
+        logmsg(LOG_ERR, "Cannot commit DB transaction (%s)", errMsg);
+        sqlite3_free(errMsg);
+        db_release(sqlDB);
+        return -1;
+    }
+    db_release(sqlDB);
+    logmsg(LOG_DEBUG, "Address backfill updated %lu rows from %zu lookups", nrows, n);
+    return 0;
+}
+
+/**
+ * Look up and store the address for one batch of pending coordinates.
+ * Only a reply that says there is no address for the coordinates stores
+ * "?". Any other failure (network, service error) leaves the rows pending
+ * so that they are tried again later.
+ * @param[out] more Set to TRUE if there might be more pending rows
+ * @return 0 on success, -1 on failure or if no lookup succeeded,
+ * GOOGLE_STATUS_OVERQUOTA if the service will not accept more lookups
+ * for a while
+ */
+static int
+_gw_resolve_batch(_Bool *more) {
+    size_t n;
+    int rc = 0;
+
+    *more = FALSE;
+    if (-1 == _gw_read_batch(&n)) {
+        return -1;
+    }
+
+    size_t nresolved = 0, nfailed = 0;
+    unsigned fails = 0;
+    for (size_t i = 0; i < n && fails < GEOWORKER_MAX_FAILS; i++) {
+        pthread_mutex_lock(&gw_mutex);
+        const _Bool stopping = gw_stopping;
+        pthread_mutex_unlock(&gw_mutex);
+        if (stopping) {
+            break;
+        }
+
+        char lat[32], lon[32];
+        snprintf(lat, sizeof (lat), "%.6f", gw_batch[i].lat);
+        snprintf(lon, sizeof (lon), "%.6f", gw_batch[i].lon);
+        // The rate limit is handled in the lookup
+        rc = get_address_from_latlon(lat, lon, gw_batch[i].address, sizeof (gw_batch[i].address));
+        if (GOOGLE_STATUS_OVERQUOTA == rc) {
+            break;
+        }
+        if (0 == rc || GOOGLE_STATUS_ZERO == rc || GOOGLE_STATUS_INVALID == rc) {
+            // The lookup sets the address to "?" when the service says
+            // there is no address for these coordinates
+            gw_batch[i].resolved = TRUE;
+            nresolved++;
+            fails = 0;
+        } else {
+            nfailed++;
+            fails++;
+        }
+    }
+
+    if (nresolved > 0 && -1 == _gw_store_batch(n)) {
+        return -1;
+    }
+
+    if (GOOGLE_STATUS_OVERQUOTA == rc) {
+        return GOOGLE_STATUS_OVERQUOTA;
+    }
+    if (nfailed > 0) {
+        logmsg(LOG_NOTICE, "Address lookup failed for %zu coordinates. They will be tried again later.", nfailed);
+        if (0 == nresolved) {
+            return -1;
+        }
+    }
+    *more = GEOWORKER_BATCH == n && 0 == nfailed;
+    return 0;
+}
+
+/**
+ * The worker thread. Resolves pending addresses whenever new rows have
+ * been stored and at regular intervals.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+geoworker_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&gw_mutex);
+    while (!gw_stopping) {
+
+        const time_t now = time(NULL);
+        time_t wake = 0;
+        if (!gw_pending) {
+            wake = now + GEOWORKER_POLL_INTERVAL;
+        } else if (now < gw_not_before) {
+            wake = gw_not_before;
+        } else if (now <= gw_notify_at) {
+            // Give the DB writer a moment to commit the new rows
+            wake = gw_notify_at + 1;
+        }
+        if (wake) {
+            struct timespec deadline = {wake, 0};
+            if (ETIMEDOUT == pthread_cond_timedwait(&gw_cond, &gw_mutex, &deadline)) {
+                gw_pending = TRUE;
+            }
+            continue;
+        }
+        gw_pending = FALSE;
+        pthread_mutex_unlock(&gw_mutex);
+
+        _Bool more;
+        int rc = _gw_resolve_batch(&more);
+
+        pthread_mutex_lock(&gw_mutex);
+        if (GOOGLE_STATUS_OVERQUOTA == rc) {
+            logmsg(LOG_NOTICE, "Address backfill paused for %d s since the lookup quota is exceeded", GEOWORKER_QUOTA_WAIT);
+            gw_not_before = time(NULL) + GEOWORKER_QUOTA_WAIT;
+            gw_pending = TRUE;
+        } else if (-1 == rc) {
+            // Nothing could be looked up. Wait before the next try and
+            // double the wait each time it happens again.
+            gw_retry_wait = gw_retry_wait ? gw_retry_wait * 2 : GEOWORKER_RETRY_WAIT;
+            if (gw_retry_wait > GEOWORKER_QUOTA_WAIT) {
+                gw_retry_wait = GEOWORKER_QUOTA_WAIT;
+            }
+            logmsg(LOG_NOTICE, "Address backfill paused for %u s after failed lookups", gw_retry_wait);
+            gw_not_before = time(NULL) + gw_retry_wait;
+            gw_pending = TRUE;
+        } else {
+            gw_retry_wait = 0;
+            if (more) {
+                gw_pending = TRUE;
+            }
+        }
+    }
+    pthread_mutex_unlock(&gw_mutex);
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Start the address backfill worker. Any rows left pending from a previous
+ * run are picked up directly.
+ * @return 0 on success, -1 on failure
+ */
+int
+geoworker_init(void) {
+    pthread_mutex_lock(&gw_mutex);
+    if (gw_running) {
+        pthread_mutex_unlock(&gw_mutex);
+        return 0;
+    }
+    int ret = pthread_create(&gw_thread, NULL, geoworker_thread, NULL);
+    if (0 != ret) {
+        pthread_mutex_unlock(&gw_mutex);
+        logmsg(LOG_CRIT, "Could not create address backfill thread ( %d : %s )", ret, strerror(ret));
+        return -1;
+    }
+    gw_running = TRUE;
+    pthread_mutex_unlock(&gw_mutex);
+    logmsg(LOG_DEBUG, "Started address backfill worker");
+    return 0;
+}
+
+/**
+ * Stop the address backfill worker. Rows that are still pending will be
+ * handled at next start.
+ */
+void
+geoworker_shutdown(void) {
+    if (!gw_running) {
+        return;
+    }
+    pthread_mutex_lock(&gw_mutex);
+    gw_stopping = TRUE;
+    pthread_cond_signal(&gw_cond);
+    pthread_mutex_unlock(&gw_mutex);
+    pthread_join(gw_thread, NULL);
+    gw_running = FALSE;
+    logmsg(LOG_DEBUG, "Address backfill worker stopped");
+}
+
+/**
+ * Tell the worker that there are new rows with a pending address
+ */
+void
+geoworker_notify(void) {
+    pthread_mutex_lock(&gw_mutex);
+    if (!gw_pending) {
+        gw_pending = TRUE;
+        gw_notify_at = time(NULL);
+        pthread_cond_signal(&gw_cond);
+    }
+    pthread_mutex_unlock(&gw_mutex);
+}
+
+/* EOF */
@@ -44,6 +44,7 @@
 #include <sys/stat.h>
 
 #include <poll.h>
+#include <pthread.h>
 
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -211,6 +212,54 @@ _free_smtp_attachment(struct smtp_attachment **handle) {
     *handle = NULL;
 }
 
+/**
+ * Free all memory associated with the current message in the SMTP handle
+ * so that the session can be used to send a new message
+ * @param handle
+ */
+static void
+_smtp_clear_message(struct smtp_handle *handle) {
+    _smtp_chkfree(handle->from);
+    _smtp_chkfree(handle->date);
+    _smtp_chkfree(handle->returnpath);
+    _smtp_chkfree(handle->subject);
+    _smtp_chkfree(handle->contenttype);
+    _smtp_chkfree(handle->contenttransferencoding);
+    _smtp_chkfree(handle->html);
+    _smtp_chkfree(handle->plain);
+    _smtp_chkfree(handle->databuff);
+    handle->from = handle->date = handle->returnpath = handle->subject = NULL;
+    handle->contenttype = handle->contenttransferencoding = NULL;
+    handle->html = handle->plain = handle->databuff = NULL;
+
+    for (size_t i = 0; i < handle->toidx; ++i) {
+        _smtp_chkfree(handle->to[i]);
+        handle->to[i] = NULL;
+    }
+    _smtp_chkfree(handle->to_concatenated);
+    handle->to_concatenated = NULL;
+    handle->toidx = 0;
+    for (size_t i = 0; i < handle->ccidx; ++i) {
+        _smtp_chkfree(handle->cc[i]);
+        handle->cc[i] = NULL;
+    }
+    _smtp_chkfree(handle->cc_concatenated);
+    handle->cc_concatenated = NULL;
+    handle->ccidx = 0;
+    for (size_t i = 0; i < handle->bccidx; ++i) {
+        _smtp_chkfree(handle->bcc[i]);
+        handle->bcc[i] = NULL;
+    }
+    _smtp_chkfree(handle->bcc_concatenated);
+    handle->bcc_concatenated = NULL;
+    handle->bccidx = 0;
+
+    for (size_t i = 0; i < handle->attachmentidx; ++i) {
+        _free_smtp_attachment(&handle->attachment[i]);
+    }
+    handle->attachmentidx = 0;
+}
+
 /**
  * Free all memory associated with the SMTP handle
  * @param handle
@@ -220,36 +269,11 @@ _free_smtp_handle(struct smtp_handle **handle) {
     if (*handle == NULL)
         return;
     _free_smtplist((*handle)->cap, 64);
-    _smtp_chkfree((*handle)->from);
-    _smtp_chkfree((*handle)->date);
-    _smtp_chkfree((*handle)->returnpath);
-    _smtp_chkfree((*handle)->subject);
+    _smtp_clear_message(*handle);
     _smtp_chkfree((*handle)->mimeversion);
     _smtp_chkfree((*handle)->useragent);
-    _smtp_chkfree((*handle)->contenttype);
-    _smtp_chkfree((*handle)->contenttransferencoding);
-    _smtp_chkfree((*handle)->html);
-    _smtp_chkfree((*handle)->plain);
-
-    _smtp_chkfree((*handle)->databuff);
+    _smtp_chkfree((*handle)->session_key);
 
-    for (size_t i = 0; i < (*handle)->toidx; ++i) {
-        _smtp_chkfree((*handle)->to[i]);
-    }
-    _smtp_chkfree((*handle)->to_concatenated);
-    for (size_t i = 0; i < (*handle)->ccidx; ++i) {
-        _smtp_chkfree((*handle)->cc[i]);
-    }
-    _smtp_chkfree((*handle)->cc_concatenated);
-    for (size_t i = 0; i < (*handle)->bccidx; ++i) {
-        _smtp_chkfree((*handle)->bcc[i]);
-    }
-    _smtp_chkfree((*handle)->bcc_concatenated);
-    
-    for (size_t i = 0; i < (*handle)->attachmentidx; ++i) {
-        _free_smtp_attachment(& (*handle)->attachment[i]);
-    }
-    
     free(*handle);
     *handle = NULL;
 }
@@ -459,7 +483,7 @@ _smtp_send_command(struct smtp_handle *handle, char *cmd, char *arg, struct smtp
     } else {
         snprintf(tmpbuff, 255, "%s%s\r\n", cmd, arg);
     }
-    ssize_t nw = send(handle->sfd, tmpbuff, strlen(tmpbuff), 0);
+    ssize_t nw = send(handle->sfd, tmpbuff, strlen(tmpbuff), MSG_NOSIGNAL);
 
     if (nw != (ssize_t) strnlen(tmpbuff, 255)) {
         printf("Error writing to socket (%s)", strerror(errno));
@@ -624,25 +648,149 @@ _sendchk(struct smtp_handle *handle, char *cmd, char *arg, int expected) {
 }
 
 /**
- * Send a data stream to the SMTP server. This means all the data that
- * are sent after the DATA command.
+ * Read a number of (possibly multiline) replies from the SMTP server. This is
+ * used with pipelining where the replies to several commands can arrive in the
+ * same or in several reads from the socket.
  * @param handle SMTP session handle
- * @param cmd
- * @param arg
- * @return 0 if all the data could be written, -1 otherwise
+ * @param status Array to store the status code for each reply
+ * @param n Number of replies to read
+ * @return 0 if all replies were read, -1 otherwise
  */
 static int
-_senddata(struct smtp_handle *handle, char *cmd, char *arg) {
-    if (cmd == NULL || arg == NULL) {
+_smtp_read_replies(struct smtp_handle *handle, int status[], size_t n) {
+    const size_t maxlen = 4096;
+    char *buffer = calloc(1, maxlen);
+    char *line = buffer;
+    size_t len = 0, got = 0;
+
+    while (got < n) {
+        char *eol;
+        while (got < n && (eol = strstr(line, "\r\n"))) {
+            if (eol - line < 3 || !isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2])) {
+                free(buffer);
+                return -1;
+            }
+            // Only the last line in a multiline reply has a space (or nothing) after the code
+            if (' ' == line[3] || '\r' == line[3]) {
+                status[got++] = (line[0] - '0')*100 + (line[1] - '0')*10 + (line[2] - '0');
+            }
+            line = eol + 2;
+        }
+        if (got >= n) {
+            break;
+        }
+
+        // Keep any partial line and read more from the server
+        len -= line - buffer;
+        memmove(buffer, line, len + 1);
+        line = buffer;
+        if (len >= maxlen - 1 || _read_sock_timeout(handle->sfd, buffer + len, maxlen - len - 1)) {
+            free(buffer);
+            return -1;
+        }
+        const size_t newlen = strlen(buffer);
+        if (newlen == len) {
+            // Server closed the connection
+            free(buffer);
+            return -1;
+        }
+        len = newlen;
+    }
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Send the envelope (MAIL FROM, all RCPT TO and DATA) in one write and then
+ * read all the replies as specified by the PIPELINING extension (RFC 2920).
+ * If any of the commands fail after the server has accepted the DATA command
+ * the session can not be used any more and must be closed by the caller to
+ * abort the message.
+ * @param handle SMTP session handle
+ * @param from_addr Normalized address of the sender
+ * @return 0 if all commands were accepted, -1 otherwise
+ */
+static int
+_smtp_send_envelope_pipelined(struct smtp_handle *handle, char *from_addr) {
+    char *rcpts[3 * MAX_RCPT];
+    size_t nrcpt = 0;
+    for (size_t i = 0; i < handle->toidx; i++) rcpts[nrcpt++] = handle->to[i];
+    for (size_t i = 0; i < handle->ccidx; i++) rcpts[nrcpt++] = handle->cc[i];
+    for (size_t i = 0; i < handle->bccidx; i++) rcpts[nrcpt++] = handle->bcc[i];
+
+    const size_t maxlen = (nrcpt + 2) * 300;
+    char *cmds = calloc(1, maxlen);
+    char email_namepart[256];
+    char email_addrpart[256];
+    char linebuff[300];
+
+    snprintf(cmds, maxlen, "MAIL FROM: %s\r\n", from_addr);
+    for (size_t i = 0; i < nrcpt; i++) {
+        if (-1 == _smtp_normalize_mailaddr(rcpts[i], email_namepart, 256, email_addrpart, 256)) {
+            free(cmds);
+            return -1;
+        }
+        snprintf(linebuff, sizeof (linebuff), "RCPT TO: %s\r\n", email_addrpart);
+        xstrlcat(cmds, linebuff, maxlen);
+    }
+    xstrlcat(cmds, "DATA\r\n", maxlen);
+
+    const size_t cmdlen = strlen(cmds);
+    ssize_t nw = send(handle->sfd, cmds, cmdlen, MSG_NOSIGNAL);
+    free(cmds);
+    if (nw != (ssize_t) cmdlen) {
         return -1;
     }
-    const size_t N = strlen(cmd) + strlen(arg) + 3;
-    char *buff = calloc(1, N);
-    snprintf(buff, N, "%s%s\r\n", cmd, arg);
-    ssize_t num = send(handle->sfd, buff, strlen(buff), 0);
-    int rc = num == (ssize_t) strlen(buff) ? 0 : -1;
-    free(buff);
-    return rc;
+
+    int status[3 * MAX_RCPT + 2];
+    if (-1 == _smtp_read_replies(handle, status, nrcpt + 2)) {
+        return -1;
+    }
+    if (250 != status[0] || 354 != status[nrcpt + 1]) {
+        return -1;
+    }
+    for (size_t i = 1; i <= nrcpt; i++) {
+        if (250 != status[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send the envelope (MAIL FROM, all RCPT TO and DATA) one command at a time
+ * and check each reply before the next command is sent.
+ * @param handle SMTP session handle
+ * @param from_addr Normalized address of the sender
+ * @return 0 if all commands were accepted, -1 otherwise
+ */
+static int
+_smtp_send_envelope(struct smtp_handle *handle, char *from_addr) {
+    char email_namepart[256];
+    char email_addrpart[256];
+    if (-1 == _sendchk(handle, "MAIL FROM: ", from_addr, 250)) {
+        return -1;
+    }
+    for (size_t i = 0; i < handle->toidx; i++) {
+        if (-1 == _smtp_normalize_mailaddr(handle->to[i], email_namepart, 256, email_addrpart, 256) ||
+                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < handle->ccidx; i++) {
+        if (-1 == _smtp_normalize_mailaddr(handle->cc[i], email_namepart, 256, email_addrpart, 256) ||
+                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < handle->bccidx; i++) {
+        if (-1 == _smtp_normalize_mailaddr(handle->bcc[i], email_namepart, 256, email_addrpart, 256) ||
+                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
+            return -1;
+        }
+    }
+    if (-1 == _sendchk(handle, "DATA", "", 354)) return -1;
+    return 0;
 }
 
 /**
@@ -1256,57 +1404,51 @@ smtp_sendmail(struct smtp_handle *handle, char *from, char *subject) {
 
     char email_namepart[256];
     char email_addrpart[256];
-    if (-1 == _smtp_normalize_mailaddr(from, email_namepart, 256, email_addrpart, 256) ||
-            -1 == _sendchk(handle, "MAIL FROM: ", email_addrpart, 250)) {
+    if (-1 == _smtp_normalize_mailaddr(from, email_namepart, 256, email_addrpart, 256)) {
         return -1;
     }
-    for (size_t i = 0; i < handle->toidx; i++) {
-        if (-1 == _smtp_normalize_mailaddr(handle->to[i], email_namepart, 256, email_addrpart, 256) ||
-                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
+    if (1 == smtp_server_support(handle, SMTP_SERVER_FEATURE_PIPELINING)) {
+        if (-1 == _smtp_send_envelope_pipelined(handle, email_addrpart)) {
             return -1;
         }
-    }
-    for (size_t i = 0; i < handle->ccidx; i++) {
-        if (-1 == _smtp_normalize_mailaddr(handle->cc[i], email_namepart, 256, email_addrpart, 256) ||
-                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
-            return -1;
-        }
-    }
-    for (size_t i = 0; i < handle->bccidx; i++) {
-        if (-1 == _smtp_normalize_mailaddr(handle->bcc[i], email_namepart, 256, email_addrpart, 256) ||
-                -1 == _sendchk(handle, "RCPT TO: ", email_addrpart, 250)) {
-            return -1;
-        }
-    }
-    if (-1 == _sendchk(handle, "DATA", "", 354)) return -1;
-    if (-1 == _senddata(handle, "Date: ", handle->date)) return -1;
-    if (-1 == _senddata(handle, "From: ", handle->from)) return -1;
-    if (-1 == _senddata(handle, "To: ", handle->to_concatenated)) return -1;
-  
-
-    if (handle->cc_concatenated && *handle->cc_concatenated) {
-        if (-1 == _senddata(handle, "Cc: ", handle->cc_concatenated)) {
-            // logmsg(LOG_DEBUG, "smtp_sendmail #10.3.1");
-            return -1;
-        }
-    }
-    if (-1 == _senddata(handle, "Subject: ", handle->subject)) return -1;
-    if (-1 == _senddata(handle, "MIME-Version: ", handle->mimeversion)) return -1;
-    if (-1 == _senddata(handle, handle->contenttype, "")) return -1;
-
-    if (handle->contenttransferencoding) {
-        if (-1 == _senddata(handle, handle->contenttransferencoding, "")) {
-            return -1;
-        }
-    }
-
-    if (-1 == _senddata(handle, "\r\n", "") ||
-        -1 == _senddata(handle, handle->databuff, "")) {
+    } else if (-1 == _smtp_send_envelope(handle, email_addrpart)) {
         return -1;
     }
-
-    if (-1 == _sendchk(handle, ".", "", 250) ||
-            -1 == _sendchk(handle, "QUIT", "", 221)) {
+    // Send all headers, the body and the terminating "." in a single write.
+    // Many small writes followed by a wait for the reply interacts badly with
+    // delayed ACKs and costs far more than the data itself.
+    const char *cc = handle->cc_concatenated && *handle->cc_concatenated ? handle->cc_concatenated : NULL;
+    const size_t msglen = strlen(handle->date) + strlen(handle->from) + strlen(handle->to_concatenated) +
+            (cc ? strlen(cc) : 0) + strlen(handle->subject) + strlen(handle->mimeversion) +
+            strlen(handle->contenttype) +
+            (handle->contenttransferencoding ? strlen(handle->contenttransferencoding) : 0) +
+            strlen(handle->databuff) + 256;
+    char *msg = calloc(1, msglen);
+    snprintf(msg, msglen,
+            "Date: %s\r\n"
+            "From: %s\r\n"
+            "To: %s\r\n"
+            "%s%s%s"
+            "Subject: %s\r\n"
+            "MIME-Version: %s\r\n"
+            "%s\r\n"
+            "%s%s"
+            "\r\n"
+            "%s\r\n"
+            ".\r\n",
+            handle->date, handle->from, handle->to_concatenated,
+            cc ? "Cc: " : "", cc ? cc : "", cc ? "\r\n" : "",
+            handle->subject, handle->mimeversion, handle->contenttype,
+            handle->contenttransferencoding ? handle->contenttransferencoding : "",
+            handle->contenttransferencoding ? "\r\n" : "",
+            handle->databuff);
+
+    const size_t len = strlen(msg);
+    ssize_t nw = send(handle->sfd, msg, len, MSG_NOSIGNAL);
+    free(msg);
+    int status[1];
+    if (nw != (ssize_t) len ||
+        -1 == _smtp_read_replies(handle, status, 1) || 250 != status[0]) {
         return -1;
     }
 
@@ -1353,7 +1495,7 @@ smtp_setup(char *server_ip_or_fqdn, char *user, char *pwd, int port) {
         handle = _smtp_connect(server_ip_or_fqdn, "smtp");
     } else {
         char numbuff[8];
-        if (port > 1023) {
+        if (port > 65535) {
             return NULL;
         }
         snprintf(numbuff, sizeof(numbuff), "%d", port);
@@ -1456,19 +1598,128 @@ smtp_setup(char *server_ip_or_fqdn, char *user, char *pwd, int port) {
 }
 
 /**
- * This is the opposite to smtp_setup. This will cleanup all used memory by the
- * smtp session
+ * This is the opposite to smtp_setup. This will end the session with the
+ * server and cleanup all used memory by the smtp session
  * @param handle SMTP session handle
  */
 void
 smtp_cleanup(struct smtp_handle **handle) {
 
+    // We don't care about the reply since the session is closed anyway
+    (void) send((*handle)->sfd, "QUIT\r\n", 6, MSG_NOSIGNAL);
     shutdown((*handle)->sfd, SHUT_RDWR);
     close((*handle)->sfd);
     _free_smtp_handle(handle);
     *handle = NULL;
 }
 
+/**
+ * Clear the current message and send RSET to the server so that the session
+ * can be used to send a new message.
+ * @param handle SMTP session handle
+ * @return 0 if the server accepted the reset, -1 otherwise
+ */
+int
+smtp_reset(struct smtp_handle *handle) {
+    _smtp_clear_message(handle);
+    return _sendchk(handle, "RSET", "", 250);
+}
+
+/*
+ * Pool of authenticated sessions that are kept open between messages. A
+ * session is identified by the server, port and user it was setup with.
+ */
+static pthread_mutex_t smtp_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct smtp_handle *smtp_pool[SMTP_SESSION_POOL_SIZE];
+
+/**
+ * Get an authenticated session from the pool or setup a new session if there
+ * is no usable session in the pool. A pooled session that has been idle for
+ * too long, or that does not accept a RSET, is closed and replaced transparently.
+ * The session must be given back with smtp_session_release()
+ * @param server_ip_or_fqdn Server IP och fully qualified name
+ * @param user User name to login to with server
+ * @param pwd Password
+ * @param port Optional port for SMTP service
+ * @return NULL on failure, pointer to smtp_handle otherwise
+ */
+struct smtp_handle *
+smtp_session_get(char *server_ip_or_fqdn, char *user, char *pwd, int port) {
+    char key[512];
+    snprintf(key, sizeof (key), "%s:%d:%s", server_ip_or_fqdn, port, user);
+
+    struct smtp_handle *handle;
+    do {
+        handle = NULL;
+        pthread_mutex_lock(&smtp_pool_mutex);
+        for (size_t i = 0; i < SMTP_SESSION_POOL_SIZE && NULL == handle; i++) {
+            if (smtp_pool[i] && 0 == strcmp(smtp_pool[i]->session_key, key)) {
+                handle = smtp_pool[i];
+                smtp_pool[i] = NULL;
+            }
+        }
+        pthread_mutex_unlock(&smtp_pool_mutex);
+
+        if (NULL == handle) {
+            break;
+        }
+        if (time(NULL) - handle->last_used > SMTP_SESSION_IDLE_TIMEOUT ||
+            -1 == smtp_reset(handle)) {
+            smtp_cleanup(&handle);
+        }
+    } while (NULL == handle);
+
+    if (NULL == handle) {
+        handle = smtp_setup(server_ip_or_fqdn, user, pwd, port);
+        if (handle) {
+            handle->session_key = strdup(key);
+        }
+    }
+    return handle;
+}
+
+/**
+ * Give back a session to the pool. If the last message could not be sent the
+ * state of the session is unknown and it is closed instead.
+ * @param handle SMTP session handle. Set to NULL after the call.
+ * @param reuse TRUE if the session can be used for another message
+ */
+void
+smtp_session_release(struct smtp_handle **handle, _Bool reuse) {
+    if (NULL == *handle) {
+        return;
+    }
+    if (reuse && (*handle)->session_key) {
+        _smtp_clear_message(*handle);
+        (*handle)->last_used = time(NULL);
+        pthread_mutex_lock(&smtp_pool_mutex);
+        for (size_t i = 0; i < SMTP_SESSION_POOL_SIZE && *handle; i++) {
+            if (NULL == smtp_pool[i]) {
+                smtp_pool[i] = *handle;
+                *handle = NULL;
+            }
+        }
+        pthread_mutex_unlock(&smtp_pool_mutex);
+    }
+    if (*handle) {
+        smtp_cleanup(handle);
+    }
+}
+
+/**
+ * Close all pooled sessions
+ */
+void
+smtp_session_pool_close(void) {
+    pthread_mutex_lock(&smtp_pool_mutex);
+    for (size_t i = 0; i < SMTP_SESSION_POOL_SIZE; i++) {
+        if (smtp_pool[i]) {
+            smtp_cleanup(&smtp_pool[i]);
+        }
+    }
+    pthread_mutex_unlock(&smtp_pool_mutex);
+}
+
 /**
  * Utility function to send basic HTML or plain message through the specified SMTP server
  * @param server
@@ -74,6 +74,13 @@ extern "C" {
 /* Maximum size fo each recipient line */
 #define MAX_HEADER_ADDR_SIZE 2048
 
+/* Maximum number of idle sessions kept open in the session pool */
+#define SMTP_SESSION_POOL_SIZE 8
+
+/* Seconds an idle pooled session is kept before it is reconnected. Kept well
+   below the 5 min that RFC 5321 recommends servers to wait for a command. */
+#define SMTP_SESSION_IDLE_TIMEOUT 60
+
 /*
  * Structure to hold the reply from SMTP server for a specific command
  */
@@ -154,6 +161,10 @@ struct smtp_handle {
         This is what is actually sent to the SMTP server as
         the payload of the mail.*/
     char *databuff;
+    /** Server, port and user for a pooled session */
+    char *session_key;
+    /** Time when the pooled session was last used */
+    time_t last_used;
 };
 
 
@@ -199,6 +210,18 @@ smtp_setup(char *server_ip, char *user, char *pwd, int port);
 void
 smtp_cleanup(struct smtp_handle **handle);
 
+int
+smtp_reset(struct smtp_handle *handle);
+
+struct smtp_handle *
+smtp_session_get(char *server_ip_or_fqdn, char *user, char *pwd, int port);
+
+void
+smtp_session_release(struct smtp_handle **handle, _Bool reuse);
+
+void
+smtp_session_pool_close(void);
+
 void
 smtp_dump_handle(struct smtp_handle * handle, FILE *fp);
 
@@ -41,6 +41,7 @@
 #include <sys/param.h>
 #include <errno.h>
 #include <libgen.h>
+#include <stddef.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,41 +67,6 @@ static char package_name[MAX_PACKAGENAME] = {'\0'};
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"
 
-/**
- * Utility function
- * Simplify a formatted write to a file descriptor
- *
- * @param fd File descriptor to write to
- * @param buf Format string
- * @param ... number of arguments depends on the format string
- * @return 0 on success , <> 0 on failure
- */
-int
-_writef_log(int fd, const char *buf, ...) {
-    if (fd >= 0) {
-        const int blen = MAX(1024 * 20, strlen(buf) + 1);
-        char *tmpbuff = calloc(blen, 1);
-        if (tmpbuff == NULL) {
-            syslog(LOG_ERR, "FATAL: Cannot allocate buffer in _writef_log()");
-            _exit(EXIT_FAILURE);
-        }
-        va_list ap;
-        va_start(ap, buf);
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wformat-nonliteral"
-        vsnprintf(tmpbuff, blen, buf, ap);
-#pragma clang diagnostic pop
-
-        tmpbuff[blen - 1] = 0;
-        int ret = write(fd, tmpbuff, strnlen(tmpbuff, blen));
-        free(tmpbuff);
-        va_end(ap);
-        return ret;
-    }
-    return -1;
-}
-
-
 /**
  * _vsyslogf
  * Write a message to the system logger with printf() formatting capabilities
@@ -142,11 +108,350 @@ _vsyslogf(int priority, const char *msg, ...) {
     va_end(ap);
 }
 
-#define MAXLOGFILEBUFF 10*1024
+/*
+ * The log messages are formatted by the calling thread and put in a ring
+ * buffer from which one writer thread writes them, in order, to the log file
+ * (or syslog). The writer keeps the log file open and writes all messages
+ * that are available with one write(). Until the writer has been started
+ * (and after it has been stopped) messages are written directly by the
+ * calling thread.
+ *
+ * The ring is a bounded multi producer queue where each slot has a sequence
+ * number which tells if it is free for the producer that reserved that
+ * position or filled and ready for the writer. Producers reserve a position
+ * with one atomic compare-and-swap so no lock is taken when logging.
+ */
+
+/**
+ * Number of slots in the log ring. Must be a power of 2
+ */
+#define LOG_RING_SIZE 1024
+
+/**
+ * Maximum length of one log message (including prefix). Longer messages are
+ * truncated.
+ */
+#define LOG_MSG_MAXLEN 2048
+
+/**
+ * Size of the buffer the writer collects messages in before writing
+ */
+#define LOG_BATCH_SIZE (64*1024)
+
+/**
+ * The most one call to _log_add_batch() can add to a batch. With LOG_COMPRESS
+ * a pending "Msg repeated" line may be written before the message itself.
+ */
+#define LOG_ADD_MAXLEN ((1 + LOG_COMPRESS) * (LOG_MSG_MAXLEN + 64))
+
+/**
+ * How often (in seconds) the writer checks if the log file has been
+ * rotated (moved or removed) and must be reopened
+ */
+#define LOG_ROTATE_CHECK_INTERVAL 2
+
+/**
+ * Maximum time in ms the writer sleeps when there is nothing to write
+ */
+#define LOG_WRITER_IDLE_MS 500
+
+struct log_slot {
+    size_t seq;
+    int priority;
+    time_t ts;
+    size_t len;
+    char msg[LOG_MSG_MAXLEN];
+};
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static size_t log_ring_tail = 0; // Next position for producers (atomic)
+static size_t log_ring_head = 0; // Next position for the writer
+
+static pthread_t log_writer_thread;
+static _Bool log_writer_running = FALSE;
+static int log_writer_stopping = 0; // Atomic
+static int log_writer_idle = 0; // Atomic. Writer waits for a signal
+static pthread_mutex_t log_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond = PTHREAD_COND_INITIALIZER;
+
+// The open log file. Protected by logger_mutex
+static int log_fd = -1;
+static time_t log_rotate_check = 0;
+static int _loginit = 0;
+
 #define LASTLOGMSG_LEN 4096
 static char _lastlogmsg[LASTLOGMSG_LEN] = {'\0'};
 static int _lastlogcnt = 0;
 
+/**
+ * Check if a message with this priority should be logged with the current
+ * verbosity. We only print errors by default and info if the verbose flag
+ * is set
+ * @param priority Log message priority
+ * @return TRUE if the message should be logged
+ */
+static inline _Bool
+_log_enabled(const int priority) {
+    return (priority == LOG_ERR) || (priority == LOG_CRIT) || (priority == LOG_WARNING) ||
+            ((priority == LOG_INFO) && verbose_log > 0) ||
+            ((priority == LOG_NOTICE) && verbose_log > 1) ||
+            ((priority == LOG_DEBUG) && verbose_log > 2);
+}
+
+/**
+ * Check if the syslog should be used instead of a log file
+ * @return TRUE if syslog is used
+ */
+static inline _Bool
+_log_use_syslog(void) {
+    return *logfile_name == '\0' || strcmp(logfile_name, LOGFILE_SYSLOG) == 0;
+}
+
+/**
+ * Make sure the log file is open. The file is reopened if it has been moved
+ * or removed since it was opened (for example by a log rotation). Must be
+ * called with the logger_mutex held.
+ * @return The file descriptor for the log file
+ */
+static int
+_log_open(void) {
+    if (strcmp(logfile_name, "stdout") == 0) {
+        return STDOUT_FILENO;
+    } else if (strcmp(logfile_name, "stderr") == 0) {
+        return STDERR_FILENO;
+    }
+
+    const time_t now = time(NULL);
+    if (log_fd >= 0 && now - log_rotate_check >= LOG_ROTATE_CHECK_INTERVAL) {
+        log_rotate_check = now;
+        struct stat fst, pst;
+        if (-1 == stat(logfile_name, &pst) || -1 == fstat(log_fd, &fst) ||
+            pst.st_ino != fst.st_ino || pst.st_dev != fst.st_dev) {
+            close(log_fd);
+            log_fd = -1;
+        }
+    }
+
+    if (log_fd < 0) {
+        const mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        log_fd = open(logfile_name, O_APPEND | O_CREAT | O_WRONLY | O_CLOEXEC, mode);
+        if (log_fd < 0) {
+            // Give a message on syslog and terminate
+            if (!_loginit) {
+                openlog(PACKAGE_NAME, LOG_PID | LOG_CONS, LOG_USER);
+                _loginit = 1;
+            }
+            syslog(LOG_ERR, "Couldn't open specified file as logfile. (%s)", logfile_name);
+            exit(EXIT_FAILURE);
+        }
+        log_rotate_check = now;
+    }
+    return log_fd;
+}
+
+/**
+ * Close the log file if it is open. Must be called with the logger_mutex
+ * held.
+ */
+static void
+_log_close(void) {
+    if (log_fd >= 0) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+/**
+ * Write a buffer to the log file. Must be called with the logger_mutex held.
+ * @param buf Buffer
+ * @param len Length of buffer
+ */
+static void
+_log_write(const char *buf, size_t len) {
+    const int fd = _log_open();
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ * Add one log message to the batch of messages to write to the log file. If
+ * syslog is used the message is sent directly instead. Must be called with
+ * the logger_mutex held.
+ * @param batch Buffer where the log file lines are collected
+ * @param bsize Size of the batch buffer
+ * @param blen Current length of batch (updated)
+ * @param priority Message priority
+ * @param ts Time when the message was logged
+ * @param msg The message
+ */
+static void
+_log_add_batch(char *batch, const size_t bsize, size_t *blen, const int priority, const time_t ts, const char *msg) {
+    if (_log_use_syslog()) {
+        if (!_loginit) {
+            openlog(package_name, LOG_PID | LOG_CONS, LOG_DAEMON);
+            _loginit = 1;
+        }
+        syslog(priority, "%s", msg);
+        return;
+    }
+
+    char timebuff[32];
+    ctime_r(&ts, timebuff);
+
+    // Get rid of the year at end of time string
+    timebuff[strnlen(timebuff, sizeof (timebuff)) - 5] = 0;
+
+    char *line = batch + *blen;
+    const size_t avail = bsize - *blen;
+    int n = 0;
+    if (!LOG_COMPRESS) {
+        n = snprintf(line, avail, "%s: %s\n", timebuff, msg);
+    } else {
+        // If this message has already been written we ignore this and keep
+        // count on the number of times we written this message.
+        if (strcmp(msg, _lastlogmsg)) {
+            if (_lastlogcnt > 0) {
+                if (1 == _lastlogcnt) {
+                    n = snprintf(line, avail, "%s: %s\n", timebuff, _lastlogmsg);
+                } else {
+                    n = snprintf(line, avail, "%s: Msg repeated (#%d) \"%s\"\n", timebuff, _lastlogcnt, _lastlogmsg);
+                }
+                _lastlogcnt = 0;
+                *_lastlogmsg = '\0';
+            } else {
+                strncpy(_lastlogmsg, msg, LASTLOGMSG_LEN - 1);
+            }
+            n = MIN((size_t) n, avail);
+            n += snprintf(line + n, avail - n, "%s: %s\n", timebuff, msg);
+        } else {
+            _lastlogcnt++;
+        }
+    }
+    n = MIN((size_t) n, avail - 1);
+    snprintf(last_logmsg, MAX_LASTLOGMSG, "%s: %s\n", timebuff, msg);
+    *blen += n;
+}
+
+/**
+ * Writer thread. Collects all available messages from the ring and writes
+ * them with one write.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+_log_writer(void *arg) {
+    (void) arg;
+    static char batch[LOG_BATCH_SIZE];
+
+    while (TRUE) {
+        size_t blen = 0;
+        pthread_mutex_lock(&logger_mutex);
+        while (TRUE) {
+            struct log_slot *slot = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_ring_head + 1) {
+                break;
+            }
+            if (sizeof (batch) - blen < LOG_ADD_MAXLEN) {
+                _log_write(batch, blen);
+                blen = 0;
+            }
+            _log_add_batch(batch, sizeof (batch), &blen, slot->priority, slot->ts, slot->msg);
+            __atomic_store_n(&slot->seq, log_ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            log_ring_head++;
+        }
+        if (blen > 0) {
+            _log_write(batch, blen);
+        }
+        pthread_mutex_unlock(&logger_mutex);
+
+        if (blen > 0) {
+            continue;
+        }
+        if (__atomic_load_n(&log_writer_stopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        // Nothing to do. Wait for a producer to wake us up
+        pthread_mutex_lock(&log_wake_mutex);
+        __atomic_store_n(&log_writer_idle, 1, __ATOMIC_SEQ_CST);
+        const struct log_slot *slot = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != log_ring_head + 1 &&
+            !__atomic_load_n(&log_writer_stopping, __ATOMIC_SEQ_CST)) {
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_nsec += LOG_WRITER_IDLE_MS * 1000000L;
+            abstime.tv_sec += abstime.tv_nsec / 1000000000L;
+            abstime.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&log_wake_cond, &log_wake_mutex, &abstime);
+        }
+        __atomic_store_n(&log_writer_idle, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Put a formatted message in the ring. If the ring is full the caller waits
+ * for the writer to make room so that no messages are lost.
+ * @param priority Message priority
+ * @param ts Time stamp for message
+ * @param msg Message
+ * @param len Length of message
+ * @return 0 on success, -1 if the ring is full and there is no writer
+ */
+static int
+_log_enqueue(const int priority, const time_t ts, const char *msg, const size_t len) {
+    size_t pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    while (TRUE) {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        const size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        const ptrdiff_t dif = (ptrdiff_t) seq - (ptrdiff_t) pos;
+        if (0 == dif) {
+            if (__atomic_compare_exchange_n(&log_ring_tail, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+                return -1;
+            }
+            // The ring is full. Give the writer a chance to catch up.
+            pthread_mutex_lock(&log_wake_mutex);
+            pthread_cond_signal(&log_wake_cond);
+            pthread_mutex_unlock(&log_wake_mutex);
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+            pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&log_ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->priority = priority;
+    slot->ts = ts;
+    slot->len = len;
+    memcpy(slot->msg, msg, len + 1);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&log_writer_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_signal(&log_wake_cond);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+    return 0;
+}
+
 /**
  * Log message to either specified log file or if no file is specified use
  * system logger. The name of the output device to use is set in the main
@@ -158,146 +463,120 @@ static int _lastlogcnt = 0;
  */
 void
 logmsg(int priority, const char *msg, ...) {
-    static const int blen = 20 * 1024;
-    static int _loginit = 0;
-    char *msgbuff, *tmpbuff, *logfilebuff;
 
-    pthread_mutex_lock(&logger_mutex);
-
-    msgbuff = calloc(1, blen);
-    tmpbuff = calloc(1, blen);
-    logfilebuff = calloc(1, blen);
-    if (msgbuff == NULL || tmpbuff == NULL || logfilebuff == NULL) {
-        free(msgbuff);
-        free(tmpbuff);
-        free(logfilebuff);
-        syslog(priority, "FATAL. Can not allocate message buffers in logmsg().");
-        pthread_mutex_unlock(&logger_mutex);
+    // Filtered out messages should cost as little as possible
+    if (!_log_enabled(priority)) {
         return;
     }
 
-    // We only print errors by default and info if the verbose flag is set
-    if ((priority == LOG_ERR) || (priority == LOG_CRIT) || (priority == LOG_WARNING) ||
-            ((priority == LOG_INFO) && verbose_log > 0) ||
-            ((priority == LOG_NOTICE) && verbose_log > 1) ||
-            ((priority == LOG_DEBUG) && verbose_log > 2)) {
-        va_list ap;
-        va_start(ap, msg);
-
-        int erroffset = 0;
-        if (priority == LOG_DEBUG) {
-            tmpbuff[0] = '>';
-            tmpbuff[1] = '>';
-            tmpbuff[2] = '>';
-            tmpbuff[3] = ' ';
-            erroffset = 4;
-        } else if (priority == LOG_WARNING) {
-            tmpbuff[0] = '*';
-            tmpbuff[1] = ' ';
-            erroffset = 2;
-        } else if (priority == LOG_ERR) {
-            tmpbuff[0] = '*';
-            tmpbuff[1] = '*';
-            tmpbuff[2] = ' ';
-            erroffset = 3;
-        } else if (priority == LOG_CRIT) {
-            tmpbuff[0] = '*';
-            tmpbuff[1] = '*';
-            tmpbuff[2] = '*';
-            tmpbuff[3] = '*';
-            tmpbuff[4] = ' ';
-            erroffset = 5;
-        }
+    char tmpbuff[LOG_MSG_MAXLEN];
+    int erroffset = 0;
+    if (priority == LOG_DEBUG) {
+        memcpy(tmpbuff, ">>> ", 4);
+        erroffset = 4;
+    } else if (priority == LOG_WARNING) {
+        memcpy(tmpbuff, "* ", 2);
+        erroffset = 2;
+    } else if (priority == LOG_ERR) {
+        memcpy(tmpbuff, "** ", 3);
+        erroffset = 3;
+    } else if (priority == LOG_CRIT) {
+        memcpy(tmpbuff, "**** ", 5);
+        erroffset = 5;
+    }
 
+    va_list ap;
+    va_start(ap, msg);
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-nonliteral"
-        vsnprintf(tmpbuff + erroffset, blen - 1 - erroffset, msg, ap);
+    vsnprintf(tmpbuff + erroffset, sizeof (tmpbuff) - erroffset, msg, ap);
 #pragma clang diagnostic pop
+    va_end(ap);
 
-        tmpbuff[blen - 1] = 0;
-        xstrtrim_crnl(tmpbuff);
-
-        // We don't allow any CR or NL characters in the log so replace
-        // them with spaces
-        for (size_t i = 0; i < strlen(tmpbuff); i++)
-            if (tmpbuff[i] == '\r' || tmpbuff[i] == '\n')
-                tmpbuff[i] = ' ';
-
-        if (*logfile_name == '\0' || strcmp(logfile_name, LOGFILE_SYSLOG) == 0) {
-            if (!_loginit) {
-                openlog(package_name, LOG_PID | LOG_CONS, LOG_DAEMON);
-                _loginit = 1;
-            }
-            syslog(priority, "%s", tmpbuff);
-            // Syslogger
-        } else {
-            mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-            int fd;
-
-            // Use file
-            if (strcmp(logfile_name, "stdout") == 0) {
-                fd = STDOUT_FILENO;
-            } else if (strcmp(logfile_name, "stderr") == 0) {
-                fd = STDERR_FILENO;
-            } else {
-                fd = open(logfile_name, O_APPEND | O_CREAT | O_WRONLY, mode);
-            }
-            if (fd < 0) {
-                // Give a message on syslog and terminate
-                if (!_loginit) {
-                    openlog(PACKAGE_NAME, LOG_PID | LOG_CONS, LOG_USER);
-                    _loginit = 1;
-                }
-                syslog(LOG_ERR, "Couldn't open specified file as logfile. (%s)", tmpbuff);
-                exit(EXIT_FAILURE);
-            } else {
-                char timebuff[32];
-                time_t now = time(NULL);
-
-                ctime_r(&now, timebuff);
+    xstrtrim_crnl(tmpbuff);
 
-                // Get rid of the year at end of time string
-                timebuff[strnlen(timebuff, sizeof (timebuff)) - 5] = 0;
-                snprintf(msgbuff, blen - 1, "%s: %s\n", timebuff, tmpbuff);
-                msgbuff[blen - 1] = 0;
+    // We don't allow any CR or NL characters in the log so replace
+    // them with spaces
+    size_t len = 0;
+    for (; tmpbuff[len]; len++) {
+        if (tmpbuff[len] == '\r' || tmpbuff[len] == '\n')
+            tmpbuff[len] = ' ';
+    }
 
-                if (!LOG_COMPRESS) {
-                    _writef_log(fd, msgbuff);
-                } else {
-                    // If this message has already been written we ignore this and keep
-                    // count on the number of times we written this message.
-                    if (strcmp(tmpbuff, _lastlogmsg)) {
-                        if (_lastlogcnt > 0) {
-                            if (1 == _lastlogcnt) {
-                                _writef_log(fd, "%s: %s\n", timebuff, _lastlogmsg);
-                            } else {
-                                _writef_log(fd, "%s: Msg repeated (#%d) \"%s\"\n", timebuff, _lastlogcnt, _lastlogmsg);
-                            }
-                            _lastlogcnt = 0;
-                            *_lastlogmsg = '\0';
-                        } else {
-                            strncpy(_lastlogmsg, tmpbuff, LASTLOGMSG_LEN);
-                        }
-                        _writef_log(fd, msgbuff);
-                    } else {
-                        _lastlogcnt++;
-                    }
-                }
-                if (fd != STDOUT_FILENO && fd != STDERR_FILENO) {
-                    close(fd);
-                }
-                strncpy(last_logmsg, msgbuff, MAX_LASTLOGMSG - 1);
-                last_logmsg[MAX_LASTLOGMSG - 1] = '\0';
-            }
+    const time_t now = time(NULL);
+    if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE) ||
+        -1 == _log_enqueue(priority, now, tmpbuff, len)) {
+        char batch[LOG_ADD_MAXLEN];
+        size_t blen = 0;
+        pthread_mutex_lock(&logger_mutex);
+        _log_add_batch(batch, sizeof (batch), &blen, priority, now, tmpbuff);
+        if (blen > 0) {
+            _log_write(batch, blen);
         }
+        // Without the writer the file is not kept open since the daemon
+        // closes all descriptors when it is forked
+        _log_close();
+        pthread_mutex_unlock(&logger_mutex);
+    }
+}
 
-        va_end(ap);
+/**
+ * Start the log writer thread. From now on all messages are written by the
+ * writer. Must be called after the daemon has been forked and the signals
+ * have been blocked.
+ * @return 0 on success, -1 on failure
+ */
+int
+logger_start(void) {
+    if (log_writer_running) {
+        return 0;
+    }
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring[i].seq = i;
     }
+    log_ring_head = log_ring_tail = 0;
+    __atomic_store_n(&log_writer_stopping, 0, __ATOMIC_SEQ_CST);
 
-    free(msgbuff);
-    free(tmpbuff);
-    free(logfilebuff);
+    int ret = pthread_create(&log_writer_thread, NULL, _log_writer, NULL);
+    if (0 != ret) {
+        logmsg(LOG_ERR, "Could not create log writer thread ( %d : %s )", ret, strerror(ret));
+        return -1;
+    }
+    __atomic_store_n(&log_writer_running, TRUE, __ATOMIC_RELEASE);
 
+    // Make sure queued messages are written also when the daemon is
+    // terminated with exit()
+    atexit(logger_shutdown);
+    return 0;
+}
+
+/**
+ * Stop the log writer thread after all queued messages have been written.
+ * After this call messages are written directly by the calling thread.
+ */
+void
+logger_shutdown(void) {
+    if (!log_writer_running || pthread_equal(pthread_self(), log_writer_thread)) {
+        return;
+    }
+    __atomic_store_n(&log_writer_stopping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&log_wake_mutex);
+    pthread_cond_signal(&log_wake_cond);
+    pthread_mutex_unlock(&log_wake_mutex);
+    pthread_join(log_writer_thread, NULL);
+    __atomic_store_n(&log_writer_running, FALSE, __ATOMIC_RELEASE);
+
+    // Write any messages that were queued while the writer was stopping
+    pthread_mutex_lock(&logger_mutex);
+    while (__atomic_load_n(&log_ring[log_ring_head & (LOG_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == log_ring_head + 1) {
+        char batch[LOG_ADD_MAXLEN];
+        size_t blen = 0;
+        struct log_slot *slot = &log_ring[log_ring_head & (LOG_RING_SIZE - 1)];
+        _log_add_batch(batch, sizeof (batch), &blen, slot->priority, slot->ts, slot->msg);
+        _log_write(batch, blen);
+        log_ring_head++;
+    }
+    _log_close();
     pthread_mutex_unlock(&logger_mutex);
 }
 
@@ -49,6 +49,12 @@ logmsg(int priority, const char *msg, ...)
 int
 setup_logger(char *packageName) ;
 
+int
+logger_start(void);
+
+void
+logger_shutdown(void);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,442 @@
+/* =========================================================================
+ * File:        MAILDIGEST.C
+ * Description: Coalesce event mails into periodic digest mails. A busy
+ *              tracker (or force_mail_on_all_events) may produce one mail
+ *              per position and each mail costs its own template render,
+ *              minimap lookups and SMTP transaction. When digest mode is
+ *              enabled the events are instead collected per recipient and
+ *              device and sent as one summary mail with a table of all
+ *              events at the end of each window. Priority events are not
+ *              collected and are mailed right away as before.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "g7config.h"
+#include "utils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "dict.h"
+#include "mailqueue.h"
+#include "maildigest.h"
+
+/**
+ * Initial number of event slots in a new digest. Doubled when needed up to
+ * MAILDIGEST_MAX_EVENTS
+ */
+#define MAILDIGEST_INITIAL_EVENTS 16
+
+/**
+ * Upper bound for the length of one formatted row in the event tables
+ */
+#define MAILDIGEST_HTML_ROW_LEN 1024
+#define MAILDIGEST_TXT_ROW_LEN 256
+
+/**
+ * Highest event id we know of
+ */
+#define MAILDIGEST_MAX_EVENTID 100
+
+/**
+ * The events collected for one recipient and device
+ */
+struct digest {
+    struct digest *next;
+    char to[256];
+    char devid[32];             // Device id as shown in the mail
+    char nick_devid[512];
+    time_t deadline;            // When the digest should be sent
+    size_t n;                   // Number of events
+    size_t size;                // Number of allocated event slots
+    struct maildigest_event *ev;
+};
+
+/**
+ * Open digests. Protected by md_mutex
+ */
+static struct digest *md_list = NULL;
+static struct maildigest_stat md_stat;
+
+static _Bool md_priority[MAILDIGEST_MAX_EVENTID + 1];
+static _Bool md_running = FALSE;
+static _Bool md_stopping = FALSE;
+
+static pthread_t md_thread;
+static pthread_mutex_t md_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t md_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Free a digest
+ * @param d Digest to free
+ */
+static void
+_md_free(struct digest *d) {
+    free(d->ev);
+    free(d);
+}
+
+/**
+ * Format the digest window as a readable duration, e.g. "1 hour 30 minutes"
+ * or "45 seconds"
+ * @param secs Length of the window in seconds
+ * @param buf Buffer for the result
+ * @param len Size of buffer
+ */
+static void
+_md_format_window(const unsigned secs, char *buf, const size_t len) {
+    const unsigned part[3] = {secs / 3600, secs % 3600 / 60, secs % 60};
+    static const char *unit[3] = {"hour", "minute", "second"};
+    size_t n = 0;
+    *buf = '\0';
+    for (size_t i = 0; i < 3 && n < len; i++) {
+        if (part[i] > 0 || (0 == secs && 2 == i)) {
+            n += snprintf(buf + n, len - n, "%s%u %s%s", n > 0 ? " " : "", part[i], unit[i], 1 == part[i] ? "" : "s");
+        }
+    }
+}
+
+/**
+ * Build the digest mail and hand it over to the mail queue
+ * @param d Digest to send
+ * @return 0 on success, -99 if mail is disabled, -1 on failure
+ */
+static int
+_md_send(struct digest *d) {
+    dict_t dict = new_dict();
+    char buf[512];
+
+    // Build the event tables in both HTML and plain text and find the
+    // center of all the positions for the overview map
+    char *html = _chk_calloc_exit(d->n * MAILDIGEST_HTML_ROW_LEN + 1);
+    char *txt = _chk_calloc_exit(d->n * MAILDIGEST_TXT_ROW_LEN + 1);
+    size_t hlen = 0, tlen = 0, npos = 0;
+    double lat_sum = 0, lon_sum = 0;
+    for (size_t i = 0; i < d->n; i++) {
+        const struct maildigest_event *ev = &d->ev[i];
+        hlen += snprintf(html + hlen, MAILDIGEST_HTML_ROW_LEN,
+                "<tr><td style=\"padding:4px;font-size:10pt;\">%s</td>"
+                "<td style=\"padding:4px;font-size:10pt;\">%s (%s)</td>"
+                "<td style=\"padding:4px;font-size:10pt;\"><a href=\"http://maps.google.com/maps?q=%s,%s\">%s, %s</a></td>"
+                "<td style=\"padding:4px;font-size:10pt;\">%s</td>"
+                "<td style=\"padding:4px;font-size:10pt;\">%s</td>"
+                "<td style=\"padding:4px;font-size:10pt;\">%s</td>"
+                "<td style=\"padding:4px;font-size:10pt;\">%sV</td></tr>\n",
+                ev->datetime, ev->eventdesc, ev->eventcmd, ev->lat, ev->lon, ev->lat, ev->lon,
+                ev->speed, ev->heading, ev->sat, ev->voltage);
+        tlen += snprintf(txt + tlen, MAILDIGEST_TXT_ROW_LEN,
+                "%-20s %-12s %11s %11s %5s %5s %3s %5sV\n",
+                ev->datetime, ev->eventcmd, ev->lat, ev->lon, ev->speed, ev->heading, ev->sat, ev->voltage);
+        const double lat = strtod(ev->lat, NULL);
+        const double lon = strtod(ev->lon, NULL);
+        if (lat != 0.0 || lon != 0.0) {
+            lat_sum += lat;
+            lon_sum += lon;
+            npos++;
+        }
+    }
+    add_dict(dict, "EVENT_TABLE_HTML", html);
+    add_dict(dict, "EVENT_TABLE_TXT", txt);
+    free(html);
+    free(txt);
+
+    if (npos > 0) {
+        snprintf(buf, sizeof (buf), "%.6f", lat_sum / npos);
+        add_dict(dict, "LAT", buf);
+        snprintf(buf, sizeof (buf), "%.6f", lon_sum / npos);
+        add_dict(dict, "LON", buf);
+    } else {
+        add_dict(dict, "LAT", d->ev[d->n - 1].lat);
+        add_dict(dict, "LON", d->ev[d->n - 1].lon);
+    }
+
+    add_dict(dict, "DEVICEID", d->devid);
+    add_dict(dict, "NICK_DEVID", d->nick_devid);
+    add_dict(dict, "FIRST_DATETIME", d->ev[0].datetime);
+    add_dict(dict, "LAST_DATETIME", d->ev[d->n - 1].datetime);
+    snprintf(buf, sizeof (buf), "%zu", d->n);
+    add_dict(dict, "NUM_EVENTS", buf);
+    _md_format_window(md_stat.window, buf, sizeof (buf));
+    add_dict(dict, "DIGEST_WINDOW", buf);
+    add_dict(dict, "DAEMONVERSION", PACKAGE_VERSION);
+
+    time_t now = time(NULL);
+    ctime_r(&now, buf);
+    buf[strnlen(buf, sizeof (buf)) - 1] = 0; // Remove trailing newline
+    add_dict(dict, "SERVERTIME", buf);
+    gethostname(buf, sizeof (buf));
+    buf[sizeof (buf) - 1] = '\0';
+    add_dict(dict, "SERVERNAME", buf);
+
+    char subjectbuff[512];
+    snprintf(subjectbuff, sizeof (subjectbuff), SUBJECT_DIGESTMAIL, mail_subject_prefix, d->devid, d->n);
+
+    // The mail queue takes over the dictionary
+    const int rc = mailqueue_enqueue(subjectbuff, d->to, "mail_digest", dict, include_minimap ? MAILJOB_OVERVIEW : 0);
+    if (-1 == rc) {
+        logmsg(LOG_ERR, "Failed to queue digest mail using template \"mail_digest\"");
+    } else if (0 == rc) {
+        logmsg(LOG_INFO, "Queued digest mail with %zu events for \"%s\" to \"%s\"", d->n, d->devid, d->to);
+    }
+    return rc;
+}
+
+/**
+ * Update the statistics for a digest that has been taken off the list.
+ * The caller must hold md_mutex.
+ * @param d Digest
+ */
+static void
+_md_count_sent(const struct digest *d) {
+    md_stat.pending_events -= d->n;
+    md_stat.pending_digests--;
+    md_stat.digests++;
+    md_stat.events += d->n;
+}
+
+/**
+ * Digest thread. Sends each digest when its window has passed (or when it
+ * is full) and then sleeps until the next digest is due.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+maildigest_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&md_mutex);
+    while (!md_stopping) {
+
+        // Take all due digests off the list
+        const time_t now = time(NULL);
+        time_t next = 0;
+        struct digest *due = NULL, **pp = &md_list;
+        while (*pp) {
+            struct digest *d = *pp;
+            if (d->deadline <= now) {
+                *pp = d->next;
+                d->next = due;
+                due = d;
+                _md_count_sent(d);
+            } else {
+                if (0 == next || d->deadline < next) {
+                    next = d->deadline;
+                }
+                pp = &d->next;
+            }
+        }
+
+        if (NULL == due) {
+            if (next) {
+                struct timespec deadline = {.tv_sec = next, .tv_nsec = 0};
+                pthread_cond_timedwait(&md_cond, &md_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&md_cond, &md_mutex);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&md_mutex);
+        while (due) {
+            struct digest *d = due;
+            due = d->next;
+            (void) _md_send(d);
+            _md_free(d);
+        }
+        pthread_mutex_lock(&md_mutex);
+    }
+    pthread_mutex_unlock(&md_mutex);
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Start digest mode
+ * @param window Length of the digest window in seconds. 0 disables digest mode
+ * @param priority_events Comma separated list of event ids that should never
+ * be put in a digest
+ * @return 0 on success (or if digest mode is disabled), -1 on failure
+ */
+int
+maildigest_init(const unsigned window, const char *priority_events) {
+    memset(&md_stat, 0, sizeof (md_stat));
+    memset(md_priority, 0, sizeof (md_priority));
+    if (0 == window) {
+        return 0;
+    }
+
+    char *list = strdup(priority_events), *saveptr = NULL;
+    for (char *tok = strtok_r(list, ", ", &saveptr); tok; tok = strtok_r(NULL, ", ", &saveptr)) {
+        const int id = xatoi(tok);
+        if (id < 0 || id > MAILDIGEST_MAX_EVENTID) {
+            logmsg(LOG_ERR, "Ignoring unknown event id \"%s\" in mail_digest_priority_events", tok);
+            continue;
+        }
+        md_priority[id] = TRUE;
+    }
+    free(list);
+
+    int ret = pthread_create(&md_thread, NULL, maildigest_thread, NULL);
+    if (0 != ret) {
+        logmsg(LOG_CRIT, "Could not create mail digest thread ( %d : %s )", ret, strerror(ret));
+        return -1;
+    }
+    md_stat.window = window;
+    md_running = TRUE;
+    logmsg(LOG_DEBUG, "Started mail digest with a %u s window", window);
+    return 0;
+}
+
+/**
+ * Stop digest mode. All open digests are handed over to the mail queue
+ * right away so no events are lost. Must be called before the mail queue
+ * is shut down.
+ */
+void
+maildigest_shutdown(void) {
+    if (!md_running) {
+        return;
+    }
+    pthread_mutex_lock(&md_mutex);
+    md_stopping = TRUE;
+    pthread_cond_signal(&md_cond);
+    pthread_mutex_unlock(&md_mutex);
+    pthread_join(md_thread, NULL);
+
+    // From now on events fall back to one mail per event
+    pthread_mutex_lock(&md_mutex);
+    md_running = FALSE;
+    struct digest *d = md_list;
+    md_list = NULL;
+    for (struct digest *p = d; p; p = p->next) {
+        _md_count_sent(p);
+    }
+    pthread_mutex_unlock(&md_mutex);
+
+    while (d) {
+        struct digest *next = d->next;
+        (void) _md_send(d);
+        _md_free(d);
+        d = next;
+    }
+    logmsg(LOG_DEBUG, "Mail digest stopped after %lu digests", md_stat.digests);
+}
+
+/**
+ * Check if a mail for this event should be put in a digest. Events that are
+ * not put in a digest are mailed right away.
+ * @param eventid Event id
+ * @return TRUE if digest mode is enabled and this is not a priority event
+ */
+_Bool
+maildigest_use(const int eventid) {
+    if (!md_running) {
+        return FALSE;
+    }
+    if (eventid >= 0 && eventid <= MAILDIGEST_MAX_EVENTID && md_priority[eventid]) {
+        pthread_mutex_lock(&md_mutex);
+        md_stat.priority++;
+        pthread_mutex_unlock(&md_mutex);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Add an event to the digest for this recipient and device. A new digest is
+ * opened if there is none and it is sent when the window has passed.
+ * @param to Recipient mail address
+ * @param devid Device id as it should be shown in the mail
+ * @param nick_devid Nick name and device id
+ * @param ev The event
+ * @return 0 on success, -1 if digest mode is not running
+ */
+int
+maildigest_add(const char *to, const char *devid, const char *nick_devid, const struct maildigest_event *ev) {
+    pthread_mutex_lock(&md_mutex);
+    if (!md_running || md_stopping) {
+        pthread_mutex_unlock(&md_mutex);
+        return -1;
+    }
+
+    struct digest *d = md_list;
+    while (d && (strcmp(d->devid, devid) || strcmp(d->to, to))) {
+        d = d->next;
+    }
+
+    if (NULL == d) {
+        d = _chk_calloc_exit(sizeof (struct digest));
+        xstrlcpy(d->to, to, sizeof (d->to));
+        xstrlcpy(d->devid, devid, sizeof (d->devid));
+        d->deadline = time(NULL) + md_stat.window;
+        d->next = md_list;
+        md_list = d;
+        md_stat.pending_digests++;
+        // Wake up the thread so it knows about the new deadline
+        pthread_cond_signal(&md_cond);
+    }
+
+    if (d->n == d->size) {
+        d->size = d->size ? 2 * d->size : MAILDIGEST_INITIAL_EVENTS;
+        d->ev = realloc(d->ev, d->size * sizeof (struct maildigest_event));
+        if (NULL == d->ev) {
+            logmsg(LOG_CRIT, "Out of memory in maildigest_add()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The nick may have changed since the digest was opened
+    xstrlcpy(d->nick_devid, nick_devid, sizeof (d->nick_devid));
+    d->ev[d->n++] = *ev;
+    md_stat.pending_events++;
+
+    // A full digest is sent right away
+    if (d->n >= MAILDIGEST_MAX_EVENTS) {
+        d->deadline = 0;
+        pthread_cond_signal(&md_cond);
+    }
+    pthread_mutex_unlock(&md_mutex);
+    return 0;
+}
+
+/**
+ * Get a snapshot of the digest statistics
+ * @param[out] stat Statistics
+ */
+void
+maildigest_get_stat(struct maildigest_stat *stat) {
+    pthread_mutex_lock(&md_mutex);
+    *stat = md_stat;
+    pthread_mutex_unlock(&md_mutex);
+}
+
+/* EOF */
@@ -0,0 +1,82 @@
+/* =========================================================================
+ * File:        MAILDIGEST.H
+ * Description: Coalesce event mails into periodic digest mails
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef MAILDIGEST_H
+#define	MAILDIGEST_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of events in one digest. When a digest is full it is sent
+ * right away without waiting for the end of the window.
+ */
+#define MAILDIGEST_MAX_EVENTS 500
+
+/**
+ * One event in a digest
+ */
+struct maildigest_event {
+    char datetime[32];
+    char eventcmd[32];
+    char eventdesc[64];
+    char lat[16];
+    char lon[16];
+    char speed[16];
+    char heading[16];
+    char sat[16];
+    char voltage[16];
+};
+
+/**
+ * Statistics for the digest mails
+ */
+struct maildigest_stat {
+    unsigned window;            // Length of the digest window in seconds (0 = disabled)
+    size_t pending_events;      // Number of events waiting for the next digest
+    size_t pending_digests;     // Number of open digests (recipient and device)
+    unsigned long digests;      // Number of digest mails queued
+    unsigned long events;       // Number of events sent in digest mails
+    unsigned long priority;     // Number of priority events that bypassed the digest
+};
+
+int
+maildigest_init(const unsigned window, const char *priority_events);
+
+void
+maildigest_shutdown(void);
+
+_Bool
+maildigest_use(const int eventid);
+
+int
+maildigest_add(const char *to, const char *devid, const char *nick_devid, const struct maildigest_event *ev);
+
+void
+maildigest_get_stat(struct maildigest_stat *stat);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MAILDIGEST_H */
@@ -0,0 +1,652 @@
+/* =========================================================================
+ * File:        MAILQUEUE.C
+ * Description: Persistent queue for event mails. Sending a mail involves
+ *              an address lookup, fetching minimaps and an SMTP session
+ *              which may all be slow. To avoid holding up the tracker
+ *              threads the mails are only queued there and then sent by a
+ *              small pool of worker threads. Each queued mail is also
+ *              written to a file in the queue directory so mails that
+ *              have not been sent when the daemon stops are sent after
+ *              the next start. Failed mails are retried with an
+ *              exponential backoff.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "g7config.h"
+#include "utils.h"
+#include "futils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "geoloc.h"
+#include "mailutil.h"
+#include "mailqueue.h"
+
+/**
+ * Delay (in seconds) before the first retry of a failed mail. The delay is
+ * doubled for each following attempt up to MAILQUEUE_MAX_RETRY_DELAY.
+ */
+#define MAILQUEUE_RETRY_DELAY 30
+#define MAILQUEUE_MAX_RETRY_DELAY 3600
+
+/**
+ * Suffix for the files in the queue directory
+ */
+#define MAILQUEUE_FILE_SUFFIX ".job"
+
+/**
+ * One queued mail
+ */
+struct mailjob {
+    struct mailjob *next;
+    char filename[64];          // Name of the job file in the queue directory
+    char subject[256];
+    char to[256];
+    char templatename[64];
+    unsigned flags;             // Work left to do before sending (MAILJOB_*)
+    unsigned attempts;          // Number of failed send attempts
+    double queued_ms;           // Wall clock time in ms when the mail was queued
+    time_t next_try;            // Earliest time for the next attempt
+    dict_t dict;                // Keywords for the template
+};
+
+/**
+ * The queue. Mails are appended at the tail and the workers take the first
+ * mail that is ready to be sent. Protected by mq_mutex
+ */
+static struct mailjob *mq_head = NULL;
+static struct mailjob *mq_tail = NULL;
+static struct mailqueue_stat mq_stat;
+
+static unsigned mq_max_retries = 0;
+static unsigned mq_seq = 0;
+static _Bool mq_running = FALSE;
+static _Bool mq_stopping = FALSE;
+static char mq_dir[512];
+
+static pthread_t mq_threads[MAILQUEUE_MAX_WORKERS];
+static pthread_mutex_t mq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mq_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Wall clock time in ms. Used for the latency since a queued mail may be
+ * sent after a restart of the daemon.
+ * @return Current time in ms
+ */
+static double
+_mq_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Free a mail job
+ * @param job Job to free
+ */
+static void
+_mq_free_job(struct mailjob *job) {
+    if (job->dict) {
+        free_dict(job->dict);
+    }
+    free(job);
+}
+
+/**
+ * Append a job to the queue. The caller must hold mq_mutex.
+ * @param job Job to append
+ */
+static void
+_mq_append(struct mailjob *job) {
+    job->next = NULL;
+    if (mq_tail) {
+        mq_tail->next = job;
+    } else {
+        mq_head = job;
+    }
+    mq_tail = job;
+    mq_stat.queue_len++;
+    if (mq_stat.queue_len > mq_stat.queue_peak) {
+        mq_stat.queue_peak = mq_stat.queue_len;
+    }
+}
+
+/**
+ * Write a string to the job file escaping tab, newline and backslash so that
+ * each entry in the file is exactly one line.
+ * @param fp File to write to
+ * @param str String to write
+ */
+static void
+_mq_fputs_esc(FILE *fp, const char *str) {
+    for (; *str; str++) {
+        switch (*str) {
+            case '\\': fputs("\\\\", fp);
+                break;
+            case '\t': fputs("\\t", fp);
+                break;
+            case '\n': fputs("\\n", fp);
+                break;
+            case '\r': fputs("\\r", fp);
+                break;
+            default: fputc(*str, fp);
+        }
+    }
+}
+
+/**
+ * Undo the escaping done by _mq_fputs_esc() in place
+ * @param str String to unescape
+ */
+static void
+_mq_unescape(char *str) {
+    char *d = str;
+    for (; *str; str++) {
+        if ('\\' == *str && str[1]) {
+            str++;
+            *d++ = 't' == *str ? '\t' : 'n' == *str ? '\n' : 'r' == *str ? '\r' : *str;
+        } else {
+            *d++ = *str;
+        }
+    }
+    *d = '\0';
+}
+
+/**
+ * Store a job in the queue directory. The job is first written to a
+ * temporary file and then renamed so that a crash never leaves a half
+ * written job behind.
+ * @param job Job to store
+ * @return 0 on success, -1 on failure
+ */
+static int
+_mq_write_job(const struct mailjob *job) {
+    char fname[600], tmpname[610];
+    snprintf(fname, sizeof (fname), "%s/%s", mq_dir, job->filename);
+    snprintf(tmpname, sizeof (tmpname), "%s.tmp", fname);
+
+    FILE *fp = fopen(tmpname, "w");
+    if (NULL == fp) {
+        logmsg(LOG_ERR, "Cannot write queued mail \"%s\" ( %d : %s )", tmpname, errno, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "queued\t%.0f\nattempts\t%u\nflags\t%u\n", job->queued_ms, job->attempts, job->flags);
+    fputs("subject\t", fp);
+    _mq_fputs_esc(fp, job->subject);
+    fputs("\nto\t", fp);
+    _mq_fputs_esc(fp, job->to);
+    fputs("\ntemplate\t", fp);
+    _mq_fputs_esc(fp, job->templatename);
+    fputc('\n', fp);
+    for (size_t i = 0; i < job->dict->idx; i++) {
+        fputs("key\t", fp);
+        _mq_fputs_esc(fp, job->dict->tuple[i].key);
+        fputc('\t', fp);
+        _mq_fputs_esc(fp, job->dict->tuple[i].val);
+        fputc('\n', fp);
+    }
+    if (0 != fclose(fp) || -1 == rename(tmpname, fname)) {
+        logmsg(LOG_ERR, "Cannot write queued mail \"%s\" ( %d : %s )", fname, errno, strerror(errno));
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove the file for a job from the queue directory
+ * @param job Job
+ */
+static void
+_mq_remove_job(const struct mailjob *job) {
+    char fname[600];
+    snprintf(fname, sizeof (fname), "%s/%s", mq_dir, job->filename);
+    if (-1 == unlink(fname) && ENOENT != errno) {
+        logmsg(LOG_ERR, "Cannot remove queued mail \"%s\" ( %d : %s )", fname, errno, strerror(errno));
+    }
+}
+
+/**
+ * Callback for process_files(). Read one job file left in the queue
+ * directory from a previous run and add it to the queue.
+ * @param filename Full path of the job file
+ * @param idx Not used
+ * @return 0 on success, -1 on failure
+ */
+static int
+_mq_load_job(char *filename, size_t idx) {
+    (void) idx;
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp) {
+        logmsg(LOG_ERR, "Cannot read queued mail \"%s\" ( %d : %s )", filename, errno, strerror(errno));
+        return -1;
+    }
+
+    struct mailjob *job = _chk_calloc_exit(sizeof (struct mailjob));
+    job->dict = new_dict();
+    char *base = strrchr(filename, '/');
+    xstrlcpy(job->filename, base ? base + 1 : filename, sizeof (job->filename));
+
+    char *line = NULL;
+    size_t len = 0;
+    while (-1 != getline(&line, &len, fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *val = strchr(line, '\t');
+        if (NULL == val) {
+            continue;
+        }
+        *val++ = '\0';
+        if (0 == strcmp(line, "key")) {
+            char *kval = strchr(val, '\t');
+            if (kval) {
+                *kval++ = '\0';
+                _mq_unescape(val);
+                _mq_unescape(kval);
+                add_dict(job->dict, val, kval);
+            }
+            continue;
+        }
+        _mq_unescape(val);
+        if (0 == strcmp(line, "queued")) {
+            job->queued_ms = strtod(val, NULL);
+        } else if (0 == strcmp(line, "attempts")) {
+            job->attempts = (unsigned) xatoi(val);
+        } else if (0 == strcmp(line, "flags")) {
+            job->flags = (unsigned) xatoi(val);
+        } else if (0 == strcmp(line, "subject")) {
+            xstrlcpy(job->subject, val, sizeof (job->subject));
+        } else if (0 == strcmp(line, "to")) {
+            xstrlcpy(job->to, val, sizeof (job->to));
+        } else if (0 == strcmp(line, "template")) {
+            xstrlcpy(job->templatename, val, sizeof (job->templatename));
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if ('\0' == *job->to || '\0' == *job->templatename) {
+        logmsg(LOG_ERR, "Ignoring corrupt queued mail \"%s\"", filename);
+        _mq_free_job(job);
+        unlink(filename);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mq_mutex);
+    _mq_append(job);
+    pthread_mutex_unlock(&mq_mutex);
+    return 0;
+}
+
+/**
+ * Do the remaining work for a mail and send it
+ * @param job Mail to send
+ * @return 0 on success, -99 if mail is disabled, -1 on failure
+ */
+static int
+_mq_send(struct mailjob *job) {
+    char *lat = getval_dict(job->dict, "LAT");
+    char *lon = getval_dict(job->dict, "LON");
+
+    if ((job->flags & MAILJOB_ADDRESS) && lat && lon) {
+        char address[512];
+        // No need for error check since the address field will have  "?" in case of error
+        get_address_from_latlon(lat, lon, address, sizeof (address));
+        add_dict(job->dict, "APPROX_ADDRESS", address);
+        job->flags &= ~MAILJOB_ADDRESS;
+    }
+
+    if ((job->flags & MAILJOB_MINIMAP) && lat && lon) {
+
+        logmsg(LOG_DEBUG, "Adding minimap to mail");
+
+        char kval[32];
+        snprintf(kval, sizeof (kval), "%d", minimap_width);
+        add_dict(job->dict, "IMG_WIDTH", kval);
+
+        snprintf(kval, sizeof (kval), "%d", minimap_overview_zoom);
+        add_dict(job->dict, "ZOOM_OVERVIEW", kval);
+
+        snprintf(kval, sizeof (kval), "%d", minimap_detailed_zoom);
+        add_dict(job->dict, "ZOOM_DETAILED", kval);
+
+        char *overview_imgdata = NULL, *detailed_imgdata = NULL;
+        size_t overview_datasize = 0, detailed_datasize = 0;
+        int rc = get_minimap_from_latlon(lat, lon, minimap_overview_zoom, minimap_width, minimap_height, &overview_imgdata, &overview_datasize);
+        if (0 == rc)
+            rc = get_minimap_from_latlon(lat, lon, minimap_detailed_zoom, minimap_width, minimap_height, &detailed_imgdata, &detailed_datasize);
+
+        if (0 == rc) {
+            char templatename[80];
+            snprintf(templatename, sizeof (templatename), "%s_img", job->templatename);
+
+            struct inlineimage_t inlineimg_arr[2];
+            setup_inlineimg(&inlineimg_arr[0], "overview_map.png", overview_datasize, overview_imgdata);
+            setup_inlineimg(&inlineimg_arr[1], "detailed_map.png", detailed_datasize, detailed_imgdata);
+
+            rc = send_mail_template(job->subject, daemon_email_from, job->to, templatename,
+                    job->dict, NULL, 2, inlineimg_arr);
+
+            free_inlineimg_array(inlineimg_arr, 2);
+        } else {
+            logmsg(LOG_ERR, "Failed to get static map from Google. Are you using a correct API key?");
+            logmsg(LOG_ERR, "Sending mail without the static maps.");
+            rc = send_mail_template(job->subject, daemon_email_from, job->to, job->templatename,
+                    job->dict, NULL, 0, NULL);
+        }
+        // The images are our own copies from the minimap cache
+        free(overview_imgdata);
+        free(detailed_imgdata);
+        return rc;
+    }
+
+    if ((job->flags & MAILJOB_OVERVIEW) && lat && lon) {
+
+        char kval[32];
+        snprintf(kval, sizeof (kval), "%d", minimap_width);
+        add_dict(job->dict, "IMG_WIDTH", kval);
+
+        snprintf(kval, sizeof (kval), "%d", minimap_overview_zoom);
+        add_dict(job->dict, "ZOOM_OVERVIEW", kval);
+
+        char *overview_imgdata = NULL;
+        size_t overview_datasize = 0;
+        int rc = get_minimap_from_latlon(lat, lon, minimap_overview_zoom, minimap_width, minimap_height, &overview_imgdata, &overview_datasize);
+        if (0 == rc) {
+            char templatename[80];
+            snprintf(templatename, sizeof (templatename), "%s_img", job->templatename);
+
+            struct inlineimage_t inlineimg;
+            setup_inlineimg(&inlineimg, "overview_map.png", overview_datasize, overview_imgdata);
+
+            rc = send_mail_template(job->subject, daemon_email_from, job->to, templatename,
+                    job->dict, NULL, 1, &inlineimg);
+
+            free_inlineimg_array(&inlineimg, 1);
+        } else {
+            logmsg(LOG_ERR, "Failed to get static map from Google. Sending mail without the overview map.");
+            rc = send_mail_template(job->subject, daemon_email_from, job->to, job->templatename,
+                    job->dict, NULL, 0, NULL);
+        }
+        free(overview_imgdata);
+        return rc;
+    }
+
+    return send_mail_template(job->subject, daemon_email_from, job->to, job->templatename,
+            job->dict, NULL, 0, NULL);
+}
+
+/**
+ * Mail worker thread. Takes the first mail that is ready to be sent from the
+ * queue and sends it. Failed mails are put back last in the queue with a
+ * delay before the next attempt.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+mailqueue_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&mq_mutex);
+    while (!mq_stopping) {
+
+        // Find the first mail that is ready and the time when the next
+        // delayed mail will be ready
+        const time_t now = time(NULL);
+        time_t next_try = 0;
+        struct mailjob *prev = NULL, *job = mq_head;
+        while (job && job->next_try > now) {
+            if (0 == next_try || job->next_try < next_try) {
+                next_try = job->next_try;
+            }
+            prev = job;
+            job = job->next;
+        }
+
+        if (NULL == job) {
+            if (next_try) {
+                struct timespec deadline = {.tv_sec = next_try, .tv_nsec = 0};
+                pthread_cond_timedwait(&mq_cond, &mq_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&mq_cond, &mq_mutex);
+            }
+            continue;
+        }
+
+        // Unlink the mail from the queue while it is being sent
+        if (prev) {
+            prev->next = job->next;
+        } else {
+            mq_head = job->next;
+        }
+        if (mq_tail == job) {
+            mq_tail = prev;
+        }
+        mq_stat.queue_len--;
+        mq_stat.inflight++;
+        pthread_mutex_unlock(&mq_mutex);
+
+        const int rc = _mq_send(job);
+        const double sent_ms = _mq_now_ms();
+
+        _Bool done = TRUE;
+        if (-1 == rc) {
+            job->attempts++;
+            if (job->attempts > mq_max_retries) {
+                logmsg(LOG_ERR, "Giving up mail \"%s\" to \"%s\" after %u attempts", job->subject, job->to, job->attempts);
+            } else {
+                unsigned delay = MAILQUEUE_RETRY_DELAY << (job->attempts - 1 < 8 ? job->attempts - 1 : 8);
+                if (delay > MAILQUEUE_MAX_RETRY_DELAY) {
+                    delay = MAILQUEUE_MAX_RETRY_DELAY;
+                }
+                job->next_try = time(NULL) + delay;
+                logmsg(LOG_NOTICE, "Failed to send mail \"%s\". Retrying in %u s", job->subject, delay);
+                // Remember the attempts and the address lookup already done
+                (void) _mq_write_job(job);
+                done = FALSE;
+            }
+        } else {
+            if (0 == rc) {
+                logmsg(LOG_INFO, "Sent mail \"%s\" to \"%s\"", job->subject, job->to);
+            }
+        }
+        if (done) {
+            _mq_remove_job(job);
+        }
+
+        pthread_mutex_lock(&mq_mutex);
+        mq_stat.inflight--;
+        if (done) {
+            if (-1 == rc) {
+                mq_stat.failed++;
+            } else if (0 == rc) {
+                const double latency = sent_ms - job->queued_ms;
+                mq_stat.sent++;
+                mq_stat.latency_avg_ms += (latency - mq_stat.latency_avg_ms) / (double) mq_stat.sent;
+                if (latency > mq_stat.latency_max_ms) {
+                    mq_stat.latency_max_ms = latency;
+                }
+            }
+            _mq_free_job(job);
+        } else {
+            mq_stat.retries++;
+            _mq_append(job);
+        }
+    }
+    pthread_mutex_unlock(&mq_mutex);
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Load mails left in the queue directory and start the mail workers
+ * @param nworkers Number of worker threads
+ * @param max_retries Maximum number of times a failed mail is retried
+ * @return 0 on success, -1 on failure
+ */
+int
+mailqueue_init(const unsigned nworkers, const unsigned max_retries) {
+    mq_max_retries = max_retries;
+    memset(&mq_stat, 0, sizeof (mq_stat));
+
+    snprintf(mq_dir, sizeof (mq_dir), "%s/%s", data_dir, MAILQUEUE_SUBDIR);
+    if (-1 == chkcreatedir(data_dir, MAILQUEUE_SUBDIR)) {
+        return -1;
+    }
+
+    size_t nfiles = 0;
+    if (-1 == process_files(mq_dir, MAILQUEUE_FILE_SUFFIX, MAILQUEUE_MAX_LEN, &nfiles, _mq_load_job)) {
+        logmsg(LOG_ERR, "Failed to read all queued mails from \"%s\"", mq_dir);
+    } else if (nfiles > 0) {
+        logmsg(LOG_INFO, "Found %zu queued mails from previous run", nfiles);
+    }
+
+    const unsigned n = nworkers < MAILQUEUE_MAX_WORKERS ? nworkers : MAILQUEUE_MAX_WORKERS;
+    for (unsigned i = 0; i < n; i++) {
+        int ret = pthread_create(&mq_threads[i], NULL, mailqueue_thread, NULL);
+        if (0 != ret) {
+            logmsg(LOG_CRIT, "Could not create mail worker thread ( %d : %s )", ret, strerror(ret));
+            break;
+        }
+        mq_stat.workers++;
+    }
+    if (0 == mq_stat.workers) {
+        return -1;
+    }
+    mq_running = TRUE;
+    logmsg(LOG_DEBUG, "Started %u mail workers", mq_stat.workers);
+    return 0;
+}
+
+/**
+ * Stop the mail workers. Mails being sent are finished but mails still in
+ * the queue are kept in the queue directory and sent after the next start.
+ */
+void
+mailqueue_shutdown(void) {
+    if (!mq_running) {
+        return;
+    }
+    pthread_mutex_lock(&mq_mutex);
+    mq_stopping = TRUE;
+    pthread_cond_broadcast(&mq_cond);
+    pthread_mutex_unlock(&mq_mutex);
+    for (unsigned i = 0; i < mq_stat.workers; i++) {
+        pthread_join(mq_threads[i], NULL);
+    }
+    mq_running = FALSE;
+
+    size_t left = mq_stat.queue_len;
+    while (mq_head) {
+        struct mailjob *job = mq_head;
+        mq_head = job->next;
+        _mq_free_job(job);
+    }
+    mq_tail = NULL;
+    mq_stat.queue_len = 0;
+    if (left > 0) {
+        logmsg(LOG_NOTICE, "Mail workers stopped with %zu mails left in queue", left);
+    } else {
+        logmsg(LOG_DEBUG, "Mail workers stopped after sending %lu mails", mq_stat.sent);
+    }
+}
+
+/**
+ * Queue a mail to be sent by the mail workers. The queue takes over the
+ * ownership of the dictionary which must not be used by the caller after
+ * this call. If the workers are not running the mail is sent directly.
+ * @param subject Mail subject
+ * @param to To mail address
+ * @param templatename The template name (without suffix)
+ * @param dict The keywords for the template
+ * @param flags Work to be done by the worker before the mail is sent (MAILJOB_*)
+ * @return 0 on success, -99 if mail is disabled, -1 on failure
+ */
+int
+mailqueue_enqueue(const char *subject, const char *to, const char *templatename, dict_t dict, const unsigned flags) {
+
+    if (!enable_mail) {
+        logmsg(LOG_DEBUG, "Mailhandling disabled in configuration. No mail will be sent.");
+        free_dict(dict);
+        return -99;
+    }
+
+    struct mailjob *job = _chk_calloc_exit(sizeof (struct mailjob));
+    xstrlcpy(job->subject, subject, sizeof (job->subject));
+    xstrlcpy(job->to, to, sizeof (job->to));
+    xstrlcpy(job->templatename, templatename, sizeof (job->templatename));
+    job->flags = flags;
+    job->dict = dict;
+    job->queued_ms = _mq_now_ms();
+
+    if (!mq_running) {
+        int rc = _mq_send(job);
+        _mq_free_job(job);
+        return rc;
+    }
+
+    pthread_mutex_lock(&mq_mutex);
+    if (mq_stat.queue_len >= MAILQUEUE_MAX_LEN) {
+        mq_stat.dropped++;
+        pthread_mutex_unlock(&mq_mutex);
+        logmsg(LOG_ERR, "Mail queue is full (%d mails). Mail \"%s\" dropped.", MAILQUEUE_MAX_LEN, subject);
+        _mq_free_job(job);
+        return -1;
+    }
+    snprintf(job->filename, sizeof (job->filename), "%ld-%d-%u" MAILQUEUE_FILE_SUFFIX,
+            (long) time(NULL), (int) getpid(), ++mq_seq);
+    pthread_mutex_unlock(&mq_mutex);
+
+    // A mail that cannot be stored is still sent, it will only be lost
+    // if the daemon is stopped before that
+    (void) _mq_write_job(job);
+
+    pthread_mutex_lock(&mq_mutex);
+    _mq_append(job);
+    pthread_cond_signal(&mq_cond);
+    pthread_mutex_unlock(&mq_mutex);
+    return 0;
+}
+
+/**
+ * Get a snapshot of the mail queue statistics
+ * @param[out] stat Statistics
+ */
+void
+mailqueue_get_stat(struct mailqueue_stat *stat) {
+    pthread_mutex_lock(&mq_mutex);
+    *stat = mq_stat;
+    pthread_mutex_unlock(&mq_mutex);
+}
+
+/* EOF */
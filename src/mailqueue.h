@@ -0,0 +1,94 @@
+/* =========================================================================
+ * File:        MAILQUEUE.H
+ * Description: Persistent queue for event mails that are sent by a pool
+ *              of worker threads.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef MAILQUEUE_H
+#define	MAILQUEUE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "dict.h"
+
+/**
+ * Name of the directory under the main data directory where queued mails
+ * are stored until they have been sent
+ */
+#define MAILQUEUE_SUBDIR "mailqueue"
+
+/**
+ * Maximum number of mail worker threads
+ */
+#define MAILQUEUE_MAX_WORKERS 8
+
+/**
+ * Maximum number of mails waiting to be sent. New mails are dropped when
+ * the queue is full.
+ */
+#define MAILQUEUE_MAX_LEN 5000
+
+/**
+ * Flags for work that is done by the worker before the mail is sent.
+ * MAILJOB_ADDRESS  - Lookup the address from the LAT/LON keys and add it as
+ *                    APPROX_ADDRESS
+ * MAILJOB_MINIMAP  - Add minimaps for the LAT/LON keys and use the template
+ *                    with the "_img" suffix
+ * MAILJOB_OVERVIEW - As MAILJOB_MINIMAP but only add the overview map
+ */
+#define MAILJOB_ADDRESS 0x01
+#define MAILJOB_MINIMAP 0x02
+#define MAILJOB_OVERVIEW 0x04
+
+/**
+ * Statistics for the mail queue
+ */
+struct mailqueue_stat {
+    size_t queue_len;           // Number of mails waiting to be sent
+    size_t queue_peak;          // Largest number of waiting mails seen
+    unsigned inflight;          // Number of mails being sent right now
+    unsigned workers;           // Number of worker threads
+    unsigned long sent;         // Number of sent mails
+    unsigned long retries;      // Number of failed attempts that will be retried
+    unsigned long failed;       // Number of mails given up after all retries
+    unsigned long dropped;      // Number of mails dropped since the queue was full
+    double latency_avg_ms;      // Average time from queued to sent
+    double latency_max_ms;      // Longest time from queued to sent
+};
+
+int
+mailqueue_init(const unsigned nworkers, const unsigned max_retries);
+
+void
+mailqueue_shutdown(void);
+
+int
+mailqueue_enqueue(const char *subject, const char *to, const char *templatename, dict_t dict, const unsigned flags);
+
+void
+mailqueue_get_stat(struct mailqueue_stat *stat);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MAILQUEUE_H */
@@ -222,7 +222,7 @@ send_mail_template(char *subject, char *from, char *to,
         }
     }
 
-    struct smtp_handle *handle = smtp_setup(smtp_server, smtp_user, smtp_pwd, smtp_port);
+    struct smtp_handle *handle = smtp_session_get(smtp_server, smtp_user, smtp_pwd, smtp_port);
 
     if (handle == NULL) {
         logmsg(LOG_ERR, "Could NOT connect to SMTP server (%s) with credentials [%s:%s] on port %d", smtp_server, smtp_user, smtp_pwd, smtp_port);
@@ -239,7 +239,7 @@ send_mail_template(char *subject, char *from, char *to,
         free(buffer);
         if (buffer2)
             free(buffer2);
-        smtp_cleanup(&handle);
+        smtp_session_release(&handle, TRUE);
         return -1;
     } else {
         logmsg(LOG_DEBUG, "Added recipients To: '%s'", to);
@@ -290,10 +290,45 @@ send_mail_template(char *subject, char *from, char *to,
         logmsg(LOG_DEBUG, "Successfully sent SMTP mail with subject '%s' ", subject);
     }
 
-    smtp_cleanup(&handle);
+    smtp_session_release(&handle, 0 == rc);
     return rc;
 }
 
+/**
+ * Callback for process_files(). Compile one mail template.
+ * @param filename Full path of the template file
+ * @param idx Not used
+ * @return 0 on success, -1 on failure
+ */
+static int
+_load_mail_template(char *filename, size_t idx) {
+    (void) idx;
+    if (-1 == dict_load_template(filename)) {
+        logmsg(LOG_ERR, "Cannot load mail template \"%s\"", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compile all mail templates at startup so that they are ready to use when
+ * the first mail is sent. A template that is changed afterwards is compiled
+ * again the next time it is used.
+ * @return 0 on success, -1 on failure
+ */
+int
+load_mail_templates(void) {
+    char dirbuff[256];
+    size_t nhtml = 0, ntxt = 0;
+    snprintf(dirbuff, sizeof (dirbuff), "%s/%s", data_dir, MAIL_TEMPLATE_SUBDIR);
+    if (-1 == process_files(dirbuff, ".html", 256, &nhtml, _load_mail_template) ||
+        -1 == process_files(dirbuff, ".txt", 256, &ntxt, _load_mail_template)) {
+        return -1;
+    }
+    logmsg(LOG_INFO, "Loaded %zu mail templates from \"%s\"", nhtml + ntxt, dirbuff);
+    return 0;
+}
+
 /**
  * Send mail with both HTML and alternative plain text format. The to and from
  * address are taken from the config file
@@ -314,7 +349,7 @@ sendmail_helper(char *subject, char *buffer_plain, char *buffer_html) {
     } else {
 
         logmsg(LOG_DEBUG, "Sendmail_helper: Using SMTP server");
-        struct smtp_handle *handle = smtp_setup(smtp_server, smtp_user, smtp_pwd, smtp_port);
+        struct smtp_handle *handle = smtp_session_get(smtp_server, smtp_user, smtp_pwd, smtp_port);
         if (handle == NULL) {
             logmsg(LOG_ERR, "Could NOT connect to SMTP server (%s) with credentials [%s:%s] on port %d", smtp_server, smtp_user, smtp_pwd, smtp_port);
             return -1;
@@ -323,14 +358,14 @@ sendmail_helper(char *subject, char *buffer_plain, char *buffer_html) {
 
         if (-1 == smtp_add_html(handle, buffer_html, buffer_plain)) {
             logmsg(LOG_ERR, "Could NOT add content in mail");
-            smtp_cleanup(&handle);
+            smtp_session_release(&handle, TRUE);
             return -1;
         }
         logmsg(LOG_DEBUG, "Sendmail_helper: Added plain and HTML content");
 
         if (-1 == smtp_add_rcpt(handle, SMTP_RCPT_TO, send_mailaddress)) {
             logmsg(LOG_ERR, "Could NOT add recepient to mail");
-            smtp_cleanup(&handle);
+            smtp_session_release(&handle, TRUE);
             return -1;
         }
         logmsg(LOG_DEBUG, "Sendmail_helper: Added recipient '%s'", send_mailaddress);
@@ -340,7 +375,7 @@ sendmail_helper(char *subject, char *buffer_plain, char *buffer_html) {
             logmsg(LOG_ERR, "could not SEND mail via SMTP.");
         }
 
-        smtp_cleanup(&handle);
+        smtp_session_release(&handle, 0 == rc);
         logmsg(LOG_DEBUG, "Sendmail_helper: Cleaned up and sent mail successfully.");
     }
 
@@ -370,7 +405,7 @@ sendmail_binattach_helper(char *to, char *subject, char *buffer_plain, char *buf
     } else {
 
         logmsg(LOG_DEBUG, "Sendmail_helper: Using SMTP server");
-        struct smtp_handle *handle = smtp_setup(smtp_server, smtp_user, smtp_pwd, smtp_port);
+        struct smtp_handle *handle = smtp_session_get(smtp_server, smtp_user, smtp_pwd, smtp_port);
         if (handle == NULL) {
             logmsg(LOG_ERR, "Could NOT connect to SMTP server (%s) with credentials [%s:%s] on port %d", smtp_server, smtp_user, smtp_pwd, smtp_port);
             return -1;
@@ -379,21 +414,21 @@ sendmail_binattach_helper(char *to, char *subject, char *buffer_plain, char *buf
 
         if (-1 == smtp_add_html(handle, buffer_html, buffer_plain)) {
             logmsg(LOG_ERR, "Could NOT add content in mail");
-            smtp_cleanup(&handle);
+            smtp_session_release(&handle, TRUE);
             return -1;
         }
         logmsg(LOG_DEBUG, "Sendmail_helper: Added plain and HTML content");
 
         if (-1 == smtp_add_rcpt(handle, SMTP_RCPT_TO, to)) {
             logmsg(LOG_ERR, "Could NOT add recepient to mail");
-            smtp_cleanup(&handle);
+            smtp_session_release(&handle, TRUE);
             return -1;
         }
         logmsg(LOG_DEBUG, "Sendmail_helper: Added recipient '%s'", to);
 
         if (-1 == smtp_add_attachment_binary(handle, binaryFile)) {
             logmsg(LOG_ERR, "Could not add binary attachment to mail");
-            smtp_cleanup(&handle);
+            smtp_session_release(&handle, TRUE);
             return -1;
         }
 
@@ -402,7 +437,7 @@ sendmail_binattach_helper(char *to, char *subject, char *buffer_plain, char *buf
             logmsg(LOG_ERR, "could not SEND mail via SMTP.");
         }
 
-        smtp_cleanup(&handle);
+        smtp_session_release(&handle, 0 == rc);
         logmsg(LOG_DEBUG, "Sendmail_helper: Cleaned up and sent mail successfully.");
     }
 
@@ -72,6 +72,9 @@ read_inlineimg_from_file(char *filename, struct inlineimage_t *inlineimg);
 int
 tst_mailimg(void);
 
+int
+load_mail_templates(void);
+
 #ifdef	__cplusplus
 }
 #endif
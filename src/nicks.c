@@ -51,6 +51,22 @@ static size_t nick_cb_cnt = 0;
 // List of all nicks read from the DB
 struct nick_res_t nick_res_set[MAX_NICK_RES_SET];
 
+/**
+ * The nick name for every device id is also kept in memory. The nick is
+ * needed for each received event and the tracker event loops must never
+ * wait for a DB connection. The cache is loaded at startup and reloaded
+ * after each change of the nick table.
+ */
+struct nick_cache_entry {
+    long devid;
+    _Bool duplicate;
+    char nick[16];
+};
+static struct nick_cache_entry *nick_cache = NULL;
+static size_t nick_cache_len = 0;
+static _Bool nick_cache_loaded = FALSE;
+static pthread_rwlock_t nick_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 // Silent gcc about unused "arg"in the callbacks
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -88,6 +104,68 @@ update_nick_callback(void *NotUsed, int nColumns, char **vals, char **names) {
 }
 #pragma GCC diagnostic pop
 
+/**
+ * Read all nick names from the DB into the in-memory cache
+ * @return 0 on success, -1 on failure
+ */
+int
+nick_cache_load(void) {
+    sqlite3 *sqlDB;
+    sqlite3_stmt *stmt;
+    struct nick_cache_entry *cache = NULL;
+    size_t len = 0, size = 0;
+    int rc;
+
+    if (-1 == db_acquire(&sqlDB)) {
+        return -1;
+    }
+    if (-1 == db_prepare_cached(sqlDB, _SQL_SELECT_NICK_ALL, &stmt)) {
+        db_release(sqlDB);
+        return -1;
+    }
+    while (SQLITE_ROW == (rc = sqlite3_step(stmt))) {
+        const long devid = (long) sqlite3_column_int64(stmt, 0);
+        size_t i = 0;
+        while (i < len && cache[i].devid != devid) {
+            i++;
+        }
+        if (i < len) {
+            logmsg(LOG_ERR, "Duplicate entry in NICK TABLE for devid=%ld", devid);
+            cache[i].duplicate = TRUE;
+            continue;
+        }
+        if (len == size) {
+            size = size ? size * 2 : 16;
+            struct nick_cache_entry *tmp = realloc(cache, size * sizeof (struct nick_cache_entry));
+            if (NULL == tmp) {
+                logmsg(LOG_CRIT, "Out of memory when loading nick names");
+                break;
+            }
+            cache = tmp;
+        }
+        cache[len].devid = devid;
+        cache[len].duplicate = FALSE;
+        xmb_strncpy(cache[len].nick, (const char *) sqlite3_column_text(stmt, 1), 12);
+        len++;
+    }
+    if (SQLITE_DONE != rc) {
+        logmsg(LOG_ERR, "Cannot SELECT on nick table (%s)", sqlite3_errmsg(sqlDB));
+        db_release(sqlDB);
+        free(cache);
+        return -1;
+    }
+    db_release(sqlDB);
+
+    pthread_rwlock_wrlock(&nick_cache_lock);
+    free(nick_cache);
+    nick_cache = cache;
+    nick_cache_len = len;
+    nick_cache_loaded = TRUE;
+    pthread_rwlock_unlock(&nick_cache_lock);
+    logmsg(LOG_DEBUG, "Loaded %zu nick names", len);
+    return 0;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-truncation"
 /**
@@ -105,13 +183,16 @@ int
 db_update_nick(const char *nick, const char *devid, const char *imei, const char *sim, const char *phone, const char *fwver) {
     sqlite3 *sqlDB;
     int rc = 0;
-    if (0 == db_setup(&sqlDB)) {
+
+    // The IMEI is the key so it must always be given
+    if (imei == NULL || *imei == '\0')
+        return -1;
+
+    if (0 == db_acquire(&sqlDB)) {
         char q[2048];
         char *errMsg;
 
         // First check if this device is already registered
-        if (imei == NULL || *imei == '\0')
-            return -1;
 
         nick_cb_cnt = 0;
         snprintf(q, sizeof (q), "SELECT * FROM %s WHERE fld_imei=%s;", DB_TABLE_NICK, imei);
@@ -119,13 +200,13 @@ db_update_nick(const char *nick, const char *devid, const char *imei, const char
         if (SQLITE_OK != rc) {
             logmsg(LOG_ERR, "Cannot SELECT on nick table (%s)", errMsg);
             sqlite3_free(errMsg);
-            db_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
         char currTime[32];
         if (-1 == get_datetime(currTime, 0)) {
             logmsg(LOG_CRIT, "Cannot determine local time");
-            db_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
         if (nick_cb_cnt > 0) {
@@ -153,7 +234,7 @@ db_update_nick(const char *nick, const char *devid, const char *imei, const char
                 if (SQLITE_OK != rc) {
                     logmsg(LOG_ERR, "Cannot do NICK Update (%s)", errMsg);
                     sqlite3_free(errMsg);
-                    db_close(sqlDB);
+                    db_release(sqlDB);
                     return -1;
                 }
 
@@ -174,17 +255,18 @@ db_update_nick(const char *nick, const char *devid, const char *imei, const char
                 if (SQLITE_OK != rc) {
                     logmsg(LOG_ERR, "Cannot do NICK new entry (%s)", errMsg);
                     sqlite3_free(errMsg);
-                    db_close(sqlDB);
+                    db_release(sqlDB);
                     return -1;
                 }
 
             } else {
                 logmsg(LOG_ERR, "All values must be defined when creating a new nick");
-                db_close(sqlDB);
+                db_release(sqlDB);
                 return -1;
             }
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
+        (void) nick_cache_load();
 
     } else {
         rc = -1;
@@ -196,44 +278,40 @@ db_update_nick(const char *nick, const char *devid, const char *imei, const char
 /**
  * Return the nickname (if defined) for the supplied device id. It is the
  * calling routines responsibility to ensure that the nick name buffer can
- * hold 12 chars
+ * hold 12 chars. The nick is taken from the in-memory cache so this never
+ * waits for the DB once the cache has been loaded.
  * @param devid Device id to find nick name for
  * @param[out] nick Nickname.
  * @return 0 on success, -1 no nick name defined
  */
 int
 db_get_nick_from_devid(const char *devid, char *nick) {
-    sqlite3 *sqlDB;
-    int rc = 0;
     *nick = '\0';
-    if (0 == db_setup(&sqlDB)) {
-        char q[512];
-        char *errMsg;
 
-        snprintf(q, sizeof (q), "SELECT * FROM %s WHERE fld_devid=%s", DB_TABLE_NICK, devid);
-        nick_cb_cnt = 0;
-        rc = sqlite3_exec(sqlDB, q, update_nick_callback, (void *) NULL, &errMsg);
-        if (SQLITE_OK != rc) {
-            logmsg(LOG_ERR, "Cannot SELECT on nick table (%s)", errMsg);
-            sqlite3_free(errMsg);
-            db_close(sqlDB);
-            return -1;
-        }
-        if (1 == nick_cb_cnt) {
-            xmb_strncpy(nick, nick_res_set[0].nick, 12);
-        } else if (nick_cb_cnt > 1) {
-            logmsg(LOG_ERR, "Duplicate entry in NICK TABLE for devid=%s", devid);
-            rc = -1;
-        } else {
-            logmsg(LOG_INFO, "devid=%s does not have a nick name", devid);
-            rc = -1;
-        }
-        db_close(sqlDB);
-    } else {
+    if (!nick_cache_loaded && -1 == nick_cache_load()) {
         logmsg(LOG_ERR, "Cannot open DB to get nick name for devid=%s", devid);
-        rc = -1;
+        return -1;
     }
 
+    const long id = xatol(devid);
+    int rc = -1;
+    pthread_rwlock_rdlock(&nick_cache_lock);
+    for (size_t i = 0; i < nick_cache_len; i++) {
+        if (nick_cache[i].devid == id) {
+            if (nick_cache[i].duplicate) {
+                logmsg(LOG_ERR, "Duplicate entry in NICK TABLE for devid=%s", devid);
+            } else {
+                xstrlcpy(nick, nick_cache[i].nick, 16);
+                rc = 0;
+            }
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&nick_cache_lock);
+
+    if (-1 == rc && '\0' == *nick) {
+        logmsg(LOG_INFO, "devid=%s does not have a nick name", devid);
+    }
     return rc;
 }
 
@@ -250,7 +328,7 @@ db_get_devid_from_nick(const char *nick, char *devid) {
     sqlite3 *sqlDB;
     int rc = 0;
     *devid = '\0';
-    if (0 == db_setup(&sqlDB)) {
+    if (0 == db_acquire(&sqlDB)) {
         char q[512];
         char *errMsg;
 
@@ -260,7 +338,7 @@ db_get_devid_from_nick(const char *nick, char *devid) {
         if (SQLITE_OK != rc) {
             logmsg(LOG_ERR, "Cannot SELECT on nick table (%s)", errMsg);
             sqlite3_free(errMsg);
-            db_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
         if (1 == nick_cb_cnt) {
@@ -272,7 +350,7 @@ db_get_devid_from_nick(const char *nick, char *devid) {
             logmsg(LOG_ERR, "Nickname=%s does not exists", nick);
             rc = -1;
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
     } else {
         rc = -1;
     }
@@ -289,7 +367,7 @@ int
 db_delete_nick(const char *nick) {
     sqlite3 *sqlDB;
     int rc = 0;
-    if (0 == db_setup(&sqlDB)) {
+    if (0 == db_acquire(&sqlDB)) {
         char q[512];
         char *errMsg;
 
@@ -298,14 +376,15 @@ db_delete_nick(const char *nick) {
         if (SQLITE_OK != rc) {
             logmsg(LOG_ERR, "Cannot DELETE on nick table (%s)", errMsg);
             sqlite3_free(errMsg);
-            db_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
         if (1 != sqlite3_changes(sqlDB)) {
             logmsg(LOG_DEBUG, "Trying to delete non-existing nick-name");
             rc = -1;
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
+        (void) nick_cache_load();
     } else {
         rc = -1;
     }
@@ -324,7 +403,7 @@ int
 db_get_nick_list(const int sockd, const char *imei, int listformat) {
     sqlite3 *sqlDB;
     int rc = 0;
-    if (0 == db_setup(&sqlDB)) {
+    if (0 == db_acquire(&sqlDB)) {
         char q[512];
         char *errMsg;
 
@@ -338,7 +417,7 @@ db_get_nick_list(const int sockd, const char *imei, int listformat) {
         if (SQLITE_OK != rc) {
             logmsg(LOG_ERR, "Cannot SELECT on nick table (%s)", errMsg);
             sqlite3_free(errMsg);
-            db_close(sqlDB);
+            db_release(sqlDB);
             return -1;
         }
 
@@ -423,7 +502,7 @@ db_get_nick_list(const int sockd, const char *imei, int listformat) {
         } else {
             _writef(sockd, "[ERR] No nick names defined yet");
         }
-        db_close(sqlDB);
+        db_release(sqlDB);
     } else {
         rc = -1;
     }
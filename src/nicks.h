@@ -38,6 +38,7 @@ extern "C" {
   "'fld_upddate' TEXT NOT NULL);"
 
 #define DB_TABLE_NICK "tbl_device_nick"
+#define _SQL_SELECT_NICK_ALL "SELECT fld_devid, fld_nick FROM " DB_TABLE_NICK ";"
 
 #define MAX_NICK_RES_SET 100
 
@@ -52,6 +53,9 @@ struct nick_res_t {
     char upddate[24];
 } ;
 
+int
+nick_cache_load(void);
+
 int
 db_get_nick_list(const int sockd, const char *imei, int listformat);
 
@@ -0,0 +1,251 @@
+/* =========================================================================
+ * File:        OUTBUF.C
+ * Description: Buffered output writer for files and sockets. Used by the
+ *              exporters and other functions that produce output in many
+ *              small pieces so that each piece does not cost one
+ *              allocation and one system call.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/param.h>
+
+#include "config.h"
+#include "utils.h"
+#include "logger.h"
+#include "outbuf.h"
+
+/**
+ * Initialize an output buffer. No memory is allocated until the first
+ * data is written.
+ * @param ob Buffer to initialize
+ * @param fd File or socket that the buffer is flushed to
+ * @param htmlencode TRUE if the data should be HTML encoded when written
+ */
+void
+outbuf_init(struct outbuf *ob, const int fd, const _Bool htmlencode) {
+    memset(ob, 0, sizeof (*ob));
+    ob->fd = fd;
+    ob->htmlencode = htmlencode;
+}
+
+/**
+ * Write all the io vectors, restarting after partial writes which can
+ * happen with sockets.
+ * @param fd File descriptor
+ * @param iov Vectors to write (modified)
+ * @param niov Number of vectors
+ * @return 0 on success, -1 on failure
+ */
+static int
+_writev_all(const int fd, struct iovec *iov, int niov) {
+    while (niov > 0) {
+        ssize_t n = writev(fd, iov, niov);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        while (niov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write all buffered data to the file descriptor. The chunks are kept for
+ * reuse.
+ * @param ob Output buffer
+ * @return 0 on success, -1 on failure
+ */
+int
+outbuf_flush(struct outbuf *ob) {
+    if (0 == ob->nchunks) {
+        return ob->err;
+    }
+
+    struct iovec iov[OUTBUF_MAX_CHUNKS];
+    char *enc[OUTBUF_MAX_CHUNKS];
+    size_t n = ob->nchunks;
+
+    for (size_t i = 0; i < n; i++) {
+        enc[i] = NULL;
+        if (ob->htmlencode) {
+            // html_encode() works on NUL terminated strings and there is
+            // always room for the terminator since a chunk is never
+            // completely filled
+            ob->chunk[i][ob->len[i]] = '\0';
+            enc[i] = html_encode(ob->chunk[i]);
+            iov[i].iov_base = enc[i];
+            iov[i].iov_len = strlen(enc[i]);
+        } else {
+            iov[i].iov_base = ob->chunk[i];
+            iov[i].iov_len = ob->len[i];
+        }
+        ob->len[i] = 0;
+    }
+    ob->nchunks = 0;
+
+    if (0 == ob->err && -1 == _writev_all(ob->fd, iov, (int) n)) {
+        logmsg(LOG_ERR, "Failed to write buffered output to fd=%d ( %d : %s )", ob->fd, errno, strerror(errno));
+        ob->err = -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free(enc[i]);
+    }
+    return ob->err;
+}
+
+/**
+ * Append raw data to the output buffer. The buffer is flushed when all
+ * chunks are full.
+ * @param ob Output buffer
+ * @param data Data to append
+ * @param len Length of data
+ * @return 0 on success, -1 on failure
+ */
+int
+outbuf_write(struct outbuf *ob, const char *data, size_t len) {
+    while (len > 0) {
+        // One byte is always left unused in each chunk for the string
+        // terminator needed when HTML encoding
+        if (0 == ob->nchunks || ob->len[ob->nchunks - 1] == OUTBUF_CHUNK_SIZE - 1) {
+            if (OUTBUF_MAX_CHUNKS == ob->nchunks) {
+                if (-1 == outbuf_flush(ob)) {
+                    return -1;
+                }
+            }
+            if (NULL == ob->chunk[ob->nchunks]) {
+                ob->chunk[ob->nchunks] = _chk_calloc_exit(OUTBUF_CHUNK_SIZE);
+            }
+            ob->len[ob->nchunks] = 0;
+            ob->nchunks++;
+        }
+        const size_t c = ob->nchunks - 1;
+        const size_t n = MIN(len, OUTBUF_CHUNK_SIZE - 1 - ob->len[c]);
+        memcpy(ob->chunk[c] + ob->len[c], data, n);
+        ob->len[c] += n;
+        data += n;
+        len -= n;
+    }
+    return ob->err;
+}
+
+/**
+ * Append a string to the output buffer
+ * @param ob Output buffer
+ * @param str String to append
+ * @return 0 on success, -1 on failure
+ */
+int
+outbuf_puts(struct outbuf *ob, const char *str) {
+    return outbuf_write(ob, str, strlen(str));
+}
+
+/**
+ * Append formatted output to the buffer. The output is formatted directly
+ * into the current chunk when it fits which is the normal case.
+ * @param ob Output buffer
+ * @param fmt Format string
+ * @param ap Arguments
+ * @return 0 on success, -1 on failure
+ */
+int
+outbuf_vprintf(struct outbuf *ob, const char *fmt, va_list ap) {
+    if (ob->nchunks > 0) {
+        const size_t c = ob->nchunks - 1;
+        const size_t avail = OUTBUF_CHUNK_SIZE - ob->len[c];
+        va_list aq;
+        va_copy(aq, ap);
+        int n = vsnprintf(ob->chunk[c] + ob->len[c], avail, fmt, aq);
+        va_end(aq);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t) n < avail) {
+            ob->len[c] += n;
+            return ob->err;
+        }
+    }
+
+    // Did not fit in what is left of the current chunk
+    char *tmp;
+    int n = vasprintf(&tmp, fmt, ap);
+    if (n < 0) {
+        logmsg(LOG_ERR, "Out of memory when formatting buffered output");
+        return -1;
+    }
+    int ret = outbuf_write(ob, tmp, n);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * Append formatted output to the buffer
+ * @param ob Output buffer
+ * @param fmt Format string
+ * @param ... Number of args depends on the format string
+ * @return 0 on success, -1 on failure
+ */
+int
+outbuf_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int ret = outbuf_vprintf(ob, fmt, ap);
+    va_end(ap);
+    return ret;
+}
+
+/**
+ * Flush any remaining data and free all memory used by the buffer. The
+ * file descriptor is not closed.
+ * @param ob Output buffer
+ * @return 0 if all data was written, -1 if any write failed
+ */
+int
+outbuf_close(struct outbuf *ob) {
+    int ret = outbuf_flush(ob);
+    for (size_t i = 0; i < OUTBUF_MAX_CHUNKS; i++) {
+        free(ob->chunk[i]);
+        ob->chunk[i] = NULL;
+    }
+    return ret;
+}
+
+/* EOF */
@@ -0,0 +1,84 @@
+/* =========================================================================
+ * File:        OUTBUF.H
+ * Description: Buffered output writer for files and sockets
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef OUTBUF_H
+#define	OUTBUF_H
+
+#include <stdarg.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/**
+ * Size of each chunk in the output buffer
+ */
+#define OUTBUF_CHUNK_SIZE (16*1024)
+
+/**
+ * Maximum number of chunks held before the buffer is flushed. All chunks
+ * are written with one call to writev()
+ */
+#define OUTBUF_MAX_CHUNKS 8
+
+/**
+ * A buffered writer bound to one file descriptor. Formatted output is
+ * appended to a list of fixed size chunks which are written with a single
+ * writev() when the buffer is full or explicitly flushed.
+ */
+struct outbuf {
+    int fd;                             // File or socket to write to
+    _Bool htmlencode;                   // HTML encode the data when it is flushed
+    int err;                            // Set after the first failed write
+    size_t nchunks;                     // Number of chunks in use
+    size_t len[OUTBUF_MAX_CHUNKS];      // Used length of each chunk
+    char *chunk[OUTBUF_MAX_CHUNKS];     // Allocated chunks (kept between flushes)
+};
+
+void
+outbuf_init(struct outbuf *ob, const int fd, const _Bool htmlencode);
+
+int
+outbuf_write(struct outbuf *ob, const char *data, size_t len);
+
+int
+outbuf_puts(struct outbuf *ob, const char *str);
+
+int
+outbuf_vprintf(struct outbuf *ob, const char *fmt, va_list ap)
+        __attribute__ ((format (printf, 2, 0)));
+
+int
+outbuf_printf(struct outbuf *ob, const char *fmt, ...)
+        __attribute__ ((format (printf, 2, 3)));
+
+int
+outbuf_flush(struct outbuf *ob);
+
+int
+outbuf_close(struct outbuf *ob);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* OUTBUF_H */
@@ -0,0 +1,448 @@
+/* =========================================================================
+ * File:        PLUGINS.C
+ * Description: Load event handler plugins and dispatch events to them.
+ *              The plugins are shared objects in the plugin directory that
+ *              register callbacks for location updates, tracker
+ *              connections and command replies (see g7plugin.h). This is
+ *              a much cheaper alternative to the event scripts since no
+ *              process is started and the plugin gets the parsed record.
+ *              The events are put in a bounded queue and the callbacks are
+ *              called from a single dispatcher thread so a slow plugin can
+ *              never hold up the trackers. When the queue is full new
+ *              events are dropped.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "g7config.h"
+#include "utils.h"
+#include "futils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "plugins.h"
+
+/**
+ * Maximum number of events the dispatcher takes from the queue at a time
+ */
+#define PLUGINS_BATCH 64
+
+/**
+ * Event types in the queue
+ */
+#define PLUGIN_EV_LOCATION 1
+#define PLUGIN_EV_CONNECTION 2
+#define PLUGIN_EV_CMDREPLY 3
+
+/**
+ * One queued event. The reply in a command reply is our own copy that is
+ * freed after the event has been dispatched.
+ */
+struct plugin_event {
+    int type;
+    union {
+        struct g7plugin_location loc;
+        struct g7plugin_connection conn;
+        struct g7plugin_cmdreply cmdreply;
+    } u;
+};
+
+/**
+ * One loaded plugin
+ */
+struct plugin_entry {
+    void *handle;
+    struct g7plugin plugin;
+    struct plugins_info info;
+};
+
+static struct plugin_entry pl_list[PLUGINS_MAX];
+static unsigned pl_num = 0;
+
+/**
+ * Which kind of events at least one plugin wants
+ */
+static _Bool pl_want_location = FALSE;
+static _Bool pl_want_connection = FALSE;
+static _Bool pl_want_cmdreply = FALSE;
+
+/**
+ * The event queue as a ring buffer. Protected by pl_mutex
+ */
+static struct plugin_event *pl_queue = NULL;
+static size_t pl_head = 0;
+static struct plugins_stat pl_stat;
+
+static _Bool pl_running = FALSE;
+static _Bool pl_stopping = FALSE;
+
+static pthread_t pl_thread;
+static pthread_mutex_t pl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pl_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Monotonic time in micro seconds used for the callback times
+ * @return Current time in us
+ */
+static double
+_pl_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/**
+ * Callback for process_files(). Load one plugin.
+ * @param filename Full path of the shared object
+ * @param idx Not used
+ * @return 0 on success, -1 on failure
+ */
+static int
+_pl_load(char *filename, size_t idx) {
+    (void) idx;
+    if (pl_num >= PLUGINS_MAX) {
+        logmsg(LOG_ERR, "Too many plugins. Plugin \"%s\" not loaded", filename);
+        return -1;
+    }
+
+    void *handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (NULL == handle) {
+        logmsg(LOG_ERR, "Cannot load plugin \"%s\" ( %s )", filename, dlerror());
+        return -1;
+    }
+    g7plugin_init_func init;
+    *(void **) (&init) = dlsym(handle, G7PLUGIN_INIT_SYMBOL);
+    if (NULL == init) {
+        logmsg(LOG_ERR, "Plugin \"%s\" has no %s() function", filename, G7PLUGIN_INIT_SYMBOL);
+        dlclose(handle);
+        return -1;
+    }
+
+    struct plugin_entry *entry = &pl_list[pl_num];
+    memset(entry, 0, sizeof (*entry));
+    xstrlcpy(entry->info.filename, filename, sizeof (entry->info.filename));
+    entry->plugin.api_version = G7PLUGIN_API_VERSION;
+    entry->plugin.filename = entry->info.filename;
+    if (0 != init(&entry->plugin)) {
+        logmsg(LOG_ERR, "Plugin \"%s\" failed to initialize", filename);
+        dlclose(handle);
+        return -1;
+    }
+    entry->handle = handle;
+    xstrlcpy(entry->info.name, entry->plugin.name ? entry->plugin.name : filename, sizeof (entry->info.name));
+
+    pl_want_location |= NULL != entry->plugin.on_location;
+    pl_want_connection |= NULL != entry->plugin.on_connection;
+    pl_want_cmdreply |= NULL != entry->plugin.on_cmdreply;
+    pl_num++;
+    logmsg(LOG_INFO, "Loaded plugin \"%s\" from \"%s\"", entry->info.name, filename);
+    return 0;
+}
+
+/**
+ * Call the callbacks for one event in all plugins
+ * @param ev Event
+ */
+static void
+_pl_dispatch(const struct plugin_event *ev) {
+    for (unsigned i = 0; i < pl_num; i++) {
+        struct plugin_entry *entry = &pl_list[i];
+        const struct g7plugin *p = &entry->plugin;
+        const double start = _pl_now_us();
+        switch (ev->type) {
+            case PLUGIN_EV_LOCATION:
+                if (NULL == p->on_location)
+                    continue;
+                p->on_location(&ev->u.loc, p->user);
+                break;
+            case PLUGIN_EV_CONNECTION:
+                if (NULL == p->on_connection)
+                    continue;
+                p->on_connection(&ev->u.conn, p->user);
+                break;
+            case PLUGIN_EV_CMDREPLY:
+                if (NULL == p->on_cmdreply)
+                    continue;
+                p->on_cmdreply(&ev->u.cmdreply, p->user);
+                break;
+            default:
+                continue;
+        }
+        // Only the dispatcher thread updates the plugin statistics
+        const double t = _pl_now_us() - start;
+        pthread_mutex_lock(&pl_mutex);
+        entry->info.calls++;
+        entry->info.avg_us += (t - entry->info.avg_us) / (double) entry->info.calls;
+        if (t > entry->info.max_us) {
+            entry->info.max_us = t;
+        }
+        pthread_mutex_unlock(&pl_mutex);
+    }
+}
+
+/**
+ * Dispatcher thread. Takes the events from the queue in batches and calls
+ * the plugins without holding the queue lock. Any events left in the queue
+ * when the daemon stops are dispatched before the thread exits.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+plugins_thread(void *arg) {
+    (void) arg;
+    struct plugin_event batch[PLUGINS_BATCH];
+
+    pthread_mutex_lock(&pl_mutex);
+    while (TRUE) {
+        if (0 == pl_stat.queue_len) {
+            if (pl_stopping) {
+                break;
+            }
+            pthread_cond_wait(&pl_cond, &pl_mutex);
+            continue;
+        }
+
+        size_t n = 0;
+        while (n < PLUGINS_BATCH && pl_stat.queue_len > 0) {
+            batch[n++] = pl_queue[pl_head];
+            pl_head = (pl_head + 1) % pl_stat.queue_size;
+            pl_stat.queue_len--;
+        }
+        pthread_mutex_unlock(&pl_mutex);
+
+        for (size_t i = 0; i < n; i++) {
+            _pl_dispatch(&batch[i]);
+            if (PLUGIN_EV_CMDREPLY == batch[i].type) {
+                free((char *) batch[i].u.cmdreply.reply);
+            }
+        }
+
+        pthread_mutex_lock(&pl_mutex);
+        pl_stat.delivered += n;
+    }
+    pthread_mutex_unlock(&pl_mutex);
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Put an event in the queue. If the queue is full the event is dropped.
+ * @param ev Event
+ * @return 0 on success, -1 if the event was dropped
+ */
+static int
+_pl_enqueue(const struct plugin_event *ev) {
+    pthread_mutex_lock(&pl_mutex);
+    if (pl_stopping) {
+        // Events that arrive while the daemon stops are ignored
+        pthread_mutex_unlock(&pl_mutex);
+        return -1;
+    }
+    if (pl_stat.queue_len >= pl_stat.queue_size) {
+        // Avoid flooding the log when a plugin cannot keep up
+        if (0 == pl_stat.dropped++ % 1000) {
+            logmsg(LOG_ERR, "Plugin event queue is full (%zu events). Events are dropped.", pl_stat.queue_size);
+        }
+        pthread_mutex_unlock(&pl_mutex);
+        return -1;
+    }
+    pl_queue[(pl_head + pl_stat.queue_len) % pl_stat.queue_size] = *ev;
+    pl_stat.queue_len++;
+    if (pl_stat.queue_len > pl_stat.queue_peak) {
+        pl_stat.queue_peak = pl_stat.queue_len;
+    }
+    pthread_cond_signal(&pl_cond);
+    pthread_mutex_unlock(&pl_mutex);
+    return 0;
+}
+
+/**
+ * Load all plugins in the plugin directory and start the dispatcher
+ * @param dir Plugin directory. If empty no plugins are loaded
+ * @param queue_size Maximum number of events waiting to be dispatched
+ * @return 0 on success (or if there are no plugins), -1 on failure
+ */
+int
+plugins_init(const char *dir, const unsigned queue_size) {
+    memset(&pl_stat, 0, sizeof (pl_stat));
+    if (NULL == dir || '\0' == *dir) {
+        return 0;
+    }
+
+    size_t nfiles = 0;
+    if (-1 == process_files(dir, ".so", PLUGINS_MAX, &nfiles, _pl_load)) {
+        logmsg(LOG_ERR, "Failed to load all plugins from \"%s\"", dir);
+    }
+    if (0 == pl_num) {
+        logmsg(LOG_DEBUG, "No plugins loaded from \"%s\"", dir);
+        return 0;
+    }
+
+    pl_queue = _chk_calloc_exit(queue_size * sizeof (struct plugin_event));
+    pl_stat.queue_size = queue_size;
+    pl_stat.nplugins = pl_num;
+
+    int ret = pthread_create(&pl_thread, NULL, plugins_thread, NULL);
+    if (0 != ret) {
+        logmsg(LOG_CRIT, "Could not create plugin dispatcher thread ( %d : %s )", ret, strerror(ret));
+        plugins_shutdown();
+        return -1;
+    }
+    pl_running = TRUE;
+    logmsg(LOG_INFO, "Started plugin dispatcher with %u plugins", pl_num);
+    return 0;
+}
+
+/**
+ * Dispatch the events still in the queue, stop the dispatcher and unload
+ * all plugins
+ */
+void
+plugins_shutdown(void) {
+    if (pl_running) {
+        pthread_mutex_lock(&pl_mutex);
+        pl_stopping = TRUE;
+        pthread_cond_signal(&pl_cond);
+        pthread_mutex_unlock(&pl_mutex);
+        pthread_join(pl_thread, NULL);
+        pl_running = FALSE;
+    }
+
+    for (unsigned i = 0; i < pl_num; i++) {
+        if (pl_list[i].plugin.on_exit) {
+            pl_list[i].plugin.on_exit(pl_list[i].plugin.user);
+        }
+        dlclose(pl_list[i].handle);
+    }
+    if (pl_num > 0) {
+        logmsg(LOG_DEBUG, "Unloaded %u plugins after %lu events", pl_num, pl_stat.delivered);
+    }
+    pl_num = 0;
+    free(pl_queue);
+    pl_queue = NULL;
+}
+
+/**
+ * Queue a location update for the plugins
+ * @param flds The fields of the location update
+ */
+void
+plugins_location(struct splitfields *flds) {
+    if (!pl_running || !pl_want_location) {
+        return;
+    }
+    struct plugin_event ev;
+    ev.type = PLUGIN_EV_LOCATION;
+    struct g7plugin_location *loc = &ev.u.loc;
+    loc->ts = time(NULL);
+    loc->devid = (unsigned) xatol(flds->fld[GM7_LOC_DEVID]);
+    loc->datetime = xatol(flds->fld[GM7_LOC_DATE]);
+    loc->lat = strtod(flds->fld[GM7_LOC_LAT], NULL);
+    loc->lon = strtod(flds->fld[GM7_LOC_LON], NULL);
+    loc->speed = xatoi(flds->fld[GM7_LOC_SPEED]);
+    loc->heading = xatoi(flds->fld[GM7_LOC_HEADING]);
+    loc->altitude = xatoi(flds->fld[GM7_LOC_ALT]);
+    loc->satellite = xatoi(flds->fld[GM7_LOC_SAT]);
+    loc->eventid = xatoi(flds->fld[GM7_LOC_EVENTID]);
+    loc->voltage = strtod(flds->fld[GM7_LOC_VOLT], NULL);
+    loc->detach = xatoi(flds->fld[GM7_LOC_DETACH]);
+    (void) _pl_enqueue(&ev);
+}
+
+/**
+ * Queue a tracker connection event for the plugins
+ * @param devid Device ID
+ * @param event G7PLUGIN_CONNECT or G7PLUGIN_DISCONNECT
+ * @param ipadr IP address of the tracker
+ */
+void
+plugins_connection(const unsigned devid, const int event, const char *ipadr) {
+    if (!pl_running || !pl_want_connection) {
+        return;
+    }
+    struct plugin_event ev;
+    ev.type = PLUGIN_EV_CONNECTION;
+    ev.u.conn.ts = time(NULL);
+    ev.u.conn.devid = devid;
+    ev.u.conn.event = event;
+    xstrlcpy(ev.u.conn.ipadr, ipadr, sizeof (ev.u.conn.ipadr));
+    (void) _pl_enqueue(&ev);
+}
+
+/**
+ * Queue a command reply for the plugins
+ * @param devid Device ID
+ * @param tag Command tag
+ * @param cmd Command name
+ * @param isok TRUE if the device reported success
+ * @param reply The full reply
+ */
+void
+plugins_cmdreply(const unsigned devid, const char *tag, const char *cmd, const _Bool isok, const char *reply) {
+    if (!pl_running || !pl_want_cmdreply) {
+        return;
+    }
+    struct plugin_event ev;
+    ev.type = PLUGIN_EV_CMDREPLY;
+    ev.u.cmdreply.ts = time(NULL);
+    ev.u.cmdreply.devid = devid;
+    ev.u.cmdreply.isok = isok;
+    xstrlcpy(ev.u.cmdreply.tag, tag, sizeof (ev.u.cmdreply.tag));
+    xstrlcpy(ev.u.cmdreply.cmd, cmd, sizeof (ev.u.cmdreply.cmd));
+    ev.u.cmdreply.reply = strdup(reply);
+    if (-1 == _pl_enqueue(&ev)) {
+        free((char *) ev.u.cmdreply.reply);
+    }
+}
+
+/**
+ * Get a snapshot of the plugin statistics
+ * @param[out] stat Dispatcher statistics
+ * @param[out] info Statistics for each plugin
+ * @param maxinfo Size of the info array
+ * @return The number of plugins filled in to the info array
+ */
+size_t
+plugins_get_stat(struct plugins_stat *stat, struct plugins_info *info, const size_t maxinfo) {
+    pthread_mutex_lock(&pl_mutex);
+    *stat = pl_stat;
+    size_t n = 0;
+    for (; n < pl_num && n < maxinfo; n++) {
+        info[n] = pl_list[n].info;
+    }
+    pthread_mutex_unlock(&pl_mutex);
+    return n;
+}
+
+/* EOF */
@@ -0,0 +1,84 @@
+/* =========================================================================
+ * File:        PLUGINS.H
+ * Description: Load event handler plugins and dispatch events to them
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef PLUGINS_H
+#define	PLUGINS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include "g7plugin.h"
+
+struct splitfields;
+
+/**
+ * Maximum number of plugins that are loaded
+ */
+#define PLUGINS_MAX 16
+
+/**
+ * Statistics for the plugin dispatcher
+ */
+struct plugins_stat {
+    unsigned nplugins;          // Number of loaded plugins
+    size_t queue_len;           // Number of events waiting to be dispatched
+    size_t queue_peak;          // Largest number of waiting events seen
+    size_t queue_size;          // Maximum number of waiting events
+    unsigned long delivered;    // Number of dispatched events
+    unsigned long dropped;      // Number of events dropped since the queue was full
+};
+
+/**
+ * Statistics for one plugin
+ */
+struct plugins_info {
+    char name[64];
+    char filename[256];
+    unsigned long calls;        // Number of callback calls
+    double avg_us;              // Average time in a callback
+    double max_us;              // Longest time in a callback
+};
+
+int
+plugins_init(const char *dir, const unsigned queue_size);
+
+void
+plugins_shutdown(void);
+
+void
+plugins_location(struct splitfields *flds);
+
+void
+plugins_connection(const unsigned devid, const int event, const char *ipadr);
+
+void
+plugins_cmdreply(const unsigned devid, const char *tag, const char *cmd, const _Bool isok, const char *reply);
+
+size_t
+plugins_get_stat(struct plugins_stat *stat, struct plugins_info *info, const size_t maxinfo);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* PLUGINS_H */
@@ -224,20 +224,21 @@ listPresets(int sockd) {
 }
 
 /**
- * Execute a single command function. This is a server device command given in the function form
- * as FUNC(par1,par2,..)
- * @param cli_info  Client context
+ * Translate a single command function given in the function form as
+ * FUNC(par1,par2,..) to the raw device command
  * @param presetString  The function string
  * @param tag Command tag
  * @param pin Device PIN code
+ * @param[out] cmdBuf The raw device command
+ * @param maxlen Size of cmdBuf
  * @return 0 on success, -1 on failure
  */
 int
-execPresetFunc(struct client_info *cli_info, const char *presetString, const char *tag, const char *pin) {
-    char cmdBuf[128], tmpBuf[128];
+buildPresetFunc(const char *presetString, const char *tag, const char *pin, char *cmdBuf, const size_t maxlen) {
+    char tmpBuf[128];
 
     CLEAR(tmpBuf);
-    CLEAR(cmdBuf);
+    memset(cmdBuf, 0, maxlen);
     
     xmb_strncpy(tmpBuf, presetString, sizeof(tmpBuf)-1);    
     
@@ -263,7 +264,7 @@ execPresetFunc(struct client_info *cli_info, const char *presetString, const cha
     if (rc < 0) {
         return -1;
     }
-    snprintf(cmdBuf, sizeof (cmdBuf) - 1, "$WP+%s+%s=%s", devCmd, tag, pin);
+    snprintf(cmdBuf, maxlen - 1, "$WP+%s+%s=%s", devCmd, tag, pin);
 
     char argBuf[64];
     char *ap = argBuf;
@@ -278,23 +279,42 @@ execPresetFunc(struct client_info *cli_info, const char *presetString, const cha
         }
         *ap = '\0';
         if (*argBuf) {
-            xstrlcat(cmdBuf, ",", sizeof(cmdBuf));
-            xstrlcat(cmdBuf, argBuf, sizeof(cmdBuf));            
+            xstrlcat(cmdBuf, ",", maxlen);
+            xstrlcat(cmdBuf, argBuf, maxlen);            
         } else {
             // Add an empty argument (Preserve the previous value)
-            xstrlcat(cmdBuf, ",", sizeof(cmdBuf));
+            xstrlcat(cmdBuf, ",", maxlen);
         }
         ap = argBuf;
 
     } while (*c && (*c != ')') );
 
+    return 0;
+}
+
+/**
+ * Execute a single command function. This is a server device command given in the function form
+ * as FUNC(par1,par2,..)
+ * @param cli_info  Client context
+ * @param presetString  The function string
+ * @param tag Command tag
+ * @param pin Device PIN code
+ * @return 0 on success, -1 on failure
+ */
+int
+execPresetFunc(struct client_info *cli_info, const char *presetString, const char *tag, const char *pin) {
+    char cmdBuf[128];
+
+    if (-1 == buildPresetFunc(presetString, tag, pin, cmdBuf, sizeof (cmdBuf))) {
+        return -1;
+    }
 
     // We use (-1) for sockd in the call to avoid having any output from the
     // commands displayed to the user.    
     const int old_sockd = cli_info->cli_socket;
     cli_info->cli_socket = -1;
 
-    rc = send_rawcmd(cli_info, cmdBuf, tag);
+    int rc = send_rawcmd(cli_info, cmdBuf, tag);
 
     cli_info->cli_socket = old_sockd;
 
@@ -305,25 +325,9 @@ execPresetFunc(struct client_info *cli_info, const char *presetString, const cha
 }
 
 /**
- * Construct a raw device command from the command stored in the preset
- * @param pre Pointer to preset data structure
- * @param cmdIdx Command index for this command
- * @param tag The tag to use in command (can be an empty string)
- * @param pin Device PIN code
- * @return 0 on success, -1 on failure
- */
-int
-execPresetCommand(struct client_info *cli_info, struct presetType *pre, size_t cmdIdx, const char *tag, const char *pin) {
-    int rc = execPresetFunc(cli_info, pre->cmd[cmdIdx], tag, pin);
-    if (rc < 0) {
-        logmsg(LOG_ERR, "Cannot execute command in preset file \"%s\" command #%zd. Incorrect command name?", pre->name, cmdIdx);
-        return -1;
-    }
-    return 0;
-}
-
-/**
- * Execute all commands in the specified preset
+ * Execute all commands in the specified preset. The commands are sent as one
+ * batch so that over GPRS several commands can be in flight to the device at
+ * the same time (see gprs_cmd_window)
  * @param sockd Client socket to write to
  * @param presetName Name of preset
  * @return 0 on success, -1 on failure
@@ -335,7 +339,6 @@ execPreset(struct client_info *cli_info, char *presetName) {
 
     struct presetType *ptr;
     char pinbuff[16];
-    char tagbuff[16];
 
     if (-1 == get_device_pin(pinbuff, sizeof (pinbuff))) {
         return -1;
@@ -343,18 +346,48 @@ execPreset(struct client_info *cli_info, char *presetName) {
 
     if (0 == getPreset(presetName, &ptr)) {
         logmsg(LOG_DEBUG, "Executing %zd commands in preset \"%s\"", ptr->ncmd, ptr->name);
+        if (0 == ptr->ncmd) {
+            _writef(sockd, "Successfully executed %zd commands in preset \"%s\"", ptr->ncmd, ptr->name);
+            return 0;
+        }
+
+        struct devcmd_batch *batch = calloc(ptr->ncmd, sizeof (struct devcmd_batch));
+        if (NULL == batch) {
+            logmsg(LOG_ERR, "Out of memory in execPreset()");
+            _writef(sockd, "[ERR] Out of memory.");
+            return -1;
+        }
         for (size_t i = 0; i < ptr->ncmd; ++i) {
-            if (-1 == get_device_tag(tagbuff, sizeof (tagbuff))) {
+            if (-1 == get_device_tag(batch[i].tag, sizeof (batch[i].tag))) {
+                free(batch);
                 return -1;
             }
             logmsg(LOG_DEBUG, "   #%02zd : %s", i, ptr->cmd[i]);
-            if (-1 == execPresetCommand(cli_info, ptr, i, tagbuff, pinbuff)) {
-                logmsg(LOG_ERR, "Failed to execute command #%02zd in preset \"%s\"", i, ptr->name);
+            if (-1 == buildPresetFunc(ptr->cmd[i], batch[i].tag, pinbuff, batch[i].cmd, sizeof (batch[i].cmd))) {
+                logmsg(LOG_ERR, "Cannot execute command in preset file \"%s\" command #%zd. Incorrect command name?", ptr->name, i);
                 _writef(sockd, "[ERR] Failed to execute command #%02zd in preset \"%s\".", i, ptr->name);
+                free(batch);
                 return -1;
             }
-            usleep(1000); // Sleep 0.1s between each command to give the device some time.
         }
+
+        // We use (-1) for sockd in the call to avoid having any output from the
+        // commands displayed to the user.
+        cli_info->cli_socket = -1;
+        int rc = send_rawcmd_batch(cli_info, batch, ptr->ncmd, TRUE, NULL, NULL);
+        cli_info->cli_socket = sockd;
+
+        if (rc < 0) {
+            size_t i = 0;
+            while (i < ptr->ncmd - 1 && 0 == batch[i].rc) {
+                i++;
+            }
+            logmsg(LOG_ERR, "Failed to execute command #%02zd in preset \"%s\"", i, ptr->name);
+            _writef(sockd, "[ERR] Failed to execute command #%02zd in preset \"%s\".", i, ptr->name);
+            free(batch);
+            return -1;
+        }
+        free(batch);
         _writef(sockd, "Successfully executed %zd commands in preset \"%s\"", ptr->ncmd, ptr->name);
         return 0;
     } else {
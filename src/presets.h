@@ -67,6 +67,9 @@ listPresets(int sockd);
 int
 commandPreset(struct client_info *cli_info, char *cmd, size_t nf, char **fields);
 
+int
+buildPresetFunc(const char *presetString, const char *tag, const char *pin, char *cmdBuf, const size_t maxlen);
+
 int
 execPresetFunc(struct client_info *cli_info, const char *presetString, const char *tag, const char *pin);
 
@@ -0,0 +1,640 @@
+/* =========================================================================
+ * File:        SCRIPTPOOL.C
+ * Description: Bounded execution service for the event scripts. The
+ *              scripts were earlier run with system() from a new detached
+ *              thread for each event which meant that a burst of events
+ *              gave an unbounded number of threads and shells. The scripts
+ *              are now queued and run by a fixed number of worker threads
+ *              with posix_spawn(). The queue has a maximum length and a
+ *              queued script for a device is replaced by a newer event for
+ *              the same script and device. Which scripts exist is kept in a
+ *              table that is updated by inotify so no access() call is
+ *              needed for each event.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifndef __APPLE__
+#include <sys/inotify.h>
+#endif
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "g7config.h"
+#include "utils.h"
+#include "futils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "scriptpool.h"
+
+extern char **environ;
+
+/**
+ * Size of the buffer used to read inotify events
+ */
+#define SCRIPTPOOL_EVENT_BUF_LEN (32 * 1024)
+
+/**
+ * How often (in ms) the directory watcher checks if it should stop
+ */
+#define SCRIPTPOOL_WATCH_TIMEOUT 1000
+
+/**
+ * Longest time (in ms) between two checks if a running script has finished
+ */
+#define SCRIPTPOOL_POLL_MAX 100
+
+/**
+ * Time (in s) a script that has run too long gets to exit after SIGTERM
+ * before it is killed
+ */
+#define SCRIPTPOOL_KILL_GRACE 2
+
+/**
+ * One queued script
+ */
+struct scriptjob {
+    struct scriptjob *next;
+    unsigned script;            // Script id
+    char devid[32];             // Device the event is for. Used to coalesce events
+    char *argv[SCRIPTPOOL_MAX_ARGS + 3];
+    double queued_ms;           // Time in ms when the script was queued
+};
+
+/**
+ * The queue. Protected by sp_mutex
+ */
+static struct scriptjob *sp_head = NULL;
+static struct scriptjob *sp_tail = NULL;
+static struct scriptpool_stat sp_stat;
+
+/**
+ * Which scripts exist. Protected by sp_mutex
+ */
+static _Bool sp_present[SCRIPTPOOL_NUM_SCRIPTS];
+
+static _Bool sp_running = FALSE;
+static _Bool sp_stopping = FALSE;
+static unsigned sp_timeout = 0;
+static char sp_dir[512];
+
+static pthread_t sp_threads[SCRIPTPOOL_MAX_WORKERS];
+static pthread_t sp_watch_thread;
+static _Bool sp_watch_started = FALSE;
+static pthread_mutex_t sp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sp_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Monotonic time in ms used for the wait and run times
+ * @return Current time in ms
+ */
+static double
+_sp_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Get the full path of a script
+ * @param script Script id
+ * @param[out] buf Buffer for the path
+ * @param len Size of buffer
+ */
+static void
+_sp_script_path(const unsigned script, char *buf, const size_t len) {
+    if (SCRIPTPOOL_TRACKER_CONN == script) {
+        snprintf(buf, len, "%s/%s/tracker_conn.sh", data_dir, SCRIPTPOOL_SUBDIR);
+    } else {
+        snprintf(buf, len, "%s/%s/%u_action.sh", data_dir, SCRIPTPOOL_SUBDIR, script);
+    }
+}
+
+/**
+ * Check if a script exists and is readable
+ * @param script Script id
+ * @return TRUE if the script exists
+ */
+static _Bool
+_sp_access(const unsigned script) {
+    char path[600];
+    _sp_script_path(script, path, sizeof (path));
+    return 0 == access(path, R_OK);
+}
+
+/**
+ * Update the presence table for all scripts
+ */
+static void
+_sp_scan(void) {
+    _Bool present[SCRIPTPOOL_NUM_SCRIPTS];
+    for (unsigned i = 0; i < SCRIPTPOOL_NUM_SCRIPTS; i++) {
+        present[i] = _sp_access(i);
+    }
+    pthread_mutex_lock(&sp_mutex);
+    memcpy(sp_present, present, sizeof (sp_present));
+    pthread_mutex_unlock(&sp_mutex);
+}
+
+/**
+ * Free a script job
+ * @param job Job to free
+ */
+static void
+_sp_free_job(struct scriptjob *job) {
+    for (size_t i = 0; job->argv[i]; i++) {
+        free(job->argv[i]);
+    }
+    free(job);
+}
+
+/**
+ * Wait for a script to exit without reaping it. While the script is not
+ * reaped its process id, and so its process group id, cannot be reused.
+ * @param pid Process id of the script
+ * @param timeout Maximum time to wait in s
+ * @return 0 if the script has exited, 1 on timeout, -1 on failure
+ */
+static int
+_sp_wait_exit(const pid_t pid, const unsigned timeout) {
+    // We cannot get SIGCHLD for only our own child since all threads share
+    // the signal handling so check with an increasing interval instead
+    const double deadline = _sp_now_ms() + timeout * 1000.0;
+    unsigned poll_ms = 1;
+    while (TRUE) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (-1 == waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT)) {
+            if (EINTR != errno) {
+                return -1;
+            }
+        } else if (info.si_pid == pid) {
+            return 0;
+        }
+        if (_sp_now_ms() >= deadline) {
+            return 1;
+        }
+        usleep(poll_ms * 1000);
+        poll_ms = poll_ms * 2 < SCRIPTPOOL_POLL_MAX ? poll_ms * 2 : SCRIPTPOOL_POLL_MAX;
+    }
+}
+
+/**
+ * Run a script and wait for it to finish. The script is started with
+ * posix_spawn() directly on "sh" so no extra shell is needed to parse a
+ * command line. All signals are blocked in our threads so the child gets an
+ * empty signal mask and default signal handlers. The script is run in its
+ * own process group so that a script that has run longer than the configured
+ * timeout can be stopped together with any commands it has started.
+ * @param job Script to run
+ * @param[out] timedout Set to TRUE if the script was stopped since it ran too long
+ * @return 0 if the script ran with exit status 0, -1 otherwise
+ */
+static int
+_sp_spawn(const struct scriptjob *job, _Bool *timedout) {
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid;
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigfillset(&sigs);
+    sigdelset(&sigs, SIGKILL);
+    sigdelset(&sigs, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    int rc = posix_spawn(&pid, "/bin/sh", NULL, &attr, job->argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (0 != rc) {
+        logmsg(LOG_ERR, "Cannot start script \"%s\" ( %d : %s )", job->argv[1], rc, strerror(rc));
+        return -1;
+    }
+
+    *timedout = FALSE;
+    if (sp_timeout > 0 && 1 == _sp_wait_exit(pid, sp_timeout)) {
+        // Ask the script to stop and kill it if it does not. Any commands
+        // started by the script are in the same process group and are
+        // stopped as well.
+        logmsg(LOG_ERR, "Script \"%s\" has run for more than %u s. Stopping it.", job->argv[1], sp_timeout);
+        *timedout = TRUE;
+        (void) kill(-pid, SIGTERM);
+        (void) _sp_wait_exit(pid, SCRIPTPOOL_KILL_GRACE);
+        (void) kill(-pid, SIGKILL);
+    }
+
+    int status;
+    while (-1 == waitpid(pid, &status, 0)) {
+        if (EINTR != errno) {
+            logmsg(LOG_ERR, "Cannot wait for script \"%s\" ( %d : %s )", job->argv[1], errno, strerror(errno));
+            return -1;
+        }
+    }
+    if (*timedout) {
+        return -1;
+    }
+    if (WIFEXITED(status) && 0 == WEXITSTATUS(status)) {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Script worker thread. Takes the first script from the queue and runs it.
+ * @param arg Not used
+ * @return (void *)0
+ */
+static void *
+scriptpool_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&sp_mutex);
+    while (!sp_stopping) {
+        if (NULL == sp_head) {
+            pthread_cond_wait(&sp_cond, &sp_mutex);
+            continue;
+        }
+
+        struct scriptjob *job = sp_head;
+        sp_head = job->next;
+        if (NULL == sp_head) {
+            sp_tail = NULL;
+        }
+        sp_stat.queue_len--;
+        sp_stat.running++;
+        pthread_mutex_unlock(&sp_mutex);
+
+        _Bool timedout = FALSE;
+        const double start_ms = _sp_now_ms();
+        const int rc = _sp_spawn(job, &timedout);
+        const double end_ms = _sp_now_ms();
+
+        if (0 == rc) {
+            logmsg(LOG_NOTICE, "Shell script: \"%s\" have run.", job->argv[1]);
+        } else {
+            logmsg(LOG_ERR, "Error running shell script: \"%s\"", job->argv[1]);
+        }
+
+        pthread_mutex_lock(&sp_mutex);
+        sp_stat.running--;
+        sp_stat.runs++;
+        if (-1 == rc) {
+            sp_stat.failed++;
+        }
+        if (timedout) {
+            sp_stat.timeouts++;
+        }
+        const double wait = start_ms - job->queued_ms;
+        const double run = end_ms - start_ms;
+        sp_stat.wait_avg_ms += (wait - sp_stat.wait_avg_ms) / (double) sp_stat.runs;
+        sp_stat.run_avg_ms += (run - sp_stat.run_avg_ms) / (double) sp_stat.runs;
+        if (wait > sp_stat.wait_max_ms) {
+            sp_stat.wait_max_ms = wait;
+        }
+        if (run > sp_stat.run_max_ms) {
+            sp_stat.run_max_ms = run;
+        }
+        _sp_free_job(job);
+    }
+    pthread_mutex_unlock(&sp_mutex);
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+#ifndef __APPLE__
+
+/**
+ * Get the script id from the file name of a script
+ * @param name File name (without directory)
+ * @return The script id, -1 if this is not a script we know of
+ */
+static int
+_sp_name_to_script(const char *name) {
+    if (0 == strcmp(name, "tracker_conn.sh")) {
+        return SCRIPTPOOL_TRACKER_CONN;
+    }
+    char *end = NULL;
+    const long id = strtol(name, &end, 10);
+    if (end == name || 0 != strcmp(end, "_action.sh") || id < 0 || id > SCRIPTPOOL_MAX_EVENTID) {
+        return -1;
+    }
+    return (int) id;
+}
+
+/**
+ * Watch the script directory and update the presence table when a script is
+ * added, removed or changed.
+ * @param arg The inotify file descriptor
+ * @return (void *)0
+ */
+static void *
+scriptpool_watch_thread(void *arg) {
+    const int inotify_fd = (int) (intptr_t) arg;
+    char *event_buffer = _chk_calloc_exit(SCRIPTPOOL_EVENT_BUF_LEN);
+    struct pollfd pfd = {.fd = inotify_fd, .events = POLLIN};
+
+    while (!sp_stopping) {
+        const int ret = poll(&pfd, 1, SCRIPTPOOL_WATCH_TIMEOUT);
+        if (ret <= 0) {
+            continue;
+        }
+        const ssize_t length = read(inotify_fd, event_buffer, SCRIPTPOOL_EVENT_BUF_LEN);
+        ssize_t i = 0;
+        _Bool lost = FALSE;
+        while (i < length) {
+            struct inotify_event *event = (struct inotify_event *) &event_buffer[i];
+            if (event->mask & IN_Q_OVERFLOW) {
+                _sp_scan();
+            } else if (event->mask & IN_IGNORED) {
+                lost = TRUE;
+            } else if (event->len) {
+                const int script = _sp_name_to_script(event->name);
+                if (script >= 0) {
+                    const _Bool present = _sp_access(script);
+                    pthread_mutex_lock(&sp_mutex);
+                    sp_present[script] = present;
+                    pthread_mutex_unlock(&sp_mutex);
+                    logmsg(LOG_DEBUG, "Script \"%s\" %s", event->name, present ? "available" : "removed");
+                }
+            }
+            i += sizeof (struct inotify_event) + event->len;
+        }
+        if (lost) {
+            // The directory itself has been removed so fall back on checking
+            // each script when it is needed
+            logmsg(LOG_NOTICE, "Script directory \"%s\" is no longer watched", sp_dir);
+            pthread_mutex_lock(&sp_mutex);
+            sp_stat.watching = FALSE;
+            pthread_mutex_unlock(&sp_mutex);
+            break;
+        }
+    }
+
+    close(inotify_fd);
+    free(event_buffer);
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Start watching the script directory
+ * @return 0 on success, -1 on failure
+ */
+static int
+_sp_watch_init(void) {
+    const int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        logmsg(LOG_ERR, "Cannot initialize inotify for scripts ( %d : %s )", errno, strerror(errno));
+        return -1;
+    }
+    if (inotify_add_watch(inotify_fd, sp_dir,
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB) < 0) {
+        logmsg(LOG_ERR, "Cannot watch script directory \"%s\" ( %d : %s )", sp_dir, errno, strerror(errno));
+        close(inotify_fd);
+        return -1;
+    }
+    int ret = pthread_create(&sp_watch_thread, NULL, scriptpool_watch_thread, (void *) (intptr_t) inotify_fd);
+    if (0 != ret) {
+        logmsg(LOG_ERR, "Could not create script watcher thread ( %d : %s )", ret, strerror(ret));
+        close(inotify_fd);
+        return -1;
+    }
+    sp_watch_started = TRUE;
+    return 0;
+}
+
+#else
+
+// No inotify on OSX so each script is checked when it is needed
+static int
+_sp_watch_init(void) {
+    return -1;
+}
+
+#endif
+
+/**
+ * Start the script workers and the watcher of the script directory
+ * @param nworkers Number of scripts that can run at the same time
+ * @param queue_size Maximum number of scripts waiting to run
+ * @param timeout Maximum run time in s for a script (0 = no limit)
+ * @return 0 on success, -1 on failure
+ */
+int
+scriptpool_init(const unsigned nworkers, const unsigned queue_size, const unsigned timeout) {
+    memset(&sp_stat, 0, sizeof (sp_stat));
+    sp_stat.queue_size = queue_size;
+    sp_timeout = timeout;
+
+    snprintf(sp_dir, sizeof (sp_dir), "%s/%s", data_dir, SCRIPTPOOL_SUBDIR);
+    if (-1 == chkcreatedir(data_dir, SCRIPTPOOL_SUBDIR)) {
+        return -1;
+    }
+
+    // Start watching before the first scan so no change is missed
+    sp_stat.watching = 0 == _sp_watch_init();
+    _sp_scan();
+
+    const unsigned n = nworkers < SCRIPTPOOL_MAX_WORKERS ? nworkers : SCRIPTPOOL_MAX_WORKERS;
+    for (unsigned i = 0; i < n; i++) {
+        int ret = pthread_create(&sp_threads[i], NULL, scriptpool_thread, NULL);
+        if (0 != ret) {
+            logmsg(LOG_CRIT, "Could not create script worker thread ( %d : %s )", ret, strerror(ret));
+            break;
+        }
+        sp_stat.workers++;
+    }
+    if (0 == sp_stat.workers) {
+        return -1;
+    }
+    pthread_mutex_lock(&sp_mutex);
+    sp_running = TRUE;
+    pthread_mutex_unlock(&sp_mutex);
+    logmsg(LOG_DEBUG, "Started %u script workers", sp_stat.workers);
+    return 0;
+}
+
+/**
+ * Stop the script workers. Scripts that are running are waited for but
+ * scripts still in the queue are dropped.
+ */
+void
+scriptpool_shutdown(void) {
+    pthread_mutex_lock(&sp_mutex);
+    sp_stopping = TRUE;
+    pthread_cond_broadcast(&sp_cond);
+    pthread_mutex_unlock(&sp_mutex);
+
+    if (sp_watch_started) {
+        pthread_join(sp_watch_thread, NULL);
+        sp_watch_started = FALSE;
+    }
+    if (!sp_running) {
+        return;
+    }
+    for (unsigned i = 0; i < sp_stat.workers; i++) {
+        pthread_join(sp_threads[i], NULL);
+    }
+
+    // The tracker threads may still be running so the queue is only touched
+    // with the mutex held. New scripts are rejected since sp_stopping is set.
+    pthread_mutex_lock(&sp_mutex);
+    sp_running = FALSE;
+    const size_t left = sp_stat.queue_len;
+    while (sp_head) {
+        struct scriptjob *job = sp_head;
+        sp_head = job->next;
+        _sp_free_job(job);
+    }
+    sp_tail = NULL;
+    sp_stat.queue_len = 0;
+    pthread_mutex_unlock(&sp_mutex);
+    if (left > 0) {
+        logmsg(LOG_NOTICE, "Script workers stopped with %zu scripts not run", left);
+    } else {
+        logmsg(LOG_DEBUG, "Script workers stopped after running %lu scripts", sp_stat.runs);
+    }
+}
+
+/**
+ * Check if a script exists
+ * @param script Script id
+ * @return TRUE if the script exists
+ */
+_Bool
+scriptpool_has_script(const unsigned script) {
+    if (script >= SCRIPTPOOL_NUM_SCRIPTS) {
+        return FALSE;
+    }
+    pthread_mutex_lock(&sp_mutex);
+    const _Bool watching = sp_stat.watching;
+    const _Bool present = sp_present[script];
+    pthread_mutex_unlock(&sp_mutex);
+    return watching ? present : _sp_access(script);
+}
+
+/**
+ * Queue a script to be run by the script workers. If a script with the same
+ * id is already waiting to run for the same device it is given the new
+ * arguments instead so only the latest event is run. If the queue is full or
+ * the workers are not running (failed to start or already stopped) the script
+ * is dropped so the caller is never blocked by a slow script.
+ * @param script Script id
+ * @param devid Device id the event is for
+ * @param args NULL terminated list of arguments to the script
+ * @return 0 on success, -1 on failure
+ */
+int
+scriptpool_run(const unsigned script, const char *devid, char *const args[]) {
+    if (script >= SCRIPTPOOL_NUM_SCRIPTS) {
+        return -1;
+    }
+
+    struct scriptjob *job = _chk_calloc_exit(sizeof (struct scriptjob));
+    char path[600];
+    _sp_script_path(script, path, sizeof (path));
+    job->script = script;
+    xstrlcpy(job->devid, devid, sizeof (job->devid));
+    job->argv[0] = strdup("sh");
+    job->argv[1] = strdup(path);
+    size_t n = 2;
+    for (size_t i = 0; args[i] && i < SCRIPTPOOL_MAX_ARGS; i++) {
+        job->argv[n++] = strdup(args[i]);
+    }
+    job->argv[n] = NULL;
+    job->queued_ms = _sp_now_ms();
+
+    pthread_mutex_lock(&sp_mutex);
+    if (!sp_running || sp_stopping) {
+        if (0 == sp_stat.dropped++ % 100) {
+            logmsg(LOG_ERR, "Script workers are not running. Script \"%s\" dropped.", path);
+        }
+        pthread_mutex_unlock(&sp_mutex);
+        _sp_free_job(job);
+        return -1;
+    }
+    for (struct scriptjob *q = sp_head; q; q = q->next) {
+        if (q->script == script && 0 == strcmp(q->devid, job->devid)) {
+            // Keep the place in the queue but use the newest event
+            for (size_t i = 0; q->argv[i]; i++) {
+                free(q->argv[i]);
+            }
+            memcpy(q->argv, job->argv, sizeof (q->argv));
+            sp_stat.coalesced++;
+            pthread_mutex_unlock(&sp_mutex);
+            free(job);
+            return 0;
+        }
+    }
+    if (sp_stat.queue_len >= sp_stat.queue_size) {
+        // Avoid flooding the log during a burst
+        if (0 == sp_stat.dropped++ % 100) {
+            logmsg(LOG_ERR, "Script queue is full (%zu scripts). Script \"%s\" dropped.", sp_stat.queue_size, path);
+        }
+        pthread_mutex_unlock(&sp_mutex);
+        _sp_free_job(job);
+        return -1;
+    }
+    if (sp_tail) {
+        sp_tail->next = job;
+    } else {
+        sp_head = job;
+    }
+    sp_tail = job;
+    sp_stat.queue_len++;
+    if (sp_stat.queue_len > sp_stat.queue_peak) {
+        sp_stat.queue_peak = sp_stat.queue_len;
+    }
+    pthread_cond_signal(&sp_cond);
+    pthread_mutex_unlock(&sp_mutex);
+    return 0;
+}
+
+/**
+ * Get a snapshot of the script statistics
+ * @param[out] stat Statistics
+ */
+void
+scriptpool_get_stat(struct scriptpool_stat *stat) {
+    pthread_mutex_lock(&sp_mutex);
+    *stat = sp_stat;
+    pthread_mutex_unlock(&sp_mutex);
+}
+
+/* EOF */
@@ -0,0 +1,93 @@
+/* =========================================================================
+ * File:        SCRIPTPOOL.H
+ * Description: Bounded execution service for the event scripts
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef SCRIPTPOOL_H
+#define	SCRIPTPOOL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/**
+ * Name of the directory under the main data directory with the event scripts
+ */
+#define SCRIPTPOOL_SUBDIR "event_scripts"
+
+/**
+ * Script ids. The action scripts "<id>_action.sh" use the event id (0-100)
+ * as script id. The script run on a new tracker connection has its own id.
+ */
+#define SCRIPTPOOL_MAX_EVENTID 100
+#define SCRIPTPOOL_TRACKER_CONN (SCRIPTPOOL_MAX_EVENTID + 1)
+#define SCRIPTPOOL_NUM_SCRIPTS (SCRIPTPOOL_TRACKER_CONN + 1)
+
+/**
+ * Maximum number of script worker threads
+ */
+#define SCRIPTPOOL_MAX_WORKERS 16
+
+/**
+ * Maximum number of arguments given to a script
+ */
+#define SCRIPTPOOL_MAX_ARGS 16
+
+/**
+ * Statistics for the script execution
+ */
+struct scriptpool_stat {
+    size_t queue_len;           // Number of scripts waiting to run
+    size_t queue_peak;          // Largest number of waiting scripts seen
+    size_t queue_size;          // Maximum number of waiting scripts
+    unsigned running;           // Number of scripts running right now
+    unsigned workers;           // Number of worker threads
+    _Bool watching;             // TRUE if the script directory is watched with inotify
+    unsigned long runs;         // Number of finished scripts
+    unsigned long failed;       // Number of scripts that could not start or had exit status != 0
+    unsigned long timeouts;     // Number of scripts stopped since they ran longer than the timeout
+    unsigned long dropped;      // Number of scripts dropped since the queue was full
+    unsigned long coalesced;    // Number of scripts replaced by a newer event for the same device
+    double wait_avg_ms;         // Average time from queued to started
+    double wait_max_ms;         // Longest time from queued to started
+    double run_avg_ms;          // Average run time
+    double run_max_ms;          // Longest run time
+};
+
+int
+scriptpool_init(const unsigned nworkers, const unsigned queue_size, const unsigned timeout);
+
+void
+scriptpool_shutdown(void);
+
+_Bool
+scriptpool_has_script(const unsigned script);
+
+int
+scriptpool_run(const unsigned script, const char *devid, char *const args[]);
+
+void
+scriptpool_get_stat(struct scriptpool_stat *stat);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* SCRIPTPOOL_H */
@@ -165,7 +165,7 @@ static const struct option long_options [] = {
 
 char *cmd_list[] = {
     "get", "set", "do", "help", "db",
-    "preset", ".date", ".cachestat", ".usb", ".target", ".ver", ".lc", ".ld",
+    "preset", ".date", ".cachestat", ".dbstat", ".mailstat", ".scriptstat", ".pluginstat", ".bcast", ".usb", ".target", ".ver", ".lc", ".ld",
     ".lookup", ".table", ".nick", ".ln", ".dn", ".ratereset", ".report", ".breport", ".freport", 
     "exit", "quit",
     (char *) NULL
@@ -215,7 +215,7 @@ char *onoff_cmd_list[] = {
 };
 
 char *help_cmd_list[] = {
-    "db", "preset", ".date", ".cachestat", ".usb", 
+    "db", "preset", ".date", ".cachestat", ".dbstat", ".mailstat", ".scriptstat", ".pluginstat", ".bcast", ".usb", 
     ".target", ".ver", ".lc", ".ld", ".lookup", ".table", ".nick", 
     ".ln", ".dn", ".ratereset", ".report", ".breport", 
     "address", "ver", "locg", "gfevt", "phone",
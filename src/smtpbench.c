@@ -0,0 +1,369 @@
+/* =========================================================================
+ * File:        SMTPBENCH.C
+ * Description: Benchmark and check of the SMTP session pool and the
+ *              PIPELINING support in libsmtpmail. A small stand-in SMTP
+ *              server is started on the loopback interface and a number
+ *              of mails are sent to it
+ *              - with a new session for each mail (as before the pool),
+ *              - with pooled sessions and a server that supports PIPELINING,
+ *              - with pooled sessions and a server without PIPELINING.
+ *              The server counts connections, mails and envelopes that
+ *              arrived in a single read so that it can be verified that
+ *              the pooled and pipelined paths are really used.
+ *
+ *              Build and run with "make check" or run as
+ *              ./smtpbench [-n <mails>]
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "utils.h"
+#include "logger.h"
+#include "libxstr/xstr.h"
+#include "libsmtpmail/mailclientlib.h"
+
+/**
+ * Default number of mails sent in each run
+ */
+#define SMTPBENCH_MAILS 200
+
+/**
+ * Size of the read buffer for each connection to the stand-in server
+ */
+#define SMTPBENCH_BUFFSIZE 8192
+
+/**
+ * Counters kept by the stand-in server for the current run
+ */
+struct smtpbench_stat {
+    unsigned connections;
+    unsigned mails;
+    unsigned envelopes;
+    unsigned pipelined;
+};
+
+static pthread_mutex_t smtpbench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct smtpbench_stat smtpbench_stat;
+static _Bool smtpbench_pipelining = TRUE;
+
+/**
+ * The library logs through logmsg(). The benchmark only needs the errors
+ * on stderr.
+ */
+void
+logmsg(int priority, const char *msg, ...) {
+    if (priority <= LOG_ERR) {
+        va_list ap;
+        va_start(ap, msg);
+        vfprintf(stderr, msg, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+}
+
+/**
+ * Serve one client connection to the stand-in server. All complete command
+ * lines that arrive in one read are handled and all the replies are sent
+ * back in one write, the same way a real server handles a pipelined client.
+ * @param arg The socket of the connection
+ * @return NULL
+ */
+static void *
+smtpbench_conn(void *arg) {
+    const int sd = (int) (intptr_t) arg;
+    char *buff = calloc(1, SMTPBENCH_BUFFSIZE);
+    char reply[1024];
+    size_t len = 0;
+    _Bool indata = FALSE, quit = FALSE;
+
+    pthread_mutex_lock(&smtpbench_mutex);
+    smtpbench_stat.connections++;
+    pthread_mutex_unlock(&smtpbench_mutex);
+
+    const char *greeting = "220 localhost stand-in ESMTP\r\n";
+    (void) send(sd, greeting, strlen(greeting), MSG_NOSIGNAL);
+
+    while (!quit) {
+        const ssize_t nr = recv(sd, buff + len, SMTPBENCH_BUFFSIZE - len - 1, 0);
+        if (nr <= 0) {
+            break;
+        }
+        len += nr;
+        buff[len] = '\0';
+
+        *reply = '\0';
+        _Bool mail = FALSE, data = FALSE;
+        char *line = buff, *eol;
+        while (!quit && (eol = strstr(line, "\r\n"))) {
+            *eol = '\0';
+            if (indata) {
+                if (0 == strcmp(line, ".")) {
+                    indata = FALSE;
+                    pthread_mutex_lock(&smtpbench_mutex);
+                    smtpbench_stat.mails++;
+                    pthread_mutex_unlock(&smtpbench_mutex);
+                    xstrlcat(reply, "250 OK queued\r\n", sizeof (reply));
+                }
+            } else if (0 == strncasecmp(line, "EHLO", 4)) {
+                xstrlcat(reply, smtpbench_pipelining ?
+                        "250-localhost\r\n250-PIPELINING\r\n250 8BITMIME\r\n" :
+                        "250-localhost\r\n250 8BITMIME\r\n", sizeof (reply));
+            } else if (0 == strncasecmp(line, "MAIL FROM:", 10)) {
+                mail = TRUE;
+                xstrlcat(reply, "250 OK\r\n", sizeof (reply));
+            } else if (0 == strncasecmp(line, "RCPT TO:", 8) || 0 == strcasecmp(line, "RSET")) {
+                xstrlcat(reply, "250 OK\r\n", sizeof (reply));
+            } else if (0 == strcasecmp(line, "DATA")) {
+                data = TRUE;
+                indata = TRUE;
+                xstrlcat(reply, "354 End data with <CR><LF>.<CR><LF>\r\n", sizeof (reply));
+            } else if (0 == strcasecmp(line, "QUIT")) {
+                quit = TRUE;
+                xstrlcat(reply, "221 Bye\r\n", sizeof (reply));
+            } else {
+                xstrlcat(reply, "502 Command not implemented\r\n", sizeof (reply));
+            }
+            line = eol + 2;
+        }
+
+        if (mail) {
+            pthread_mutex_lock(&smtpbench_mutex);
+            smtpbench_stat.envelopes++;
+            // The whole envelope from MAIL FROM to DATA arrived in one read
+            if (data) {
+                smtpbench_stat.pipelined++;
+            }
+            pthread_mutex_unlock(&smtpbench_mutex);
+        }
+
+        // Keep a partial line for the next read. A too long line can only be
+        // mail data which is not needed.
+        len -= line - buff;
+        memmove(buff, line, len + 1);
+        if (len >= SMTPBENCH_BUFFSIZE - 1) {
+            len = 0;
+        }
+
+        if (*reply && strlen(reply) != (size_t) send(sd, reply, strlen(reply), MSG_NOSIGNAL)) {
+            break;
+        }
+    }
+
+    free(buff);
+    close(sd);
+    return NULL;
+}
+
+/**
+ * Accept connections to the stand-in server and start a thread for each
+ * @param arg The listening socket
+ * @return NULL
+ */
+static void *
+smtpbench_server(void *arg) {
+    const int lsd = (int) (intptr_t) arg;
+    for (;;) {
+        const int sd = accept(lsd, NULL, NULL);
+        if (sd < 0) {
+            continue;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, smtpbench_conn, (void *) (intptr_t) sd)) {
+            close(sd);
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the stand-in server on an unused port on the loopback interface
+ * @return The port number, -1 on failure
+ */
+static int
+smtpbench_server_start(void) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof (addr);
+
+    const int lsd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lsd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(lsd, (struct sockaddr *) &addr, sizeof (addr)) ||
+            listen(lsd, 16) ||
+            getsockname(lsd, (struct sockaddr *) &addr, &addrlen)) {
+        close(lsd);
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, smtpbench_server, (void *) (intptr_t) lsd)) {
+        close(lsd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Add a small plain text mail with two recipients to the session and send it
+ * @param handle SMTP session handle
+ * @param i Sequence number of the mail
+ * @return 0 on success, -1 on failure
+ */
+static int
+smtpbench_sendmail(struct smtp_handle *handle, const unsigned i) {
+    char to[] = "Tracker owner <owner@localhost>";
+    char cc[] = "backup@localhost";
+    char from[] = "g7ctrl <g7ctrl@localhost>";
+    char subject[64], body[256];
+
+    snprintf(subject, sizeof (subject), "Tracker event %u", i);
+    snprintf(body, sizeof (body), "Device 3000000001 reported event %u.\nThis is a test mail from smtpbench.\n", i);
+    if (-1 == smtp_add_rcpt(handle, SMTP_RCPT_TO, to) ||
+            -1 == smtp_add_rcpt(handle, SMTP_RCPT_CC, cc) ||
+            -1 == smtp_add_plain(handle, body)) {
+        return -1;
+    }
+    return smtp_sendmail(handle, from, subject);
+}
+
+/**
+ * Send the mails in one run and print the result
+ * @param name Name of the run
+ * @param port Port of the stand-in server
+ * @param pooled TRUE to use the session pool, FALSE for a new session per mail
+ * @param n Number of mails
+ * @param[out] stat The server counters for this run
+ * @return Number of mails that could not be sent
+ */
+static unsigned
+smtpbench_run(const char *name, const int port, const _Bool pooled, const unsigned n,
+        struct smtpbench_stat *stat) {
+    char server[] = "127.0.0.1";
+    char user[] = "", pwd[] = "";
+    struct timespec t0, t1;
+    unsigned failed = 0;
+
+    pthread_mutex_lock(&smtpbench_mutex);
+    memset(&smtpbench_stat, 0, sizeof (smtpbench_stat));
+    pthread_mutex_unlock(&smtpbench_mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (unsigned i = 0; i < n; i++) {
+        struct smtp_handle *handle;
+        if (pooled) {
+            handle = smtp_session_get(server, user, pwd, port);
+        } else {
+            handle = smtp_setup(server, user, pwd, port);
+        }
+        if (NULL == handle) {
+            failed++;
+            continue;
+        }
+        const int rc = smtpbench_sendmail(handle, i);
+        if (rc) {
+            failed++;
+        }
+        if (pooled) {
+            smtp_session_release(&handle, 0 == rc);
+        } else {
+            smtp_cleanup(&handle);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    smtp_session_pool_close();
+
+    pthread_mutex_lock(&smtpbench_mutex);
+    *stat = smtpbench_stat;
+    pthread_mutex_unlock(&smtpbench_mutex);
+
+    const double s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%-22s %6u mails in %7.3f s  %8.0f mails/s  %8.1f us/mail  connections=%u pipelined=%u/%u\n",
+            name, n, s, n / s, s * 1e6 / n, stat->connections, stat->pipelined, stat->envelopes);
+    return failed;
+}
+
+int
+main(int argc, char **argv) {
+    unsigned n = SMTPBENCH_MAILS;
+    struct smtpbench_stat stat;
+    int opt, ret = EXIT_SUCCESS;
+
+    while (-1 != (opt = getopt(argc, argv, "n:"))) {
+        if ('n' == opt) {
+            n = (unsigned) atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n <mails>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (0 == n) {
+        n = SMTPBENCH_MAILS;
+    }
+
+    const int port = smtpbench_server_start();
+    if (-1 == port) {
+        fprintf(stderr, "Cannot start stand-in SMTP server\n");
+        return EXIT_FAILURE;
+    }
+
+    smtpbench_pipelining = TRUE;
+    if (smtpbench_run("new session/mail", port, FALSE, n, &stat) ||
+            stat.mails != n || stat.connections != n) {
+        fprintf(stderr, "FAILED: expected %u mails on %u connections\n", n, n);
+        ret = EXIT_FAILURE;
+    }
+    if (smtpbench_run("pooled, pipelined", port, TRUE, n, &stat) ||
+            stat.mails != n || stat.connections != 1 || stat.pipelined != n) {
+        fprintf(stderr, "FAILED: expected %u pipelined mails on one connection\n", n);
+        ret = EXIT_FAILURE;
+    }
+    smtpbench_pipelining = FALSE;
+    if (smtpbench_run("pooled, no pipelining", port, TRUE, n, &stat) ||
+            stat.mails != n || stat.connections != 1 || stat.pipelined != 0) {
+        fprintf(stderr, "FAILED: expected %u not pipelined mails on one connection\n", n);
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
+
+/* EOF */
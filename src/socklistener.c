@@ -54,6 +54,7 @@
 #include "socklistener.h"
 #include "g7cmd.h"
 #include "tracker.h"
+#include "trkloop.h"
 #include "sighandling.h"
 
 /**
@@ -240,7 +241,14 @@ startupsrv(void) {
                 ret = pthread_create(&client_info_list[i].cli_thread, NULL, cmd_clientsrv, (void *) & client_info_list[i]);
             } else {
                 client_info_list[i].cli_is_cmdconn = FALSE;
-                ret = pthread_create(&client_info_list[i].cli_thread, NULL, tracker_clientsrv, (void *) & client_info_list[i]);
+                client_info_list[i].cli_evloop = FALSE;
+                // If tracker event loops are enabled the connection is handed over to
+                // one of the loops, otherwise (or if that fails) it gets its own thread
+                if (!trkloop_enabled() || -1 == trkloop_add(&client_info_list[i])) {
+                    ret = pthread_create(&client_info_list[i].cli_thread, NULL, tracker_clientsrv, (void *) & client_info_list[i]);
+                } else {
+                    ret = 0;
+                }
             }
 
             if (ret != 0) {
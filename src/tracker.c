@@ -39,6 +39,8 @@
 #include <signal.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <sys/stat.h>
 
 #include "config.h"
@@ -53,9 +55,14 @@
 #include "g7cmd.h"
 #include "g7sendcmd.h"
 #include "mailutil.h"
+#include "mailqueue.h"
+#include "maildigest.h"
+#include "scriptpool.h"
+#include "plugins.h"
 #include "nicks.h"
 #include "geoloc.h"
 #include "geoloc_cache.h"
+#include "tracker.h"
 
 #define LEN_10K (10*1024)
 #define LEN_1K (1024)
@@ -113,34 +120,6 @@ chk_specialhandling(struct splitfields *flds, struct client_info *cli_info) {
     }
 }
 
-/**
- * Run a system command
- * @param arg Command string
- * @return NULL
- */
-void *
-system_thread(void *arg) {
-    char *system_cmd = (char *) arg;
-
-    // To avoid reserving ~8MB after the thread terminates we
-    // detach it. Without doing this the pthreads library would keep
-    // the exit status until the thread is joined (or detached) which would mean
-    // loosing 8MB for each created thread
-    pthread_detach(pthread_self());
-
-    int rc = system(system_cmd);
-
-    if (0 == rc) {
-        logmsg(LOG_NOTICE, "Shell script: \"%s\" have run.", system_cmd);
-    } else {
-        logmsg(LOG_ERR, "Error running shell script: \"%s\"", system_cmd);
-    }
-
-    free(system_cmd);
-    pthread_exit(NULL);
-    return (void *) 0;
-}
-
 /**
  * Check if the corresponding action script to the received event
  * should be executed. Normally events 2 and 0 will not be executed
@@ -164,27 +143,20 @@ chk_actionscript(struct splitfields *flds) {
 
     // Translate dev id to nick name if it exists
 
-    char scriptName[256];
-    snprintf(scriptName, sizeof (scriptName), "%s/event_scripts/%u_action.sh", data_dir, eventid);
-
-    if (0 == access(scriptName, R_OK)) {
+    if (scriptpool_has_script(eventid)) {
         char nick[16];
         if (db_get_nick_from_devid(flds->fld[GM7_LOC_DEVID], nick)) {
             // No nickname. Put device ID in its place
             xmb_strncpy(nick, flds->fld[GM7_LOC_DEVID], sizeof (nick) - 1);
             //nick[sizeof (nick) - 1] = '\0';
         }
-        const size_t size = 2048;
-        char *cmd = _chk_calloc_exit(size);
-        snprintf(cmd, size, "sh %s -t %s -d %s -l \"%s\" -n \"%s\" -m \"%s\"",
-                scriptName,
-                flds->fld[GM7_LOC_DATE], flds->fld[GM7_LOC_DEVID],
-                flds->fld[GM7_LOC_LAT], flds->fld[GM7_LOC_LON], nick);
-
-        pthread_t dummy_threadid;
-        int rc = pthread_create(&dummy_threadid, NULL, system_thread, (void *) cmd);
-        if (rc) {
-            logmsg(LOG_ERR, "Cannot start script thread: \"%s\"", cmd);
+        char *args[] = {
+            "-t", flds->fld[GM7_LOC_DATE], "-d", flds->fld[GM7_LOC_DEVID],
+            "-l", flds->fld[GM7_LOC_LAT], "-n", flds->fld[GM7_LOC_LON], "-m", nick,
+            NULL
+        };
+        if (-1 == scriptpool_run(eventid, flds->fld[GM7_LOC_DEVID], args)) {
+            logmsg(LOG_ERR, "Cannot run action script for event %u", eventid);
         }
     }
 }
@@ -270,20 +242,14 @@ chk_connection_notification(char *devid, struct client_info *cli_info) {
     // First kick off any scripts that needs to run
     if (script_on_tracker_conn) {
         // Then check if there is a shell script to be executed
-        char scriptName[512];
-        snprintf(scriptName, sizeof (scriptName), "%s/event_scripts/tracker_conn.sh", data_dir);
-        if (0 == access(scriptName, R_OK)) {
-            const size_t size = 1024;
-            char *cmd = _chk_calloc_exit(size);
-            snprintf(cmd, size, "sh %s -d %s -n \"%s\"", scriptName, devid, nick);
-            logmsg(LOG_DEBUG, "Executing script on tracker connect cmd='%s'", cmd);
-            pthread_t dummy_threadid;
-            int rc = pthread_create(&dummy_threadid, NULL, system_thread, (void *) cmd);
-            if (rc) {
-                logmsg(LOG_ERR, "Cannot start script thread: \"%s\"", cmd);
+        if (scriptpool_has_script(SCRIPTPOOL_TRACKER_CONN)) {
+            char *args[] = {"-d", devid, "-n", nick, NULL};
+            logmsg(LOG_DEBUG, "Executing script on tracker connect for device '%s'", devid);
+            if (-1 == scriptpool_run(SCRIPTPOOL_TRACKER_CONN, devid, args)) {
+                logmsg(LOG_ERR, "Cannot run script on tracker connect for device '%s'", devid);
             }
         } else {
-            logmsg(LOG_WARNING, "Script on tracker connect enabled but no script found at '%s'", scriptName);
+            logmsg(LOG_WARNING, "Script on tracker connect enabled but no script found in '%s/%s'", data_dir, SCRIPTPOOL_SUBDIR);
         }
     }
 
@@ -320,13 +286,10 @@ chk_connection_notification(char *devid, struct client_info *cli_info) {
             snprintf(subjectbuff, sizeof (subjectbuff), SUBJECT_NEWCONNECTION, mail_subject_prefix, devid);
         }
         
-        if (-1 == send_mail_template(subjectbuff, daemon_email_from, send_mailaddress, "mail_tracker_conn", 
-                                     dict, NULL, 0, NULL)) {
-            logmsg(LOG_ERR, "Failed to send mail using template \"mail_tracker_conn\"");
+        // The mail queue takes over the dictionary
+        if (0 == mailqueue_enqueue(subjectbuff, send_mailaddress, "mail_tracker_conn", dict, 0)) {
+            logmsg(LOG_INFO, "Queued mail for new device connection (%s) to \"%s\"", devid, send_mailaddress);
         }
-        
-        logmsg(LOG_INFO, "Sent mail for new device connection (%s) to \"%s\"", devid, send_mailaddress);
-        free_dict(dict);
 
     }
 }
@@ -353,12 +316,6 @@ chk_sendmail(struct splitfields *flds, int forceSend) {
             return;
         }
 
-        dict_t dict = new_dict();
-        
-        add_serverinfo2dict(dict);
-        add_diskspace2dict(dict);
-        add_avgload2dict(dict);
-
         // Format the displayed date/time from the device so it is a bit easier to read in the mail
         char datetimeFmt[32];
         size_t tmpIdx = 4;
@@ -402,10 +359,35 @@ chk_sendmail(struct splitfields *flds, int forceSend) {
                 short_devid[i] = flds->fld[GM7_LOC_DEVID][devid_len-4+i];
             }            
             short_devid[4] = '\0';            
-            add_dict(dict, "DEVICEID", short_devid);
-        } else {
-            add_dict(dict, "DEVICEID", flds->fld[GM7_LOC_DEVID]);
         }
+        char *devid = use_short_devid ? short_devid : flds->fld[GM7_LOC_DEVID];
+
+        // In digest mode all but the priority events are collected and
+        // mailed together when the digest window has passed
+        if (maildigest_use(event)) {
+            struct maildigest_event ev;
+            xstrlcpy(ev.datetime, datetimeFmt, sizeof (ev.datetime));
+            xstrlcpy(ev.eventcmd, eventCmd, sizeof (ev.eventcmd));
+            xstrlcpy(ev.eventdesc, eventDesc, sizeof (ev.eventdesc));
+            xstrlcpy(ev.lat, flds->fld[GM7_LOC_LAT], sizeof (ev.lat));
+            xstrlcpy(ev.lon, flds->fld[GM7_LOC_LON], sizeof (ev.lon));
+            xstrlcpy(ev.speed, flds->fld[GM7_LOC_SPEED], sizeof (ev.speed));
+            xstrlcpy(ev.heading, flds->fld[GM7_LOC_HEADING], sizeof (ev.heading));
+            xstrlcpy(ev.sat, flds->fld[GM7_LOC_SAT], sizeof (ev.sat));
+            xstrlcpy(ev.voltage, flds->fld[GM7_LOC_VOLT], sizeof (ev.voltage));
+            if (0 == maildigest_add(send_mailaddress, devid, nick_devid, &ev)) {
+                logmsg(LOG_DEBUG, "Added event \"%s\" to mail digest for \"%s\"", eventCmd, devid);
+                return;
+            }
+        }
+
+        dict_t dict = new_dict();
+        
+        add_serverinfo2dict(dict);
+        add_diskspace2dict(dict);
+        add_avgload2dict(dict);
+
+        add_dict(dict, "DEVICEID", devid);
         
         // Add generic fields
         add_dict(dict,"NICK_DEVID", nick_devid);
@@ -472,92 +454,38 @@ chk_sendmail(struct splitfields *flds, int forceSend) {
         snprintf(rndval,sizeof(rndval),"%d",rand());
         add_dict(dict, "RANDOM", rndval);
         
-        // Check to see if we should do a reverse address lookup
+        // The address lookup and the minimaps may be slow so they are left
+        // to the mail worker
+        unsigned flags = 0;
         if (use_address_lookup) {
-            char address[512];            
-            // No need for error check since the address field will have  "?" in case of error
-            get_address_from_latlon(flds->fld[GM7_LOC_LAT], flds->fld[GM7_LOC_LON], address, sizeof (address));
-            add_dict(dict, "APPROX_ADDRESS", address);
+            flags |= MAILJOB_ADDRESS;
         } else {
             add_dict(dict, "APPROX_ADDRESS", "(disabled)");
         }
+        if (include_minimap) {
+            flags |= MAILJOB_MINIMAP;
+        }
 
         char subjectbuff[LEN_MEDIUM];
         snprintf(subjectbuff, sizeof (subjectbuff), SUBJECT_EVENTMAIL, 
                 mail_subject_prefix, 
-                use_short_devid ? short_devid : flds->fld[GM7_LOC_DEVID], 
+                devid, 
                 eventDesc);
-            
-
-        if (include_minimap) {
-            
-            logmsg(LOG_DEBUG,"Adding minimap to mail");
-
-            char kval[32];
-            snprintf(kval,sizeof(kval),"%d",minimap_width);
-            add_dict(dict, "IMG_WIDTH", kval);
-            
-            snprintf(kval,sizeof(kval),"%d",minimap_overview_zoom);
-            add_dict(dict, "ZOOM_OVERVIEW", kval);
-            
-            snprintf(kval,sizeof(kval),"%d",minimap_detailed_zoom);
-            add_dict(dict, "ZOOM_DETAILED", kval);
-
-            char *overview_imgdata, *detailed_imgdata;
-            const char *lat = flds->fld[GM7_LOC_LAT];
-            const char *lon = flds->fld[GM7_LOC_LON];
-            const unsigned short overview_zoom = minimap_overview_zoom;
-            const unsigned short detailed_zoom = minimap_detailed_zoom;
-            char imgsize[12];
-            snprintf(imgsize,sizeof(imgsize),"%dx%d",minimap_width,minimap_height);
-            const char *overview_filename = "overview_map.png";
-            const char *detailed_filename = "detailed_map.png";
-            size_t overview_datasize=0, detailed_datasize=0;
-
-            int rc1 = get_minimap_from_latlon(lat, lon, overview_zoom, minimap_width, minimap_height, &overview_imgdata, &overview_datasize);
-            if( 0 == rc1 )
-                rc1 = get_minimap_from_latlon(lat, lon, detailed_zoom, minimap_width, minimap_height, &detailed_imgdata, &detailed_datasize);
-
-            if (-1 == rc1 ) {
-                logmsg(LOG_ERR, "Failed to get static map from Google. Are you using a correct API key?");
-                logmsg(LOG_ERR, "Sending mail without the static maps.");
-                rc = send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,
-                                "mail_event",
-                                dict, NULL, 0, NULL);
-            } else {
-                struct inlineimage_t *inlineimg_arr = calloc(2, sizeof (struct inlineimage_t));
-                setup_inlineimg(&inlineimg_arr[0], overview_filename, overview_datasize, overview_imgdata);
-                setup_inlineimg(&inlineimg_arr[1], detailed_filename, detailed_datasize, detailed_imgdata);
-
-                rc = send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,
-                                    "mail_event_img",
-                                    dict, NULL, 2, inlineimg_arr);
-
-                free_inlineimg_array(inlineimg_arr, 2);
-                free(inlineimg_arr);
-
-            }
 
-        } else {
-            // rc = -1 => Error
-            // rc = -99 => Mail disabled in the configuration
-            rc = send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,
-                    "mail_event",
-                    dict, NULL, 0, NULL);
-        }
-        
+        // The mail queue takes over the dictionary
+        // rc = -1 => Error
+        // rc = -99 => Mail disabled in the configuration
+        rc = mailqueue_enqueue(subjectbuff, send_mailaddress, "mail_event", dict, flags);
         if (-1 == rc) {
-            logmsg(LOG_ERR, "Failed to send mail using template \"mail_event\"");
+            logmsg(LOG_ERR, "Failed to queue mail using template \"mail_event\"");
         } else if ( 0 == rc ) {
-            logmsg(LOG_INFO, "Sent mail for event \"%s\" to \"%s\"", eventCmd, send_mailaddress);
+            logmsg(LOG_INFO, "Queued mail for event \"%s\" to \"%s\"", eventCmd, send_mailaddress);
         }        
-        
-        free_dict(dict);
     }
 }
 
 /**
- * This callback is called after each location event has been stored in the DB
+ * This callback is called after each location event has been queued for storage in the DB
  * @param flds The splitted field in the location event
  * @param cb_option Force mail flag
  */
@@ -573,13 +501,16 @@ store_loc_Callback(struct splitfields *flds, void *cb_option) {
     // Check for any potential action script to run
     chk_actionscript(flds);
 
+    // Hand the location over to any plugins
+    plugins_location(flds);
+
     // Check for any special handling of this event type
     chk_specialhandling(flds, cli_info);
 }
 
 /**
  * This handler takes care of all that needs to be done when we have received
- * a location update package, i.e. storing it in the DB and potentially sending
+ * a location update package, i.e. queuing it for the DB and potentially sending
  * a mail and calling an event script. See store_loc_Callback()
  * @param cli_info Information record on connected device client
  * @param buffer The actual data package we have received
@@ -590,8 +521,7 @@ static int
 handleLocPackage(struct client_info *cli_info, const char *buffer, const size_t len) {
     logmsg(LOG_DEBUG, "LOC PKG: (%s:%d) -> %s [%zd]", cli_info->cli_ipadr, cli_info->cli_socket, "ARRIVE_PKG_LOC", len);
     logmsg(LOG_DEBUG, "RAW: [%s]", buffer);
-    const unsigned num_loc=1;
-    return db_store_locations(cli_info->cli_socket,num_loc,buffer, store_loc_Callback, (void *) cli_info);
+    return db_queue_locations(buffer, store_loc_Callback, (void *) cli_info);
 }
 
 /**
@@ -640,6 +570,7 @@ handleCmdReplyPackage(struct client_info *cli_info, const char *buffer, const si
             logmsg(LOG_ERR, "Location reply is NOT from the expected tracker=%u but from=%u", cli_info->cli_devid, devid);
             return -1;
         }
+        isok = TRUE;
     } else {
 
         // 1. Parse the reply to extract tag and command
@@ -649,9 +580,11 @@ handleCmdReplyPackage(struct client_info *cli_info, const char *buffer, const si
             return -1;
         }
     }
-    // 2. Look up the command in the queue and get the entry
-    struct cmdqueue_t *entry;
-    if (cmdqueue_match(cli_info->cli_devid, tag, &entry)) {
+    plugins_cmdreply(cli_info->cli_devid, tag, cmdname, isok, buffer);
+
+    // 2. Look up the command in the queue, store the reply and wake up the
+    // command thread that is waiting for it
+    if (cmdqueue_set_reply(cli_info->cli_devid, tag, buffer)) {
         // No matching command was found
         if (strcmp(tag, GFEN_TRACK_TAG)) {
             logmsg(LOG_INFO, "Stray CMD reply [%u]: \"%s\"", cli_info->cli_devid, buffer);
@@ -661,10 +594,6 @@ handleCmdReplyPackage(struct client_info *cli_info, const char *buffer, const si
             return 0;
         }
     }
-    xmb_strncpy(entry->reply, buffer, sizeof (entry->reply) - 1);
-    logmsg(LOG_DEBUG, "Matching cmd: [%u:%s] \"%s\" ts=%lu, sock=%d",
-            entry->devid, entry->tag, entry->cmd, entry->ts, entry->user_sockd);
-    entry->validreply = TRUE;
     return 0;
 
     /*
@@ -706,7 +635,10 @@ handleKeepAlivePackage(struct client_info *cli_info, const char *buffer, const s
         logmsg(LOG_DEBUG, "KEEP_ALIVE_PACKAGE [deviceid=%u : seq=%04u]", devid, seq);
         if (0 == cli_info->cli_devid) {
             _Bool is_reconnection = FALSE;
-            // Check if this device ID already exists in that case kill that thread
+            // Check if this device ID already exists in that case kill that thread.
+            // The list is scanned under the socks_mutex so that no slot can be
+            // released or reused by another thread while we look at it.
+            pthread_mutex_lock(&socks_mutex);
             for (size_t i = 0; i < max_clients; i++) {
                 if (client_info_list[i].cli_ts && devid == client_info_list[i].cli_devid) {
                     // Check that this isn't ourself
@@ -714,13 +646,24 @@ handleKeepAlivePackage(struct client_info *cli_info, const char *buffer, const s
                             client_info_list[i].cli_socket != cli_info->cli_socket) {
                         char ip[16] = {'\0'};
                         xmb_strncpy(ip, client_info_list[i].cli_ipadr, 15);
-                        pthread_cancel(client_info_list[i].cli_thread);
+                        if (client_info_list[i].cli_evloop) {
+                            // The old connection is owned by an event loop which may be
+                            // serving other trackers as well so we cannot cancel the thread.
+                            // Instead shut down the socket and let the owning loop see the
+                            // EOF and do the cleanup in its own thread.
+                            (void) shutdown(client_info_list[i].cli_socket, SHUT_RDWR);
+                        } else {
+                            pthread_cancel(client_info_list[i].cli_thread);
+                        }
                         logmsg(LOG_DEBUG, "Canceled old tracker client at IP=%s", ip);
                         is_reconnection = TRUE;
                     }
                 }
             }
 
+            // Note the device id for this connection
+            cli_info->cli_devid = devid;
+            pthread_mutex_unlock(&socks_mutex);
 
             if (!is_reconnection) {
                 char devidbuff[12];
@@ -728,8 +671,7 @@ handleKeepAlivePackage(struct client_info *cli_info, const char *buffer, const s
                 chk_connection_notification(devidbuff, cli_info);
             }
 
-            // Note the device id for this connection
-            cli_info->cli_devid = devid;
+            plugins_connection(devid, G7PLUGIN_CONNECT, cli_info->cli_ipadr);
         }
 
         ssize_t rc = write(cli_info->cli_socket, buffer, KEEP_ALIVE_LEN);
@@ -748,18 +690,22 @@ handleKeepAlivePackage(struct client_info *cli_info, const char *buffer, const s
 }
 
 /**
- * Tracker thread cleanup function
- * @param arg
+ * Close the socket to a tracker and release its slot in the list of
+ * connected clients. This is used both as the cleanup handler for the
+ * dedicated tracker threads and by the tracker event loops.
+ * @param cli_info The client info record for the tracker connection
  */
-static void
-trk_thread_cleanup(void *arg) {
-    struct client_info *cli_info = (struct client_info *) arg;
-
-    logmsg(LOG_DEBUG, "Tracker thread CleanupHandler() for IP=%s", cli_info->cli_ipadr);
+void
+tracker_conn_close(struct client_info *cli_info) {
+    if (cli_info->cli_devid) {
+        plugins_connection(cli_info->cli_devid, G7PLUGIN_DISCONNECT, cli_info->cli_ipadr);
+    }
+    // Close while holding the mutex so that nobody can find this device id
+    // together with a socket number that has already been reused
+    pthread_mutex_lock(&socks_mutex);
     if (-1 == _dbg_close(cli_info->cli_socket)) {
         logmsg(LOG_ERR, "Failed to close socket %d to device %s. ( %d : %s )", cli_info->cli_socket, cli_info->cli_ipadr, errno, strerror(errno));
     }
-    pthread_mutex_lock(&socks_mutex);
     memset(cli_info, 0, sizeof (struct client_info));
     cli_info->target_cli_idx = -1;
     cli_info->target_usb_idx = -1;
@@ -767,6 +713,18 @@ trk_thread_cleanup(void *arg) {
     pthread_mutex_unlock(&socks_mutex);
 }
 
+/**
+ * Tracker thread cleanup function
+ * @param arg
+ */
+static void
+trk_thread_cleanup(void *arg) {
+    struct client_info *cli_info = (struct client_info *) arg;
+
+    logmsg(LOG_DEBUG, "Tracker thread CleanupHandler() for IP=%s", cli_info->cli_ipadr);
+    tracker_conn_close(cli_info);
+}
+
 /** Timeout in seconds fro the listening for tracker connections. We use
  * the timeout to check how long time the tracker has been idle.
  */
@@ -816,6 +774,226 @@ arrivingPackageType(const char *buffer) {
     return -1;
 }
 
+/**
+ * Initial size of the per connection frame reassembly buffer. The buffer
+ * grows on demand (doubling) up to TRACKER_FRAME_MAXLEN
+ */
+#define TRACKER_FRAME_INITLEN 1024
+
+/**
+ * Maximum size of one frame from the tracker. The largest frames are the
+ * batches of stale positions "[...]" sent after a lost connection.
+ */
+#define TRACKER_FRAME_MAXLEN BUFFER_50K
+
+/**
+ * Minimum free space we want in the reassembly buffer before reading from
+ * the socket. If there is less free space the buffer is enlarged.
+ */
+#define TRACKER_FRAME_MINREAD 512
+
+/**
+ * Initialize a frame reassembly buffer. The actual memory is allocated at
+ * the first read.
+ * @param framer The framer to initialize
+ */
+void
+trkframer_init(struct trkframer *framer) {
+    framer->buf = NULL;
+    framer->size = 0;
+    framer->len = 0;
+}
+
+/**
+ * Release the memory held by a frame reassembly buffer. Any partially
+ * received frame is discarded.
+ * @param framer The framer to free
+ */
+void
+trkframer_free(struct trkframer *framer) {
+    free(framer->buf);
+    trkframer_init(framer);
+}
+
+/**
+ * Cleanup handler used by tracker threads to free the framer if the
+ * thread is canceled
+ * @param arg Pointer to the framer
+ */
+static void
+trkframer_cleanup(void *arg) {
+    trkframer_free((struct trkframer *) arg);
+}
+
+/**
+ * Make sure there is room for at least TRACKER_FRAME_MINREAD more bytes
+ * (plus a terminating '\0') in the framer.
+ * @param framer The framer
+ * @return 0 on success, -1 if the buffer would exceed TRACKER_FRAME_MAXLEN
+ * or we are out of memory
+ */
+static int
+trkframer_reserve(struct trkframer *framer) {
+    if (framer->size - framer->len > TRACKER_FRAME_MINREAD) {
+        return 0;
+    }
+    size_t newsize = framer->size ? framer->size * 2 : TRACKER_FRAME_INITLEN;
+    if (newsize > TRACKER_FRAME_MAXLEN + 1) {
+        newsize = TRACKER_FRAME_MAXLEN + 1;
+    }
+    if (newsize <= framer->size) {
+        // Already at max size so use whatever room is left
+        return framer->size - framer->len > 1 ? 0 : -1;
+    }
+    char *newbuf = realloc(framer->buf, newsize);
+    if (NULL == newbuf) {
+        return -1;
+    }
+    framer->buf = newbuf;
+    framer->size = newsize;
+    return 0;
+}
+
+/**
+ * Find the length of the next complete frame at the start of the buffer.
+ * There are three kind of frames:
+ * - KEEP_ALIVE packages which are 8 binary bytes starting with 0xD0 0xD7
+ * - Batches of stale positions surrounded by "[" and "]". Inside the
+ *   batch the positions are separated by "\r\n"
+ * - Ordinary events and command replies terminated by "\r\n"
+ * @param buf Start of the data
+ * @param len Number of bytes available
+ * @return The length of the frame or 0 if the frame is not yet complete
+ */
+static size_t
+trkframer_framelen(const char *buf, const size_t len) {
+    if ((char) 0xD0 == buf[0] && (len < 2 || (char) 0xD7 == buf[1])) {
+        return len >= KEEP_ALIVE_LEN ? KEEP_ALIVE_LEN : 0;
+    }
+    if ('[' == buf[0]) {
+        const char *end = memchr(buf, ']', len);
+        return end ? (size_t) (end - buf) + 1 : 0;
+    }
+    for (size_t i = 0; i + 1 < len; i++) {
+        if ('\r' == buf[i] && '\n' == buf[i + 1]) {
+            return i + 2;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hand over one complete frame to the right package handler.
+ * @param cli_info The client info record for the tracker that sent the frame
+ * @param frame The frame, '\0' terminated
+ * @param len Length of the frame
+ */
+static void
+tracker_dispatch_frame(struct client_info *cli_info, const char *frame, const size_t len) {
+    int rc;
+
+    if ((char) 0xD0 == *frame) {
+        logmsg(LOG_DEBUG, "Incoming KEEP_ALIVE from IP=%s:%d (len=%zu)",
+                cli_info->cli_ipadr, cli_info->cli_socket, len);
+        rc = handleKeepAlivePackage(cli_info, frame, len);
+        if (-1 == rc) {
+            logmsg(LOG_DEBUG, "Failed to handle incoming KEEP_ALIVE package");
+        }
+        return;
+    }
+
+    logmsg(LOG_DEBUG, "Incoming event from IP=%s:%d (len=%zu)",
+            cli_info->cli_ipadr, cli_info->cli_socket, len);
+    logmsg(LOG_DEBUG, "Event string: \"%s\"", frame);
+
+    // A batch of stale positions always goes straight to the DB. It can hold many
+    // rows so it cannot be classified by the number of fields
+    const int pkg_t = '[' == *frame ? ARRIVE_PKG_LOC : arrivingPackageType(frame);
+    switch (pkg_t) {
+        case ARRIVE_PKG_CMDREPLY:
+            rc = handleCmdReplyPackage(cli_info, frame, len);
+            break;
+        case ARRIVE_PKG_LOC:
+            rc = handleLocPackage(cli_info, frame, len);
+            break;
+        default:
+            rc = -1;
+            break;
+    }
+    if (rc < 0) {
+        logmsg(LOG_ERR, "Error handling %s",
+                pkg_t == ARRIVE_PKG_CMDREPLY ? "ARRIVE_PKG_CMDREPLY" :
+                pkg_t == ARRIVE_PKG_LOC ? "ARRIVE_PKG_LOC" : "UNKNOWN_PACKAGE TYPE");
+    }
+}
+
+/**
+ * Read available data from a tracker socket and dispatch all complete frames
+ * to the package handlers. A frame that is split over several TCP segments
+ * is kept in the per connection framer until the rest of it has arrived.
+ * The data is read directly into the framer and the frames are handled in
+ * place so the only copying done is when a partial frame is moved to the
+ * start of the buffer after the complete frames have been handled.
+ * This is shared between the dedicated tracker threads and the tracker
+ * event loops.
+ * @param cli_info The client info record for the tracker
+ * @param framer The frame reassembly buffer for this connection
+ * @return Number of bytes read, 0 on connection close and < 0 on error
+ */
+ssize_t
+tracker_read_frames(struct client_info *cli_info, struct trkframer *framer) {
+    if (-1 == trkframer_reserve(framer)) {
+        // Can only happen if the tracker sends garbage that never forms a frame
+        logmsg(LOG_ERR, "Discarding %zu bytes of unframed data from tracker at IP=%s", framer->len, cli_info->cli_ipadr);
+        framer->len = 0;
+        if (NULL == framer->buf) {
+            logmsg(LOG_CRIT, "Cannot allocate memory for reading incoming tracker data.");
+            return -1;
+        }
+    }
+
+    const ssize_t numreads = socket_read(cli_info->cli_socket, framer->buf + framer->len,
+                                         framer->size - framer->len - 1);
+    if (numreads <= 0) {
+        if (framer->len > 0) {
+            logmsg(LOG_ERR, "Received an incomplete event from tracker (%zu bytes discarded)", framer->len);
+        }
+        return numreads;
+    }
+    framer->len += numreads;
+
+    size_t pos = 0;
+    size_t flen;
+    while (pos < framer->len) {
+        char *frame = framer->buf + pos;
+
+        // Skip line terminators between frames, for example after a "]"
+        if ('\r' == *frame || '\n' == *frame) {
+            pos++;
+            continue;
+        }
+
+        flen = trkframer_framelen(frame, framer->len - pos);
+        if (0 == flen) {
+            break;
+        }
+
+        // There is always room for one more character in the buffer
+        const char oldchar = frame[flen];
+        frame[flen] = '\0';
+        tracker_dispatch_frame(cli_info, frame, flen);
+        frame[flen] = oldchar;
+        pos += flen;
+    }
+
+    if (pos > 0) {
+        framer->len -= pos;
+        memmove(framer->buf, framer->buf + pos, framer->len);
+    }
+
+    return numreads;
+}
+
 /**
  * This is the thread entry point that gets started for each device that
  * connects to us.
@@ -833,8 +1011,7 @@ tracker_clientsrv(void *arg) {
     int rc;
     ssize_t numreads;
     struct client_info *cli_info = (struct client_info *) arg;
-    fd_set read_fdset;
-    struct timeval timeout;
+    struct pollfd pfd;
 
     // To avoid reserving ~8MB after the thread terminates we
     // detach it. Without doing this the pthreads library would keep
@@ -856,110 +1033,41 @@ tracker_clientsrv(void *arg) {
 
     pthread_cleanup_push(trk_thread_cleanup, arg);
 
+    struct trkframer framer;
+    trkframer_init(&framer);
+    pthread_cleanup_push(trkframer_cleanup, &framer);
+
+    // Declared inside the cleanup scope since pthread_cleanup_push() may
+    // use setjmp() and the variable is changed in the loop below
     unsigned idle_time = 0;
-    char *buffer = calloc(BUFFER_50K, sizeof(char));
-    if (!buffer) {
-        logmsg(LOG_CRIT, "Cannot allocate memory for reading incoming tracker data. Aborting.");
-    } else {
-        do {
-            FD_ZERO(&read_fdset);
-            FD_SET((unsigned) cli_info->cli_socket, &read_fdset);
 
-            timerclear(&timeout);
-            timeout.tv_sec = TRACKER_SOCKET_TIMEOUT;
+    do {
+        pfd.fd = cli_info->cli_socket;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
-            rc = select(cli_info->cli_socket + 1, &read_fdset, NULL, NULL, &timeout);
-            if (rc == 0) {
-                //Timeout
+        rc = poll(&pfd, 1, TRACKER_SOCKET_TIMEOUT * 1000);
+        if (rc == 0) {
+            //Timeout
 
-                idle_time += TRACKER_SOCKET_TIMEOUT;
-
-                if (idle_time >= max_device_idle_time) {
-                    numreads = -1; // Force a disconnect
-                    logmsg(LOG_DEBUG, "Tracker disconnected after being idle for more than %d seconds.", max_device_idle_time);
-                } else {
-                    numreads = 1; // To keep the loop going
-                }
+            idle_time += TRACKER_SOCKET_TIMEOUT;
 
+            if (idle_time >= max_device_idle_time) {
+                numreads = -1; // Force a disconnect
+                logmsg(LOG_DEBUG, "Tracker disconnected after being idle for more than %d seconds.", max_device_idle_time);
             } else {
+                numreads = 1; // To keep the loop going
+            }
 
-                idle_time = 0;
-                *buffer = '\0';
-                numreads = socket_read(cli_info->cli_socket, buffer, BUFFER_50K);
-
-                char *ptr, *ptrstart;
-                char oldchar;
-                if (numreads > 0) {
-
-                    buffer[BUFFER_50K - 1] = '\0';
-                    buffer[numreads] = '\0';
-
-                    if (*buffer) {
+        } else {
 
-                        if ((char) 0xD0 == *buffer && (char) 0xD7 == *(buffer + 1)) {
-                            logmsg(LOG_DEBUG, "Incoming KEEP_ALIVE from IP=%s:%d (len=%zd)",
-                                    cli_info->cli_ipadr, cli_info->cli_socket, numreads);
-                            rc = handleKeepAlivePackage(cli_info, buffer, numreads);
-                            if( -1 == rc ) {
-                                logmsg(LOG_DEBUG, "Failed to handle incoming KEEP_ALIVE package");
-                            }
-                        } else {
-                            // This gets a bit complicated due to the fact that the device might
-                            // send back multiple location events in the same reply. We must therefore
-                            // split the replies and handle them one by one. We do this by inserting
-                            // a string terminating 0 after each '\\r\\n' sequence found and restore
-                            // the overwritten character in the next loop
-                            ptr = buffer;
-                            do {
-                                ptrstart = ptr;
-                                while (*ptr && *ptr != '\r')
-                                    ptr++;
-                                if (*ptr == '\r' && *(ptr + 1) == '\n') {
-                                    oldchar = *(ptr + 2);
-                                    *(ptr + 2) = '\0';
-                                } else {
-                                    logmsg(LOG_ERR, "Expecting device event to end with '\\r\\n' but found %d %d",(int)(*ptr),(int)(*(ptr+1)));                                    
-                                    break;
-                                }
-
-                                logmsg(LOG_DEBUG, "Incoming event from IP=%s:%d (len=%zd)",                                        
-                                        cli_info->cli_ipadr, cli_info->cli_socket, numreads);
-                                logmsg(LOG_DEBUG, "Event string: \"%s\"",ptrstart);
-                                int pkg_t = arrivingPackageType(ptrstart);
-                                switch (pkg_t) {
-                                    case ARRIVE_PKG_CMDREPLY:
-                                        rc = handleCmdReplyPackage(cli_info, ptrstart, numreads);
-                                        break;
-                                    case ARRIVE_PKG_LOC:
-                                        rc = handleLocPackage(cli_info, ptrstart, numreads);
-                                        break;
-                                    default:
-                                        rc = -1;
-                                        break;
-                                }
-                                if (rc < 0) {
-                                    logmsg(LOG_ERR, "Error handling %s",
-                                            pkg_t == ARRIVE_PKG_CMDREPLY ? "ARRIVE_PKG_CMDREPLY" :
-                                            pkg_t == ARRIVE_PKG_LOC ? "ARRIVE_PKG_LOC" : "UNKNOWN_PACKAGE TYPE");
-                                }
-
-                                *(ptr + 2) = oldchar;
-                                ptr += 2;
-
-                            } while (oldchar);
-                        }
-                    }
+            idle_time = 0;
+            numreads = tracker_read_frames(cli_info, &framer);
 
-                } else {
-                    if (numreads > 0) {
-                        logmsg(LOG_ERR, "Received an incomplete location update from tracker");
-                    }
-                }
-            }
-        } while (numreads > 0);
+        }
+    } while (numreads > 0);
 
-        free(buffer);
-    }
+    pthread_cleanup_pop(TRUE);
 
     logmsg(LOG_DEBUG, "Connection from device IP=%s on socket %d closed.", cli_info->cli_ipadr, cli_info->cli_socket);
 
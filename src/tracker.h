@@ -30,9 +30,33 @@
 extern "C" {
 #endif
 
+struct client_info;
+
+/**
+ * Per connection buffer used to reassemble frames from the tracker that
+ * are split over several reads
+ */
+struct trkframer {
+    char *buf;      // Buffer with received but not yet handled data
+    size_t size;    // Allocated size of buf
+    size_t len;     // Number of bytes in buf
+};
+
 void *
 tracker_clientsrv(void *arg);
 
+void
+trkframer_init(struct trkframer *framer);
+
+void
+trkframer_free(struct trkframer *framer);
+
+ssize_t
+tracker_read_frames(struct client_info *cli_info, struct trkframer *framer);
+
+void
+tracker_conn_close(struct client_info *cli_info);
+
 #ifdef	__cplusplus
 }
 #endif
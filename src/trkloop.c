@@ -0,0 +1,347 @@
+/* =========================================================================
+ * File:        TRKLOOP.C
+ * Description: Event loops that multiplexes many tracker connections on a
+ *              small number of threads. This is an alternative to the
+ *              original model with one dedicated thread per connected
+ *              tracker which does not scale beyond a few hundred devices
+ *              since each thread reserves its own stack and read buffer.
+ *              Each event loop owns an epoll set and dispatches incoming
+ *              data to the same handlers as the dedicated tracker threads.
+ * Author:      Johan Persson (johan162@gmail.com)
+ *
+ * Copyright (C) 2013-2015  Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// Standard UNIX includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifndef __APPLE__
+#include <sys/epoll.h>
+#endif
+
+#include "config.h"
+#include "g7ctrl.h"
+#include "utils.h"
+#include "logger.h"
+#include "g7config.h"
+#include "tracker.h"
+#include "trkloop.h"
+
+#ifndef __APPLE__
+
+/**
+ * Maximum number of events handled in one call to epoll_wait()
+ */
+#define TRKLOOP_MAX_EVENTS 64
+
+/**
+ * Timeout in ms for epoll_wait(). This determines how often we check
+ * for idle trackers.
+ */
+#define TRKLOOP_WAIT_TIMEOUT 1000
+
+/**
+ * State for one event loop
+ */
+struct trkloop {
+    pthread_t thread;   // Thread running the loop
+    int epfd;           // The epoll set for all trackers owned by this loop
+    unsigned nconn;     // Number of trackers currently owned by this loop
+    size_t *idle_idx;   // Scratch area used when closing idle trackers
+};
+
+/**
+ * All event loops
+ */
+static struct trkloop *trkloops = NULL;
+static unsigned num_trkloops = 0;
+
+/**
+ * Timestamp for the last received data for each slot in client_info_list.
+ * Each slot is owned by at most one event loop so no locking is needed
+ */
+static time_t *trk_last_active = NULL;
+
+/**
+ * Frame reassembly buffer for each slot in client_info_list. Allocated on
+ * demand when the tracker sends data and released when it disconnects.
+ */
+static struct trkframer *trk_framers = NULL;
+
+/**
+ * Protects the per loop connection counters used to balance the load
+ */
+static pthread_mutex_t trkloop_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Remove a tracker from the event loop and close the connection
+ * @param loop The owning event loop
+ * @param cli_info The tracker connection to close
+ */
+static void
+trkloop_close(struct trkloop *loop, struct client_info *cli_info) {
+    if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_DEL, cli_info->cli_socket, NULL)) {
+        logmsg(LOG_ERR, "Failed to remove socket %d from tracker event loop ( %d : %s )",
+                cli_info->cli_socket, errno, strerror(errno));
+    }
+    pthread_mutex_lock(&trkloop_mutex);
+    loop->nconn--;
+    pthread_mutex_unlock(&trkloop_mutex);
+
+    trkframer_free(&trk_framers[cli_info - client_info_list]);
+
+    logmsg(LOG_DEBUG, "Connection from device IP=%s on socket %d closed.", cli_info->cli_ipadr, cli_info->cli_socket);
+    tracker_conn_close(cli_info);
+}
+
+/**
+ * Close all trackers owned by this loop that have been idle for longer than
+ * max_device_idle_time. The candidates are first collected while holding the
+ * socks_mutex and then closed since closing needs to take the same mutex.
+ * @param loop The event loop to check
+ * @param now Current time
+ */
+static void
+trkloop_close_idle(struct trkloop *loop, const time_t now) {
+    size_t nidle = 0;
+
+    pthread_mutex_lock(&socks_mutex);
+    for (size_t i = 0; i < max_clients; i++) {
+        if (client_info_list[i].cli_evloop &&
+            pthread_equal(client_info_list[i].cli_thread, loop->thread) &&
+            now - trk_last_active[i] >= (time_t) max_device_idle_time) {
+            loop->idle_idx[nidle++] = i;
+        }
+    }
+    pthread_mutex_unlock(&socks_mutex);
+
+    for (size_t i = 0; i < nidle; i++) {
+        logmsg(LOG_DEBUG, "Tracker disconnected after being idle for more than %d seconds.", max_device_idle_time);
+        trkloop_close(loop, &client_info_list[loop->idle_idx[i]]);
+    }
+}
+
+/**
+ * Thread entry point for an event loop. Waits for data on any of the
+ * tracker sockets owned by this loop and hands the data over to the
+ * tracker package handlers.
+ * @param arg Pointer to the loop state
+ * @return (void *)0
+ */
+static void *
+trkloop_thread(void *arg) {
+    struct trkloop *loop = (struct trkloop *) arg;
+    struct epoll_event events[TRKLOOP_MAX_EVENTS];
+    time_t last_idle_check = time(NULL);
+
+    pthread_detach(pthread_self());
+
+    while (TRUE) {
+        int nev = epoll_wait(loop->epfd, events, TRKLOOP_MAX_EVENTS, TRKLOOP_WAIT_TIMEOUT);
+        if (-1 == nev) {
+            if (EINTR == errno) {
+                continue;
+            }
+            logmsg(LOG_CRIT, "epoll_wait() failed in tracker event loop ( %d : %s )", errno, strerror(errno));
+            break;
+        }
+
+        const time_t now = time(NULL);
+        for (int e = 0; e < nev; e++) {
+            const size_t idx = events[e].data.u32;
+            struct client_info *cli_info = &client_info_list[idx];
+
+            if ((events[e].events & EPOLLIN) && tracker_read_frames(cli_info, &trk_framers[idx]) > 0) {
+                trk_last_active[idx] = now;
+                continue;
+            }
+
+            // Remote end closed the connection or the socket is in error
+            trkloop_close(loop, cli_info);
+        }
+
+        if (now - last_idle_check >= 1) {
+            trkloop_close_idle(loop, now);
+            last_idle_check = now;
+        }
+    }
+
+    pthread_exit(NULL);
+    return (void *) 0;
+}
+
+/**
+ * Make sure that the process is allowed to have at least as many open
+ * files as we can have connected clients (plus some extra for DB, log files
+ * and USB). Only the soft limit is raised, never above the hard limit.
+ */
+static void
+trkloop_raise_nofile(void) {
+    struct rlimit rl;
+    const rlim_t wanted = (rlim_t) max_clients + 64;
+
+    if (0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < wanted) {
+        rl.rlim_cur = (RLIM_INFINITY != rl.rlim_max && rl.rlim_max < wanted) ? rl.rlim_max : wanted;
+        if (-1 == setrlimit(RLIMIT_NOFILE, &rl)) {
+            logmsg(LOG_ERR, "Cannot raise limit of open files to %lu ( %d : %s )",
+                    (unsigned long) wanted, errno, strerror(errno));
+        } else {
+            logmsg(LOG_DEBUG, "Raised limit of open files to %lu", (unsigned long) rl.rlim_cur);
+        }
+    }
+}
+
+/**
+ * Setup and start the tracker event loops. Must be called after the
+ * client_info_list has been allocated and before the socket listener
+ * is started.
+ * @param nloops Number of event loops (threads) to start. If 0 no loops
+ * are started and each tracker will get its own thread as before.
+ * @return 0 on success, -1 on failure
+ */
+int
+trkloop_init(const unsigned nloops) {
+    if (0 == nloops) {
+        return 0;
+    }
+
+    trkloop_raise_nofile();
+
+    trk_last_active = calloc(max_clients, sizeof (time_t));
+    trk_framers = calloc(max_clients, sizeof (struct trkframer));
+    trkloops = calloc(nloops, sizeof (struct trkloop));
+    if (NULL == trk_last_active || NULL == trk_framers || NULL == trkloops) {
+        logmsg(LOG_CRIT, "Cannot allocate memory for tracker event loops");
+        return -1;
+    }
+
+    for (unsigned i = 0; i < nloops; i++) {
+        trkloops[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        trkloops[i].idle_idx = calloc(max_clients, sizeof (size_t));
+        if (-1 == trkloops[i].epfd || NULL == trkloops[i].idle_idx) {
+            logmsg(LOG_CRIT, "Cannot setup tracker event loop %u ( %d : %s )", i, errno, strerror(errno));
+            return -1;
+        }
+        // Only count the loops that are actually running so that trkloop_add()
+        // never hands a tracker to a loop without a thread
+        int ret = pthread_create(&trkloops[i].thread, NULL, trkloop_thread, (void *) &trkloops[i]);
+        if (0 != ret) {
+            logmsg(LOG_CRIT, "Could not create thread for tracker event loop ( %d : %s )", ret, strerror(ret));
+            return -1;
+        }
+        num_trkloops++;
+    }
+
+    logmsg(LOG_INFO, "Started %u tracker event loops", num_trkloops);
+    return 0;
+}
+
+/**
+ * Check if tracker connections should be handed over to the event loops
+ * @return TRUE if at least one event loop is running
+ */
+_Bool
+trkloop_enabled(void) {
+    return num_trkloops > 0;
+}
+
+/**
+ * Hand over a newly accepted tracker connection to the least loaded event
+ * loop. The caller must hold the socks_mutex. On success the cli_thread
+ * field is set to the thread of the owning loop which marks the slot as
+ * being in use.
+ * @param cli_info Slot in client_info_list for the new connection
+ * @return 0 on success, -1 on failure
+ */
+int
+trkloop_add(struct client_info *cli_info) {
+    if (0 == num_trkloops) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&trkloop_mutex);
+    struct trkloop *loop = &trkloops[0];
+    for (unsigned i = 1; i < num_trkloops; i++) {
+        if (trkloops[i].nconn < loop->nconn) {
+            loop = &trkloops[i];
+        }
+    }
+    loop->nconn++;
+    pthread_mutex_unlock(&trkloop_mutex);
+
+    const size_t idx = cli_info - client_info_list;
+    trk_last_active[idx] = time(NULL);
+    cli_info->cli_thread = loop->thread;
+    cli_info->cli_evloop = TRUE;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof (ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = (uint32_t) idx;
+    if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, cli_info->cli_socket, &ev)) {
+        logmsg(LOG_ERR, "Failed to add socket %d to tracker event loop ( %d : %s )",
+                cli_info->cli_socket, errno, strerror(errno));
+        cli_info->cli_thread = 0;
+        cli_info->cli_evloop = FALSE;
+        pthread_mutex_lock(&trkloop_mutex);
+        loop->nconn--;
+        pthread_mutex_unlock(&trkloop_mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+#else
+
+/*
+ * OS X does not have epoll. On this platform each tracker will always be
+ * served by its own thread.
+ */
+
+int
+trkloop_init(const unsigned nloops) {
+    if (nloops > 0) {
+        logmsg(LOG_NOTICE, "Tracker event loops are not supported on this platform. Using one thread per tracker.");
+    }
+    return 0;
+}
+
+_Bool
+trkloop_enabled(void) {
+    return FALSE;
+}
+
+int
+trkloop_add(struct client_info *cli_info) {
+    (void) cli_info;
+    return -1;
+}
+
+#endif
+
+/* EOF */
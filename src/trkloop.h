@@ -1,6 +1,7 @@
 /* =========================================================================
- * File:        RKEY.H
- * Description: Functions to do key/val pair substitution in buffers
+ * File:        TRKLOOP.H
+ * Description: Event loops that multiplexes many tracker connections on a
+ *              small number of threads.
  * Author:      Johan Persson (johan162@gmail.com)
  *
  * Copyright (C) 2013-2015  Johan Persson
@@ -20,43 +21,31 @@
  * =========================================================================
  */
 
-
-#ifndef RKEY_H
-#define	RKEY_H
+#ifndef TRKLOOP_H
+#define	TRKLOOP_H
 
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
-#define MAX_KEYPAIR_VAL_SIZE 1024
-
 /**
- * Holds each keypair to be replaced in the buffer/file
+ * Maximum number of tracker event loops that can be configured
  */
-struct keypairs {
-    char *key;
-    char *val;
-};
+#define MAX_TRACKER_EVENT_LOOPS 64
 
-int
-replace_keywords(char *buffer, size_t maxlen, struct keypairs keys[], size_t nkeys);
+struct client_info;
 
 int
-replace_keywords_in_file(char *filename,char **buffer, struct keypairs keys[], size_t nkeys);
+trkloop_init(const unsigned nloops);
 
-struct keypairs *
-new_keypairlist(size_t maxsize);
+_Bool
+trkloop_enabled(void);
 
 int
-add_keypair(struct keypairs *keys, size_t maxkeys, char *key, char *val, size_t *idx);
-
-int
-free_keypairlist(struct keypairs *keys, size_t maxkeys);
-
+trkloop_add(struct client_info *cli_info);
 
 #ifdef	__cplusplus
 }
 #endif
 
-#endif	/* RKEY_H */
-
+#endif	/* TRKLOOP_H */
@@ -118,7 +118,10 @@ _chk_calloc_exit(size_t size) {
 /**
  * _writef
  * Utility function
- * Simplify a formatted write to a file descriptor
+ * Simplify a formatted write to a file descriptor. Short output (which is
+ * the normal case) is formatted on the stack and only longer output needs
+ * a heap buffer. Code that writes many pieces to the same file descriptor
+ * should use an output buffer (see outbuf.h) instead.
  *
  * @param fd File/socket to write to
  * @param buf Format string
@@ -128,9 +131,8 @@ _chk_calloc_exit(size_t size) {
 int
 _writef(const int fd, const char *buf, ...) {
     if (fd >= 0) {
-        const int blen = SIZE_1MB;
-        
-        char *tmpbuff = _chk_calloc_exit(blen);
+        char sbuff[2048];
+        char *tmpbuff = sbuff;
         va_list ap;
         va_start(ap, buf);
 
@@ -140,41 +142,187 @@ _writef(const int fd, const char *buf, ...) {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-nonliteral"
 #pragma clang diagnostic ignored "-Wunused-result"            
-        int len = vsnprintf(tmpbuff, blen, buf, ap);
-        if( len > blen ) {
-            // Output was truncated
-            logmsg(LOG_CRIT,"Internal error. Output truncated in _writef()");
-            const char *errstr = "Error: Output truncated.";
-            (void)write(fd, errstr, strlen(errstr));
-            free(tmpbuff);
-            va_end(ap);
-            return -1;
+        va_list aq;
+        va_copy(aq, ap);
+        int len = vsnprintf(sbuff, sizeof (sbuff), buf, aq);
+        va_end(aq);
+        if (len >= (int) sizeof (sbuff)) {
+            // Too large for the stack buffer so format again into a
+            // buffer of exactly the right size
+            tmpbuff = _chk_calloc_exit(len + 1);
+            len = vsnprintf(tmpbuff, len + 1, buf, ap);
         }
 #pragma clang diagnostic pop
 #pragma GCC diagnostic pop
+        va_end(ap);
 
-        tmpbuff[blen - 1] = 0;
-        int ret;
-        if (htmlencode_flag) {
-            char *htmlbuff = html_encode(tmpbuff);
-            ret = write(fd, htmlbuff, strlen(htmlbuff));
-            free(htmlbuff);
-        } else {
-            ret = write(fd, tmpbuff, strlen(tmpbuff));
+        int ret = -1;
+        if (len >= 0) {
+            if (htmlencode_flag) {
+                char *htmlbuff = html_encode(tmpbuff);
+                ret = write(fd, htmlbuff, strlen(htmlbuff));
+                free(htmlbuff);
+            } else {
+                ret = write(fd, tmpbuff, len);
+            }
+        }
+        if (tmpbuff != sbuff) {
+            free(tmpbuff);
         }
-        free(tmpbuff);
-        va_end(ap);
         return ret;
     }
     return -1;
 }
 
+/**
+ * Size of the cache with compiled command regular expressions. Must be a
+ * power of 2 and well above the number of distinct command patterns used
+ * by the command interpreters.
+ */
+#define MATCHCMD_CACHE_SIZE 512
+
+/**
+ * Options used when compiling all command regular expressions
+ */
+#define MATCHCMD_PCRE_OPTIONS (PCRE_CASELESS | PCRE_MULTILINE | PCRE_NEWLINE_CRLF | PCRE_UTF8)
+
+/**
+ * A compiled and studied command regular expression
+ */
+struct matchcmd_pattern {
+    char *regex;
+    pcre *cregex;
+    pcre_extra *extra;
+};
+
+/**
+ * All command patterns are compiled the first time they are used and then
+ * kept for the life time of the daemon. Since the set of patterns is fixed
+ * the table is only written to while the command grammar is warming up.
+ */
+static struct matchcmd_pattern matchcmd_cache[MATCHCMD_CACHE_SIZE];
+static size_t matchcmd_cache_num = 0;
+static pthread_rwlock_t matchcmd_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Compile and study a command regular expression. When available the
+ * pattern is also JIT compiled.
+ * @param regex Regular expression
+ * @param[out] pat The compiled pattern
+ * @return 0 on success, -1 on failure
+ */
+static int
+_matchcmd_compile(const char *regex, struct matchcmd_pattern *pat) {
+    const char *errptr;
+    int erroff;
+
+    pat->cregex = pcre_compile(regex, MATCHCMD_PCRE_OPTIONS, &errptr, &erroff, NULL);
+    if (NULL == pat->cregex) {
+        logmsg(LOG_ERR, "Cannot compile command regex \"%s\" at offset %d ( %s )", regex, erroff, errptr);
+        return -1;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pat->extra = pcre_study(pat->cregex, PCRE_STUDY_JIT_COMPILE, &errptr);
+#else
+    pat->extra = pcre_study(pat->cregex, 0, &errptr);
+#endif
+    return 0;
+}
+
+/**
+ * Free a compiled command pattern
+ * @param pat Pattern to free
+ */
+static void
+_matchcmd_free_pattern(struct matchcmd_pattern *pat) {
+    if (pat->extra) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study(pat->extra);
+#else
+        pcre_free(pat->extra);
+#endif
+    }
+    pcre_free(pat->cregex);
+}
+
+/**
+ * Simple FNV-1a string hash used to index the pattern cache
+ * @param str String to hash
+ * @return Hash value
+ */
+static inline size_t
+_matchcmd_hash(const char *str) {
+    size_t h = 2166136261u;
+    while (*str) {
+        h = (h ^ (unsigned char) *str++) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Find the compiled version of the regex in the cache and compile and add it
+ * if it is not yet there.
+ * @param regex Regular expression
+ * @param[out] pat Compiled pattern
+ * @return 1 if the pattern is owned by the cache, 0 if the cache is full and
+ * the caller must free the pattern, -1 if the pattern cannot be compiled
+ */
+static int
+_matchcmd_lookup(const char *regex, struct matchcmd_pattern *pat) {
+    const size_t h = _matchcmd_hash(regex);
+
+    pthread_rwlock_rdlock(&matchcmd_cache_lock);
+    for (size_t i = 0; i < MATCHCMD_CACHE_SIZE; i++) {
+        const struct matchcmd_pattern *p = &matchcmd_cache[(h + i) & (MATCHCMD_CACHE_SIZE - 1)];
+        if (NULL == p->regex) {
+            break;
+        }
+        if (0 == strcmp(p->regex, regex)) {
+            *pat = *p;
+            pthread_rwlock_unlock(&matchcmd_cache_lock);
+            return 1;
+        }
+    }
+    pthread_rwlock_unlock(&matchcmd_cache_lock);
+
+    if (-1 == _matchcmd_compile(regex, pat)) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&matchcmd_cache_lock);
+    // Keep the table at most half full so that probe sequences stay short
+    if (matchcmd_cache_num >= MATCHCMD_CACHE_SIZE / 2) {
+        pthread_rwlock_unlock(&matchcmd_cache_lock);
+        return 0;
+    }
+    for (size_t i = 0; i < MATCHCMD_CACHE_SIZE; i++) {
+        struct matchcmd_pattern *p = &matchcmd_cache[(h + i) & (MATCHCMD_CACHE_SIZE - 1)];
+        if (NULL == p->regex) {
+            p->regex = strdup(regex);
+            p->cregex = pat->cregex;
+            p->extra = pat->extra;
+            matchcmd_cache_num++;
+            break;
+        }
+        if (0 == strcmp(p->regex, regex)) {
+            // Another thread got here first
+            _matchcmd_free_pattern(pat);
+            *pat = *p;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&matchcmd_cache_lock);
+    return 1;
+}
+
 /**
  * Utility function that uses Perl Regular Expression library to match
  * a string and return an array of the found subexpressions
  * NOTE: It is the calling routines obligation to free the returned
  * field with a call to
  * pcre_free_substring_list((const char **)field);
+ * Each regular expression is only compiled once and then reused for all
+ * subsequent matches.
  *
  * @param regex Regular expression to match the command
  * @param cmd Command string to test
@@ -183,21 +331,22 @@ _writef(const int fd, const char *buf, ...) {
  */
 int
 matchcmd(const char *regex, const char *cmd, char ***field) {
-    pcre *cregex;
+    struct matchcmd_pattern pat;
     int ovector[100];
-    const char *errptr;
-    int erroff, ret;
+    int ret;
 
-    cregex = pcre_compile(regex, PCRE_CASELESS | PCRE_MULTILINE | PCRE_NEWLINE_CRLF | PCRE_UTF8,
-            &errptr, &erroff, NULL);
+    const int cached = _matchcmd_lookup(regex, &pat);
+    if (-1 == cached) {
+        return -1;
+    }
 
-    if (cregex) {
-        ret = pcre_exec(cregex, NULL, cmd, strlen(cmd), 0, 0, ovector, 90);
-        pcre_free(cregex);
-        if (ret > 0) {
-            (void) pcre_get_substring_list(cmd, ovector, ret, (const char ***) field);
-            return ret;
-        }
+    ret = pcre_exec(pat.cregex, pat.extra, cmd, strlen(cmd), 0, 0, ovector, 90);
+    if (0 == cached) {
+        _matchcmd_free_pattern(&pat);
+    }
+    if (ret > 0) {
+        (void) pcre_get_substring_list(cmd, ovector, ret, (const char ***) field);
+        return ret;
     }
     return -1;
 }
@@ -209,30 +358,16 @@ matchcmd(const char *regex, const char *cmd, char ***field) {
  * field with a call to
  * pcre_free_substring_list((const char **)field);
  * This function differs from the matchcmd() function in that it handles
- * a possible multi-line command string.
+ * a possible multi-line command string. Since both functions compile the
+ * regex with the same options this is now the same as matchcmd()
  * @param regex
  * @param cmd
  * @param field
  * @return -1 on failure, 0 on success
  */
 int
-matchcmd_ml(const char *regex, const char *cmd, char ***field) { //, const char *func, int line) {
-    pcre *cregex;
-    int ovector[100];
-    const char *errptr;
-    int erroff, ret;
-
-    //logmsg(LOG_DEBUG, "matchcmd() called from '%s()' at line #%05d",func,line);
-    cregex = pcre_compile(regex, PCRE_CASELESS | PCRE_UTF8 | PCRE_NEWLINE_CRLF | PCRE_MULTILINE, &errptr, &erroff, NULL);
-    if (cregex) {
-        ret = pcre_exec(cregex, NULL, cmd, strlen(cmd), 0, 0, ovector, 90);
-        pcre_free(cregex);
-        if (ret > 0) {
-            (void) pcre_get_substring_list(cmd, ovector, ret, (const char ***) field);
-            return ret;
-        }
-    }
-    return -1;
+matchcmd_ml(const char *regex, const char *cmd, char ***field) {
+    return matchcmd(regex, cmd, field);
 }
 
 /**
@@ -205,6 +205,9 @@ splitdatetime(char *datetime, char *buff);
 // Required alphanumeric sequence for function call  
 #define _PR_ANF "([\\p{L}]+)\\(([\\p{N}\\p{L}\\\"\\.\\+\\,]*)\\)"
 
+// Required comma separated list of alphanumeric sequences
+#define _PR_ANL "([\\p{L}\\p{N}\\_\\-\\,]+)"
+
 // Required alphanumeric starting with a letter
 #define _PR_AAN "([\\p{L}][\\p{L}\\p{N}\\_\\-]*)"
 